@@ -0,0 +1,3 @@
+// images for the bench and the checks, see src/bench/image.c
+int quiet_mkfs(char *path, int block_size, int files_hint, int journal_blocks);
+int make_sized_image(char *path, int64_t size, int block_size, int journal_blocks);
@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <sys/uio.h>
+
 #define STATUS_OK 0
 #define STATUS_ERR 1
 #define STATUS_NOT_MOUNT 2
@@ -9,11 +12,44 @@
 #define STATUS_NOT_DIR 8
 #define STATUS_SIZE_ERR 9
 #define STATUS_NOT_EMPTY 10
+#define STATUS_NAME_TOO_LONG 11
+#define STATUS_BUSY 12
+// too many symlinks on the way, like ELOOP
+#define STATUS_LOOP 13
+
+/* A mounted image, see sfs_mount(). */
+typedef struct sfs_struct sfs_t;
+
+#define SFS_READ 0
+#define SFS_WRITE 1
+
+// advise_file() hints
+#define SFS_ADVICE_NORMAL 0
+#define SFS_ADVICE_SEQUENTIAL 1
+#define SFS_ADVICE_RANDOM 2
+
+// seek_file() whence, the values of lseek()
+#define SFS_SEEK_DATA 3
+#define SFS_SEEK_HOLE 4
+
+/* One read or write of a sfs_submit() batch. */
+typedef struct {
+    int fid;
+    int op;
+    int64_t offset;
+    int64_t size;
+    char *data;
+    // set by sfs_submit()
+    int status;
+} sfs_op;
 
 int mount(char *path);
 int umount();
 int dump_stats();
+int create_image(char *path, int64_t size);
 int mkfs(char *path);
+int mkfs_geometry(char *path, int block_size, double descr_part, int files_hint);
+int mkfs_journal(char *path, int block_size, double descr_part, int files_hint, int journal_blocks);
 int create_file(char *path);
 int list(char *path);
 int filestat(int descr_id);
@@ -24,11 +60,67 @@ int close_file(int fid);
 int read_file(int fid, int offset, int size, char *data);
 int write_file(int fid, int offset, int size, char *data);
 int trancate(char *path, int new_size);
+int read_file64(int fid, int64_t offset, int64_t size, char *data);
+int write_file64(int fid, int64_t offset, int64_t size, char *data);
+int trancate64(char *path, int64_t new_size);
+int read_iov(int fid, int64_t offset, int64_t size, struct iovec *iov, int *iov_num);
+int unpin_file(int fid);
+int readv_file(int fid, int64_t offset, const struct iovec *iov, int iov_num);
+int writev_file(int fid, int64_t offset, const struct iovec *iov, int iov_num);
+int submit_ops(sfs_op *ops, int ops_num);
+int advise_file(int fid, int advice);
+int64_t seek_file(int fid, int64_t offset, int whence);
 int make_dir(char *path);
 int remove_dir(char *path);
 int mksymlink(char *from_arg, char *to_arg);
 int cd(char *path);
 int is_mount();
+int set_dcache_size(int size);
+int set_commit_window(int ms, int blocks);
+int commit_journal();
+int sync_image();
+int set_flusher(int age_ms, int ratio);
+int set_delayed_alloc(int max_blocks);
+int set_tail_packing(int max_size);
 int get_file_size(char *path_arg);
+int64_t get_file_size64(char *path_arg);
+int get_file_fragments(char *path_arg);
 char *pwd();
 char *abs_path(char *path);
+
+/* The same on a given instance.  Threads may use different instances at
+   the same time. */
+sfs_t *sfs_mount(char *path);
+int sfs_umount(sfs_t *sfs);
+int sfs_dump_stats(sfs_t *sfs);
+int sfs_create_file(sfs_t *sfs, char *path);
+int sfs_list(sfs_t *sfs, char *path);
+int sfs_filestat(sfs_t *sfs, int descr_id);
+int sfs_mklink(sfs_t *sfs, char *from, char *to);
+int sfs_rmlink(sfs_t *sfs, char *path);
+int sfs_open(sfs_t *sfs, char *path);
+int sfs_close(sfs_t *sfs, int fid);
+int sfs_read(sfs_t *sfs, int fid, int64_t offset, int64_t size, char *data);
+int sfs_write(sfs_t *sfs, int fid, int64_t offset, int64_t size, char *data);
+int sfs_truncate(sfs_t *sfs, char *path, int64_t new_size);
+int sfs_read_iov(sfs_t *sfs, int fid, int64_t offset, int64_t size, struct iovec *iov, int *iov_num);
+int sfs_unpin(sfs_t *sfs, int fid);
+int sfs_readv(sfs_t *sfs, int fid, int64_t offset, const struct iovec *iov, int iov_num);
+int sfs_writev(sfs_t *sfs, int fid, int64_t offset, const struct iovec *iov, int iov_num);
+int sfs_submit(sfs_t *sfs, sfs_op *ops, int ops_num);
+int sfs_advise(sfs_t *sfs, int fid, int advice);
+int64_t sfs_seek(sfs_t *sfs, int fid, int64_t offset, int whence);
+int sfs_mkdir(sfs_t *sfs, char *path);
+int sfs_rmdir(sfs_t *sfs, char *path);
+int sfs_symlink(sfs_t *sfs, char *from, char *to);
+int sfs_cd(sfs_t *sfs, char *path);
+char *sfs_pwd(sfs_t *sfs);
+int sfs_set_dcache_size(sfs_t *sfs, int size);
+int sfs_set_commit_window(sfs_t *sfs, int ms, int blocks);
+int sfs_commit(sfs_t *sfs);
+int sfs_sync(sfs_t *sfs);
+int sfs_set_flusher(sfs_t *sfs, int age_ms, int ratio);
+int sfs_set_delayed_alloc(sfs_t *sfs, int max_blocks);
+int sfs_set_tail_packing(sfs_t *sfs, int max_size);
+int64_t sfs_file_size(sfs_t *sfs, char *path);
+int sfs_file_fragments(sfs_t *sfs, char *path);
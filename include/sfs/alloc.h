@@ -0,0 +1,19 @@
+int alloc_init();
+void alloc_release();
+int alloc_free_blocks();
+bool alloc_reserve(int num);
+void alloc_unreserve(int num);
+void alloc_spend_promise(int num);
+
+void mask_block(int num);
+void umask_block(int num);
+void mask_blocks(int64_t start, int64_t count);
+bool check_block(int num);
+int find_block();
+int find_run(int goal, int want, int *start);
+int alloc_range(int start, int want);
+int alloc_blocks(int goal, int want, int *start);
+int alloc_dir_goal();
+
+void free_range(int start, int count);
+void free_blocks(int *blocks, int count);
@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+
+#define DEFAULT_BLOCK_SIZE 512
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_DESCRIPTORS_PART 0.05
+#define DIR_TYPE 1
+#define FILE_TYPE 2
+#define LINK_TYPE 3
+#define FILENAME_SIZE 20
+#define FIDS_NUM 512
+#define MAX_PATH_SIZE 512
+#define FILE_LOCKS_NUM 256
+
+#define MASK ((uint8_t *) (char *)FS + SFS->mask_offset)
+// images made before descr_size existed have 0 there
+#define LEGACY_DESCR_SIZE 20
+#define DESCR_SIZE (SFS->descr_size)
+#define DESCR(ID) ((descr_struct *) ((char *)FS + SFS->descr_table_offset + (int64_t) (ID) * DESCR_SIZE))
+// the id of a descriptor from where it lies, without reading it
+#define DESCR_ID(descr) ((int) (((char *) (descr) - (char *) DESCR(0)) / DESCR_SIZE))
+#define BLOCKS(ID) ((void *)((char *)FS + (int64_t) (ID) * BLOCK_SIZE))
+
+// blocks mapped, which delayed writes don't count in yet
+#define BLOCKS_NUM(descr) ((int) ((disk_size(descr) + BLOCK_SIZE - 1) / BLOCK_SIZE))
+#define FILES_IN_BLOCK (BLOCK_SIZE / sizeof(file_struct))
+
+// free descriptors are chained through blocks_id, -1 ends the list
+#define NO_DESCR -1
+// descriptors that were ever initialized, the rest of the table is garbage
+#define DESCRS_READY (FEATURES & FEATURE_LAZY_DESCRS ? FS->descr_ready : MAX_FILES)
+// how many more are initialized once the free list runs out
+#define DESCRS_CHUNK 64
+
+// v2 images carry the magic and keep sizes in 64 bits, v1 ones have 0 there
+#define SFS_MAGIC 0x32534653
+#define SFS_VERSION 2
+#define IS_V2 (FS->magic == SFS_MAGIC)
+#define FS_SIZE (IS_V2 ? FS->size64 : (int64_t) FS->size)
+// only descriptors reaching past reserved_hi have size_hi
+#define HAS_SIZE_HI (DESCR_SIZE >= (int) offsetof(descr_struct, inline_data))
+// only descriptors longer than the legacy ones have flags, and holes
+#define HAS_FLAGS (DESCR_SIZE > LEGACY_DESCR_SIZE)
+// logical block numbers are ints
+#define MAX_FILE_SIZE (HAS_SIZE_HI ? (int64_t) INT32_MAX * BLOCK_SIZE : (int64_t) INT32_MAX)
+
+// fs_struct features
+#define FEATURE_EXTENTS 0x1
+#define FEATURE_JOURNAL 0x2
+#define FEATURE_LAZY_DESCRS 0x4
+#define FEATURE_INLINE_DATA 0x8
+#define FEATURE_TAIL_PACKING 0x10
+
+// descr_struct flags
+#define DESCR_EXTENTS 0x1
+// some blocks below the size may be unmapped, they read as zeros
+#define DESCR_HOLES 0x2
+// the data lives in inline_data and the file has no map yet
+#define DESCR_INLINE 0x4
+// the data lives in units of a block shared with other small files
+#define DESCR_PACKED 0x8
+
+#define INLINE_EXTENTS 3
+#define INLINE_DATA_SIZE 56
+
+/* A run of LEN blocks starting at logical BLOCK, mapped to physical
+   blocks from START on.  Extent tree index entries reuse the layout with
+   LEN 0 and START pointing to the child node. */
+typedef struct {
+    uint32_t block;
+    uint16_t len;
+    uint16_t start_hi;
+    uint32_t start_lo;
+} extent_struct;
+
+typedef struct {
+    int id;
+    int type;
+    int links_num;
+    int size;
+    int blocks_id;
+    // the fields below exist only on images with DESCR_SIZE covering them
+    uint16_t flags;
+    // extent tree depth, 0 while extents[] holds the extents themselves
+    uint16_t depth;
+    uint16_t extents_num;
+    // DESCR_PACKED only, the units of block blocks_id holding the data
+    uint8_t pack_unit;
+    uint8_t pack_units;
+    extent_struct extents[INLINE_EXTENTS];
+    // v2 only, the high half of size
+    uint32_t size_hi;
+    uint32_t reserved_hi;
+    // FEATURE_INLINE_DATA only, the bytes of a small file or symlink,
+    // zeros past its size
+    char inline_data[INLINE_DATA_SIZE];
+} descr_struct;
+
+typedef struct {
+    int block_size;
+    int blocks_num;
+    int size;
+    // int mask_size;
+    int mask_offset;
+    int max_files;
+    int descr_table_offset;
+    // head of the free descriptor list, 0 if it was never built
+    int free_descr;
+    // bytes per descriptor, 0 for LEGACY_DESCR_SIZE
+    int descr_size;
+    int features;
+    // what mkfs was asked for, 0 on older images
+    float descriptors_part;
+    int files_hint;
+    // v2 only; size above holds as much of size64 as fits in an int
+    uint32_t magic;
+    int version;
+    int64_t size64;
+    // FEATURE_JOURNAL only, where the log is and how many blocks it has
+    int journal_start;
+    int journal_blocks;
+    // FEATURE_LAZY_DESCRS only, the table is initialized up to here
+    int descr_ready;
+} fs_struct;
+
+typedef struct {
+    char filename[FILENAME_SIZE];
+    int descr_id;
+} file_struct;
+
+/* An open file.  Reads and writes through it update the position and
+   readahead state with relaxed atomics, as they happen under a shared
+   file lock; losing a race only makes readahead guess worse. */
+typedef struct {
+    // descriptor, -1 while the fid is free
+    int descr_id;
+    // read_iov() pins taken through the fid
+    int pins;
+    // SFS_ADVICE_* given by advise_file()
+    int advice;
+    // end of the last read or write
+    int64_t pos;
+    // the image was prefetched up to ra_end, in windows of ra_size bytes
+    int64_t ra_end;
+    int64_t ra_size;
+} fid_struct;
+
+/* One mounted image with its open files and working directory.  Library
+   calls work on the instance SFS of the calling thread; the sfs_*()
+   entry points switch it for the time of the call.
+
+   Threads may share an instance.  Locks are taken in this order:
+
+     - ns_lock guards the directory tree, the descriptor table and
+       work_dir: shared while walking paths, exclusive to change them;
+     - file_locks guard the data, size and map of files, hashed by
+       descriptor id: shared for reads, exclusive for writes;
+     - then the block map hint slot of the file, then the table of
+       packed blocks, then a per-thread allocation pool, then one
+       allocation group at a time;
+     - the dcache, fids_lock, the journal lock and the lock of the
+       delayed tails are leaves, nothing else is taken while holding them.
+
+   The journal committer and flush_dirty() take ns_lock and then every
+   file lock in order (lock_all()) to see the image between operations,
+   so every change to it happens under one of them taken exclusively.
+
+   mount() and umount() must not race with anything else on the
+   instance. */
+struct sfs_struct {
+    fs_struct *fs;
+    // bytes of the image mapped at fs
+    int64_t mapped_size;
+    // what of fs_struct never changes once mounted, copied by
+    // load_geometry(): the journal remaps the pages of the info block
+    // while it holds uncommitted metadata
+    int block_size;
+    int blocks_num;
+    int mask_offset;
+    int descr_table_offset;
+    int descr_size;
+    int max_files;
+    int features;
+    // the image file, open while it is mapped
+    int image_fd;
+    fid_struct fids[FIDS_NUM];
+    // read_iov() pins taken through all fids
+    int pins_num;
+    char work_dir[MAX_PATH_SIZE];
+    // descriptor of work_dir, NO_DESCR once it has been removed
+    int work_dir_id;
+    int dcache_size;
+    // journal commit window, 0 blocks for a quarter of the log
+    int commit_ms;
+    int commit_blocks;
+    // background writeback after flush_age_ms or past flush_ratio percent
+    // of the image dirty, off while both are 0
+    int flush_age_ms;
+    int flush_ratio;
+    // blocks an append may wait for in memory, 0 maps them right away
+    int delay_blocks;
+    // files up to pack_size bytes share blocks, 0 gives each its own
+    int pack_size;
+    // state of the modules, NULL until they are set up
+    struct alloc_state *alloc;
+    struct dcache_state *dcache;
+    struct map_state *map;
+    struct journal_state *journal;
+    struct flush_state *flush;
+    struct delay_state *delay;
+    struct pack_state *pack;
+    pthread_rwlock_t ns_lock;
+    pthread_rwlock_t file_locks[FILE_LOCKS_NUM];
+    // guards taking and freeing fids, their pins and pins_num
+    pthread_mutex_t fids_lock;
+};
+
+extern __thread sfs_t *SFS;
+
+#define FS (SFS->fs)
+#define MAPPED_SIZE (SFS->mapped_size)
+#define BLOCK_SIZE (SFS->block_size)
+#define FS_BLOCKS (SFS->blocks_num)
+#define MAX_FILES (SFS->max_files)
+#define FEATURES (SFS->features)
+#define IMAGE_FD (SFS->image_fd)
+#define FIDS (SFS->fids)
+#define PINS_NUM (SFS->pins_num)
+#define WORK_DIR (SFS->work_dir)
+#define WORK_DIR_ID (SFS->work_dir_id)
+#define DCACHE_SIZE (SFS->dcache_size)
+
+void load_geometry();
+void init_instance(sfs_t *sfs);
+void release_instance(sfs_t *sfs);
+void lock_ns(bool write);
+void unlock_ns();
+void lock_file(descr_struct *file, bool write);
+void unlock_file(descr_struct *file);
+void lock_all();
+void unlock_all();
+
+int64_t file_size(descr_struct *file);
+int64_t disk_size(descr_struct *file);
+void set_file_size(descr_struct *file, int64_t size);
+int read_descr(descr_struct *file, int64_t offset, int64_t size, char *data);
+int write_descr(descr_struct *file, int64_t offset, int64_t size, char *data);
@@ -0,0 +1,11 @@
+#define DCACHE_DEFAULT_SIZE (1024 * 1024)
+
+int dcache_init(int size);
+void dcache_release();
+bool dcache_get(int dir_id, char *filename, int *descr_id);
+void dcache_put(int dir_id, char *filename, int descr_id);
+void dcache_forget_dir(int dir_id);
+bool dcache_get_link(int link_id, int dir_id, int *target_id, int *hops);
+void dcache_put_link(int link_id, int dir_id, int target_id, int hops);
+void dcache_forget_links();
+void dcache_dump_stats();
@@ -0,0 +1,15 @@
+// blocks a file may wait for in memory by default, 0 turns it off
+#define DELAY_DEFAULT_BLOCKS 256
+#define DELAY_MAX_MEMORY (64 * 1024 * 1024)
+
+int delay_init();
+int delay_release();
+bool delay_fits(descr_struct *file, int64_t new_size);
+int delay_grow(descr_struct *file, int64_t new_size);
+int64_t delay_size(descr_struct *file);
+char *delay_span(descr_struct *file, int64_t offset, int64_t *size);
+bool delay_pending(descr_struct *file, int64_t offset, int64_t size);
+int delay_place(descr_struct *file);
+void delay_drop(descr_struct *file);
+int delay_flush();
+void delay_dump_stats();
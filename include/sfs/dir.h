@@ -0,0 +1,11 @@
+typedef int dir_callback(file_struct *file, void *arg);
+
+uint32_t name_hash(char *name);
+
+int dir_lookup(descr_struct *dir, char *filename);
+int add_to_dir(descr_struct *dir, descr_struct *file, char *filename);
+int rm_from_dir(descr_struct *dir, char *filename);
+int dir_foreach(descr_struct *dir, dir_callback *callback, void *arg);
+int dir_files_num(descr_struct *dir);
+int dir_blocks_num(descr_struct *dir);
+void dir_release(descr_struct *dir);
@@ -0,0 +1,5 @@
+int ext_run(descr_struct *file, int block_id, int max_num, int *start);
+int ext_hole(descr_struct *file, int block_id, int max_num);
+int ext_insert(descr_struct *file, int block_id, int start, int len, int *inserted);
+void ext_truncate(descr_struct *file, int block_id);
+int ext_blocks_num(descr_struct *file);
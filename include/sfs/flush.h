@@ -0,0 +1,8 @@
+int flush_init();
+void flush_stop();
+void flush_release();
+void mark_dirty(void *addr, int64_t size);
+void flush_dirty(bool stopped);
+void flush_policy();
+int flush_dirty_num();
+void flush_dump_stats();
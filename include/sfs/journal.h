@@ -0,0 +1,17 @@
+#define COMMIT_DEFAULT_MS 1000
+// mkfs gives the journal a part of the image between the sizes below
+#define DEFAULT_JOURNAL_PART 64
+#define MIN_JOURNAL_SIZE (64 * 1024)
+#define MAX_JOURNAL_SIZE (32 * 1024 * 1024)
+// the super block and a transaction of one block
+#define MIN_JOURNAL_BLOCKS 4
+
+int journal_format(int start, int blocks_num);
+int journal_init();
+void journal_release();
+void journal_dirty(void *addr, int64_t size);
+void journal_sync();
+void journal_msync(void *addr, int64_t size);
+void journal_write_back();
+void journal_window(int ms, int blocks);
+void journal_dump_stats();
@@ -0,0 +1,16 @@
+int map_hints_init();
+void map_hints_release();
+bool is_inline(descr_struct *file);
+bool has_map(descr_struct *file);
+int map_init(descr_struct *file, int goal);
+int map_uninline(descr_struct *file);
+void map_inline(descr_struct *file);
+int map_run(descr_struct *file, int block_id, int max_num, int *start);
+int map_grow(descr_struct *file, int blocks_num);
+int map_spare(int blocks);
+int map_fill(descr_struct *file, int first, int end);
+int map_hole(descr_struct *file, int block_id, int max_num);
+void map_shrink(descr_struct *file, int blocks_num);
+void map_release(descr_struct *file);
+int map_blocks_num(descr_struct *file);
+int map_fragments(descr_struct *file);
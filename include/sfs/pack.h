@@ -0,0 +1,15 @@
+// bytes up to which a file shares a block by default, 0 turns it off
+#define PACK_DEFAULT_SIZE 2048
+
+int pack_init();
+void pack_release();
+bool is_packed(descr_struct *file);
+bool pack_fits(descr_struct *file, int64_t new_size);
+int pack_grow(descr_struct *file, int64_t new_size);
+void pack_shrink(descr_struct *file, int64_t new_size);
+void pack_set(descr_struct *file, int block_id, int unit, int units);
+void pack_free(descr_struct *file);
+void pack_put(int block_id, int unit, int units);
+char *pack_span(descr_struct *file);
+int pack_room(descr_struct *file);
+void pack_dump_stats(int *blocks, int blocks_num, int64_t bytes);
@@ -0,0 +1,12 @@
+typedef struct {
+    // directory holding the last component, NULL for the root itself
+    descr_struct *parent;
+    // what the path names, NULL if the last component doesn't exist
+    descr_struct *target;
+    // last component
+    char name[FILENAME_SIZE];
+} path_struct;
+
+int walk_path(char *path, bool follow, path_struct *walk);
+int walk_target(char *link_path, char *target, path_struct *walk);
+int normalize_path(char *path, char *normalized);
@@ -0,0 +1 @@
+void read_ahead(fid_struct *fid, descr_struct *file, int64_t offset, int64_t size);
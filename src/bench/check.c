@@ -0,0 +1,1648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/dcache.h"
+#include "sfs/journal.h"
+#include "sfs/delay.h"
+#include "sfs/pack.h"
+#include "bench/image.h"
+
+/*
+ * Behavior checks, run by `make check`.
+ *
+ * Each check builds an image, drives it through the public calls only and
+ * compares return codes and file contents with what they must be.  Failed
+ * expectations are printed, and the exit status is 1 if any check failed.
+ */
+
+#define IMAGE_SIZE (16 * 1024 * 1024)
+#define BIG_DIR_FILES 2000
+#define DCACHE_FILES 60
+// room for a few entries only
+#define TINY_DCACHE 200
+#define EXTENT_BLOCKS 64
+#define LARGE_IMAGE_SIZE (3LL * 1024 * 1024 * 1024)
+#define LARGE_OFFSET (5LL * 512 * 1024 * 1024)
+#define V1_IMAGE_SIZE (1024 * 1024)
+#define V1_FILE_SIZE 20000
+// past one index block of 512 byte blocks, and past two levels of them
+#define DOUBLE_FILE_SIZE (100 * 1024)
+#define TRIPLE_FILE_SIZE (9 * 1024 * 1024)
+#define INDEXED_IMAGE_SIZE (12 * 1024 * 1024)
+#define INDEXED_STEP 65000
+#define PIN_IOVS 16
+#define VEC_FILE_SIZE 12106
+#define INSTANCE_FILES 100
+#define THREADS_NUM 4
+#define THREAD_ROUNDS 200
+#define THREAD_FILES 8
+#define THREAD_MAX_SIZE 9000
+#define ALLOC_ROUNDS 3
+#define CRASH_FILES 50
+#define CRASH_FILE_SIZE 3000
+// a table of a few chunks, and a few descriptors into one more
+#define DESCR_FILES (3 * DESCRS_CHUNK + 8)
+#define DELAYED_FILES 64
+#define DELAYED_FILE_SIZE (400 * 1024)
+#define SPARSE_STRIDE (1024 * 1024)
+#define SPARSE_IMAGE_SIZE (64 * 1024 * 1024)
+// what fits in a descriptor and in a packed block by default
+#define INLINE_SIZE 56
+#define PACKED_SIZE 1000
+#define MAPPED_FILE_SIZE 6000
+#define PACKED_FILES 500
+// symlinks followed on one path before STATUS_LOOP
+#define MAX_HOPS 40
+
+/* Failed expectations so far. */
+int FAILED = 0;
+
+/* Count and print a failed expectation. */
+bool expect(bool ok, char *format, ...)
+{
+    if (ok)
+        return true;
+    va_list args;
+    va_start(args, format);
+    printf("  failed: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    FAILED++;
+    return false;
+}
+
+int make_image(char *path, int block_size, int journal_blocks)
+{
+    return make_sized_image(path, IMAGE_SIZE, block_size, journal_blocks);
+}
+
+/* SIZE bytes of a pattern that differs between SEEDs and offsets. */
+void fill(char *buf, int size, int seed)
+{
+    for (int i = 0; i < size; ++i)
+        buf[i] = 'a' + (seed * 7 + i) % 26;
+}
+
+/* Create PATH holding SIZE bytes of DATA. */
+int put_file(char *path, char *data, int size)
+{
+    int err = create_file(path);
+    if (err)
+        return err;
+    int fid = open_file(path);
+    if (fid < 0)
+        return STATUS_ERR;
+    err = write_file(fid, 0, size, data);
+    close_file(fid);
+    return err;
+}
+
+/* Does PATH hold exactly SIZE bytes of DATA? */
+bool same_file(char *path, char *data, int size)
+{
+    if (get_file_size(path) != size)
+        return false;
+    int fid = open_file(path);
+    if (fid < 0)
+        return false;
+    char *got = malloc(size + 1);
+    bool same = read_file(fid, 0, size, got) == STATUS_OK && memcmp(got, data, size) == 0;
+    free(got);
+    close_file(fid);
+    return same;
+}
+
+/* Does PATH hold the string WANT? */
+bool holds(char *path, char *want)
+{
+    return same_file(path, want, strlen(want));
+}
+
+// 27 names of 15 characters with one filename hash: each part of three
+// is a three-way collision from the state the parts before it leave
+char *COLLISION_PARTS[3][3] = {
+    {"Dicmz", "vHjPE", "DQAet"}, {"Cueqt", "bwkRT", "PpKDE"}, {"KHEhq", "PTBPQ", "toyrM"},
+};
+#define COLLISIONS_NUM 27
+
+/* Directories past a block become hash trees: every name stays found
+   through creates, removes and a remount, even names of one hash, and a
+   directory that can't be converted for want of space stays whole. */
+void check_htree(char *image)
+{
+    if (!expect(make_image(image, 512, -1) == STATUS_OK, "make image"))
+        return;
+    char path[64];
+    expect(make_dir("/big") == STATUS_OK, "mkdir /big");
+    for (int i = 0; i < BIG_DIR_FILES; ++i)
+    {
+        sprintf(path, "/big/file%d", i);
+        expect(create_file(path) == STATUS_OK, "create %s", path);
+    }
+    expect(create_file("/big/file7") == STATUS_EXISTS_ERR, "create an existing name");
+    for (int i = 0; i < BIG_DIR_FILES; i += 2)
+    {
+        sprintf(path, "/big/file%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+
+    expect(make_dir("/same") == STATUS_OK, "mkdir /same");
+    char names[COLLISIONS_NUM][20];
+    for (int i = 0; i < COLLISIONS_NUM; ++i)
+    {
+        sprintf(names[i], "%s%s%s", COLLISION_PARTS[0][i % 3], COLLISION_PARTS[1][i / 3 % 3],
+                COLLISION_PARTS[2][i / 9]);
+        sprintf(path, "/same/%s", names[i]);
+        expect(create_file(path) == STATUS_OK, "create %s", path);
+        // others around them, so the leaves split
+        sprintf(path, "/same/other%d", i);
+        expect(create_file(path) == STATUS_OK, "create %s", path);
+    }
+    for (int i = 0; i < COLLISIONS_NUM; i += 2)
+    {
+        sprintf(path, "/same/%s", names[i]);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    for (int i = 0; i < COLLISIONS_NUM; ++i)
+    {
+        sprintf(path, "/same/%s", names[i]);
+        expect((get_file_size(path) == 0) == (i % 2 == 1), "%s after removes", path);
+    }
+    for (int i = 0; i < COLLISIONS_NUM; i += 2)
+    {
+        sprintf(path, "/same/%s", names[i]);
+        expect(create_file(path) == STATUS_OK, "create %s again", path);
+        expect(create_file(path) == STATUS_EXISTS_ERR, "create %s twice", path);
+    }
+
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    for (int i = 0; i < BIG_DIR_FILES; ++i)
+    {
+        sprintf(path, "/big/file%d", i);
+        expect((get_file_size(path) == 0) == (i % 2 == 1), "%s after remount", path);
+    }
+    for (int i = 0; i < COLLISIONS_NUM; ++i)
+    {
+        sprintf(path, "/same/%s", names[i]);
+        expect(get_file_size(path) == 0, "%s after remount", path);
+    }
+    for (int i = 1; i < BIG_DIR_FILES; i += 2)
+    {
+        sprintf(path, "/big/file%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    expect(remove_dir("/big") == STATUS_OK, "rmdir /big once empty");
+
+    // fill the image, then the directory until it can't grow
+    expect(make_dir("/full") == STATUS_OK, "mkdir /full");
+    set_delayed_alloc(0);
+    set_tail_packing(0);
+    char block[512] = {0};
+    expect(create_file("/filler") == STATUS_OK, "create /filler");
+    int fid = open_file("/filler");
+    int offset = 0;
+    while (write_file(fid, offset, sizeof(block), block) == STATUS_OK)
+        offset += sizeof(block);
+    close_file(fid);
+    int entries = 0;
+    int err = STATUS_OK;
+    while (err == STATUS_OK)
+    {
+        sprintf(path, "/full/f%d", entries);
+        err = create_file(path);
+        if (err == STATUS_OK)
+            entries++;
+    }
+    expect(err == STATUS_NO_SPACE_LEFT, "create in a directory on a full image: %d", err);
+    for (int i = 0; i < entries; ++i)
+    {
+        sprintf(path, "/full/f%d", i);
+        expect(get_file_size(path) == 0, "%s after a failed create", path);
+    }
+    expect(trancate("/filler", 0) == STATUS_OK, "truncate /filler");
+    for (int i = entries; i < entries * 4; ++i)
+    {
+        sprintf(path, "/full/f%d", i);
+        expect(create_file(path) == STATUS_OK, "create %s once there is room", path);
+    }
+    for (int i = 0; i < entries * 4; ++i)
+    {
+        sprintf(path, "/full/f%d", i);
+        expect(get_file_size(path) == 0, "%s after the conversion", path);
+    }
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* The dentry cache never answers for a name that changed: a name looked
+   up while missing and then created, a directory removed and made again
+   under the same name, links moved between names, and all of it while a
+   tiny cache evicts entries all the time. */
+void check_dcache(char *image)
+{
+    if (!expect(make_image(image, 512, -1) == STATUS_OK, "make image"))
+        return;
+    for (int round = 0; round < 2; ++round)
+    {
+        if (round == 1)
+            expect(set_dcache_size(TINY_DCACHE) == STATUS_OK, "shrink the dcache");
+        expect(make_dir("/d") == STATUS_OK, "mkdir /d, round %d", round);
+        expect(get_file_size("/d/x") < 0 && open_file("/d/x") < 0, "missing /d/x, round %d", round);
+        expect(put_file("/d/x", "one", 3) == STATUS_OK, "create /d/x, round %d", round);
+        expect(holds("/d/x", "one"), "/d/x once created, round %d", round);
+        expect(rmlink("/d/x") == STATUS_OK, "remove /d/x, round %d", round);
+        expect(get_file_size("/d/x") < 0, "/d/x once removed, round %d", round);
+        expect(put_file("/d/x", "two", 3) == STATUS_OK && holds("/d/x", "two"), "/d/x made again, round %d",
+               round);
+
+        // the same name for another directory, which may get the same id
+        expect(make_dir("/d/sub") == STATUS_OK && put_file("/d/sub/f", "old", 3) == STATUS_OK,
+               "write /d/sub/f, round %d", round);
+        expect(holds("/d/sub/f", "old"), "/d/sub/f, round %d", round);
+        expect(rmlink("/d/sub/f") == STATUS_OK && remove_dir("/d/sub") == STATUS_OK,
+               "remove /d/sub, round %d", round);
+        expect(get_file_size("/d/sub/f") < 0 && get_file_size("/d/sub") < 0, "/d/sub once removed, round %d",
+               round);
+        expect(make_dir("/d/sub") == STATUS_OK, "mkdir /d/sub again, round %d", round);
+        expect(get_file_size("/d/sub/f") < 0, "/d/sub/f in the new /d/sub, round %d", round);
+        expect(put_file("/d/sub/f", "new", 3) == STATUS_OK && holds("/d/sub/f", "new"),
+               "/d/sub/f in the new /d/sub, round %d", round);
+
+        // a file moved to another name
+        expect(mklink("/d/x", "/d/y") == STATUS_OK && rmlink("/d/x") == STATUS_OK, "move /d/x, round %d",
+               round);
+        expect(get_file_size("/d/x") < 0 && holds("/d/y", "two"), "/d/x moved to /d/y, round %d", round);
+
+        // more names than the tiny cache holds, looked up over and over
+        char path[64];
+        char want[16];
+        expect(make_dir("/d/many") == STATUS_OK, "mkdir /d/many, round %d", round);
+        for (int i = 0; i < DCACHE_FILES; ++i)
+        {
+            sprintf(path, "/d/many/f%d", i);
+            sprintf(want, "%d", i);
+            expect(put_file(path, want, strlen(want)) == STATUS_OK, "write %s, round %d", path, round);
+        }
+        for (int i = 0; i < DCACHE_FILES; i += 2)
+        {
+            sprintf(path, "/d/many/f%d", i);
+            expect(rmlink(path) == STATUS_OK, "remove %s, round %d", path, round);
+        }
+        for (int pass = 0; pass < 3; ++pass)
+        {
+            for (int i = 0; i < DCACHE_FILES; ++i)
+            {
+                sprintf(path, "/d/many/f%d", i);
+                sprintf(want, "%d", i);
+                if (i % 2 == 0)
+                    expect(get_file_size(path) < 0, "removed %s, round %d", path, round);
+                else
+                    expect(holds(path, want), "%s, round %d", path, round);
+            }
+        }
+        for (int i = 0; i < DCACHE_FILES; ++i)
+        {
+            sprintf(path, "/d/many/f%d", i);
+            if (i % 2)
+                rmlink(path);
+        }
+        expect(remove_dir("/d/many") == STATUS_OK, "rmdir /d/many, round %d", round);
+        expect(rmlink("/d/sub/f") == STATUS_OK && remove_dir("/d/sub") == STATUS_OK
+               && rmlink("/d/y") == STATUS_OK && remove_dir("/d") == STATUS_OK, "remove /d, round %d", round);
+    }
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Paths resolve however they are spelled: with "." and "//", with ".."
+   climbing above the root, with trailing slashes, and relative to a
+   working directory that was removed, by its name.  A last component too
+   long for a directory entry is STATUS_NAME_TOO_LONG. */
+void check_paths(char *image)
+{
+    if (!expect(make_image(image, 512, -1) == STATUS_OK, "make image"))
+        return;
+    expect(make_dir("/a") == STATUS_OK && make_dir("/a/b") == STATUS_OK, "mkdir /a/b");
+    expect(put_file("/a/b/f", "f", 1) == STATUS_OK, "write /a/b/f");
+    char *spellings[] = {"/a/./b/./f", "/a/b/../b/f", "/../../a/b/f", "//a///b//f", "/a/b/./../../a/b/f"};
+    for (int i = 0; i < sizeof(spellings) / sizeof(spellings[0]); ++i)
+        expect(holds(spellings[i], "f"), "%s", spellings[i]);
+
+    expect(cd("/a//b/") == STATUS_OK && strcmp(pwd(), "/a/b") == 0, "cd /a//b/: %s", pwd());
+    char *relative[] = {"f", "./f", "../b/f", "../../../../a/b/f", ".//f"};
+    for (int i = 0; i < sizeof(relative) / sizeof(relative[0]); ++i)
+        expect(holds(relative[i], "f"), "%s from /a/b", relative[i]);
+    expect(cd("..") == STATUS_OK && strcmp(pwd(), "/a") == 0, "cd .. to %s", pwd());
+    expect(cd("../..") == STATUS_OK && strcmp(pwd(), "/") == 0, "cd ../.. to %s", pwd());
+    expect(make_dir("/c/") == STATUS_OK && get_file_size("/c") >= 0 && cd("c/") == STATUS_OK
+           && strcmp(pwd(), "/c") == 0, "mkdir and cd with a trailing slash");
+    expect(cd("/") == STATUS_OK, "cd /");
+
+    // FILENAME_SIZE holds the name and its terminating zero
+    char name[64] = "/a/";
+    memset(name + 3, 'n', FILENAME_SIZE - 1);
+    expect(create_file(name) == STATUS_OK && get_file_size(name) == 0, "a name of %d characters",
+           FILENAME_SIZE - 1);
+    strcat(name, "n");
+    expect(create_file(name) == STATUS_NAME_TOO_LONG, "create a name of %d characters", FILENAME_SIZE);
+    expect(make_dir(name) == STATUS_NAME_TOO_LONG, "mkdir a name of %d characters", FILENAME_SIZE);
+    strcat(name, "/f");
+    expect(create_file(name) == STATUS_NOT_FOUND, "create under a name of %d characters", FILENAME_SIZE);
+
+    // the removed working directory is still named by pwd()
+    expect(cd("/a/b") == STATUS_OK && rmlink("f") == STATUS_OK && remove_dir("/a/b") == STATUS_OK,
+           "remove the working directory");
+    expect(strcmp(pwd(), "/a/b") == 0, "pwd after the working directory went: %s", pwd());
+    expect(get_file_size("f") < 0 && create_file("g") != STATUS_OK, "a removed working directory");
+    expect(make_dir("/a/b") == STATUS_OK && put_file("/a/b/g", "g", 1) == STATUS_OK, "make /a/b again");
+    expect(holds("g", "g") && holds("./g", "g") && holds("../b/g", "g"), "the new /a/b by its name");
+    expect(cd(".") == STATUS_OK && put_file("h", "h", 1) == STATUS_OK && holds("/a/b/h", "h"),
+           "cd . into the new /a/b");
+    expect(cd("/") == STATUS_OK && umount() == STATUS_OK, "umount");
+}
+
+/* Does block INDEX of FID, BLOCK_SIZE bytes, hold the pattern of SEED? */
+bool same_block(int fid, int block_size, int index, int seed)
+{
+    char want[4096];
+    char got[4096];
+    fill(want, block_size, seed);
+    return read_file(fid, index * block_size, block_size, got) == STATUS_OK
+        && memcmp(got, want, block_size) == 0;
+}
+
+/* Files are mapped by extents: runs written in order merge, writes into
+   holes between extents and truncates inside one split them, and a file
+   that runs out of space in the middle of a run keeps what it mapped. */
+void check_extents(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    set_delayed_alloc(0);
+    char buf[4096];
+    expect(create_file("/seq") == STATUS_OK, "create /seq");
+    int fid = open_file("/seq");
+    for (int i = 0; i < EXTENT_BLOCKS; ++i)
+    {
+        fill(buf, block_size, i);
+        expect(write_file(fid, i * block_size, block_size, buf) == STATUS_OK, "append block %d", i);
+    }
+    expect(get_file_fragments("/seq") == 1, "appends in one run: %d fragments",
+           get_file_fragments("/seq"));
+    // every other block from the end, then the rest, into holes
+    expect(create_file("/holes") == STATUS_OK, "create /holes");
+    int holes = open_file("/holes");
+    for (int i = EXTENT_BLOCKS - 1; i >= 0; i -= 2)
+    {
+        fill(buf, block_size, 1000 + i);
+        expect(write_file(holes, i * block_size, block_size, buf) == STATUS_OK, "write block %d", i);
+    }
+    for (int i = 0; i < EXTENT_BLOCKS; i += 2)
+    {
+        fill(buf, block_size, 1000 + i);
+        expect(write_file(holes, i * block_size, block_size, buf) == STATUS_OK, "fill hole %d", i);
+    }
+    for (int i = 0; i < EXTENT_BLOCKS; ++i)
+    {
+        expect(same_block(fid, block_size, i, i), "/seq block %d", i);
+        expect(same_block(holes, block_size, i, 1000 + i), "/holes block %d", i);
+    }
+    // cut in the middle of a block, grow back with zeros
+    int cut = EXTENT_BLOCKS / 2 * block_size + 100;
+    expect(trancate("/seq", cut) == STATUS_OK, "truncate /seq inside a block");
+    expect(trancate("/seq", EXTENT_BLOCKS * block_size) == STATUS_OK, "truncate /seq back up");
+    for (int i = 0; i < EXTENT_BLOCKS / 2; ++i)
+        expect(same_block(fid, block_size, i, i), "/seq block %d after truncates", i);
+    fill(buf, block_size, EXTENT_BLOCKS / 2);
+    char zeros[4096] = {0};
+    char got[4096];
+    expect(read_file(fid, EXTENT_BLOCKS / 2 * block_size, block_size, got) == STATUS_OK
+           && memcmp(got, buf, 100) == 0 && memcmp(got + 100, zeros, block_size - 100) == 0,
+           "the block cut into");
+    for (int i = EXTENT_BLOCKS / 2 + 1; i < EXTENT_BLOCKS; ++i)
+    {
+        expect(read_file(fid, i * block_size, block_size, got) == STATUS_OK
+               && memcmp(got, zeros, block_size) == 0, "/seq block %d zero after truncates", i);
+    }
+    close_file(fid);
+    close_file(holes);
+
+    // two files in turn until both are out of space, every block their own
+    expect(create_file("/a") == STATUS_OK && create_file("/b") == STATUS_OK, "create /a and /b");
+    int fids[2] = {open_file("/a"), open_file("/b")};
+    int blocks[2] = {0, 0};
+    bool full[2] = {false, false};
+    while (!full[0] || !full[1])
+    {
+        for (int f = 0; f < 2; ++f)
+        {
+            if (full[f])
+                continue;
+            fill(buf, block_size, f * 100000 + blocks[f]);
+            int err = write_file(fids[f], blocks[f] * block_size, block_size, buf);
+            if (err == STATUS_OK)
+                blocks[f]++;
+            else
+                full[f] = expect(err == STATUS_NO_SPACE_LEFT, "write on a full image: %d", err);
+        }
+    }
+    for (int f = 0; f < 2; ++f)
+    {
+        expect(get_file_size(f ? "/b" : "/a") == blocks[f] * block_size, "size of a full file");
+        for (int i = 0; i < blocks[f]; ++i)
+        {
+            if (!expect(same_block(fids[f], block_size, i, f * 100000 + i), "block %d of a full file", i))
+                break;
+        }
+        close_file(fids[f]);
+    }
+    // what they took all comes back
+    expect(rmlink("/a") == STATUS_OK && rmlink("/b") == STATUS_OK, "remove /a and /b");
+    expect(create_file("/c") == STATUS_OK, "create /c");
+    fid = open_file("/c");
+    int c_blocks = 0;
+    while (write_file(fid, c_blocks * block_size, block_size, zeros) == STATUS_OK)
+        c_blocks++;
+    close_file(fid);
+    expect(c_blocks >= blocks[0] + blocks[1], "%d blocks after removes, %d before",
+           c_blocks, blocks[0] + blocks[1]);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Write a version 1 image of SIZE bytes to PATH, the way mkfs made them
+   before descriptors grew: 512 byte blocks, 20 byte descriptors, files
+   mapped by index blocks and a root holding . and .. only. */
+int make_v1_image(char *path, int size)
+{
+    int block_size = 512;
+    int blocks_num = size / block_size;
+    int mask_blocks = (blocks_num / 8 + block_size - 1) / block_size;
+    int max_files = size / LEGACY_DESCR_SIZE / 20;
+    int table_blocks = (max_files * LEGACY_DESCR_SIZE + block_size - 1) / block_size;
+    // the index block of the root, then its one directory block
+    int index_id = 1 + mask_blocks + table_blocks;
+    char *image = calloc(size, 1);
+    if (image == NULL)
+        return STATUS_ERR;
+    fs_struct *fs = (fs_struct *) image;
+    fs->block_size = block_size;
+    fs->blocks_num = blocks_num;
+    fs->size = size;
+    fs->mask_offset = block_size;
+    fs->max_files = max_files;
+    fs->descr_table_offset = (1 + mask_blocks) * block_size;
+    uint8_t *mask = (uint8_t *) image + fs->mask_offset;
+    for (int i = 0; i < mask_blocks * block_size * 8; ++i)
+    {
+        if (i <= index_id + 1 || i >= blocks_num)
+            mask[i / 8] |= 1 << (i % 8);
+    }
+    // id, type, links_num, size and blocks_id
+    int *descrs = (int *) (image + fs->descr_table_offset);
+    for (int i = 0; i < max_files; ++i)
+        descrs[i * 5] = i;
+    descrs[1] = DIR_TYPE;
+    descrs[2] = 1;
+    descrs[3] = 2 * sizeof(file_struct);
+    descrs[4] = index_id;
+    ((int *) (image + index_id * block_size))[0] = index_id + 1;
+    file_struct *root = (file_struct *) (image + (index_id + 1) * block_size);
+    strcpy(root[0].filename, ".");
+    strcpy(root[1].filename, "..");
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int written = fd == -1 ? -1 : write(fd, image, size);
+    if (fd != -1)
+        close(fd);
+    free(image);
+    return written == size ? STATUS_OK : STATUS_ERR;
+}
+
+/* Append SIZE bytes of DATA to PATH in writes of STEP bytes. */
+int append_file(char *path, char *data, int size, int step)
+{
+    int fid = open_file(path);
+    if (fid < 0)
+        return STATUS_ERR;
+    int err = STATUS_OK;
+    for (int done = get_file_size(path); !err && done < size; done += step)
+        err = write_file(fid, done, done + step < size ? step : size - done, data + done);
+    close_file(fid);
+    return err;
+}
+
+/* Without extents a file outgrows its index block into double and then
+   triple indirection, keeps its bytes across a remount, gives its index
+   blocks back as it shrinks and keeps its old mapping when the image
+   fills up under it. */
+void check_indexed(char *image)
+{
+    if (!expect(make_v1_image(image, INDEXED_IMAGE_SIZE) == STATUS_OK && mount(image) == STATUS_OK,
+                "mount a version 1 image"))
+        return;
+    char *data = malloc(TRIPLE_FILE_SIZE);
+    fill(data, TRIPLE_FILE_SIZE, 3);
+    expect(put_file("/double", data, DOUBLE_FILE_SIZE) == STATUS_OK, "write /double in one go");
+    // odd steps, so writes cross index blocks at every level
+    expect(create_file("/triple") == STATUS_OK
+           && append_file("/triple", data, TRIPLE_FILE_SIZE, INDEXED_STEP) == STATUS_OK, "append /triple");
+    expect(same_file("/double", data, DOUBLE_FILE_SIZE) && same_file("/triple", data, TRIPLE_FILE_SIZE),
+           "files of two and three levels");
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(same_file("/double", data, DOUBLE_FILE_SIZE) && same_file("/triple", data, TRIPLE_FILE_SIZE),
+           "files of two and three levels after remount");
+
+    expect(put_file("/rest", data, TRIPLE_FILE_SIZE) == STATUS_NO_SPACE_LEFT, "write more than is free");
+    expect(same_file("/triple", data, TRIPLE_FILE_SIZE) && rmlink("/rest") == STATUS_OK,
+           "/triple after the image filled up");
+
+    expect(trancate("/triple", DOUBLE_FILE_SIZE) == STATUS_OK && same_file("/triple", data, DOUBLE_FILE_SIZE),
+           "shrink /triple to two levels");
+    expect(trancate("/triple", V1_FILE_SIZE) == STATUS_OK && same_file("/triple", data, V1_FILE_SIZE),
+           "shrink /triple to one index block");
+    // only fits if shrinking gave the blocks back
+    expect(append_file("/triple", data, TRIPLE_FILE_SIZE, INDEXED_STEP) == STATUS_OK, "grow /triple again");
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(same_file("/double", data, DOUBLE_FILE_SIZE) && same_file("/triple", data, TRIPLE_FILE_SIZE),
+           "/triple grown again after remount");
+    free(data);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* mkfs refuses a geometry it can't lay out before it touches the image,
+   and an image too small for the table before it prints any stats.  The
+   largest block size still makes an image that works. */
+void check_geometry(char *image)
+{
+    if (!expect(make_image(image, 4096, -1) == STATUS_OK, "make image"))
+        return;
+    expect(put_file("/kept", "kept", 4) == STATUS_OK, "write /kept");
+    expect(umount() == STATUS_OK, "umount");
+
+    int block_sizes[] = {1000, 3072, MIN_BLOCK_SIZE / 2, MAX_BLOCK_SIZE * 2};
+    for (int i = 0; i < sizeof(block_sizes) / sizeof(int); ++i)
+        expect(mkfs_geometry(image, block_sizes[i], 0, 0) == STATUS_SIZE_ERR, "mkfs with %d byte blocks",
+               block_sizes[i]);
+    double parts[] = {1, 1.5, -0.25};
+    for (int i = 0; i < sizeof(parts) / sizeof(double); ++i)
+        expect(mkfs_geometry(image, 4096, parts[i], 0) == STATUS_SIZE_ERR,
+               "mkfs with %g of the image for descriptors", parts[i]);
+    expect(mkfs_geometry(image, 4096, 0, -1) == STATUS_SIZE_ERR, "mkfs with a negative files hint");
+    expect(mount(image) == STATUS_OK && holds("/kept", "kept"), "the image after refused geometries");
+    // nor does a refused mkfs unmount what is mounted
+    expect(mkfs_geometry(image, 1000, 0, 0) == STATUS_SIZE_ERR && holds("/kept", "kept"),
+           "a mounted image after a refused geometry");
+    expect(umount() == STATUS_OK, "umount");
+
+    char small[MAX_PATH_SIZE];
+    snprintf(small, sizeof(small), "%s.small", image);
+    expect(create_image(small, 3 * MIN_BLOCK_SIZE) == STATUS_OK
+           && mkfs_geometry(small, MIN_BLOCK_SIZE, 0, 0) == STATUS_NO_SPACE_LEFT, "mkfs on three blocks");
+    // a table bigger than the whole image
+    expect(mkfs_geometry(image, 4096, 0, IMAGE_SIZE) == STATUS_NO_SPACE_LEFT, "mkfs for %d files",
+           IMAGE_SIZE);
+    unlink(small);
+
+    expect(quiet_mkfs(image, MAX_BLOCK_SIZE, 0, -1) == STATUS_OK && mount(image) == STATUS_OK,
+           "mkfs with %d byte blocks", MAX_BLOCK_SIZE);
+    char data[3 * MAX_BLOCK_SIZE / 2];
+    fill(data, sizeof(data), 1);
+    expect(put_file("/big", data, sizeof(data)) == STATUS_OK, "write /big");
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(same_file("/big", data, sizeof(data)) && get_file_size("/kept") < 0,
+           "a new image of %d byte blocks", MAX_BLOCK_SIZE);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Files past 2 GB on an image past 2 GB: the int calls clamp their size
+   to INT32_MAX, the 64 bit ones keep all of it across a remount.  A
+   version 1 image still mounts, works and refuses what its 32 bit sizes
+   can't hold. */
+void check_large(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_sized_image(image, LARGE_IMAGE_SIZE, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    char data[4096];
+    char zeros[4096] = {0};
+    char got[4096];
+    fill(data, sizeof(data), 1);
+    expect(create_file("/big") == STATUS_OK, "create /big");
+    int fid = open_file("/big");
+    expect(write_file64(fid, LARGE_OFFSET, block_size, data) == STATUS_OK, "write past 2 GB");
+    close_file(fid);
+    for (int remount = 0; remount < 2; ++remount)
+    {
+        expect(get_file_size("/big") == INT32_MAX, "int size of /big, remounted %d times: %d",
+               remount, get_file_size("/big"));
+        expect(get_file_size64("/big") == LARGE_OFFSET + block_size, "size of /big, remounted %d times",
+               remount);
+        fid = open_file("/big");
+        expect(read_file64(fid, LARGE_OFFSET, block_size, got) == STATUS_OK
+               && memcmp(got, data, block_size) == 0, "the block past 2 GB, remounted %d times", remount);
+        expect(read_file64(fid, LARGE_OFFSET / 2, block_size, got) == STATUS_OK
+               && memcmp(got, zeros, block_size) == 0, "the hole before it, remounted %d times", remount);
+        expect(read_file64(fid, LARGE_OFFSET, block_size + 1, got) == STATUS_SIZE_ERR,
+               "read past the end, remounted %d times", remount);
+        close_file(fid);
+        if (remount == 0)
+            expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    }
+    expect(trancate64("/big", LARGE_OFFSET + 100) == STATUS_OK, "truncate /big past 2 GB");
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(get_file_size64("/big") == LARGE_OFFSET + 100, "size of /big after truncate and remount");
+    expect(trancate("/big", 100) == STATUS_OK && same_file("/big", zeros, 100), "truncate /big below 2 GB");
+    expect(umount() == STATUS_OK, "umount");
+
+    if (!expect(make_v1_image(image, V1_IMAGE_SIZE) == STATUS_OK && mount(image) == STATUS_OK,
+                "mount a version 1 image"))
+        return;
+    char file[V1_FILE_SIZE];
+    fill(file, sizeof(file), 2);
+    expect(make_dir("/d") == STATUS_OK, "mkdir /d on version 1");
+    expect(put_file("/d/f", file, sizeof(file)) == STATUS_OK, "write /d/f on version 1");
+    fid = open_file("/d/f");
+    expect(write_file64(fid, (int64_t) INT32_MAX, 1, "x") == STATUS_SIZE_ERR, "write past 2 GB on version 1");
+    close_file(fid);
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount version 1");
+    expect(same_file("/d/f", file, sizeof(file)), "/d/f after remount on version 1");
+    expect(rmlink("/d/f") == STATUS_OK && remove_dir("/d") == STATUS_OK, "remove /d/f and /d on version 1");
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Do the segments of IOV hold the SIZE bytes of DATA? */
+bool same_iov(struct iovec *iov, int iov_num, char *data, int size)
+{
+    int64_t offset = 0;
+    for (int i = 0; i < iov_num; ++i)
+    {
+        if (offset + iov[i].iov_len > size || memcmp(iov[i].iov_base, data + offset, iov[i].iov_len))
+            return false;
+        offset += iov[i].iov_len;
+    }
+    return offset == size;
+}
+
+/* While read_iov() pins a file its bytes stay where the segments point:
+   writing, truncating and removing it, closing the fid and umount are
+   STATUS_BUSY, other files stay writable, and unpin_file() lets all of
+   it through again.  For inline, packed and holed files. */
+void check_pins(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    char data[4 * 4096];
+    char *paths[] = {"/inline", "/packed", "/holed"};
+    int sizes[] = {40, 700, sizeof(data)};
+    fill(data, sizeof(data), 1);
+    // blocks 1 and 2 of /holed are never written
+    memset(data + block_size, 0, 2 * block_size);
+    for (int i = 0; i < 3; ++i)
+    {
+        expect(create_file(paths[i]) == STATUS_OK, "create %s", paths[i]);
+        int fid = open_file(paths[i]);
+        if (i < 2)
+        {
+            expect(write_file(fid, 0, sizes[i], data) == STATUS_OK, "write %s", paths[i]);
+        } else {
+            expect(write_file(fid, 0, block_size, data) == STATUS_OK
+                   && write_file(fid, 3 * block_size, block_size, data + 3 * block_size) == STATUS_OK,
+                   "write %s around a hole", paths[i]);
+        }
+        close_file(fid);
+    }
+    expect(put_file("/other", data, 100) == STATUS_OK, "write /other");
+    int other = open_file("/other");
+
+    for (int i = 0; i < 3; ++i)
+    {
+        int fid = open_file(paths[i]);
+        int second = open_file(paths[i]);
+        struct iovec iov[PIN_IOVS];
+        int iov_num = PIN_IOVS;
+        expect(read_iov(fid, 0, sizes[i], iov, &iov_num) == STATUS_OK, "pin %s", paths[i]);
+        expect(same_iov(iov, iov_num, data, sizes[i]), "segments of %s", paths[i]);
+        expect(write_file(fid, 0, 1, "x") == STATUS_BUSY, "write pinned %s", paths[i]);
+        expect(write_file(second, sizes[i], 1, "x") == STATUS_BUSY, "append to pinned %s", paths[i]);
+        expect(trancate(paths[i], 1) == STATUS_BUSY, "truncate pinned %s", paths[i]);
+        expect(rmlink(paths[i]) == STATUS_BUSY, "remove pinned %s", paths[i]);
+        expect(close_file(fid) == STATUS_BUSY, "close pinned %s", paths[i]);
+        expect(umount() == STATUS_BUSY, "umount with %s pinned", paths[i]);
+        expect(write_file(other, 0, 1, "x") == STATUS_OK, "write /other with %s pinned", paths[i]);
+        expect(same_iov(iov, iov_num, data, sizes[i]) && same_file(paths[i], data, sizes[i]),
+               "%s after what was refused", paths[i]);
+
+        expect(unpin_file(fid) == STATUS_OK, "unpin %s", paths[i]);
+        expect(unpin_file(fid) == STATUS_ERR, "unpin %s twice", paths[i]);
+        expect(write_file(fid, 0, 1, "x") == STATUS_OK, "write %s after unpin", paths[i]);
+        expect(trancate(paths[i], 1) == STATUS_OK, "truncate %s after unpin", paths[i]);
+        expect(close_file(fid) == STATUS_OK && close_file(second) == STATUS_OK, "close %s after unpin",
+               paths[i]);
+        expect(rmlink(paths[i]) == STATUS_OK, "remove %s after unpin", paths[i]);
+    }
+    close_file(other);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Point IOV_NUM segments of IOV at DATA, one after the other, with the
+   lengths in LENS. */
+void split_iov(struct iovec *iov, int *lens, int iov_num, char *data)
+{
+    for (int i = 0; i < iov_num; ++i)
+    {
+        iov[i].iov_base = data;
+        iov[i].iov_len = lens[i];
+        data += lens[i];
+    }
+}
+
+/* readv_file() and writev_file() move the bytes of uneven segments, empty
+   ones and ones across blocks included, as one read or write would.  A
+   submit_ops() batch with failing ops sets the status of each, completes
+   the others and only then returns STATUS_ERR. */
+void check_vectors(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    char data[VEC_FILE_SIZE];
+    char got[VEC_FILE_SIZE];
+    fill(data, sizeof(data), 1);
+    struct iovec iov[6];
+    int write_lens[] = {1, 4095, 5000, 0, 3000, 10};
+    split_iov(iov, write_lens, 6, data);
+    expect(create_file("/v") == STATUS_OK, "create /v");
+    int fid = open_file("/v");
+    expect(writev_file(fid, 0, iov, 6) == STATUS_OK, "writev /v");
+    expect(same_file("/v", data, sizeof(data)), "/v after writev");
+    // over the middle, from other buffers
+    char middle[6000];
+    fill(middle, sizeof(middle), 2);
+    memcpy(data + 3000, middle, sizeof(middle));
+    int middle_lens[] = {2500, 3500};
+    split_iov(iov, middle_lens, 2, middle);
+    expect(writev_file(fid, 3000, iov, 2) == STATUS_OK, "writev over the middle of /v");
+    int read_lens[] = {7, 0, 9000, 2999};
+    memset(got, 0, sizeof(got));
+    split_iov(iov, read_lens, 4, got);
+    expect(readv_file(fid, 100, iov, 4) == STATUS_OK && memcmp(got, data + 100, sizeof(data) - 100) == 0,
+           "readv /v");
+    read_lens[3] = 3000;
+    split_iov(iov, read_lens, 4, got);
+    expect(readv_file(fid, 100, iov, 4) == STATUS_SIZE_ERR, "readv past the end of /v");
+    close_file(fid);
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(same_file("/v", data, sizeof(data)), "/v after remount");
+
+    // a batch with an op of each way to fail between ones that don't
+    char a[3000];
+    fill(a, sizeof(a), 3);
+    expect(create_file("/a") == STATUS_OK && create_file("/pinned") == STATUS_OK, "create /a and /pinned");
+    int a_fid = open_file("/a");
+    int v_fid = open_file("/v");
+    int pinned = open_file("/pinned");
+    expect(write_file(pinned, 0, 10, a) == STATUS_OK, "write /pinned");
+    struct iovec pin[1];
+    int pin_num = 1;
+    expect(read_iov(pinned, 0, 10, pin, &pin_num) == STATUS_OK, "pin /pinned");
+    char head[100];
+    char tail[100];
+    sfs_op ops[] = {
+        {a_fid, SFS_WRITE, 0, 1000, a},
+        {v_fid, SFS_READ, VEC_FILE_SIZE - 50, 100, got},
+        {a_fid, SFS_WRITE, 1000, 2000, a + 1000},
+        {FIDS_NUM, SFS_READ, 0, 10, got},
+        {pinned, SFS_WRITE, 0, 10, a},
+        {v_fid, SFS_READ, 0, sizeof(head), head},
+        {v_fid, SFS_READ, VEC_FILE_SIZE - sizeof(tail), sizeof(tail), tail},
+    };
+    int want[] = {STATUS_OK, STATUS_SIZE_ERR, STATUS_OK, STATUS_NOT_FOUND, STATUS_BUSY, STATUS_OK, STATUS_OK};
+    int ops_num = sizeof(ops) / sizeof(ops[0]);
+    expect(submit_ops(ops, ops_num) == STATUS_ERR, "a batch with failing ops");
+    for (int i = 0; i < ops_num; ++i)
+        expect(ops[i].status == want[i], "status of op %d: %d, not %d", i, ops[i].status, want[i]);
+    expect(same_file("/a", a, sizeof(a)), "/a written by the batch");
+    expect(memcmp(head, data, sizeof(head)) == 0, "the head of /v read by the batch");
+    expect(memcmp(tail, data + sizeof(data) - sizeof(tail), sizeof(tail)) == 0,
+           "the tail of /v read by the batch");
+    unpin_file(pinned);
+    expect(same_file("/pinned", a, 10), "/pinned after the batch");
+
+    // without them all of it goes through
+    ops_num = 3;
+    ops[1] = ops[5];
+    ops[2] = ops[6];
+    memset(head, 0, sizeof(head));
+    memset(tail, 0, sizeof(tail));
+    expect(submit_ops(ops, ops_num) == STATUS_OK, "a batch without failing ops");
+    for (int i = 0; i < ops_num; ++i)
+        expect(ops[i].status == STATUS_OK, "status of op %d: %d", i, ops[i].status);
+    expect(memcmp(head, data, sizeof(head)) == 0, "the head of /v read by the second batch");
+    expect(memcmp(tail, data + sizeof(data) - sizeof(tail), sizeof(tail)) == 0,
+           "the tail of /v read by the second batch");
+    close_file(a_fid);
+    close_file(v_fid);
+    close_file(pinned);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Does PATH on SFS hold the string WANT? */
+bool sfs_holds(sfs_t *sfs, char *path, char *want)
+{
+    int size = strlen(want);
+    if (sfs_file_size(sfs, path) != size)
+        return false;
+    int fid = sfs_open(sfs, path);
+    if (fid < 0)
+        return false;
+    char got[64];
+    bool same = sfs_read(sfs, fid, 0, size, got) == STATUS_OK && memcmp(got, want, size) == 0;
+    sfs_close(sfs, fid);
+    return same;
+}
+
+/* Write and read back INSTANCE_FILES files in the working directory of
+   an instance, each holding its own path. */
+void *fill_instance(void *arg)
+{
+    sfs_t *sfs = arg;
+    char path[64];
+    char *name = sfs_pwd(sfs);
+    bool ok = true;
+    for (int i = 0; i < INSTANCE_FILES; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%d", name, i);
+        int fid = sfs_create_file(sfs, path) == STATUS_OK ? sfs_open(sfs, path) : -1;
+        ok = ok && fid >= 0 && sfs_write(sfs, fid, 0, strlen(path), path) == STATUS_OK;
+        sfs_close(sfs, fid);
+    }
+    for (int i = 0; i < INSTANCE_FILES; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%d", name, i);
+        ok = ok && sfs_holds(sfs, path, path);
+    }
+    return ok ? sfs : NULL;
+}
+
+/* Instances mounted side by side, and next to the default one, keep
+   their own working directory, open files and contents, from one thread
+   or from one thread each. */
+void check_instances(char *image)
+{
+    char images[2][MAX_PATH_SIZE];
+    for (int i = 0; i < 2; ++i)
+    {
+        snprintf(images[i], sizeof(images[i]), "%s.%d", image, i);
+        if (!expect(make_image(images[i], 4096, -1) == STATUS_OK && umount() == STATUS_OK, "make %s",
+                    images[i]))
+            return;
+    }
+    if (!expect(make_image(image, 4096, -1) == STATUS_OK, "make image"))
+        return;
+    sfs_t *a = sfs_mount(images[0]);
+    sfs_t *b = sfs_mount(images[1]);
+    if (!expect(a != NULL && b != NULL, "mount two instances"))
+        return;
+
+    expect(sfs_mkdir(a, "/d") == STATUS_OK && sfs_mkdir(b, "/d") == STATUS_OK
+           && make_dir("/d") == STATUS_OK, "mkdir /d on each");
+    expect(sfs_mkdir(a, "/d/a") == STATUS_OK && sfs_cd(a, "/d/a") == STATUS_OK
+           && sfs_cd(b, "/d") == STATUS_OK, "cd on each instance");
+    expect(strcmp(sfs_pwd(a), "/d/a") == 0 && strcmp(sfs_pwd(b), "/d") == 0 && strcmp(pwd(), "/") == 0,
+           "working directories %s, %s and %s", sfs_pwd(a), sfs_pwd(b), pwd());
+    // the same relative name lands in each instance's own directory
+    expect(sfs_create_file(a, "f") == STATUS_OK && sfs_create_file(b, "f") == STATUS_OK, "create f on each");
+    expect(sfs_file_size(a, "/d/a/f") == 0 && sfs_file_size(b, "/d/f") == 0 && sfs_file_size(b, "/d/a/f") < 0
+           && get_file_size("/d/f") < 0, "f in each working directory");
+
+    int fid_a = sfs_open(a, "f");
+    int fid_b = sfs_open(b, "f");
+    expect(fid_a >= 0 && fid_b >= 0, "open f on each");
+    expect(sfs_write(a, fid_a, 0, 1, "a") == STATUS_OK && sfs_write(b, fid_b, 0, 2, "bb") == STATUS_OK,
+           "write f on each");
+    expect(sfs_holds(a, "f", "a") && sfs_holds(b, "f", "bb"), "f holds what was written to each");
+    // fids are numbered per instance, closing one leaves the other open
+    expect(sfs_close(a, fid_a) == STATUS_OK && sfs_read(a, fid_a, 0, 1, (char[1]){0}) != STATUS_OK,
+           "read a closed fid");
+    expect(sfs_write(b, fid_b, 2, 1, "b") == STATUS_OK && sfs_close(b, fid_b) == STATUS_OK
+           && sfs_holds(b, "f", "bbb"), "write f on b after a closed its fid");
+    expect(sfs_rmlink(b, "f") == STATUS_OK && sfs_holds(a, "f", "a"), "remove f on b");
+
+    expect(sfs_umount(a) == STATUS_OK, "umount a");
+    a = sfs_mount(images[0]);
+    if (!expect(a != NULL, "remount a"))
+        return;
+    expect(strcmp(sfs_pwd(a), "/") == 0 && sfs_holds(a, "/d/a/f", "a") && strcmp(sfs_pwd(b), "/d") == 0
+           && sfs_file_size(b, "f") < 0, "both instances after a remount of one");
+
+    // one thread each, writing the same paths
+    expect(sfs_cd(a, "/d") == STATUS_OK, "cd /d on a");
+    pthread_t threads[2];
+    sfs_t *instances[2] = {a, b};
+    for (int i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, fill_instance, instances[i]);
+    for (int i = 0; i < 2; ++i)
+    {
+        void *res;
+        pthread_join(threads[i], &res);
+        expect(res == instances[i], "files of instance %d from a thread of its own", i);
+    }
+    expect(sfs_umount(a) == STATUS_OK && sfs_umount(b) == STATUS_OK, "umount both instances");
+    expect(get_file_size("/d/0") < 0 && create_file("/d/0") == STATUS_OK, "the default instance after both");
+    expect(umount() == STATUS_OK, "umount");
+    for (int i = 0; i < 2; ++i)
+        unlink(images[i]);
+}
+
+/* Sizes that keep a file inline, packed, in one block and in several. */
+int thread_size(int round)
+{
+    int sizes[] = {40, 700, 3000, THREAD_MAX_SIZE};
+    return sizes[round % 4];
+}
+
+/* One thread of check_threads(): writes files of its own in /mt, reads
+   them back, truncates, links and removes them.  Returns how many of
+   those failed. */
+void *churn_files(void *arg)
+{
+    long id = (long) arg;
+    long failed = 0;
+    char path[64];
+    char link[64];
+    char data[THREAD_MAX_SIZE];
+    for (int i = 0; i < THREAD_ROUNDS; ++i)
+    {
+        int size = thread_size(i);
+        sprintf(path, "/mt/t%ld_f%d", id, i % THREAD_FILES);
+        sprintf(link, "/mt/t%ld_l%d", id, i % THREAD_FILES);
+        fill(data, size, id * THREAD_ROUNDS + i);
+        // what the same names held a few rounds ago goes first
+        if (i >= THREAD_FILES && (rmlink(path) != STATUS_OK || rmlink(link) != STATUS_OK))
+            failed++;
+        if (put_file(path, data, size) != STATUS_OK || !same_file(path, data, size))
+            failed++;
+        if (trancate(path, size / 2) != STATUS_OK || !same_file(path, data, size / 2))
+            failed++;
+        if (mksymlink(path, link) != STATUS_OK || !same_file(link, data, size / 2))
+            failed++;
+    }
+    return (void *) failed;
+}
+
+/* Threads sharing one instance, with the journal committing and the
+   flusher syncing under them: every file holds what its thread left in
+   it, and the image mounts again with the same. */
+void check_threads(char *image)
+{
+    if (!expect(make_image(image, 512, 0) == STATUS_OK, "make image"))
+        return;
+    set_commit_window(5, 0);
+    set_flusher(5, 1);
+    expect(make_dir("/mt") == STATUS_OK, "mkdir /mt");
+    pthread_t threads[THREADS_NUM];
+    int started = 0;
+    while (started < THREADS_NUM
+           && expect(pthread_create(threads + started, NULL, churn_files, (void *) (long) started) == 0,
+                     "start thread %d", started))
+        started++;
+    for (int i = 0; i < started; ++i)
+    {
+        void *failed;
+        pthread_join(threads[i], &failed);
+        expect(failed == NULL, "%ld operations of thread %d", (long) failed, i);
+    }
+    char path[64];
+    char data[THREAD_MAX_SIZE];
+    for (int remount = 0; remount < 2; ++remount)
+    {
+        for (int t = 0; t < THREADS_NUM; ++t)
+        {
+            for (int i = THREAD_ROUNDS - THREAD_FILES; i < THREAD_ROUNDS; ++i)
+            {
+                int size = thread_size(i) / 2;
+                fill(data, size, t * THREAD_ROUNDS + i);
+                sprintf(path, "/mt/t%d_f%d", t, i % THREAD_FILES);
+                expect(same_file(path, data, size), "%s, remounted %d times", path, remount);
+                sprintf(path, "/mt/t%d_l%d", t, i % THREAD_FILES);
+                expect(same_file(path, data, size), "%s, remounted %d times", path, remount);
+            }
+        }
+        expect(umount() == STATUS_OK, "umount");
+        if (remount == 0 && !expect(mount(image) == STATUS_OK, "remount"))
+            return;
+    }
+}
+
+/* Write blocks to a new file at PATH until the image is full, the number
+   of blocks written back. */
+int fill_image(char *path, int block_size)
+{
+    if (create_file(path))
+        return 0;
+    int fid = open_file(path);
+    char zeros[4096] = {0};
+    int blocks = 0;
+    while (write_file(fid, blocks * block_size, block_size, zeros) == STATUS_OK)
+        blocks++;
+    close_file(fid);
+    return blocks;
+}
+
+/* Blocks go back to the image whatever took them: the files, links and
+   directories of threads that take them from all groups and through
+   their pools leave, once removed, as many blocks free as the image had
+   at first, and so does a remount. */
+void check_alloc(char *image)
+{
+    // 512 byte blocks, for groups of a few thousand blocks
+    int block_size = 512;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    int empty_blocks = fill_image("/filler", block_size);
+    expect(rmlink("/filler") == STATUS_OK, "remove /filler");
+    char path[64];
+    for (int round = 0; round < ALLOC_ROUNDS; ++round)
+    {
+        expect(make_dir("/mt") == STATUS_OK, "mkdir /mt in round %d", round);
+        pthread_t threads[THREADS_NUM];
+        int started = 0;
+        while (started < THREADS_NUM
+               && expect(pthread_create(threads + started, NULL, churn_files, (void *) (long) started) == 0,
+                         "start thread %d", started))
+            started++;
+        for (int i = 0; i < started; ++i)
+        {
+            void *failed;
+            pthread_join(threads[i], &failed);
+            expect(failed == NULL, "%ld operations of thread %d in round %d", (long) failed, i, round);
+        }
+        for (int t = 0; t < started; ++t)
+        {
+            for (int i = 0; i < THREAD_FILES; ++i)
+            {
+                sprintf(path, "/mt/t%d_f%d", t, i);
+                expect(rmlink(path) == STATUS_OK, "remove %s in round %d", path, round);
+                sprintf(path, "/mt/t%d_l%d", t, i);
+                expect(rmlink(path) == STATUS_OK, "remove %s in round %d", path, round);
+            }
+        }
+        expect(remove_dir("/mt") == STATUS_OK, "remove /mt in round %d", round);
+        int blocks = fill_image("/filler", block_size);
+        expect(blocks == empty_blocks, "%d blocks free after round %d, %d at first", blocks, round,
+               empty_blocks);
+        expect(rmlink("/filler") == STATUS_OK, "remove /filler");
+    }
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    int blocks = fill_image("/filler", block_size);
+    expect(blocks == empty_blocks, "%d blocks free after remount, %d at first", blocks, empty_blocks);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* What a journaled image holds after the process dies: everything
+   committed, nothing that wasn't, and a bitmap that agrees.  The child
+   leaves the page cache to the parent as a crash of the process would,
+   only the pages held back from the image go. */
+void check_journal(char *image)
+{
+    if (!expect(make_image(image, 512, 0) == STATUS_OK, "make image"))
+        return;
+    char path[64];
+    char data[CRASH_FILE_SIZE];
+    fill(data, sizeof(data), 1);
+    expect(make_dir("/a") == STATUS_OK, "mkdir /a");
+    for (int i = 0; i < CRASH_FILES; ++i)
+    {
+        sprintf(path, "/a/f%d", i);
+        expect(put_file(path, data, sizeof(data)) == STATUS_OK, "write %s", path);
+    }
+    expect(umount() == STATUS_OK, "umount");
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (mount(image))
+            _exit(1);
+        // nothing commits unless asked to
+        set_commit_window(60000, 1000000);
+        make_dir("/kept");
+        put_file("/a/kept", data, 100);
+        commit_journal();
+        make_dir("/late");
+        put_file("/a/late", data, 100);
+        rmlink("/a/f0");
+        trancate("/a/f1", 10);
+        for (int i = CRASH_FILES; i < CRASH_FILES * 2; ++i)
+        {
+            sprintf(path, "/a/f%d", i);
+            create_file(path);
+        }
+        _exit(0);
+    }
+    int status;
+    expect(child > 0 && waitpid(child, &status, 0) == child && status == 0, "crashing child");
+    if (!expect(mount(image) == STATUS_OK, "mount after the crash"))
+        return;
+    expect(get_file_size("/kept") >= 0, "committed mkdir lost");
+    expect(same_file("/a/kept", data, 100), "committed file lost");
+    expect(get_file_size("/late") < 0, "uncommitted mkdir kept");
+    expect(get_file_size("/a/late") < 0, "uncommitted create kept");
+    for (int i = 0; i < CRASH_FILES; ++i)
+    {
+        sprintf(path, "/a/f%d", i);
+        expect(same_file(path, data, sizeof(data)), "%s after the crash", path);
+    }
+    for (int i = CRASH_FILES; i < CRASH_FILES * 2; ++i)
+    {
+        sprintf(path, "/a/f%d", i);
+        expect(get_file_size(path) < 0, "uncommitted %s kept", path);
+    }
+    // the bitmap and the directories agree with the files
+    for (int i = 0; i < CRASH_FILES; ++i)
+    {
+        sprintf(path, "/a/f%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    expect(rmlink("/a/kept") == STATUS_OK, "remove /a/kept");
+    expect(remove_dir("/a") == STATUS_OK, "rmdir /a");
+    expect(make_dir("/late") == STATUS_OK, "mkdir /late");
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Do /<PREFIX><I> for I from FIRST to LAST by STEP hold their numbers? */
+bool numbered_files(char *prefix, int first, int last, int step)
+{
+    char path[64];
+    char want[16];
+    for (int i = first; i <= last; i += step)
+    {
+        sprintf(path, "/%s%d", prefix, i);
+        sprintf(want, "%d", i);
+        if (!holds(path, want))
+            return false;
+    }
+    return true;
+}
+
+/* Descriptors are initialized a chunk at a time and freed ones are
+   chained: a table filled over several chunks takes exactly as many
+   files as mkfs was asked for, before and after removes and remounts,
+   and every name finds its own descriptor. */
+void check_descrs(char *image)
+{
+    if (!expect(create_image(image, IMAGE_SIZE) == STATUS_OK
+                && quiet_mkfs(image, 512, DESCR_FILES, -1) == STATUS_OK && mount(image) == STATUS_OK,
+                "make image"))
+        return;
+    char path[64];
+    char want[16];
+    for (int i = 0; i < DESCR_FILES; ++i)
+    {
+        sprintf(path, "/f%d", i);
+        sprintf(want, "%d", i);
+        expect(put_file(path, want, strlen(want)) == STATUS_OK, "write %s", path);
+    }
+    expect(create_file("/full") == STATUS_MAX_FILES_REACHED, "create past %d files", DESCR_FILES);
+    // a few come back right away
+    for (int i = 1; i < 20; i += 2)
+    {
+        sprintf(path, "/f%d", i);
+        sprintf(want, "%d", i);
+        expect(rmlink(path) == STATUS_OK && put_file(path, want, strlen(want)) == STATUS_OK,
+               "remove and write %s again", path);
+    }
+    expect(create_file("/full") == STATUS_MAX_FILES_REACHED, "create past %d files again", DESCR_FILES);
+    expect(numbered_files("f", 0, DESCR_FILES - 1, 1), "the files of a full table");
+
+    for (int i = 1; i < DESCR_FILES; i += 2)
+    {
+        sprintf(path, "/f%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(numbered_files("f", 0, DESCR_FILES - 1, 2), "the files left after remount");
+    for (int i = 1; i < DESCR_FILES; i += 2)
+    {
+        sprintf(path, "/f%d", i);
+        expect(get_file_size(path) < 0, "removed %s after remount", path);
+    }
+    for (int i = 0; i < DESCR_FILES / 2; ++i)
+    {
+        sprintf(path, "/g%d", i);
+        sprintf(want, "%d", i);
+        expect(put_file(path, want, strlen(want)) == STATUS_OK, "write %s after remount", path);
+    }
+    expect(create_file("/full") == STATUS_MAX_FILES_REACHED, "create past %d files after remount",
+           DESCR_FILES);
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(numbered_files("f", 0, DESCR_FILES - 1, 2) && numbered_files("g", 0, DESCR_FILES / 2 - 1, 1),
+           "the files after the second remount");
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Delayed appends that are accepted get their blocks: once the image
+   refuses one, other allocations can't take the blocks promised to the
+   rest, and every file closes and reads back whole. */
+void check_delayed(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    char path[32];
+    char buf[4096];
+    fill(buf, block_size, 3);
+    int fids[DELAYED_FILES];
+    int sizes[DELAYED_FILES];
+    int files_num = 0;
+    int err = STATUS_OK;
+    while (err == STATUS_OK && files_num < DELAYED_FILES)
+    {
+        sprintf(path, "/f%d", files_num);
+        if (!expect(create_file(path) == STATUS_OK, "create %s", path))
+            break;
+        fids[files_num] = open_file(path);
+        sizes[files_num] = 0;
+        while (sizes[files_num] < DELAYED_FILE_SIZE
+               && (err = write_file(fids[files_num], sizes[files_num], block_size, buf)) == STATUS_OK)
+            sizes[files_num] += block_size;
+        files_num++;
+    }
+    expect(err == STATUS_NO_SPACE_LEFT, "delayed appends on a full image: %d", err);
+    // whatever room is left isn't the promised blocks
+    int dirs_num = 0;
+    while (true)
+    {
+        sprintf(path, "/d%d", dirs_num);
+        if (make_dir(path))
+            break;
+        dirs_num++;
+    }
+    for (int i = 0; i < files_num; ++i)
+        expect(close_file(fids[i]) == STATUS_OK, "close file %d", i);
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    char *data = malloc(DELAYED_FILE_SIZE);
+    for (int k = 0; k < DELAYED_FILE_SIZE; k += block_size)
+        memcpy(data + k, buf, block_size);
+    for (int i = 0; i < files_num; ++i)
+    {
+        sprintf(path, "/f%d", i);
+        expect(same_file(path, data, sizes[i]), "%s with %d bytes", path, sizes[i]);
+    }
+    free(data);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Is BLOCK_SIZE bytes of DATA the pattern of SEED, or zeros? */
+bool block_or_zeros(char *data, int block_size, int seed)
+{
+    char want[4096];
+    fill(want, block_size, seed);
+    if (memcmp(data, want, block_size) == 0)
+        return true;
+    for (int i = 0; i < block_size; ++i)
+    {
+        if (data[i])
+            return false;
+    }
+    return true;
+}
+
+/* Holes read as zeros, SEEK_DATA and SEEK_HOLE find the written runs,
+   extending a file maps nothing, and a hole fill that runs out of space
+   keeps the blocks it mapped away from other files. */
+void check_holes(char *image)
+{
+    int block_size = 512;
+    if (!expect(make_sized_image(image, SPARSE_IMAGE_SIZE, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    set_delayed_alloc(0);
+    set_tail_packing(0);
+    char buf[4096];
+    char got[4096];
+    char zeros[4096] = {0};
+    expect(create_file("/sparse") == STATUS_OK, "create /sparse");
+    int fid = open_file("/sparse");
+    for (int i = 0; i < 3; ++i)
+    {
+        fill(buf, block_size, i);
+        expect(write_file(fid, i * i * SPARSE_STRIDE, block_size, buf) == STATUS_OK, "write run %d", i);
+    }
+    int size = 4 * SPARSE_STRIDE + block_size;
+    expect(get_file_size("/sparse") == size, "size with holes");
+    expect(read_file(fid, SPARSE_STRIDE / 2, block_size, got) == STATUS_OK
+           && memcmp(got, zeros, block_size) == 0, "a hole reads as zeros");
+    int64_t seeks[][3] = {
+        {0, SFS_SEEK_DATA, 0},
+        {0, SFS_SEEK_HOLE, block_size},
+        {100, SFS_SEEK_DATA, 100},
+        {block_size, SFS_SEEK_DATA, SPARSE_STRIDE},
+        {SPARSE_STRIDE + 10, SFS_SEEK_HOLE, SPARSE_STRIDE + block_size},
+        {SPARSE_STRIDE + block_size, SFS_SEEK_DATA, 4 * SPARSE_STRIDE},
+        {4 * SPARSE_STRIDE, SFS_SEEK_HOLE, size},
+        {size, SFS_SEEK_DATA, -1},
+        {size, SFS_SEEK_HOLE, -1},
+    };
+    for (int i = 0; i < sizeof(seeks) / sizeof(seeks[0]); ++i)
+    {
+        int64_t found = seek_file(fid, seeks[i][0], seeks[i][1]);
+        expect(found == seeks[i][2], "seek %s from %ld: %ld", seeks[i][1] == SFS_SEEK_DATA ? "data" : "hole",
+               (long) seeks[i][0], (long) found);
+    }
+
+    // past the end of the image
+    int64_t huge = (int64_t) SPARSE_IMAGE_SIZE * 64;
+    expect(trancate64("/sparse", huge) == STATUS_OK, "extend past the image");
+    expect(get_file_size64("/sparse") == huge, "size after extending");
+    expect(seek_file(fid, size, SFS_SEEK_DATA) == -1, "no data after extending");
+    expect(seek_file(fid, size, SFS_SEEK_HOLE) == size, "a hole after extending");
+    expect(read_file64(fid, huge - block_size, block_size, got) == STATUS_OK
+           && memcmp(got, zeros, block_size) == 0, "the end reads as zeros");
+
+    // a hole fill bigger than the image: what it mapped before it ran out
+    // reads as written or as zeros, never as another file
+    int64_t offset = 8 * SPARSE_STRIDE;
+    int fill_blocks = SPARSE_IMAGE_SIZE / block_size;
+    int64_t fill_size = (int64_t) fill_blocks * block_size;
+    char *data = malloc(fill_size);
+    for (int i = 0; i < fill_blocks; ++i)
+        fill(data + (int64_t) i * block_size, block_size, 100 + i);
+    int err = write_file64(fid, offset, fill_size, data);
+    expect(err == STATUS_NO_SPACE_LEFT, "a write into a hole on a full image: %d", err);
+    // whatever is free now goes to another file
+    fill(buf, block_size, 99);
+    expect(create_file("/other") == STATUS_OK, "create /other");
+    int other = open_file("/other");
+    int other_size = 0;
+    while (write_file(other, other_size, block_size, buf) == STATUS_OK)
+        other_size += block_size;
+    close_file(other);
+    for (int i = 0; i < fill_blocks; ++i)
+    {
+        if (!expect(read_file64(fid, offset + (int64_t) i * block_size, block_size, got) == STATUS_OK
+                    && block_or_zeros(got, block_size, 100 + i), "block %d of the failed write", i))
+            break;
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        fill(buf, block_size, i);
+        expect(read_file(fid, i * i * SPARSE_STRIDE, block_size, got) == STATUS_OK
+               && memcmp(got, buf, block_size) == 0, "run %d after the failed write", i);
+    }
+    free(data);
+    close_file(fid);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Small files live in the descriptor, bigger ones packed and then in
+   blocks of their own: their bytes survive every step up and back down,
+   and bytes in the descriptor need no block even on a full image. */
+void check_inline(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    set_delayed_alloc(0);
+    char data[MAPPED_FILE_SIZE];
+    char zeros[MAPPED_FILE_SIZE] = {0};
+    char got[MAPPED_FILE_SIZE];
+    fill(data, sizeof(data), 5);
+    expect(create_file("/t") == STATUS_OK, "create /t");
+    int fid = open_file("/t");
+    int sizes[] = {10, INLINE_SIZE, PACKED_SIZE, MAPPED_FILE_SIZE};
+    int done = 0;
+    for (int i = 0; i < sizeof(sizes) / sizeof(int); ++i)
+    {
+        expect(write_file(fid, done, sizes[i] - done, data + done) == STATUS_OK, "grow to %d", sizes[i]);
+        done = sizes[i];
+        expect(same_file("/t", data, done), "/t at %d bytes", done);
+    }
+    for (int i = sizeof(sizes) / sizeof(int) - 2; i >= 0; --i)
+    {
+        expect(trancate("/t", sizes[i]) == STATUS_OK, "truncate to %d", sizes[i]);
+        expect(same_file("/t", data, sizes[i]), "/t truncated to %d", sizes[i]);
+    }
+    // grown by truncates and writes past the end, the gaps are zeros
+    for (int i = 1; i < sizeof(sizes) / sizeof(int); ++i)
+    {
+        expect(trancate("/t", sizes[i]) == STATUS_OK, "truncate up to %d", sizes[i]);
+        expect(read_file(fid, 0, sizes[i], got) == STATUS_OK && memcmp(got, data, 10) == 0
+               && memcmp(got + 10, zeros, sizes[i] - 10) == 0, "/t extended to %d", sizes[i]);
+        expect(trancate("/t", 10) == STATUS_OK, "truncate to 10");
+        expect(write_file(fid, sizes[i] - 5, 5, data) == STATUS_OK, "write at %d", sizes[i] - 5);
+        expect(read_file(fid, 0, sizes[i], got) == STATUS_OK && memcmp(got, data, 10) == 0
+               && memcmp(got + 10, zeros, sizes[i] - 15) == 0
+               && memcmp(got + sizes[i] - 5, data, 5) == 0, "/t written past its end to %d", sizes[i]);
+        expect(trancate("/t", 10) == STATUS_OK, "truncate to 10");
+    }
+    expect(trancate("/t", 0) == STATUS_OK && get_file_size("/t") == 0, "truncate to 0");
+    close_file(fid);
+    expect(mksymlink("/t", "/short") == STATUS_OK, "symlink with a short target");
+
+    // on a full image only the descriptor has room
+    fill_image("/filler", block_size);
+    expect(put_file("/small", data, INLINE_SIZE) == STATUS_OK, "inline write on a full image");
+    fid = open_file("/small");
+    expect(write_file(fid, INLINE_SIZE, MAPPED_FILE_SIZE - INLINE_SIZE, data + INLINE_SIZE) == STATUS_NO_SPACE_LEFT,
+           "growing out of the descriptor on a full image");
+    close_file(fid);
+    expect(same_file("/small", data, INLINE_SIZE), "inline bytes after a failed grow");
+    expect(get_file_size("/short") == 0, "the link to /t");
+
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(same_file("/small", data, INLINE_SIZE), "inline bytes after remount");
+    expect(get_file_size("/short") == 0, "the link to /t after remount");
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Size of packed file I. */
+int packed_size(int i)
+{
+    return INLINE_SIZE + 1 + i * 37 % (2048 - INLINE_SIZE);
+}
+
+/* Files too big for the descriptor share blocks: they read back across
+   remounts and removes of their neighbours, a packed block with room is
+   found again after mount, and every block comes back once they go. */
+void check_packing(char *image)
+{
+    int block_size = 4096;
+    if (!expect(make_image(image, block_size, -1) == STATUS_OK, "make image"))
+        return;
+    set_delayed_alloc(0);
+    int empty_blocks = fill_image("/filler", block_size);
+    expect(rmlink("/filler") == STATUS_OK, "remove /filler");
+    char path[32];
+    char data[2048];
+    expect(make_dir("/d") == STATUS_OK, "mkdir /d");
+    for (int i = 0; i < PACKED_FILES; ++i)
+    {
+        sprintf(path, "/d/f%d", i);
+        fill(data, packed_size(i), i);
+        expect(put_file(path, data, packed_size(i)) == STATUS_OK, "write %s", path);
+    }
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    set_delayed_alloc(0);
+    for (int i = 0; i < PACKED_FILES; ++i)
+    {
+        sprintf(path, "/d/f%d", i);
+        fill(data, packed_size(i), i);
+        expect(same_file(path, data, packed_size(i)), "%s after remount", path);
+    }
+
+    // the last packed block still has room, even with no block left
+    fill_image("/filler", block_size);
+    fill(data, 200, 7);
+    expect(put_file("/late", data, 200) == STATUS_OK, "packed write on a full image after remount");
+    expect(same_file("/late", data, 200), "/late");
+    expect(rmlink("/filler") == STATUS_OK, "remove /filler");
+
+    // neighbours go and others take their place
+    for (int i = 0; i < PACKED_FILES; i += 2)
+    {
+        sprintf(path, "/d/f%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    for (int i = 0; i < PACKED_FILES; i += 2)
+    {
+        sprintf(path, "/d/g%d", i);
+        fill(data, packed_size(i), PACKED_FILES + i);
+        expect(put_file(path, data, packed_size(i)) == STATUS_OK, "write %s", path);
+    }
+    for (int i = 0; i < PACKED_FILES; ++i)
+    {
+        sprintf(path, i % 2 ? "/d/f%d" : "/d/g%d", i);
+        fill(data, packed_size(i), i % 2 ? i : PACKED_FILES + i);
+        expect(same_file(path, data, packed_size(i)), "%s after its neighbours changed", path);
+    }
+    for (int i = 0; i < PACKED_FILES; ++i)
+    {
+        sprintf(path, i % 2 ? "/d/f%d" : "/d/g%d", i);
+        expect(rmlink(path) == STATUS_OK, "remove %s", path);
+    }
+    expect(rmlink("/late") == STATUS_OK, "remove /d/late");
+    expect(remove_dir("/d") == STATUS_OK, "rmdir /d");
+    // less the extent nodes a filler over scattered blocks may need
+    int blocks = fill_image("/filler", block_size);
+    expect(blocks >= empty_blocks - 4, "%d blocks free once all is removed, %d at first", blocks, empty_blocks);
+    expect(umount() == STATUS_OK, "umount");
+}
+
+/* Symlinks resolve through relative targets, .. and chains of up to
+   MAX_HOPS links, a path that needs more is STATUS_LOOP, and no resolved
+   link outlives its unlink or retargeting. */
+void check_symlinks(char *image)
+{
+    if (!expect(make_image(image, 512, -1) == STATUS_OK, "make image"))
+        return;
+    expect(make_dir("/rel") == STATUS_OK && make_dir("/rel/v1") == STATUS_OK
+           && make_dir("/rel/v2") == STATUS_OK, "mkdir /rel/v1 and /rel/v2");
+    expect(put_file("/rel/v1/f", "one", 3) == STATUS_OK && put_file("/rel/v2/f", "two", 3) == STATUS_OK,
+           "write /rel/v1/f and /rel/v2/f");
+    expect(mksymlink("v1", "/rel/cur") == STATUS_OK, "link /rel/cur");
+    expect(make_dir("/a") == STATUS_OK && make_dir("/a/b") == STATUS_OK, "mkdir /a/b");
+    expect(mksymlink("../../rel/cur/f", "/a/b/up") == STATUS_OK, "link /a/b/up");
+    // the .. of a link to a directory is the parent on disk
+    expect(mksymlink("/rel/v2", "/a/v2") == STATUS_OK, "link /a/v2");
+    expect(mksymlink("v2/../v1/f", "/a/phys") == STATUS_OK, "link /a/phys");
+    for (int i = 0; i < 3; ++i)
+    {
+        expect(holds("/rel/cur/f", "one"), "/rel/cur/f, time %d", i);
+        expect(holds("/a/b/up", "one"), "/a/b/up, time %d", i);
+        expect(holds("/a/phys", "one"), "/a/phys, time %d", i);
+    }
+    cd("/a/b");
+    expect(holds("up", "one"), "up from /a/b");
+    cd("/");
+
+    // retargeting and removing on the way are seen at once
+    expect(rmlink("/rel/cur") == STATUS_OK && mksymlink("v2", "/rel/cur") == STATUS_OK, "retarget /rel/cur");
+    expect(holds("/rel/cur/f", "two"), "/rel/cur/f after retargeting");
+    expect(holds("/a/b/up", "two"), "/a/b/up after retargeting");
+    expect(rmlink("/rel/v2/f") == STATUS_OK, "remove /rel/v2/f");
+    expect(open_file("/a/b/up") < 0 && get_file_size("/a/b/up") < 0, "/a/b/up after its target went");
+    expect(put_file("/rel/v2/f", "TWO", 3) == STATUS_OK, "write /rel/v2/f again");
+    expect(holds("/a/b/up", "TWO"), "/a/b/up after its target came back");
+    expect(rmlink("/a/b/up") == STATUS_OK, "remove /a/b/up");
+    expect(get_file_size("/a/b/up") < 0, "/a/b/up after unlink");
+    expect(put_file("/a/b/up", "file", 4) == STATUS_OK, "a file where /a/b/up was");
+    expect(holds("/a/b/up", "file"), "/a/b/up as a file");
+
+    // a link back to its own directory, followed MAX_HOPS times and once more
+    expect(make_dir("/d") == STATUS_OK && mksymlink("../d", "/d/s") == STATUS_OK, "link /d/s");
+    expect(put_file("/d/x", "x", 1) == STATUS_OK, "write /d/x");
+    char path[512] = "/d";
+    for (int i = 0; i < MAX_HOPS; ++i)
+        strcat(path, "/s");
+    strcat(path, "/x");
+    expect(holds(path, "x"), "%d hops", MAX_HOPS);
+    char loop[512] = "/d/s";
+    strcat(loop, path + 2);
+    expect(open_file(loop) < 0 && get_file_size(loop) < 0, "%d hops", MAX_HOPS + 1);
+    expect(mksymlink(loop, "/d/far") == STATUS_LOOP, "a link to %d hops", MAX_HOPS + 1);
+    strcpy(loop + strlen(loop) - 1, "new");
+    expect(create_file(loop) == STATUS_LOOP, "create through %d hops", MAX_HOPS + 1);
+
+    // a chain of links, each to the one before
+    expect(make_dir("/ch") == STATUS_OK && put_file("/ch/l0", "end", 3) == STATUS_OK, "write /ch/l0");
+    char target[32];
+    for (int i = 1; i <= MAX_HOPS + 1; ++i)
+    {
+        sprintf(path, "/ch/l%d", i);
+        sprintf(target, "l%d", i - 1);
+        expect(mksymlink(target, path) == STATUS_OK, "link %s", path);
+    }
+    expect(holds("/ch/l40", "end"), "a chain of %d links", MAX_HOPS);
+    expect(open_file("/ch/l41") < 0, "a chain of %d links", MAX_HOPS + 1);
+    expect(mksymlink("l41", "/ch/l42") == STATUS_LOOP, "a link to a chain of %d links", MAX_HOPS + 1);
+    // shortened in the middle, the rest of the chain resolves again
+    expect(rmlink("/ch/l20") == STATUS_OK && mksymlink("l0", "/ch/l20") == STATUS_OK, "retarget /ch/l20");
+    expect(holds("/ch/l41", "end"), "the chain after shortening it");
+
+    expect(umount() == STATUS_OK && mount(image) == STATUS_OK, "remount");
+    expect(holds("/rel/cur/f", "TWO"), "/rel/cur/f after remount");
+    expect(holds("/a/phys", "one"), "/a/phys after remount");
+    expect(holds("/ch/l41", "end"), "the chain after remount");
+    expect(umount() == STATUS_OK, "umount");
+}
+
+int main(int argc, char **argv)
+{
+    char *image = argc > 1 ? argv[1] : "check.dat";
+    char *names[] = {"alloc", "htree", "dcache", "paths", "extents", "indexed", "geometry", "large",
+                     "pins", "vectors", "instances", "threads", "journal", "descrs", "delayed",
+                     "holes", "inline", "packing", "symlinks"};
+    void (*checks[])(char *) = {check_alloc, check_htree, check_dcache, check_paths, check_extents,
+                                check_indexed, check_geometry, check_large, check_pins,
+                                check_vectors, check_instances, check_threads, check_journal,
+                                check_descrs, check_delayed, check_holes, check_inline,
+                                check_packing, check_symlinks};
+    int failed_checks = 0;
+    for (int i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i)
+    {
+        int failed = FAILED;
+        checks[i](image);
+        if (is_mount())
+            umount();
+        // settings outlive the mount
+        set_delayed_alloc(DELAY_DEFAULT_BLOCKS);
+        set_tail_packing(PACK_DEFAULT_SIZE);
+        set_commit_window(COMMIT_DEFAULT_MS, 0);
+        set_flusher(0, 0);
+        set_dcache_size(DCACHE_DEFAULT_SIZE);
+        printf("%-10s %s\n", names[i], FAILED == failed ? "ok" : "FAILED");
+        if (FAILED != failed)
+            failed_checks++;
+    }
+    unlink(image);
+    return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "bench/image.h"
+
+/* mkfs prints the stats of the new image, keep the report clean. */
+int quiet_mkfs(char *path, int block_size, int files_hint, int journal_blocks)
+{
+    fflush(stdout);
+    int out = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    int err = mkfs_journal(path, block_size, 0, files_hint, journal_blocks);
+    fflush(stdout);
+    dup2(out, 1);
+    close(null);
+    close(out);
+    return err;
+}
+
+/* A fresh image of SIZE bytes, mounted.  JOURNAL_BLOCKS as for
+   mkfs_journal(), -1 for none. */
+int make_sized_image(char *path, int64_t size, int block_size, int journal_blocks)
+{
+    if (create_image(path, size))
+    {
+        perror(path);
+        return STATUS_ERR;
+    }
+    int err = quiet_mkfs(path, block_size, 0, journal_blocks);
+    if (err)
+        return err;
+    return mount(path);
+}
@@ -0,0 +1,959 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/delay.h"
+#include "sfs/pack.h"
+#include "bench/image.h"
+
+#define IMAGE_SIZE (64 * 1024 * 1024)
+#define TREE_DEPTH 8
+#define FILES_NUM 1000
+#define LOOKUPS_NUM 200000
+#define IO_FILE_SIZE (16 * 1024 * 1024)
+#define IO_BYTES (256 * 1024 * 1024)
+#define IO_CHUNK 512
+#define WRITERS_NUM 8
+#define WRITER_FILE_SIZE (2 * 1024 * 1024)
+#define IOV_NUM 16
+#define BATCH_SIZE 64
+#define INSTANCES_NUM 4
+#define INSTANCE_FILE_SIZE (8 * 1024 * 1024)
+#define MAX_THREADS 8
+#define THREAD_FILE_SIZE (4 * 1024 * 1024)
+#define THREAD_CHUNK 4096
+#define STRESS_OPS 2000
+#define APPEND_FILE_SIZE (2 * 1024 * 1024)
+#define COLD_FILE_SIZE (32 * 1024 * 1024)
+#define COLD_CHUNK 65536
+#define DURABLE_OPS 400
+#define DURABLE_THREADS 4
+#define LOGS_NUM 8
+#define LOG_RECORD 100
+#define LOG_FILE_SIZE (1024 * 1024)
+#define SPARSE_STRIDE (1024 * 1024)
+#define SMALL_FILES 10000
+
+/* Every heap allocation made by the library goes through here. */
+long MALLOCS = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&MALLOCS, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+    __atomic_fetch_add(&MALLOCS, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&MALLOCS, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int make_image(char *path, int block_size)
+{
+    return make_sized_image(path, IMAGE_SIZE, block_size, 0);
+}
+
+/* Build /d0/d1/.../d7 with FILES_NUM files in the deepest directory. */
+int make_tree(char *deep_dir)
+{
+    strcpy(deep_dir, "");
+    for (int i = 0; i < TREE_DEPTH; ++i)
+    {
+        sprintf(deep_dir + strlen(deep_dir), "/d%d", i);
+        if (make_dir(deep_dir))
+            return STATUS_ERR;
+    }
+    char path[256];
+    for (int i = 0; i < FILES_NUM; ++i)
+    {
+        sprintf(path, "%s/file%d", deep_dir, i);
+        if (create_file(path))
+            return STATUS_ERR;
+    }
+    return STATUS_OK;
+}
+
+void bench_lookup(char *title, char **paths, int paths_num)
+{
+    // warm the dentry cache, then measure
+    for (int i = 0; i < paths_num; ++i)
+        get_file_size(paths[i]);
+
+    long mallocs = MALLOCS;
+    double start = now();
+    for (int i = 0; i < LOOKUPS_NUM; ++i)
+    {
+        if (get_file_size(paths[i % paths_num]) < 0)
+        {
+            fprintf(stderr, "lookup failed: %s\n", paths[i % paths_num]);
+            return;
+        }
+    }
+    double elapsed = now() - start;
+    mallocs = MALLOCS - mallocs;
+    printf("%-28s %10.1f ns/lookup %8.3f mallocs/lookup\n", title,
+           elapsed * 1e9 / LOOKUPS_NUM, (double) mallocs / LOOKUPS_NUM);
+}
+
+/* Grow PATH up to IO_FILE_SIZE, or as far as the file system lets it. */
+int make_io_file(char *path, char *buf, int chunk)
+{
+    if (create_file(path))
+        return -1;
+    int fid = open_file(path);
+    int size = 0;
+    while (size < IO_FILE_SIZE && write_file(fid, size, chunk, buf) == STATUS_OK)
+        size += chunk;
+    close_file(fid);
+    return size;
+}
+
+void bench_io(char *title, int fid, int file_size, int req_size, bool random, bool write, char *buf)
+{
+    int reqs_num = file_size / req_size;
+    int ops_num = IO_BYTES / req_size;
+    srand(1);
+    double start = now();
+    for (int i = 0; i < ops_num; ++i)
+    {
+        int req = random ? rand() % reqs_num : i % reqs_num;
+        int err = write ? write_file(fid, req * req_size, req_size, buf)
+                        : read_file(fid, req * req_size, req_size, buf);
+        if (err)
+        {
+            fprintf(stderr, "%s failed: %d\n", title, err);
+            return;
+        }
+    }
+    double elapsed = now() - start;
+    printf("%-12s %8d B %10.1f MB/s\n", title, req_size,
+           (double) ops_num * req_size / elapsed / (1024 * 1024));
+}
+
+uint32_t checksum(uint32_t sum, char *data, int64_t size)
+{
+    for (int64_t i = 0; i < size; ++i)
+        sum += (uint8_t) data[i];
+    return sum;
+}
+
+/* Checksum the whole file through a copy and straight from the image. */
+void bench_checksum(int fid, int file_size, int req_size, char *buf)
+{
+    uint32_t sums[2] = {0, 0};
+    double elapsed[2];
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        double start = now();
+        for (int offset = 0; offset < file_size; offset += req_size)
+        {
+            if (pass == 0)
+            {
+                read_file(fid, offset, req_size, buf);
+                sums[0] = checksum(sums[0], buf, req_size);
+                continue;
+            }
+            struct iovec iov[IOV_NUM];
+            int iov_num = IOV_NUM;
+            int64_t done = 0;
+            while (done < req_size)
+            {
+                read_iov(fid, offset + done, req_size - done, iov, &iov_num);
+                for (int i = 0; i < iov_num; ++i)
+                {
+                    sums[1] = checksum(sums[1], iov[i].iov_base, iov[i].iov_len);
+                    done += iov[i].iov_len;
+                }
+                unpin_file(fid);
+            }
+        }
+        elapsed[pass] = now() - start;
+    }
+    if (sums[0] != sums[1])
+        fprintf(stderr, "checksums differ\n");
+    printf("checksum %8d B %10.1f MB/s copied %10.1f MB/s zero-copy\n", req_size,
+           file_size / elapsed[0] / (1024 * 1024), file_size / elapsed[1] / (1024 * 1024));
+}
+
+/* Small random reads one by one and in submit_ops() batches, then
+   sequential writes of a buffer in small batched pieces. */
+void bench_batch(int fid, int file_size, int req_size, char *buf)
+{
+    int reqs_num = file_size / req_size;
+    int ops_num = IO_BYTES / 16 / req_size / BATCH_SIZE * BATCH_SIZE;
+    sfs_op ops[BATCH_SIZE];
+    double elapsed[3];
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        srand(1);
+        double start = now();
+        for (int i = 0; i < ops_num; i += BATCH_SIZE)
+        {
+            for (int j = 0; j < BATCH_SIZE; ++j)
+            {
+                sfs_op *op = ops + j;
+                op->fid = fid;
+                op->op = pass == 2 ? SFS_WRITE : SFS_READ;
+                op->size = req_size;
+                if (pass == 2)
+                {
+                    op->offset = (int64_t) (i + j) % reqs_num * req_size;
+                    op->data = buf + j * req_size;
+                } else {
+                    op->offset = (int64_t) (rand() % reqs_num) * req_size;
+                    op->data = buf + j * req_size;
+                }
+                if (pass == 0)
+                    read_file(fid, op->offset, req_size, op->data);
+            }
+            if (pass > 0 && submit_ops(ops, BATCH_SIZE))
+            {
+                fprintf(stderr, "batch failed\n");
+                return;
+            }
+        }
+        elapsed[pass] = now() - start;
+    }
+    double mb = (double) ops_num * req_size / (1024 * 1024);
+    printf("batch %8d B %10.1f MB/s single %10.1f MB/s rand batch %10.1f MB/s seq batch write\n",
+           req_size, mb / elapsed[0], mb / elapsed[1], mb / elapsed[2]);
+}
+
+/* Grow WRITERS_NUM files side by side, CHUNK bytes at a time. */
+void bench_writers(int chunk, char *buf)
+{
+    char path[32];
+    int fids[WRITERS_NUM];
+    for (int i = 0; i < WRITERS_NUM; ++i)
+    {
+        sprintf(path, "/w%d", i);
+        create_file(path);
+        fids[i] = open_file(path);
+    }
+    for (int offset = 0; offset < WRITER_FILE_SIZE; offset += chunk)
+    {
+        for (int i = 0; i < WRITERS_NUM; ++i)
+        {
+            if (write_file(fids[i], offset, chunk, buf))
+            {
+                fprintf(stderr, "writer %d failed at %d\n", i, offset);
+                return;
+            }
+        }
+    }
+
+    int fragments = 0;
+    double start = now();
+    for (int i = 0; i < WRITERS_NUM; ++i)
+    {
+        sprintf(path, "/w%d", i);
+        fragments += get_file_fragments(path);
+        read_file(fids[i], 0, WRITER_FILE_SIZE, buf);
+    }
+    double elapsed = now() - start;
+    printf("%d writers %6d B %8.2f fragments/file %10.1f MB/s read\n", WRITERS_NUM, chunk,
+           (double) fragments / WRITERS_NUM,
+           (double) WRITERS_NUM * WRITER_FILE_SIZE / elapsed / (1024 * 1024));
+    for (int i = 0; i < WRITERS_NUM; ++i)
+    {
+        close_file(fids[i]);
+        sprintf(path, "/w%d", i);
+        rmlink(path);
+    }
+}
+
+/* The same io on images with different block sizes. */
+int bench_block_sizes(char *image, char *buf)
+{
+    int block_sizes[] = {512, 4096, 65536};
+    for (int i = 0; i < sizeof(block_sizes) / sizeof(int); ++i)
+    {
+        if (make_image(image, block_sizes[i]))
+            return STATUS_ERR;
+        double start = now();
+        int file_size = make_io_file("/io", buf, 65536);
+        double elapsed = now() - start;
+        if (file_size <= 0)
+            return STATUS_ERR;
+        printf("%d B blocks: grow %.1f MB/s\n", block_sizes[i],
+               file_size / elapsed / (1024 * 1024));
+        int fid = open_file("/io");
+        bench_io("  seq read", fid, file_size, 65536, false, false, buf);
+        bench_io("  seq write", fid, file_size, 65536, false, true, buf);
+        bench_io("  rand read", fid, file_size, 4096, true, false, buf);
+        bench_io("  rand write", fid, file_size, 4096, true, true, buf);
+        close_file(fid);
+        umount();
+    }
+    return STATUS_OK;
+}
+
+typedef struct {
+    int id;
+    int fid;
+    // bytes to read or ops to run
+    long work;
+    char **paths;
+    int paths_num;
+    int err;
+} thread_job;
+
+void *read_job(void *arg)
+{
+    thread_job *job = arg;
+    char buf[THREAD_CHUNK];
+    for (long i = 0; i < job->work / THREAD_CHUNK && !job->err; ++i)
+    {
+        // stride through the file so threads on the same file don't march in step
+        long offset = (i * 7919 + job->id * 131) % (THREAD_FILE_SIZE / THREAD_CHUNK) * THREAD_CHUNK;
+        job->err = read_file(job->fid, offset, THREAD_CHUNK, buf);
+    }
+    return NULL;
+}
+
+void *lookup_job(void *arg)
+{
+    thread_job *job = arg;
+    for (long i = 0; i < job->work && !job->err; ++i)
+    {
+        if (get_file_size(job->paths[(i + job->id * 17) % job->paths_num]) < 0)
+            job->err = STATUS_NOT_FOUND;
+    }
+    return NULL;
+}
+
+/* Grow a file in a directory of its own chunk by chunk, so the time goes
+   into allocating blocks. */
+void *append_job(void *arg)
+{
+    thread_job *job = arg;
+    char buf[THREAD_CHUNK];
+    char path[64];
+    memset(buf, 'a' + job->id, sizeof(buf));
+    sprintf(path, "/append%d/file", job->id);
+    job->err = create_file(path);
+    int fid = open_file(path);
+    for (long i = 0; i < job->work / THREAD_CHUNK && !job->err; ++i)
+        job->err = write_file(fid, i * THREAD_CHUNK, THREAD_CHUNK, buf);
+    close_file(fid);
+    return NULL;
+}
+
+/* Everything at once: grow a file of its own and check it, make and
+   remove files next to the other threads, read the shared file. */
+void *stress_job(void *arg)
+{
+    thread_job *job = arg;
+    char buf[THREAD_CHUNK];
+    char check[THREAD_CHUNK];
+    char path[64];
+    sprintf(path, "/stress%d", job->id);
+    create_file(path);
+    int fid = open_file(path);
+    memset(buf, 'a' + job->id, sizeof(buf));
+    for (long i = 0; i < job->work && !job->err; ++i)
+    {
+        int64_t offset = i % 256 * THREAD_CHUNK;
+        job->err = write_file(fid, offset, THREAD_CHUNK, buf);
+        if (!job->err)
+            job->err = read_file(fid, offset, THREAD_CHUNK, check);
+        if (!job->err && memcmp(buf, check, THREAD_CHUNK))
+            job->err = STATUS_ERR;
+        if (!job->err)
+            job->err = read_file(job->fid, i % 1024 * THREAD_CHUNK, THREAD_CHUNK, check);
+
+        char name[64];
+        sprintf(name, "/stress/t%d_%ld", job->id, i % 32);
+        if (i >= 32 && !job->err)
+            job->err = rmlink(name);
+        if (!job->err)
+            job->err = create_file(name);
+    }
+    for (int i = 0; i < 32; ++i)
+    {
+        char name[64];
+        sprintf(name, "/stress/t%d_%d", job->id, i);
+        rmlink(name);
+    }
+    close_file(fid);
+    rmlink(path);
+    return NULL;
+}
+
+/* Make small files in a directory of its own, each durable before the
+   next one. */
+void *durable_job(void *arg)
+{
+    thread_job *job = arg;
+    char buf[THREAD_CHUNK];
+    char path[64];
+    memset(buf, 'a' + job->id, sizeof(buf));
+    for (long i = 0; i < job->work && !job->err; ++i)
+    {
+        sprintf(path, "/durable%d/f%ld", job->id, i);
+        job->err = create_file(path);
+        int fid = open_file(path);
+        if (!job->err)
+            job->err = write_file(fid, 0, sizeof(buf), buf);
+        close_file(fid);
+        if (!job->err)
+            job->err = commit_journal();
+    }
+    return NULL;
+}
+
+/* Run JOB on THREADS_NUM threads, each given WORK, and return the
+   seconds it took, -1 on failure. */
+double run_threads(void *(*job)(void *), int threads_num, thread_job *jobs, long work)
+{
+    pthread_t threads[MAX_THREADS];
+    double start = now();
+    for (int i = 0; i < threads_num; ++i)
+    {
+        jobs[i].id = i;
+        jobs[i].work = work;
+        jobs[i].err = STATUS_OK;
+        pthread_create(threads + i, NULL, job, jobs + i);
+    }
+    int err = STATUS_OK;
+    for (int i = 0; i < threads_num; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].err)
+            err = jobs[i].err;
+    }
+    double elapsed = now() - start;
+    return err ? -1 : elapsed;
+}
+
+/* Threads sharing the mounted image: reads of files of their own, reads
+   of one shared file, lookups, appends, and a mixed stress load.  Each thread
+   does the same work, so flat times mean linear scaling. */
+int bench_threads(char **paths, int paths_num, char *buf)
+{
+    int fids[MAX_THREADS];
+    char path[32];
+    memset(buf, 'x', THREAD_FILE_SIZE);
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        sprintf(path, "/thread%d", i);
+        create_file(path);
+        fids[i] = open_file(path);
+        if (write_file(fids[i], 0, THREAD_FILE_SIZE, buf))
+            return STATUS_ERR;
+    }
+    make_dir("/stress");
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        sprintf(path, "/append%d", i);
+        make_dir(path);
+    }
+
+    thread_job jobs[MAX_THREADS];
+    for (int threads_num = 1; threads_num <= MAX_THREADS; threads_num *= 2)
+    {
+        for (int i = 0; i < threads_num; ++i)
+        {
+            jobs[i].fid = fids[i];
+            jobs[i].paths = paths;
+            jobs[i].paths_num = paths_num;
+        }
+        double own = run_threads(read_job, threads_num, jobs, THREAD_FILE_SIZE * 4L);
+        for (int i = 0; i < threads_num; ++i)
+            jobs[i].fid = fids[0];
+        double shared = run_threads(read_job, threads_num, jobs, THREAD_FILE_SIZE * 4L);
+        double lookups = run_threads(lookup_job, threads_num, jobs, LOOKUPS_NUM / 4);
+        double append = run_threads(append_job, threads_num, jobs, APPEND_FILE_SIZE);
+        for (int i = 0; i < threads_num; ++i)
+        {
+            sprintf(path, "/append%d/file", i);
+            rmlink(path);
+        }
+        double stress = run_threads(stress_job, threads_num, jobs, STRESS_OPS);
+        if (own < 0 || shared < 0 || lookups < 0 || append < 0 || stress < 0)
+            return STATUS_ERR;
+        double mb = (double) threads_num * THREAD_FILE_SIZE * 4 / (1024 * 1024);
+        printf("%d threads %10.1f MB/s own files %10.1f MB/s same file %8.1f M lookups/s "
+               "%8.1f MB/s appends %8.1f K stress ops/s\n",
+               threads_num, mb / own, mb / shared, threads_num * (LOOKUPS_NUM / 4) / lookups / 1e6,
+               (double) threads_num * APPEND_FILE_SIZE / append / (1024 * 1024),
+               threads_num * STRESS_OPS / stress / 1e3);
+    }
+
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        close_file(fids[i]);
+        sprintf(path, "/thread%d", i);
+        rmlink(path);
+        sprintf(path, "/append%d", i);
+        remove_dir(path);
+    }
+    return remove_dir("/stress");
+}
+
+typedef struct {
+    char image[256];
+    int err;
+} instance_job;
+
+/* Write a file on an image of its own and check it reads back. */
+void *run_instance(void *arg)
+{
+    instance_job *job = arg;
+    static __thread char buf[65536];
+    static __thread char check[65536];
+    sfs_t *sfs = sfs_mount(job->image);
+    if (sfs == NULL)
+    {
+        job->err = STATUS_ERR;
+        return NULL;
+    }
+    memset(buf, job->image[strlen(job->image) - 1], sizeof(buf));
+    sfs_create_file(sfs, "/data");
+    int fid = sfs_open(sfs, "/data");
+    for (int offset = 0; offset < INSTANCE_FILE_SIZE && !job->err; offset += sizeof(buf))
+        job->err = sfs_write(sfs, fid, offset, sizeof(buf), buf);
+    for (int offset = 0; offset < INSTANCE_FILE_SIZE && !job->err; offset += sizeof(check))
+    {
+        job->err = sfs_read(sfs, fid, offset, sizeof(check), check);
+        if (job->err == STATUS_OK && memcmp(buf, check, sizeof(check)))
+            job->err = STATUS_ERR;
+    }
+    sfs_close(sfs, fid);
+    sfs_rmlink(sfs, "/data");
+    sfs_umount(sfs);
+    return NULL;
+}
+
+/* INSTANCES_NUM images mounted at once, each driven by a thread. */
+int bench_instances(char *image)
+{
+    instance_job jobs[INSTANCES_NUM];
+    for (int i = 0; i < INSTANCES_NUM; ++i)
+    {
+        sprintf(jobs[i].image, "%s.%d", image, i);
+        jobs[i].err = STATUS_OK;
+        if (make_image(jobs[i].image, 4096) || umount())
+            return STATUS_ERR;
+    }
+    for (int threads_num = 1; threads_num <= INSTANCES_NUM; threads_num *= 2)
+    {
+        pthread_t threads[INSTANCES_NUM];
+        double start = now();
+        for (int i = 0; i < threads_num; ++i)
+            pthread_create(threads + i, NULL, run_instance, jobs + i);
+        int err = STATUS_OK;
+        for (int i = 0; i < threads_num; ++i)
+        {
+            pthread_join(threads[i], NULL);
+            if (jobs[i].err)
+                err = jobs[i].err;
+        }
+        double elapsed = now() - start;
+        if (err)
+            return err;
+        printf("%d instances %10.1f MB/s\n", threads_num,
+               2.0 * threads_num * INSTANCE_FILE_SIZE / elapsed / (1024 * 1024));
+    }
+    for (int i = 0; i < INSTANCES_NUM; ++i)
+        unlink(jobs[i].image);
+    return STATUS_OK;
+}
+
+/* Durable creates committed through the journal and, on an image without
+   one, by syncing the whole image; threads committing at once share the
+   journal flushes. */
+int bench_durable(char *image)
+{
+    char *names[] = {"journal", "no journal"};
+    int journals[] = {0, -1};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (make_sized_image(image, IMAGE_SIZE, 4096, journals[i]))
+            return STATUS_ERR;
+        for (int t = 0; t < DURABLE_THREADS; ++t)
+        {
+            char path[64];
+            sprintf(path, "/durable%d", t);
+            if (make_dir(path))
+                return STATUS_ERR;
+        }
+        for (int threads_num = 1; threads_num <= DURABLE_THREADS; threads_num *= DURABLE_THREADS)
+        {
+            thread_job jobs[MAX_THREADS];
+            // the same ops in all, split between the threads
+            double elapsed = run_threads(durable_job, threads_num, jobs, DURABLE_OPS / threads_num);
+            if (elapsed < 0)
+                return STATUS_ERR;
+            printf("durable creates %-10s %d threads %8.0f ops/s\n", names[i], threads_num,
+                   DURABLE_OPS / elapsed);
+            for (int t = 0; t < threads_num; ++t)
+            {
+                for (int k = 0; k < DURABLE_OPS / threads_num; ++k)
+                {
+                    char path[64];
+                    sprintf(path, "/durable%d/f%d", t, k);
+                    rmlink(path);
+                }
+            }
+        }
+        if (umount())
+            return STATUS_ERR;
+    }
+    return STATUS_OK;
+}
+
+/* Time umount() after writing a little and a lot since mount(), it
+   should follow what is dirty and not the image size. */
+int bench_umount(char *image, char *buf)
+{
+    int dirty_sizes[] = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    for (int i = 0; i < sizeof(dirty_sizes) / sizeof(int); ++i)
+    {
+        if (make_image(image, 4096) || umount() || mount(image) || create_file("/dirty"))
+            return STATUS_ERR;
+        int fid = open_file("/dirty");
+        for (int offset = 0; offset < dirty_sizes[i]; offset += 64 * 1024)
+        {
+            if (write_file(fid, offset, 64 * 1024, buf))
+                return STATUS_ERR;
+        }
+        close_file(fid);
+        double start = now();
+        if (umount())
+            return STATUS_ERR;
+        printf("umount %6d KB dirty %8.2f ms\n", dirty_sizes[i] / 1024, (now() - start) * 1000);
+    }
+    return STATUS_OK;
+}
+
+/* Small records appended to several logs in turn, with blocks mapped as
+   the logs grow and with delayed allocation. */
+int bench_logs(char *image, char *buf)
+{
+    char *names[] = {"mapped", "delayed"};
+    int delays[] = {0, DELAY_DEFAULT_BLOCKS};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (make_image(image, 4096) || set_delayed_alloc(delays[i]))
+            return STATUS_ERR;
+        char path[32];
+        int fids[LOGS_NUM];
+        for (int l = 0; l < LOGS_NUM; ++l)
+        {
+            sprintf(path, "/log%d", l);
+            create_file(path);
+            fids[l] = open_file(path);
+        }
+        double start = now();
+        for (int offset = 0; offset < LOG_FILE_SIZE; offset += LOG_RECORD)
+        {
+            for (int l = 0; l < LOGS_NUM; ++l)
+            {
+                if (write_file(fids[l], offset, LOG_RECORD, buf))
+                    return STATUS_ERR;
+            }
+        }
+        int fragments = 0;
+        for (int l = 0; l < LOGS_NUM; ++l)
+        {
+            close_file(fids[l]);
+            sprintf(path, "/log%d", l);
+            fragments += get_file_fragments(path);
+        }
+        double elapsed = now() - start;
+        printf("%d logs %-8s %10.0f appends/s %8.2f fragments/file\n", LOGS_NUM, names[i],
+               (double) LOGS_NUM * (LOG_FILE_SIZE / LOG_RECORD) / elapsed, (double) fragments / LOGS_NUM);
+        if (umount())
+            return STATUS_ERR;
+    }
+    set_delayed_alloc(DELAY_DEFAULT_BLOCKS);
+    return STATUS_OK;
+}
+
+/* Extend files far past the image with truncate, write a block every
+   SPARSE_STRIDE bytes and walk the data with seek_file(); the holes
+   should cost nothing. */
+int bench_sparse(char *image, char *buf)
+{
+    if (make_image(image, 4096) || create_file("/sparse"))
+        return STATUS_ERR;
+    int64_t sizes[] = {1LL << 20, 64LL << 20, 1LL << 30};
+    for (int i = 0; i < sizeof(sizes) / sizeof(int64_t); ++i)
+    {
+        double start = now();
+        if (trancate64("/sparse", sizes[i]))
+            return STATUS_ERR;
+        printf("truncate to %5lld MB %8.3f ms\n", (long long) (sizes[i] >> 20), (now() - start) * 1000);
+    }
+    int fid = open_file("/sparse");
+    double start = now();
+    for (int64_t offset = 0; offset < sizes[2]; offset += SPARSE_STRIDE)
+    {
+        if (write_file64(fid, offset, 4096, buf))
+            return STATUS_ERR;
+    }
+    double elapsed = now() - start;
+    start = now();
+    int runs = 0;
+    int64_t offset = seek_file(fid, 0, SFS_SEEK_DATA);
+    while (offset != -1)
+    {
+        runs++;
+        offset = seek_file(fid, seek_file(fid, offset, SFS_SEEK_HOLE), SFS_SEEK_DATA);
+    }
+    printf("sparse writes %8.2f ms, %d data runs found in %.2f ms\n", elapsed * 1000, runs, (now() - start) * 1000);
+    close_file(fid);
+    return umount();
+}
+
+/* Create SMALL_FILES files of a few bytes and of more than a descriptor
+   holds, sharing blocks or not, and see how much of the sparse image they
+   touch. */
+int bench_small(char *image, char *buf)
+{
+    int sizes[] = {40, 100, 100, 1000, 1000};
+    int packs[] = {PACK_DEFAULT_SIZE, PACK_DEFAULT_SIZE, 0, PACK_DEFAULT_SIZE, 0};
+    for (int i = 0; i < sizeof(sizes) / sizeof(int); ++i)
+    {
+        set_tail_packing(packs[i]);
+        if (make_image(image, 4096) || make_dir("/small"))
+            return STATUS_ERR;
+        struct stat st;
+        stat(image, &st);
+        int64_t before = st.st_blocks;
+        double start = now();
+        for (int f = 0; f < SMALL_FILES; ++f)
+        {
+            char path[32];
+            sprintf(path, "/small/f%d", f);
+            if (create_file(path))
+                return STATUS_ERR;
+            int fid = open_file(path);
+            if (write_file(fid, 0, sizes[i], buf))
+                return STATUS_ERR;
+            close_file(fid);
+        }
+        double elapsed = now() - start;
+        if (umount())
+            return STATUS_ERR;
+        stat(image, &st);
+        printf("%d files of %4d bytes%s %10.0f files/s, %6lld KB written\n", SMALL_FILES, sizes[i],
+               packs[i] ? ", packed" : "        ", SMALL_FILES / elapsed,
+               (long long) (st.st_blocks - before) * 512 / 1024);
+    }
+    set_tail_packing(PACK_DEFAULT_SIZE);
+    return STATUS_OK;
+}
+
+/* Time mkfs of sparse images up to a hundred gigabytes; it should
+   cost about the bitmap, not the descriptor table or the image. */
+int bench_mkfs(char *image)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s.big", image);
+    int64_t sizes[] = {1LL << 30, 10LL << 30, 100LL << 30};
+    for (int i = 0; i < sizeof(sizes) / sizeof(int64_t); ++i)
+    {
+        double start = now();
+        if (create_image(path, sizes[i]) || quiet_mkfs(path, 0, 0, 0))
+        {
+            unlink(path);
+            return STATUS_ERR;
+        }
+        double elapsed = now() - start;
+        struct stat st;
+        stat(path, &st);
+        printf("mkfs %4lld GB %8.1f ms, %lld MB on disk\n", (long long) (sizes[i] >> 30), elapsed * 1000,
+               (long long) st.st_blocks * 512 / (1024 * 1024));
+    }
+    unlink(path);
+    return STATUS_OK;
+}
+
+/* Stream a file of an image just dropped from the page cache, with each
+   readahead advice, so the reads have to wait for the disk. */
+int bench_cold(char *image, char *buf)
+{
+    if (make_image(image, 4096) || create_file("/cold"))
+        return STATUS_ERR;
+    int fid = open_file("/cold");
+    for (int offset = 0; offset < COLD_FILE_SIZE; offset += 1024 * 1024)
+    {
+        if (write_file(fid, offset, 1024 * 1024, buf))
+            return STATUS_ERR;
+    }
+    close_file(fid);
+    if (umount())
+        return STATUS_ERR;
+
+    char *names[] = {"normal", "sequential", "random"};
+    int advices[] = {SFS_ADVICE_NORMAL, SFS_ADVICE_SEQUENTIAL, SFS_ADVICE_RANDOM};
+    for (int i = 0; i < 3; ++i)
+    {
+        // umount wrote the image back, so its pages can all be dropped
+        int fd = open(image, O_RDONLY);
+        if (fd == -1)
+            return STATUS_ERR;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        if (mount(image))
+            return STATUS_ERR;
+        fid = open_file("/cold");
+        advise_file(fid, advices[i]);
+        double start = now();
+        for (int offset = 0; offset < COLD_FILE_SIZE; offset += COLD_CHUNK)
+        {
+            if (read_file(fid, offset, COLD_CHUNK, buf))
+                return STATUS_ERR;
+        }
+        double elapsed = now() - start;
+        printf("cold read %-10s %8.1f MB/s\n", names[i], COLD_FILE_SIZE / elapsed / (1024 * 1024));
+        close_file(fid);
+        umount();
+    }
+    return STATUS_OK;
+}
+
+int main(int argc, char **argv)
+{
+    char *image = argc > 1 ? argv[1] : "bench.dat";
+    if (make_image(image, 0))
+    {
+        fprintf(stderr, "can't make image %s\n", image);
+        return 1;
+    }
+    char deep_dir[256];
+    if (make_tree(deep_dir))
+    {
+        fprintf(stderr, "can't build the tree\n");
+        return 1;
+    }
+
+    static char names[FILES_NUM][256];
+    char *paths[FILES_NUM];
+    for (int i = 0; i < FILES_NUM; ++i)
+    {
+        sprintf(names[i], "%s/file%d", deep_dir, i);
+        paths[i] = names[i];
+    }
+    bench_lookup("absolute", paths, FILES_NUM);
+
+    for (int i = 0; i < FILES_NUM; ++i)
+        sprintf(names[i], "/d0/./d1/d2/../d2/d3/d4/d5/d6/d7//file%d/", i);
+    bench_lookup("absolute with . and ..", paths, FILES_NUM);
+
+    cd(deep_dir);
+    for (int i = 0; i < FILES_NUM; ++i)
+        sprintf(names[i], "file%d", i);
+    bench_lookup("relative to cwd", paths, FILES_NUM);
+
+    for (int i = 0; i < FILES_NUM; ++i)
+        sprintf(names[i], "../d7/file%d", i);
+    bench_lookup("relative above cwd", paths, FILES_NUM);
+
+    cd("/");
+    make_dir("/links");
+    for (int i = 0; i < FILES_NUM; ++i)
+    {
+        char link[32];
+        sprintf(link, "/links/link%d", i);
+        sprintf(names[i], "%s/file%d", deep_dir, i);
+        mksymlink(names[i], link);
+        strcpy(names[i], link);
+    }
+    bench_lookup("through symlinks", paths, FILES_NUM);
+
+    // versioned releases: a chain of relative links to a directory
+    make_dir("/releases");
+    mksymlink(deep_dir, "/releases/v2");
+    mksymlink("v2", "/releases/stable");
+    mksymlink("./stable", "/releases/current");
+    for (int i = 0; i < FILES_NUM; ++i)
+        sprintf(names[i], "/releases/current/file%d", i);
+    bench_lookup("through a link chain", paths, FILES_NUM);
+
+    static char buf[1024 * 1024];
+    memset(buf, 'x', sizeof(buf));
+    int file_size = make_io_file("/io", buf, IO_CHUNK);
+    if (file_size <= 0)
+    {
+        fprintf(stderr, "can't make the io file\n");
+        return 1;
+    }
+    printf("io file: %d bytes\n", file_size);
+    int fid = open_file("/io");
+    int req_sizes[] = {512, 4096, 65536, 1024 * 1024};
+    for (int i = 0; i < sizeof(req_sizes) / sizeof(int); ++i)
+    {
+        if (req_sizes[i] > file_size)
+            break;
+        bench_io("seq read", fid, file_size, req_sizes[i], false, false, buf);
+        bench_io("seq write", fid, file_size, req_sizes[i], false, true, buf);
+        bench_io("rand read", fid, file_size, req_sizes[i], true, false, buf);
+        bench_io("rand write", fid, file_size, req_sizes[i], true, true, buf);
+    }
+    bench_batch(fid, file_size, 512, buf);
+    bench_batch(fid, file_size, 4096, buf);
+    bench_checksum(fid, file_size, 4096, buf);
+    bench_checksum(fid, file_size, 1024 * 1024, buf);
+    close_file(fid);
+    rmlink("/io");
+
+    static char big_buf[THREAD_FILE_SIZE];
+    bench_writers(4096, big_buf);
+    bench_writers(65536, big_buf);
+
+    for (int i = 0; i < FILES_NUM; ++i)
+        sprintf(names[i], "%s/file%d", deep_dir, i);
+    if (bench_threads(paths, FILES_NUM, big_buf))
+        fprintf(stderr, "threads failed\n");
+    umount();
+
+    if (bench_block_sizes(image, buf))
+        fprintf(stderr, "block size comparison failed\n");
+    if (bench_instances(image))
+        fprintf(stderr, "instances failed\n");
+    if (bench_cold(image, buf))
+        fprintf(stderr, "cold reads failed\n");
+    if (bench_durable(image))
+        fprintf(stderr, "durable creates failed\n");
+    if (bench_umount(image, buf))
+        fprintf(stderr, "umount failed\n");
+    if (bench_mkfs(image))
+        fprintf(stderr, "mkfs failed\n");
+    if (bench_logs(image, buf))
+        fprintf(stderr, "logs failed\n");
+    if (bench_sparse(image, buf))
+        fprintf(stderr, "sparse files failed\n");
+    if (bench_small(image, buf))
+        fprintf(stderr, "small files failed\n");
+    unlink(image);
+    return 0;
+}
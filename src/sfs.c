@@ -9,59 +9,64 @@
 #include <string.h>
 
 #include "sfs.h"
-
-#define BLOCK_SIZE 512
-#define DESCRIPTORS_PART 0.05
-#define DIR_TYPE 1
-#define FILE_TYPE 2
-#define LINK_TYPE 3
-#define FILENAME_SIZE 20
-#define FIDS_NUM 512
-#define MAX_PATH_SIZE 512
-
-#define MASK ((uint8_t *) (char *)FS + FS->mask_offset)
-#define DESCR_TABLE ((descr_struct *) ((char *)FS + FS->descr_table_offset))
-#define BLOCKS(ID) ((void *)((char *)FS + ID * FS->block_size))
-
-#define SPACE_LEFT(descr) (ceil((float) descr->size / FS->block_size) * FS->block_size - descr->size)
-#define BLOCKS_NUM(descr) ((int) ceil((float) descr->size / FS->block_size))
-#define FILES_IN_BLOCK (FS->block_size / sizeof(file_struct))
-#define FILES_NUM(descr) ((int) (descr->size / sizeof(file_struct)))
-
-typedef struct {
-    int id;
-    int type;
-    int links_num;
-    int size;
-    int blocks_id;
-} descr_struct;
-
-typedef struct {
-    int block_size;
-    int blocks_num;
-    int size;
-    // int mask_size;
-    int mask_offset;
-    int max_files;
-    int descr_table_offset;
-} fs_struct;
-
-typedef struct {
-    char filename[FILENAME_SIZE];
-    int descr_id;
-} file_struct;
-
-fs_struct *FS = NULL;
-int FIDS[FIDS_NUM] = {[0 ... FIDS_NUM - 1] = -1};
-char WORK_DIR[MAX_PATH_SIZE];
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/dir.h"
+#include "sfs/dcache.h"
+#include "sfs/path.h"
+#include "sfs/map.h"
+#include "sfs/readahead.h"
+#include "sfs/journal.h"
+#include "sfs/flush.h"
+#include "sfs/delay.h"
+#include "sfs/pack.h"
+
+// what the functions without an sfs_t argument work on
+sfs_t DEFAULT_SFS = {
+    .fids = {[0 ... FIDS_NUM - 1] = {.descr_id = -1}},
+    .dcache_size = DCACHE_DEFAULT_SIZE,
+    .commit_ms = COMMIT_DEFAULT_MS,
+    .delay_blocks = DELAY_DEFAULT_BLOCKS,
+    .pack_size = PACK_DEFAULT_SIZE,
+    .ns_lock = PTHREAD_RWLOCK_INITIALIZER,
+    .file_locks = {[0 ... FILE_LOCKS_NUM - 1] = PTHREAD_RWLOCK_INITIALIZER},
+    .fids_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+__thread sfs_t *SFS = &DEFAULT_SFS;
+
+// what holes read from
+#define ZEROS_SIZE 65536
+const char ZEROS[ZEROS_SIZE];
 
 /* Forward declarations. */
 int map_fs(char *path);
 int umap_fs();
 int check_mount();
-descr_struct *lookup_link(char *path);
-descr_struct *lookup_full(char *path);
-char *read_symlink(descr_struct *link);
+void build_free_descrs();
+bool init_descrs();
+bool valid_block_size(int block_size);
+int format_image(char *path, int block_size, double descr_part, int files_hint, int journal_blocks);
+int create(char *path_arg, int type, descr_struct **created);
+int grow_file(descr_struct *file, int64_t new_size);
+int extend_file(descr_struct *file, int64_t new_size);
+int expand_file(descr_struct *file, int64_t new_size);
+void shrink_file(descr_struct *file, int64_t new_size);
+int fill_holes(descr_struct *file, int64_t offset, int64_t size);
+int unpack_file(descr_struct *file);
+void copy_blocks(descr_struct *file, int64_t offset, int64_t size, char *data, bool to_file);
+bool is_pinned(descr_struct *file);
+int64_t file_span(descr_struct *file, int64_t offset, int64_t size, char **span);
+int check_io(descr_struct *file, int64_t offset, int64_t size, bool write);
+int list_dir(char *path_arg);
+void print_descr(descr_struct *descr);
+int add_link(char *from_arg, char *to_arg);
+int remove_link(char *path_arg);
+void pin_spans(int fid, descr_struct *file, int64_t offset, int64_t size, struct iovec *iov, int *iov_num);
+void copy_iov(descr_struct *file, int64_t offset, int64_t size, const struct iovec *iov, bool write);
+int resize_file(descr_struct *file, int64_t new_size);
+int change_dir(char *path_arg);
+int remove_empty_dir(char *path_arg);
+int make_symlink(char *from_arg, char *to_arg);
 
 
 int mount(char *path)
@@ -69,17 +74,55 @@ int mount(char *path)
     int err = map_fs(path);
     if (err)
         return err;
+    if ((FS->magic == SFS_MAGIC && FS->version != SFS_VERSION) || FS_SIZE > MAPPED_SIZE
+        || !valid_block_size(FS->block_size))
+    {
+        umap_fs();
+        return STATUS_ERR;
+    }
+    load_geometry();
+    err = flush_init();
+    // before anything reads the metadata
+    if (err == STATUS_OK)
+        err = journal_init();
+    if (err == STATUS_OK)
+        err = alloc_init();
+    if (err)
+    {
+        umap_fs();
+        return err;
+    }
+    // images made before the free list existed have 0 here
+    if (FS->free_descr == 0)
+        build_free_descrs();
+    err = map_hints_init();
+    if (err == STATUS_OK)
+        err = dcache_init(DCACHE_SIZE);
+    if (err == STATUS_OK)
+        err = delay_init();
+    if (err == STATUS_OK)
+        err = pack_init();
+    if (err)
+    {
+        umap_fs();
+        return err;
+    }
     strcpy(WORK_DIR, "/");
+    WORK_DIR_ID = 0;
+    flush_policy();
     return STATUS_OK;
 }
 
 int umount()
 {
+    if (PINS_NUM > 0)
+        return STATUS_BUSY;
     int err = check_mount();
-    strcpy(WORK_DIR, "");
-    if (err)
-        return err;
-    return umap_fs();
+    if (err == STATUS_OK)
+        err = umap_fs();
+    if (err == STATUS_OK)
+        strcpy(WORK_DIR, "");
+    return err;
 }
 
 int check_mount()
@@ -95,10 +138,27 @@ int check_mount()
 
 int umap_fs()
 {
-    msync(FS, FS->size, MS_SYNC);
-
-    if (munmap(FS, FS->size) == -1)
+    // nothing may run in the background while the modules go
+    flush_stop();
+    // delayed writes get their blocks before the journal goes, and the
+    // image stays mounted if they can't
+    int err = delay_release();
+    if (err)
+    {
+        flush_policy();
+        return err;
+    }
+    journal_release();
+    // syncs what is dirty, or the whole image if that isn't known
+    flush_release();
+    alloc_release();
+    dcache_release();
+    map_hints_release();
+    pack_release();
+
+    if (munmap(FS, MAPPED_SIZE) == -1)
         return STATUS_ERR;
+    close(IMAGE_FD);
     FS = NULL;
     return STATUS_OK;
 }
@@ -117,470 +177,592 @@ int map_fs(char *path)
         return STATUS_ERR;
     }
 
-    int fs_size = lseek(fd, 0L, SEEK_END);
+    off_t fs_size = lseek(fd, 0L, SEEK_END);
 
     FS = mmap(0, fs_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    MAPPED_SIZE = fs_size;
+    // the journal maps pages of it privately while they hold uncommitted
+    // metadata
+    IMAGE_FD = fd;
     int exit_status = STATUS_OK;
     if (FS == MAP_FAILED)
     {
         FS = NULL;
+        close(fd);
         exit_status = STATUS_ERR;
     }
-    close(fd);
     return exit_status;
 }
 
+/* Copy the geometry of the mapped image to the instance. */
+void load_geometry()
+{
+    SFS->block_size = FS->block_size;
+    SFS->blocks_num = FS->blocks_num;
+    SFS->mask_offset = FS->mask_offset;
+    SFS->descr_table_offset = FS->descr_table_offset;
+    SFS->descr_size = FS->descr_size ? FS->descr_size : LEGACY_DESCR_SIZE;
+    SFS->max_files = FS->max_files;
+    SFS->features = FS->features;
+}
+
 int dump_stats()
 {
     int err = check_mount();
     if (err)
         return err;
 
-    printf("FS size: %d\n", FS->size);
-    printf("block size: %d\n", FS->block_size);
-    printf("blocks num: %d\n", FS->blocks_num);
-    printf("max files: %d\n", FS->max_files);
+    printf("FS size: %lld\n", (long long) FS_SIZE);
+    printf("format: v%d\n", IS_V2 ? FS->version : 1);
+    printf("block size: %d\n", BLOCK_SIZE);
+    if (FS->files_hint)
+        printf("files hint: %d\n", FS->files_hint);
+    else if (FS->descriptors_part)
+        printf("descriptors part: %.3f\n", FS->descriptors_part);
+    printf("blocks num: %d\n", FS_BLOCKS);
+    printf("max files: %d\n", MAX_FILES);
+    if (FEATURES & FEATURE_LAZY_DESCRS)
+        printf("initialized descriptors: %d\n", FS->descr_ready);
     printf("mask offset: %d\n", FS->mask_offset);
     printf("descriptor table offset: %d\n", FS->descr_table_offset);
+    printf("descriptor size: %d\n", DESCR_SIZE);
+    printf("extents: %s\n", FEATURES & FEATURE_EXTENTS ? "yes" : "no");
+    printf("inline data: %s\n", FEATURES & FEATURE_INLINE_DATA ? "yes" : "no");
+    printf("tail packing: %s\n", FEATURES & FEATURE_TAIL_PACKING ? "yes" : "no");
+    journal_dump_stats();
+    flush_dump_stats();
+    delay_dump_stats();
+    printf("free blocks: %d\n", alloc_free_blocks());
+
+    // 1.00 means every file is one contiguous run
+    int files_num = 0;
+    int fragments = 0;
+    int inline_num = 0;
+    // the blocks of packed files, to tell how full they are
+    int *packed = NULL;
+    int packed_num = 0;
+    int packed_capacity = 0;
+    int64_t packed_bytes = 0;
+    lock_ns(false);
+    for (int i = 0; i < DESCRS_READY; ++i)
+    {
+        descr_struct *descr = DESCR(i);
+        if (descr->type != FILE_TYPE && descr->type != LINK_TYPE)
+            continue;
+        lock_file(descr, false);
+        if (is_inline(descr))
+        {
+            inline_num++;
+        } else if (is_packed(descr)) {
+            if (packed_num == packed_capacity)
+            {
+                int capacity = packed_capacity ? packed_capacity * 2 : 64;
+                int *more = realloc(packed, capacity * sizeof(int));
+                if (more)
+                {
+                    packed = more;
+                    packed_capacity = capacity;
+                }
+            }
+            if (packed_num < packed_capacity)
+            {
+                packed[packed_num++] = descr->blocks_id;
+                packed_bytes += file_size(descr);
+            }
+        } else if (file_size(descr) > 0) {
+            files_num++;
+            fragments += map_fragments(descr);
+        }
+        unlock_file(descr);
+    }
+    unlock_ns();
+    printf("fragments per file: %.2f\n", files_num ? (double) fragments / files_num : 0.0);
+    if (FEATURES & FEATURE_INLINE_DATA)
+        printf("inline files: %d\n", inline_num);
+    if (FEATURES & FEATURE_TAIL_PACKING)
+        pack_dump_stats(packed, packed_num, packed_bytes);
+    free(packed);
+    dcache_dump_stats();
     return STATUS_OK;
 }
 
-void mask_block(int num)
-{
-    int i = num / 8;
-    MASK[i] |= 1 << (num % 8);
-}
-
-void umask_block(int num)
+void build_free_descrs()
 {
-    int i = num / 8;
-    MASK[i] &= ~(1 << (num % 8));
+    int head = NO_DESCR;
+    for (int i = DESCRS_READY - 1; i > 0; --i)
+    {
+        descr_struct *descr = DESCR(i);
+        if (descr->type == 0)
+        {
+            journal_dirty(descr, DESCR_SIZE);
+            descr->blocks_id = head;
+            head = i;
+        }
+    }
+    journal_dirty(&FS->free_descr, sizeof(int));
+    FS->free_descr = head;
 }
 
-bool check_block(int num)
+/* Initialize the next DESCRS_CHUNK descriptors of a table mkfs left
+   alone and put them on the free list.  Return false once the whole
+   table is in use. */
+bool init_descrs()
 {
-    int i = num / 8;
-    return MASK[i] & (1 << (num % 8));
+    int first = DESCRS_READY;
+    if (first >= MAX_FILES)
+        return false;
+    int last = MAX_FILES - first > DESCRS_CHUNK ? first + DESCRS_CHUNK : MAX_FILES;
+    journal_dirty(DESCR(first), (int64_t) (last - first) * DESCR_SIZE);
+    memset(DESCR(first), 0, (int64_t) (last - first) * DESCR_SIZE);
+    for (int i = first; i < last; ++i)
+    {
+        descr_struct *descr = DESCR(i);
+        descr->id = i;
+        descr->blocks_id = i + 1 < last ? i + 1 : FS->free_descr;
+    }
+    journal_dirty(&FS->free_descr, sizeof(int));
+    journal_dirty(&FS->descr_ready, sizeof(int));
+    FS->free_descr = first;
+    FS->descr_ready = last;
+    return true;
 }
 
 descr_struct *find_descr()
 {
-    for (int i = 0; i < FS->max_files; ++i)
+    if (FS->free_descr == NO_DESCR && !init_descrs())
+        return NULL;
+    int id = FS->free_descr;
+    descr_struct *descr = DESCR(id);
+    int next = descr->blocks_id;
+    if (descr->type != 0 || next == 0 || next < NO_DESCR || next >= DESCRS_READY)
     {
-        descr_struct *descr = DESCR_TABLE + i;
-        if (descr->type == 0)
-            return descr;
+        // the list was damaged by a tool that doesn't know about it
+        build_free_descrs();
+        return find_descr();
     }
-    return NULL;
+    journal_dirty(&FS->free_descr, sizeof(int));
+    journal_dirty(descr, DESCR_SIZE);
+    FS->free_descr = next;
+    descr->blocks_id = 0;
+    return descr;
+}
+
+void release_descr(descr_struct *descr)
+{
+    journal_dirty(descr, DESCR_SIZE);
+    journal_dirty(&FS->free_descr, sizeof(int));
+    descr->type = 0;
+    set_file_size(descr, 0);
+    descr->links_num = 0;
+    descr->blocks_id = FS->free_descr;
+    FS->free_descr = descr->id;
 }
 
-int find_block()
+int rm_descr(descr_struct *descr)
 {
-    for (int i = 0; i < FS->blocks_num; ++i)
+    if (descr->type == DIR_TYPE)
     {
-        if(!check_block(i))
-            return i;
+        dir_release(descr);
+        umask_block(descr->blocks_id);
+    } else {
+        delay_drop(descr);
+        map_release(descr);
     }
-    return -1;
+    if (descr->id == WORK_DIR_ID)
+        WORK_DIR_ID = NO_DESCR;
+    release_descr(descr);
+    return STATUS_OK;
 }
 
-char *get_filename(char *path)
+int check_fid(int fid)
 {
+    if (fid >= FIDS_NUM || fid < 0)
+        return STATUS_NOT_FOUND;
+    if (FIDS[fid].descr_id == -1)
+        return STATUS_NOT_FOUND;
+    return STATUS_OK;
+}
 
-    int last_delim = -1;
-
-    for (int i = 0; i < strlen(path); ++i)
-    {
-        if (path[i] == '/')
-            last_delim = i;
-    }
-    char *filename = path + last_delim + 1;
-    return filename;
+int create_fid(descr_struct *file)
+{
+    pthread_mutex_lock(&SFS->fids_lock);
+    int fid = 0;
+    while (fid < FIDS_NUM && FIDS[fid].descr_id != -1)
+        fid++;
+    if (fid < FIDS_NUM)
+        FIDS[fid] = (fid_struct) {.descr_id = file->id};
+    pthread_mutex_unlock(&SFS->fids_lock);
+    return fid < FIDS_NUM ? fid : -1;
 }
 
-char *get_dir_path(char *path)
+int rm_fid(int fid)
 {
-    int last_delim = -1;
+    pthread_mutex_lock(&SFS->fids_lock);
+    int err = check_fid(fid);
+    if (err == STATUS_OK && FIDS[fid].pins > 0)
+        err = STATUS_BUSY;
+    if (err == STATUS_OK)
+        FIDS[fid].descr_id = -1;
+    pthread_mutex_unlock(&SFS->fids_lock);
+    return err;
+}
 
-    for (int i = 0; i < strlen(path); ++i)
+int print_file(file_struct *file, void *ignore)
+{
+    descr_struct *file_descr = DESCR(file->descr_id);
+    if (file_descr->type == FILE_TYPE)
+        printf( "%s \t\t id:%d\n", file->filename, file->descr_id);
+    if (file_descr->type == DIR_TYPE)
+        printf( "%s/ \t\t id:%d\n", file->filename, file->descr_id);
+    if (file_descr->type == LINK_TYPE)
     {
-        if (path[i] == '/')
-            last_delim = i;
+        char link_path[MAX_PATH_SIZE];
+        int size = file_descr->size < MAX_PATH_SIZE ? file_descr->size : MAX_PATH_SIZE - 1;
+        read_descr(file_descr, 0, size, link_path);
+        link_path[size] = '\0';
+        printf("%s@ -> %s \t id:%d\n", file->filename, link_path, file->descr_id);
     }
-    // for root case
-    if (last_delim == 0)
-        last_delim = 1;
-    char *dir_path = malloc(last_delim + 1);
-    strncpy(dir_path, path, last_delim);
-    dir_path[last_delim] = '\0';
-    return dir_path;
+    return STATUS_OK;
 }
 
-descr_struct *lookup(char *path, bool follow_symlinks)
+int list(char *path_arg)
 {
-    if (strcmp(path, "/") == 0)
-    {
-        return DESCR_TABLE + 0;
-    }
-    char *filename = get_filename(path);
-    char *dir_path = get_dir_path(path);
-    descr_struct *dir = lookup_full(dir_path);
-    free(dir_path);
+    int err = check_mount();
+    if (err)
+        return err;
+    lock_ns(false);
+    err = list_dir(path_arg);
+    unlock_ns();
+    return err;
+}
+
+int list_dir(char *path_arg)
+{
+    path_struct walk;
+    int err = walk_path(path_arg, true, &walk);
+    if (err)
+        return err;
+    descr_struct *dir = walk.target;
     if (dir == NULL)
-        return NULL;
-    int *blocks = BLOCKS(dir->blocks_id);
-    file_struct *files = BLOCKS(blocks[0]);
-    int bf_id = 0;
-    int block_id = 0;
-    for (int f_id = 0; f_id < FILES_NUM(dir); ++f_id)
-    {
-        file_struct *file = files + bf_id;
-        if(strcmp(file->filename, filename) == 0)
-        {
-            descr_struct *file_descr = DESCR_TABLE + file->descr_id;
-            if (follow_symlinks && file_descr->type == LINK_TYPE)
-            {
-                char *link_path = read_symlink(file_descr);
-                return lookup_full(link_path);
-            } else {
-                return file_descr;
-            }
-        }
-        bf_id++;
-        if (bf_id == FILES_IN_BLOCK)
-        {
-            bf_id = 0;
-            block_id++;
-            files = BLOCKS(blocks[block_id]);
-        }
+        return STATUS_NOT_FOUND;
+    if (dir->type != DIR_TYPE)
+    {
+        char path[MAX_PATH_SIZE];
+        err = normalize_path(path_arg, path);
+        if (err)
+            return err;
+        printf("%s\n", path);
+        return STATUS_OK;
     }
-    return NULL;
-
+    return dir_foreach(dir, print_file, NULL);
 }
 
-descr_struct *lookup_link(char *path)
+/* Make PATH an image of SIZE bytes for mkfs.  Whatever the file held
+   is dropped, and the new one is sparse: it takes disk space only as
+   blocks are written. */
+int create_image(char *path, int64_t size)
 {
-    return lookup(path, false);
+    if (size <= 0)
+        return STATUS_SIZE_ERR;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+    if (fd == -1)
+        return STATUS_ERR;
+    int err = ftruncate(fd, size) == -1 ? STATUS_ERR : STATUS_OK;
+    close(fd);
+    return err;
 }
 
-descr_struct *lookup_full(char *path)
+int mkfs(char *path)
 {
-    return lookup(path, true);
+    return mkfs_geometry(path, 0, 0, 0);
 }
 
-int add_to_dir(descr_struct *dir, descr_struct *file, char *filename)
+bool valid_block_size(int block_size)
 {
-    int left = SPACE_LEFT(dir);
-    file_struct *new_file;
-    int *blocks = BLOCKS(dir->blocks_id);
-    if (left >= sizeof(file_struct))
-    {
-        int block_id = blocks[BLOCKS_NUM(dir) - 1];
-        new_file = (file_struct *)((char *) BLOCKS(block_id) + FS->block_size - left);
-    } else {
-        int new_block_id = find_block();
-        if (new_block_id == -1)
-            return STATUS_NO_SPACE_LEFT;
-        mask_block(new_block_id);
-        blocks[BLOCKS_NUM(dir)] = new_block_id;
-        dir->size += left;
-        new_file = BLOCKS(new_block_id);
-    }
-    dir->size += sizeof(file_struct);
-    strcpy(new_file->filename, filename);
-    new_file->descr_id = file->id;
-    return STATUS_OK;
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE
+        && (block_size & (block_size - 1)) == 0;
 }
 
-int rm_from_dir(descr_struct *dir, char *filename)
+void init_instance(sfs_t *sfs)
 {
-    int *blocks = BLOCKS(dir->blocks_id);
-    file_struct *files = BLOCKS(blocks[0]);
-    int bf_id = 0;
-    int block_id = 0;
-    file_struct *del_file;
-    for (int f_id = 0; f_id < FILES_NUM(dir); ++f_id)
-    {
-        if (strcmp(files[bf_id].filename, filename) == 0)
-        {
-            del_file = files + bf_id;
-            break;
-        }
-        bf_id++;
-        if (bf_id == FILES_IN_BLOCK)
-        {
-            bf_id = 0;
-            block_id++;
-            files = BLOCKS(blocks[block_id]);
-        }
-    }
-    if (del_file == NULL)
-        return STATUS_NOT_FOUND;
-    int last_block_id = blocks[BLOCKS_NUM(dir) - 1];
-    int last_file_id = FILES_NUM(dir) % FILES_IN_BLOCK - 1;
-    file_struct *last_file = (file_struct *) BLOCKS(last_block_id) + last_file_id;
+    memset(sfs, 0, sizeof(sfs_t));
+    for (int fid = 0; fid < FIDS_NUM; ++fid)
+        sfs->fids[fid].descr_id = -1;
+    sfs->dcache_size = DCACHE_DEFAULT_SIZE;
+    sfs->commit_ms = COMMIT_DEFAULT_MS;
+    sfs->delay_blocks = DELAY_DEFAULT_BLOCKS;
+    sfs->pack_size = PACK_DEFAULT_SIZE;
+    pthread_rwlock_init(&sfs->ns_lock, NULL);
+    for (int i = 0; i < FILE_LOCKS_NUM; ++i)
+        pthread_rwlock_init(sfs->file_locks + i, NULL);
+    pthread_mutex_init(&sfs->fids_lock, NULL);
+}
 
-    // copy last file on the place of deleted file
-    strncpy(del_file->filename, last_file->filename, FILENAME_SIZE);
-    del_file->descr_id = last_file->descr_id;
+void release_instance(sfs_t *sfs)
+{
+    pthread_rwlock_destroy(&sfs->ns_lock);
+    for (int i = 0; i < FILE_LOCKS_NUM; ++i)
+        pthread_rwlock_destroy(sfs->file_locks + i);
+    pthread_mutex_destroy(&sfs->fids_lock);
+}
 
-    strncpy(last_file->filename, "", FILENAME_SIZE);
-    last_file->descr_id = 0;
+void lock_ns(bool write)
+{
+    if (write)
+        pthread_rwlock_wrlock(&SFS->ns_lock);
+    else
+        pthread_rwlock_rdlock(&SFS->ns_lock);
+}
 
-    int old_blocks_num = BLOCKS_NUM(dir);
-    dir->size -= sizeof(file_struct);
-    if (old_blocks_num - BLOCKS_NUM(dir) != 0)
-    {
-        blocks[last_block_id] = 0;
-        umask_block(last_block_id);
-    }
+void unlock_ns()
+{
+    pthread_rwlock_unlock(&SFS->ns_lock);
+}
 
-    // If it was last file in dir
-    if (dir->size == 0)
-    {
-        strncpy(del_file->filename, "", FILENAME_SIZE);
-        del_file->descr_id = 0;
-        umask_block(blocks[0]);
-        blocks[0] = 0;
-        return STATUS_OK;
-    }
-    return STATUS_OK;
+void lock_file(descr_struct *file, bool write)
+{
+    pthread_rwlock_t *lock = SFS->file_locks + DESCR_ID(file) % FILE_LOCKS_NUM;
+    if (write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
 }
 
-int rm_descr(descr_struct *descr)
+void unlock_file(descr_struct *file)
 {
-    int *blocks = BLOCKS(descr->blocks_id);
-    for (int i = 0; i < BLOCKS_NUM(descr); ++i)
-    {
-        umask_block(blocks[i]);
-    }
-    umask_block(descr->blocks_id);
-    descr->type = 0;
-    descr->size = 0;
-    descr->blocks_id = 0;
-    descr->links_num = 0;
-    return STATUS_OK;
+    pthread_rwlock_unlock(SFS->file_locks + DESCR_ID(file) % FILE_LOCKS_NUM);
 }
 
-int check_fid(int fid)
+/* Wait for every operation in flight and keep new ones out. */
+void lock_all()
 {
-    if (fid >= FIDS_NUM || fid < 0)
-        return STATUS_NOT_FOUND;
-    if (FIDS[fid] == -1)
-        return STATUS_NOT_FOUND;
-    return STATUS_OK;
+    lock_ns(true);
+    for (int i = 0; i < FILE_LOCKS_NUM; ++i)
+        pthread_rwlock_wrlock(SFS->file_locks + i);
 }
 
-int create_fid(descr_struct *file)
+void unlock_all()
 {
-    for (int fid = 0; fid < FIDS_NUM; ++fid)
-    {
-        if (FIDS[fid] == -1)
-        {
-            FIDS[fid] = file->id;
-            return fid;
-        }
-    }
-    return -1;
+    for (int i = FILE_LOCKS_NUM - 1; i >= 0; --i)
+        pthread_rwlock_unlock(SFS->file_locks + i);
+    unlock_ns();
 }
 
-int rm_fid(int fid)
+/* Make a file system with BLOCK_SIZE bytes blocks.  Descriptors take
+   DESCR_PART of the image, unless FILES_HINT says how many files are
+   expected.  Zero picks the default for any of them. */
+int mkfs_geometry(char *path, int block_size, double descr_part, int files_hint)
 {
-    int err = check_fid(fid);
-    if (err)
-        return err;
-    FIDS[fid] = -1;
-    return STATUS_OK;
+    return mkfs_journal(path, block_size, descr_part, files_hint, 0);
 }
 
-int list(char *path_arg)
+/* The same with a metadata journal of JOURNAL_BLOCKS blocks, 0 for the
+   default size and -1 for no journal at all. */
+int mkfs_journal(char *path, int block_size, double descr_part, int files_hint, int journal_blocks)
 {
-    int err = check_mount();
-    if (err)
-        return err;
+    if (block_size == 0)
+        block_size = DEFAULT_BLOCK_SIZE;
+    if (descr_part == 0)
+        descr_part = DEFAULT_DESCRIPTORS_PART;
+    if (!valid_block_size(block_size) || descr_part < 0 || descr_part >= 1 || files_hint < 0
+        || journal_blocks < -1 || (journal_blocks > 0 && journal_blocks < MIN_JOURNAL_BLOCKS))
+        return STATUS_SIZE_ERR;
 
-    char *path = abs_path(path_arg);
-    descr_struct *dir = lookup_full(path);
-    if (dir == NULL)
-    {
-        free(path);
-        return STATUS_NOT_FOUND;
-    }
-    if (dir->type != DIR_TYPE)
-    {
-        printf("%s\n", path);
-        free(path);
-        return STATUS_OK;
-    }
-    free(path);
-    int *blocks = BLOCKS(dir->blocks_id);
-    file_struct *files = BLOCKS(blocks[0]);
-    int bf_id = 0;
-    int block_id = 0;
-    for (int f_id = 0; f_id < FILES_NUM(dir); ++f_id)
-    {
-        file_struct *file = files + bf_id;
-        descr_struct *file_descr = DESCR_TABLE + file->descr_id;
-        if (file_descr->type == FILE_TYPE)
-            printf( "%s \t\t id:%d\n", file->filename, file->descr_id);
-        if (file_descr->type == DIR_TYPE)
-            printf( "%s/ \t\t id:%d\n", file->filename, file->descr_id);
-        if (file_descr->type == LINK_TYPE)
-        {
-            char *link_path = read_symlink(file_descr);
-            printf("%s@ -> %s \t id:%d\n", file->filename, link_path, file->descr_id);
-            free(link_path);
-        }
-        bf_id++;
-        if (bf_id == FILES_IN_BLOCK)
-        {
-            bf_id = 0;
-            block_id++;
-            files = BLOCKS(blocks[block_id]);
-        }
-    }
-    return STATUS_OK;
+    // on an instance of its own, so whatever is mounted stays mounted
+    sfs_t sfs;
+    init_instance(&sfs);
+    sfs_t *prev = SFS;
+    SFS = &sfs;
+    int err = format_image(path, block_size, descr_part, files_hint, journal_blocks);
+    SFS = prev;
+    release_instance(&sfs);
+    return err;
 }
 
-int mkfs(char *path)
+int format_image(char *path, int block_size, double descr_part, int files_hint, int journal_blocks)
 {
     int err = map_fs(path);
     if (err)
         return err;
+    err = map_hints_init();
+    if (err)
+    {
+        umap_fs();
+        return err;
+    }
 
-    int fd = open(path, O_RDWR | O_CREAT, (mode_t)0600);
-
-    // get file size
-    FS->size = lseek(fd, 0L, SEEK_END);
-    close(fd);
-
-    FS->block_size = BLOCK_SIZE;
-    FS->blocks_num = FS->size / FS->block_size;
-
-    int mask_size = ceil((float) FS->blocks_num / 8.0);
-    int mask_blocks_num = ceil((float) mask_size / FS->block_size);
+    int64_t size = MAPPED_SIZE;
+    // block numbers are ints, bigger images need bigger blocks
+    if (size / block_size > INT32_MAX)
+    {
+        umap_fs();
+        return STATUS_SIZE_ERR;
+    }
+    // nothing of an older format survives in the info block
+    memset(FS, 0, sizeof(fs_struct));
+    FS->magic = SFS_MAGIC;
+    FS->version = SFS_VERSION;
+    FS->size64 = size;
+    FS->size = size < INT32_MAX ? size : INT32_MAX;
+    FS->block_size = block_size;
+    FS->blocks_num = size / FS->block_size;
+    FS->descriptors_part = descr_part;
+    FS->files_hint = files_hint;
+
+    int mask_size = (FS->blocks_num + 7) / 8;
+    int mask_blocks_num = (mask_size + FS->block_size - 1) / FS->block_size;
 
     FS->mask_offset = FS->block_size;
-    FS->max_files = ceil(FS->size / sizeof(descr_struct) * DESCRIPTORS_PART);
+    FS->descr_size = sizeof(descr_struct);
+    // the table is initialized as files are made
+    FS->features = FEATURE_EXTENTS | FEATURE_INLINE_DATA | FEATURE_TAIL_PACKING | FEATURE_LAZY_DESCRS;
+    // the root takes one descriptor of its own
+    if (files_hint > 0)
+        FS->max_files = files_hint + 1;
+    else
+        FS->max_files = fmin(ceil(size / sizeof(descr_struct) * descr_part), INT32_MAX - 1);
+    if (FS->max_files < 1)
+        FS->max_files = 1;
     FS->descr_table_offset = FS->mask_offset + mask_blocks_num * FS->block_size;
-    int descr_table_blocks_num = ceil((float) FS->max_files * sizeof(descr_struct) / FS->block_size);
+    load_geometry();
+    long long descr_table_size = (long long) MAX_FILES * sizeof(descr_struct);
+    long long descr_table_blocks_num = (descr_table_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-    // mark all block as free
-    for (int i = 0; i < FS->blocks_num; ++i)
+    // the info block, the mask, the table and one block for the root
+    if (1 + mask_blocks_num + descr_table_blocks_num + 1 > FS_BLOCKS)
     {
-        umask_block(i);
+        umap_fs();
+        return STATUS_NO_SPACE_LEFT;
     }
 
-    // first block for info
-    mask_block(0);
-
-    for (int i = 1; i < mask_blocks_num + 1; ++i)
-        mask_block(i);
+    // mark all blocks as free, then the info block and the mask as busy
+    memset(MASK, 0, (int64_t) mask_blocks_num * BLOCK_SIZE);
+    mask_blocks(0, 1 + mask_blocks_num);
 
     // mark fake blocks as busy
-    int blocks_in_mask = mask_blocks_num * FS->block_size * 8;
-    for (int i = FS->blocks_num; i < blocks_in_mask; ++i)
-    {
-        mask_block(i);
-    }
+    int64_t blocks_in_mask = (int64_t) mask_blocks_num * BLOCK_SIZE * 8;
+    mask_blocks(FS_BLOCKS, blocks_in_mask - FS_BLOCKS);
 
     // descriptors table blocks
     int descr_table_first_block = mask_blocks_num + 1;
     int descr_table_last_block = descr_table_first_block + descr_table_blocks_num;
-    for (int i = descr_table_first_block; i < descr_table_last_block; ++i)
+    mask_blocks(descr_table_first_block, descr_table_blocks_num);
+
+    // the journal takes whole pages, so flushing it writes nothing else
+    int page_blocks = sysconf(_SC_PAGESIZE) / BLOCK_SIZE;
+    if (page_blocks < 1)
+        page_blocks = 1;
+    int64_t journal_start = (descr_table_last_block + page_blocks - 1) / page_blocks * page_blocks;
+    bool default_journal = journal_blocks == 0;
+    if (default_journal)
+    {
+        int64_t journal_size = fmin(fmax(size / DEFAULT_JOURNAL_PART, MIN_JOURNAL_SIZE), MAX_JOURNAL_SIZE);
+        // small images do better without one
+        journal_blocks = journal_size > size / 8 ? -1 : journal_size / BLOCK_SIZE;
+    }
+    if (journal_blocks > 0)
+        journal_blocks = (journal_blocks + page_blocks - 1) / page_blocks * page_blocks;
+    if (journal_blocks > 0 && journal_start + journal_blocks + 1 > FS_BLOCKS)
+    {
+        if (!default_journal)
+        {
+            umap_fs();
+            return STATUS_NO_SPACE_LEFT;
+        }
+        journal_blocks = -1;
+    }
+    if (journal_blocks > 0)
+    {
+        mask_blocks(journal_start, journal_blocks);
+        journal_format(journal_start, journal_blocks);
+    }
+
+    err = alloc_init();
+    if (err)
     {
-        mask_block(i);
+        umap_fs();
+        return err;
     }
 
-    // create root dir
-    descr_struct *root = DESCR_TABLE + 0;
-    root->id = 0;
+    // the root comes first
+    FS->descr_ready = 0;
+    FS->free_descr = NO_DESCR;
+    descr_struct *root = find_descr();
     root->type = DIR_TYPE;
     root->links_num = 1;
     root->size = 0;
-    int block_num = find_block();
-    if (block_num == -1)
+    err = map_init(root, -1);
+    if (err)
     {
         umap_fs();
-        return STATUS_NO_SPACE_LEFT;
+        return err;
     }
-    mask_block(block_num);
-    root->blocks_id = block_num;
     add_to_dir(root, root, ".");
     add_to_dir(root, root, "..");
 
-    // all files are free
-    for (int i = 1; i < FS->max_files; ++i)
-    {
-        descr_struct *descr = DESCR_TABLE + i;
-        descr->id = i;
-        descr->type = 0;
-        descr->links_num = 0;
-        descr->size = 0;
-        descr->blocks_id = 0;
-    }
-
     dump_stats();
     return umap_fs();
 }
 
-int create(char *path_arg, int type)
+/* Make a descriptor of TYPE at PATH_ARG, with the namespace locked for
+   writing by the caller. */
+int create(char *path_arg, int type, descr_struct **created)
 {
     int err = check_mount();
     if (err)
         return err;
-    char *path = abs_path(path_arg);
-    if (lookup_full(path) != NULL)
-    {
-        free(path);
+    path_struct walk;
+    err = walk_path(path_arg, false, &walk);
+    if (err)
+        return err;
+    if (walk.target != NULL)
         return STATUS_EXISTS_ERR;
-    }
+    descr_struct *dir = walk.parent;
+
     descr_struct *cr = find_descr();
     if (cr == NULL)
-    {
-        free(path);
         return STATUS_MAX_FILES_REACHED;
-    }
-
-    int block_num = find_block();
-    mask_block(block_num);
-
-    if (block_num == -1)
-    {
-        free(path);
-        return STATUS_NO_SPACE_LEFT;
-    }
-
     cr->type = type;
     cr->links_num = 1;
-    cr->size = 0;
-    cr->blocks_id = block_num;
-
-    char *filename = get_filename(path);
-    char *dir_path = get_dir_path(path);
-    descr_struct *dir = lookup_full(dir_path);
-    free(dir_path);
-    err = add_to_dir(dir, cr, filename);
-    free(path);
-
+    set_file_size(cr, 0);
+    // directories spread over the allocation groups, files stay with them
+    int goal = type == DIR_TYPE ? alloc_dir_goal() : dir->blocks_id;
+    err = map_init(cr, goal);
     if (err)
+    {
+        release_descr(cr);
         return err;
+    }
 
+    err = add_to_dir(dir, cr, walk.name);
+    if (err)
+    {
+        rm_descr(cr);
+        return err;
+    }
     if (type == DIR_TYPE)
     {
         err = add_to_dir(cr, cr, ".");
+        if (!err)
+            err = add_to_dir(cr, dir, "..");
         if (err)
+        {
+            rm_from_dir(dir, walk.name);
+            rm_descr(cr);
             return err;
-
-        return add_to_dir(cr, dir, "..");
-    } else {
-        return STATUS_OK;
+        }
     }
+    if (created)
+        *created = cr;
+    return STATUS_OK;
 }
 
 int create_file(char *path_arg)
 {
-    return create(path_arg, FILE_TYPE);
+    lock_ns(true);
+    int err = create(path_arg, FILE_TYPE, NULL);
+    unlock_ns();
+    return err;
 }
 
 
@@ -589,21 +771,24 @@ int filestat(int descr_id)
     int err = check_mount();
     if (err)
         return err;
-    descr_struct *descr = NULL;
-    for (int i = 0; i < FS->max_files; ++i)
-    {
-        descr_struct *descr_ = DESCR_TABLE + i;
-        if (descr_->id == descr_id)
-        {
-            descr = descr_;
-            break;
-        }
-    }
-    if (descr == NULL || descr->type == 0)
+    if (descr_id < 0 || descr_id >= MAX_FILES)
+        return STATUS_NOT_FOUND;
+    descr_struct *descr = DESCR(descr_id);
+    lock_ns(false);
+    if (descr_id >= DESCRS_READY || descr->type == 0)
     {
+        unlock_ns();
         return STATUS_NOT_FOUND;
     }
+    lock_file(descr, false);
+    print_descr(descr);
+    unlock_file(descr);
+    unlock_ns();
+    return STATUS_OK;
+}
 
+void print_descr(descr_struct *descr)
+{
     char *type;
     if (descr->type == FILE_TYPE)
     {
@@ -615,199 +800,915 @@ int filestat(int descr_id)
     }
     printf("Descriptor #%d\n", descr->id);
     printf("type: %s\n", type);
-    printf("size: %d\n", descr->size);
+    printf("size: %lld\n", (long long) file_size(descr));
     printf("links num: %d\n", descr->links_num);
-    printf("blocks num: %d\n", BLOCKS_NUM(descr));
     if (descr->type == DIR_TYPE)
     {
-        printf("files num: %d\n", FILES_NUM(descr));
+        printf("blocks num: %d\n", dir_blocks_num(descr));
+        printf("files num: %d\n", dir_files_num(descr));
+    } else {
+        printf("blocks num: %d\n", map_blocks_num(descr));
+        printf("fragments: %d\n", map_fragments(descr));
+        if (is_inline(descr))
+            printf("inline: yes\n");
+        else if (is_packed(descr))
+            printf("packed: block %d, %d bytes\n", descr->blocks_id, pack_room(descr));
     }
-    return STATUS_OK;
 }
 
 int mklink(char *from_arg, char *to_arg)
 {
-    char *from = abs_path(from_arg);
-    descr_struct *from_file = lookup_full(from);
-    free(from);
+    lock_ns(true);
+    int err = add_link(from_arg, to_arg);
+    unlock_ns();
+    return err;
+}
+
+int add_link(char *from_arg, char *to_arg)
+{
+    path_struct from;
+    int err = walk_path(from_arg, true, &from);
+    if (err)
+        return err;
+    descr_struct *from_file = from.target;
     if (from_file == NULL)
         return STATUS_NOT_FOUND;
-    char *to = abs_path(to_arg);
-    char *dir_path = get_dir_path(to);
-    char *filename = get_filename(to);
-    descr_struct *to_dir = lookup_full(dir_path);
-    free(dir_path);
-    if (to_dir == NULL)
-    {
-        free(to);
-        return STATUS_NOT_FOUND;
-    }
-    int err = add_to_dir(to_dir, from_file, filename);
-    free(to);
+    path_struct to;
+    err = walk_path(to_arg, false, &to);
     if (err)
-    {
         return err;
-    } else {
-        from_file->links_num++;
-        return STATUS_OK;
-    }
+    if (to.target != NULL)
+        return STATUS_EXISTS_ERR;
+    err = add_to_dir(to.parent, from_file, to.name);
+    if (err)
+        return err;
+    journal_dirty(from_file, DESCR_SIZE);
+    from_file->links_num++;
+    return STATUS_OK;
 }
 
 int rmlink(char *path_arg)
 {
-    char *path = abs_path(path_arg);
-    descr_struct *file = lookup_link(path);
-    if (file == NULL)
-    {
-        free(path);
+    lock_ns(true);
+    int err = remove_link(path_arg);
+    unlock_ns();
+    return err;
+}
+
+int remove_link(char *path_arg)
+{
+    path_struct walk;
+    int err = walk_path(path_arg, false, &walk);
+    if (err)
+        return err;
+    descr_struct *file = walk.target;
+    if (file == NULL || walk.parent == NULL)
         return STATUS_NOT_FOUND;
-    }
     // if (file->type != FILE_TYPE && file->type != LINK_TYPE)
-    // {
-    //     free(path);
     //     return STATUS_NOT_FILE;
-    // }
-    char *filename = get_filename(path);
-    char *dir_path = get_dir_path(path);
-    descr_struct *dir = lookup_full(dir_path);
-    free(dir_path);
-    if (dir == NULL)
-        return STATUS_NOT_FOUND;
-    int err = rm_from_dir(dir, filename);
-    free(path);
-    if (err)
+    if (file->links_num > 1)
+    {
+        err = rm_from_dir(walk.parent, walk.name);
+        if (err == STATUS_OK)
+        {
+            journal_dirty(file, DESCR_SIZE);
+            file->links_num--;
+        }
         return err;
-    file->links_num--;
-    if (file->links_num == 0)
-        return rm_descr(file);
-    return STATUS_OK;
+    }
+    // wait for io through open fids to finish before freeing the data
+    lock_file(file, true);
+    if (is_pinned(file))
+        err = STATUS_BUSY;
+    else
+        err = rm_from_dir(walk.parent, walk.name);
+    if (err == STATUS_OK)
+    {
+        journal_dirty(file, DESCR_SIZE);
+        file->links_num--;
+        err = rm_descr(file);
+    }
+    unlock_file(file);
+    return err;
 }
 
 int open_file(char *path_arg)
 {
-    char *path = abs_path(path_arg);
-    descr_struct *file = lookup_full(path);
-    free(path);
-    if (file == NULL)
-        return -1;
-    if (file->type != FILE_TYPE && file->type != LINK_TYPE)
-        return -1;
-
-    return create_fid(file);
+    lock_ns(false);
+    path_struct walk;
+    int fid = -1;
+    if (walk_path(path_arg, true, &walk) == STATUS_OK && walk.target != NULL
+        && (walk.target->type == FILE_TYPE || walk.target->type == LINK_TYPE))
+        fid = create_fid(walk.target);
+    unlock_ns();
+    return fid;
 }
 
+/* Close FID, placing the delayed writes of its file. */
 int close_file(int fid)
 {
-    return rm_fid(fid);
+    int err = check_fid(fid);
+    if (err)
+        return err;
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    lock_file(file, true);
+    err = delay_place(file);
+    unlock_file(file);
+    int closed = rm_fid(fid);
+    return closed ? closed : err;
+}
+
+/* Size of the file, delayed writes included. */
+int64_t file_size(descr_struct *file)
+{
+    int64_t size = delay_size(file);
+    return size != -1 ? size : disk_size(file);
+}
+
+/* Size of the file in the descriptor, as far as its blocks are mapped. */
+int64_t disk_size(descr_struct *file)
+{
+    if (!HAS_SIZE_HI)
+        return file->size;
+    return (int64_t) file->size_hi << 32 | (uint32_t) file->size;
+}
+
+void set_file_size(descr_struct *file, int64_t size)
+{
+    journal_dirty(file, DESCR_SIZE);
+    file->size = (uint32_t) size;
+    if (HAS_SIZE_HI)
+        file->size_hi = size >> 32;
 }
 
 int read_file(int fid, int offset, int size, char *data)
+{
+    return read_file64(fid, offset, size, data);
+}
+
+int read_file64(int fid, int64_t offset, int64_t size, char *data)
 {
     int err = check_fid(fid);
     if (err)
         return err;
-    descr_struct *file = DESCR_TABLE + FIDS[fid];
-    if (file->type != FILE_TYPE && file->type != LINK_TYPE)
-        return STATUS_NOT_FILE;
-    if (offset + size > file->size)
-        return STATUS_SIZE_ERR;
-    int *blocks = BLOCKS(file->blocks_id);
-    int block_id = offset / FS->block_size;
-    int b_id = offset % FS->block_size;
-    char *block = BLOCKS(blocks[block_id]);
-    for (int i = 0; i < size; ++i)
-    {
-        data[i] = block[b_id];
-        b_id++;
-        if (b_id >= FS->block_size)
-        {
-            b_id = 0;
-            block_id++;
-            block = BLOCKS(blocks[block_id]);
-        }
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    lock_file(file, false);
+    err = check_io(file, offset, size, false);
+    if (err == STATUS_OK)
+    {
+        read_ahead(FIDS + fid, file, offset, size);
+        copy_blocks(file, offset, size, data, false);
     }
+    unlock_file(file);
+    return err;
+}
+
+int read_descr(descr_struct *file, int64_t offset, int64_t size, char *data)
+{
+    int err = check_io(file, offset, size, false);
+    if (err)
+        return err;
+    copy_blocks(file, offset, size, data, false);
     return STATUS_OK;
 }
 
 int write_file(int fid, int offset, int size, char *data)
+{
+    return write_file64(fid, offset, size, data);
+}
+
+int write_file64(int fid, int64_t offset, int64_t size, char *data)
 {
     int err = check_fid(fid);
     if (err)
         return err;
-    descr_struct *file = DESCR_TABLE + FIDS[fid];
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    lock_file(file, true);
+    err = write_descr(file, offset, size, data);
+    if (err == STATUS_OK)
+        __atomic_store_n(&FIDS[fid].pos, offset + size, __ATOMIC_RELAXED);
+    unlock_file(file);
+    return err;
+}
+
+int write_descr(descr_struct *file, int64_t offset, int64_t size, char *data)
+{
+    int err = check_io(file, offset, size, true);
+    if (err)
+        return err;
+    copy_blocks(file, offset, size, data, true);
+    return STATUS_OK;
+}
+
+/* The bytes of the file from OFFSET on, at most SIZE of them, that lie
+   next to each other in the image; *SPAN points at the first one.  A
+   hole is read from ZEROS, so it must be filled before it is written. */
+int64_t file_span(descr_struct *file, int64_t offset, int64_t size, char **span)
+{
+    // delayed writes wait in one buffer
+    char *delayed = delay_span(file, offset, &size);
+    if (delayed)
+    {
+        *span = delayed;
+        return size;
+    }
+    if (is_inline(file))
+    {
+        *span = file->inline_data + offset;
+        return size < INLINE_DATA_SIZE - offset ? size : INLINE_DATA_SIZE - offset;
+    }
+    if (is_packed(file))
+    {
+        *span = pack_span(file) + offset;
+        return size < pack_room(file) - offset ? size : pack_room(file) - offset;
+    }
+    int block_size = BLOCK_SIZE;
+    int block_id = offset / block_size;
+    int b_offset = offset % block_size;
+    int start;
+    int64_t max_num = (b_offset + size + block_size - 1) / block_size;
+    // delayed writes may follow
+    if (max_num > BLOCKS_NUM(file) - block_id)
+        max_num = BLOCKS_NUM(file) - block_id;
+    int run = map_run(file, block_id, max_num, &start);
+    int64_t span_size;
+    if (run > 0)
+    {
+        span_size = (int64_t) run * block_size - b_offset;
+        *span = (char *) BLOCKS(start) + b_offset;
+    } else {
+        span_size = (int64_t) map_hole(file, block_id, max_num) * block_size - b_offset;
+        if (span_size > ZEROS_SIZE)
+            span_size = ZEROS_SIZE;
+        *span = (char *) ZEROS;
+    }
+    return span_size < size ? span_size : size;
+}
+
+/* Copy SIZE bytes at OFFSET between the file and DATA with one memcpy per
+   run of physically adjacent blocks.  A NULL DATA zeroes the range. */
+void copy_blocks(descr_struct *file, int64_t offset, int64_t size, char *data, bool to_file)
+{
+    while (size > 0)
+    {
+        char *span;
+        int64_t span_size = file_span(file, offset, size, &span);
+        if (data == NULL)
+        {
+            memset(span, 0, span_size);
+            mark_dirty(span, span_size);
+        } else if (to_file) {
+            memcpy(span, data, span_size);
+            mark_dirty(span, span_size);
+            data += span_size;
+        } else {
+            memcpy(data, span, span_size);
+            data += span_size;
+        }
+        size -= span_size;
+        offset += span_size;
+    }
+}
+
+/* Callers hold the file lock, and pins are taken under it, so a pin of
+   FILE is seen without fids_lock. */
+bool is_pinned(descr_struct *file)
+{
+    if (__atomic_load_n(&PINS_NUM, __ATOMIC_RELAXED) == 0)
+        return false;
+    pthread_mutex_lock(&SFS->fids_lock);
+    bool pinned = false;
+    for (int fid = 0; fid < FIDS_NUM && !pinned; ++fid)
+        pinned = FIDS[fid].pins > 0 && FIDS[fid].descr_id == file->id;
+    pthread_mutex_unlock(&SFS->fids_lock);
+    return pinned;
+}
+
+/* Point at most *IOV_NUM segments of IOV straight at the SIZE bytes at
+   OFFSET in the mapped image, and set *IOV_NUM to the number used.  When
+   they run out the segments cover less than SIZE bytes.  The file is
+   pinned until unpin_file(FID): writing, truncating or removing it,
+   closing FID and umount fail with STATUS_BUSY until then. */
+int read_iov(int fid, int64_t offset, int64_t size, struct iovec *iov, int *iov_num)
+{
+    int err = check_fid(fid);
+    if (err)
+        return err;
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    lock_file(file, false);
+    while (err == STATUS_OK && delay_pending(file, offset, size))
+    {
+        // pinned bytes stay where they are, so they have to be placed
+        unlock_file(file);
+        lock_file(file, true);
+        err = delay_place(file);
+        unlock_file(file);
+        lock_file(file, false);
+    }
+    if (err == STATUS_OK)
+        err = check_io(file, offset, size, false);
+    if (err == STATUS_OK)
+    {
+        read_ahead(FIDS + fid, file, offset, size);
+        pin_spans(fid, file, offset, size, iov, iov_num);
+    }
+    unlock_file(file);
+    return err;
+}
+
+void pin_spans(int fid, descr_struct *file, int64_t offset, int64_t size, struct iovec *iov, int *iov_num)
+{
+    int num = 0;
+    while (size > 0)
+    {
+        char *span;
+        int64_t span_size = file_span(file, offset, size, &span);
+        // runs split by the map may still be adjacent in the image
+        if (num > 0 && (char *) iov[num - 1].iov_base + iov[num - 1].iov_len == span)
+        {
+            iov[num - 1].iov_len += span_size;
+        } else {
+            if (num == *iov_num)
+                break;
+            iov[num].iov_base = span;
+            iov[num].iov_len = span_size;
+            num++;
+        }
+        offset += span_size;
+        size -= span_size;
+    }
+    *iov_num = num;
+    pthread_mutex_lock(&SFS->fids_lock);
+    FIDS[fid].pins++;
+    __atomic_fetch_add(&PINS_NUM, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&SFS->fids_lock);
+}
+
+int unpin_file(int fid)
+{
+    pthread_mutex_lock(&SFS->fids_lock);
+    int err = check_fid(fid);
+    if (err == STATUS_OK && FIDS[fid].pins == 0)
+        err = STATUS_ERR;
+    if (err == STATUS_OK)
+    {
+        FIDS[fid].pins--;
+        __atomic_fetch_sub(&PINS_NUM, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&SFS->fids_lock);
+    return err;
+}
+
+/* Check that SIZE bytes at OFFSET may be read or written, growing the file
+   for a write past its end and mapping the holes it writes to.  A write
+   starting past the end leaves a hole before it. */
+int check_io(descr_struct *file, int64_t offset, int64_t size, bool write)
+{
     if (file->type != FILE_TYPE && file->type != LINK_TYPE)
         return STATUS_NOT_FILE;
-    if (offset > file->size)
+    if (offset < 0 || size < 0)
         return STATUS_SIZE_ERR;
+    if (!write)
+        return offset + size > file_size(file) ? STATUS_SIZE_ERR : STATUS_OK;
+    if (is_pinned(file))
+        return STATUS_BUSY;
+    int64_t old_size = file_size(file);
+    int err = STATUS_OK;
+    if (offset > old_size)
+    {
+        // the bytes skipped over become a hole
+        if (offset + size > MAX_FILE_SIZE)
+            return STATUS_SIZE_ERR;
+        err = delay_place(file);
+        if (err == STATUS_OK)
+            err = expand_file(file, offset);
+        if (err)
+            return err;
+    }
+    err = fill_holes(file, offset, size);
+    if (err == STATUS_OK && offset + size > file_size(file))
+        err = extend_file(file, offset + size);
+    if (err && offset > old_size)
+        shrink_file(file, old_size);
+    // inline bytes are metadata, and so are packed ones
+    if (err == STATUS_OK && is_inline(file))
+        journal_dirty(file, DESCR_SIZE);
+    else if (err == STATUS_OK && is_packed(file))
+        journal_dirty(pack_span(file) + offset, size);
+    return err;
+}
 
-    int *blocks = BLOCKS(file->blocks_id);
-    int old_blocks_num = BLOCKS_NUM(file);
-    file->size += size - (file->size - offset);
-    // add new blocks
-    for (int i = old_blocks_num; i < BLOCKS_NUM(file); ++i)
+/* Map the holes SIZE bytes at OFFSET of the file are about to be written
+   to. */
+int fill_holes(descr_struct *file, int64_t offset, int64_t size)
+{
+    if (!HAS_FLAGS || !(file->flags & DESCR_HOLES) || size == 0)
+        return STATUS_OK;
+    // delayed writes and what is past the end have no holes
+    int64_t end = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > BLOCKS_NUM(file))
+        end = BLOCKS_NUM(file);
+    int first = offset / BLOCK_SIZE;
+    if (first >= end)
+        return STATUS_OK;
+    return map_fill(file, first, end);
+}
+
+/* Offset of the first byte from OFFSET on that is data (WHENCE
+   SFS_SEEK_DATA) or in a hole (SFS_SEEK_HOLE), like lseek().  The end of
+   the file counts as a hole.  -1 if there is none or OFFSET is past the
+   end. */
+int64_t seek_file(int fid, int64_t offset, int whence)
+{
+    if (check_fid(fid))
+        return -1;
+    if (whence != SFS_SEEK_DATA && whence != SFS_SEEK_HOLE)
+        return -1;
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    lock_file(file, false);
+    int64_t size = file_size(file);
+    int64_t found = -1;
+    if (offset >= 0 && offset < size)
     {
-        int block_id = find_block();
-        if (block_id == -1)
+        // delayed writes are data, they start right after the mapped
+        // blocks, and so are inline and packed bytes
+        bool data_inline = !has_map(file);
+        int blocks_num = data_inline ? 0 : BLOCKS_NUM(file);
+        int block_id = data_inline ? 0 : offset / BLOCK_SIZE;
+        while (block_id < blocks_num)
         {
-            // TODO: release blocks
-            return STATUS_NO_SPACE_LEFT;
+            int start;
+            int data = map_run(file, block_id, blocks_num - block_id, &start);
+            if (data > 0 && whence == SFS_SEEK_DATA)
+                break;
+            if (data == 0 && whence == SFS_SEEK_HOLE)
+                break;
+            block_id += data ? data : map_hole(file, block_id, blocks_num - block_id);
         }
-        mask_block(block_id);
-        blocks[i] = block_id;
+        found = (int64_t) block_id * BLOCK_SIZE;
+        if (block_id >= blocks_num && whence == SFS_SEEK_HOLE)
+            found = size;
+        else if (block_id >= blocks_num && size == disk_size(file) && !data_inline)
+            found = -1;
+        if (found != -1 && found < offset)
+            found = offset;
+        if (found > size)
+            found = size;
     }
+    unlock_file(file);
+    return found;
+}
 
-    int block_id = offset / FS->block_size;
-    int b_id = offset % FS->block_size;
-    char *block = BLOCKS(blocks[block_id]);
-    for (int i = 0; i < size; ++i)
+/* Move the file bytes from OFFSET on to or from the IOV buffers in turn,
+   walking the file and the buffers side by side. */
+int vector_io(int fid, int64_t offset, const struct iovec *iov, int iov_num, bool write)
+{
+    int err = check_fid(fid);
+    if (err)
+        return err;
+    descr_struct *file = DESCR(FIDS[fid].descr_id);
+    int64_t size = 0;
+    for (int i = 0; i < iov_num; ++i)
+        size += iov[i].iov_len;
+    lock_file(file, write);
+    err = check_io(file, offset, size, write);
+    if (err == STATUS_OK && write)
+        __atomic_store_n(&FIDS[fid].pos, offset + size, __ATOMIC_RELAXED);
+    else if (err == STATUS_OK)
+        read_ahead(FIDS + fid, file, offset, size);
+    if (err == STATUS_OK)
+        copy_iov(file, offset, size, iov, write);
+    unlock_file(file);
+    return err;
+}
+
+void copy_iov(descr_struct *file, int64_t offset, int64_t size, const struct iovec *iov, bool write)
+{
+    int i = 0;
+    size_t done = 0;
+    while (size > 0)
     {
-        block[b_id] = data[i];
-        b_id++;
-        if (b_id >= FS->block_size)
+        char *span;
+        int64_t span_size = file_span(file, offset, size, &span);
+        offset += span_size;
+        size -= span_size;
+        while (span_size > 0)
         {
-            b_id = 0;
-            block_id++;
-            block = BLOCKS(blocks[block_id]);
+            if (done == iov[i].iov_len)
+            {
+                i++;
+                done = 0;
+                continue;
+            }
+            int64_t len = iov[i].iov_len - done;
+            if (len > span_size)
+                len = span_size;
+            char *data = (char *) iov[i].iov_base + done;
+            if (write)
+            {
+                memcpy(span, data, len);
+                mark_dirty(span, len);
+            } else {
+                memcpy(data, span, len);
+            }
+            span += len;
+            span_size -= len;
+            done += len;
         }
     }
+}
+
+/* Tell how FID is going to be read, like posix_fadvise(): ADVICE is one
+   of the SFS_ADVICE_* values. */
+int advise_file(int fid, int advice)
+{
+    int err = check_fid(fid);
+    if (err)
+        return err;
+    if (advice != SFS_ADVICE_NORMAL && advice != SFS_ADVICE_SEQUENTIAL && advice != SFS_ADVICE_RANDOM)
+        return STATUS_ERR;
+    __atomic_store_n(&FIDS[fid].advice, advice, __ATOMIC_RELAXED);
     return STATUS_OK;
 }
 
-int trancate(char *path_arg, int new_size)
+int readv_file(int fid, int64_t offset, const struct iovec *iov, int iov_num)
 {
-    char *path = abs_path(path_arg);
-    descr_struct *file = lookup_full(path);
-    free(path);
-    if (file == NULL)
-        return STATUS_NOT_FOUND;
-    if (file->type != FILE_TYPE && file->type != LINK_TYPE)
-        return STATUS_NOT_FILE;
-    int *blocks = BLOCKS(file->blocks_id);
-    int old_blocks_num = BLOCKS_NUM(file);
-    if (file->size > new_size)
+    return vector_io(fid, offset, iov, iov_num, false);
+}
+
+int writev_file(int fid, int64_t offset, const struct iovec *iov, int iov_num)
+{
+    return vector_io(fid, offset, iov, iov_num, true);
+}
+
+#define SMALL_BATCH_SIZE 64
+
+typedef struct {
+    sfs_op *op;
+    descr_struct *file;
+    // where the op starts in the image and how much of it lies there
+    char *span;
+    int64_t span_size;
+    int index;
+} batch_item;
+
+int compare_items(const void *a, const void *b)
+{
+    const batch_item *x = a;
+    const batch_item *y = b;
+    if (x->span != y->span)
+        return x->span < y->span ? -1 : 1;
+    return x->index - y->index;
+}
+
+/* Can B be done with the same copy as A, which ends where B starts in the
+   file and in memory? */
+bool joins(batch_item *a, batch_item *b)
+{
+    return a->file == b->file && a->op->op == b->op->op
+        && a->op->offset + a->op->size == b->op->offset
+        && a->op->data + a->op->size == b->op->data;
+}
+
+#define LOCK_NONE 0
+#define LOCK_READ 1
+#define LOCK_WRITE 2
+
+/* Lock the files of a batch all at once, going up the lock array so two
+   batches can't wait for each other.  MODES gets what was taken. */
+void lock_batch(sfs_op *ops, int ops_num, char *modes)
+{
+    memset(modes, LOCK_NONE, FILE_LOCKS_NUM);
+    for (int i = 0; i < ops_num; ++i)
+    {
+        if (check_fid(ops[i].fid))
+            continue;
+        char *mode = modes + FIDS[ops[i].fid].descr_id % FILE_LOCKS_NUM;
+        if (ops[i].op == SFS_WRITE)
+            *mode = LOCK_WRITE;
+        else if (*mode == LOCK_NONE)
+            *mode = LOCK_READ;
+    }
+    for (int i = 0; i < FILE_LOCKS_NUM; ++i)
     {
-        file->size = new_size;
-        for (int i = old_blocks_num - 1; i >= BLOCKS_NUM(file); --i)
+        if (modes[i] == LOCK_WRITE)
+            pthread_rwlock_wrlock(SFS->file_locks + i);
+        else if (modes[i] == LOCK_READ)
+            pthread_rwlock_rdlock(SFS->file_locks + i);
+    }
+}
+
+void unlock_batch(char *modes)
+{
+    for (int i = 0; i < FILE_LOCKS_NUM; ++i)
+    {
+        if (modes[i] != LOCK_NONE)
+            pthread_rwlock_unlock(SFS->file_locks + i);
+    }
+}
+
+/* Run OPS_NUM reads and writes in one pass and set the status of each.
+   They are checked and the files grown in the order given, then the data
+   is copied in the order of the blocks in the image, with runs of ops
+   that continue each other in the file and in memory copied at once.
+   Ops that overlap a write of the same batch see it or not in no
+   particular order, other threads see the batch all or nothing.
+   STATUS_OK means every op succeeded. */
+int submit_ops(sfs_op *ops, int ops_num)
+{
+    int err = check_mount();
+    if (err)
+        return err;
+    batch_item small_batch[SMALL_BATCH_SIZE];
+    batch_item *items = small_batch;
+    if (ops_num > SMALL_BATCH_SIZE)
+        items = malloc(ops_num * sizeof(batch_item));
+    if (items == NULL)
+        return STATUS_ERR;
+    char modes[FILE_LOCKS_NUM];
+    lock_batch(ops, ops_num, modes);
+
+    int items_num = 0;
+    int failed = 0;
+    for (int i = 0; i < ops_num; ++i)
+    {
+        sfs_op *op = ops + i;
+        op->status = check_fid(op->fid);
+        if (op->status == STATUS_OK)
+        {
+            descr_struct *file = DESCR(FIDS[op->fid].descr_id);
+            op->status = check_io(file, op->offset, op->size, op->op == SFS_WRITE);
+            if (op->status == STATUS_OK && op->size > 0)
+            {
+                batch_item *item = items + items_num++;
+                item->op = op;
+                item->file = file;
+                item->index = i;
+            }
+        }
+        if (op->status != STATUS_OK)
+            failed++;
+    }
+    // once all files are grown, as growing may move delayed writes
+    bool sorted = true;
+    for (int i = 0; i < items_num; ++i)
+    {
+        batch_item *item = items + i;
+        item->span_size = file_span(item->file, item->op->offset, item->op->size, &item->span);
+        if (i > 0 && item[-1].span > item->span)
+            sorted = false;
+    }
+
+    if (!sorted)
+        qsort(items, items_num, sizeof(batch_item), compare_items);
+    for (int i = 0; i < items_num; )
+    {
+        batch_item *first = items + i;
+        int64_t size = first->op->size;
+        int j = i + 1;
+        while (j < items_num && joins(items + j - 1, items + j))
+            size += items[j++].op->size;
+        bool write = first->op->op == SFS_WRITE;
+        // most small ops lie in one span already found
+        if (size <= first->span_size && write)
         {
-            umask_block(blocks[i]);
-            blocks[i] = 0;
+            memcpy(first->span, first->op->data, size);
+            mark_dirty(first->span, size);
+        } else if (size <= first->span_size) {
+            memcpy(first->op->data, first->span, size);
+        } else {
+            copy_blocks(first->file, first->op->offset, size, first->op->data, write);
         }
+        i = j;
+    }
+    unlock_batch(modes);
+    if (items != small_batch)
+        free(items);
+    return failed ? STATUS_ERR : STATUS_OK;
+}
+
+/* Grow the file to NEW_SIZE for a write.  Small files share blocks,
+   appends to bigger regular files wait in memory for their blocks. */
+int extend_file(descr_struct *file, int64_t new_size)
+{
+    if (new_size > MAX_FILE_SIZE)
+        return STATUS_SIZE_ERR;
+    if (is_inline(file) && new_size <= INLINE_DATA_SIZE)
+    {
+        set_file_size(file, new_size);
+        return STATUS_OK;
+    }
+    if (pack_fits(file, new_size))
+    {
+        int err = pack_grow(file, new_size);
+        if (err == STATUS_OK)
+            set_file_size(file, new_size);
+        return err;
+    }
+    if (!has_map(file))
+    {
+        int err = unpack_file(file);
+        if (err)
+            return err;
+    }
+    if (file->type == FILE_TYPE && delay_fits(file, new_size))
+        return delay_grow(file, new_size);
+    int err = delay_place(file);
+    if (err)
+        return err;
+    return grow_file(file, new_size);
+}
+
+/* Map blocks for the bytes up to NEW_SIZE.  On failure the file keeps its
+   old size and blocks. */
+int grow_file(descr_struct *file, int64_t new_size)
+{
+    if (new_size > MAX_FILE_SIZE)
+        return STATUS_SIZE_ERR;
+    int err = map_grow(file, (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (err)
+        return err;
+    set_file_size(file, new_size);
+    return STATUS_OK;
+}
+
+/* Move the bytes of an inline or packed file into blocks of its own, once
+   they don't fit where they are any more.  On failure they stay there. */
+int unpack_file(descr_struct *file)
+{
+    bool packed = is_packed(file);
+    int block_id = file->blocks_id;
+    int unit = file->pack_unit;
+    int units = file->pack_units;
+    char *data = packed ? pack_span(file) : file->inline_data;
+    int err = map_uninline(file);
+    if (err)
+        return err;
+    // the new map has nothing yet
+    int64_t size = disk_size(file);
+    set_file_size(file, 0);
+    err = grow_file(file, size);
+    if (err)
+    {
+        map_inline(file);
+        if (packed)
+            pack_set(file, block_id, unit, units);
+        set_file_size(file, size);
+        return err;
+    }
+    copy_blocks(file, 0, size, data, true);
+    if (packed)
+    {
+        pack_put(block_id, unit, units);
     } else {
-        int fid = open_file(path_arg);
-        int add_bytes = new_size - file->size;
-        char *data = malloc(add_bytes);
-        memset(data, 0, add_bytes);
-        int err = write_file(fid, file->size, new_size - file->size, data);
-        close_file(fid);
-        free(data);
+        journal_dirty(file, DESCR_SIZE);
+        memset(file->inline_data, 0, INLINE_DATA_SIZE);
+    }
+    return STATUS_OK;
+}
+
+int trancate(char *path_arg, int new_size)
+{
+    return trancate64(path_arg, new_size);
+}
+
+/* Find what PATH_ARG names and lock it into *FILE.  The namespace is only
+   held until then, so the file can't go away but others may go on. */
+int lock_path(char *path_arg, bool write, descr_struct **file)
+{
+    lock_ns(false);
+    path_struct walk;
+    int err = walk_path(path_arg, true, &walk);
+    if (err == STATUS_OK && walk.target == NULL)
+        err = STATUS_NOT_FOUND;
+    if (err == STATUS_OK)
+    {
+        *file = walk.target;
+        lock_file(*file, write);
+    }
+    unlock_ns();
+    return err;
+}
+
+int trancate64(char *path_arg, int64_t new_size)
+{
+    descr_struct *file;
+    int err = lock_path(path_arg, true, &file);
+    if (err)
+        return err;
+    err = resize_file(file, new_size);
+    unlock_file(file);
+    return err;
+}
+
+int resize_file(descr_struct *file, int64_t new_size)
+{
+    if (file->type != FILE_TYPE && file->type != LINK_TYPE)
+        return STATUS_NOT_FILE;
+    if (new_size < 0)
+        return STATUS_SIZE_ERR;
+    if (is_pinned(file))
+        return STATUS_BUSY;
+    int err = delay_place(file);
+    if (err)
+        return err;
+    int64_t old_size = file_size(file);
+    if (old_size > new_size)
+        shrink_file(file, new_size);
+    else if (old_size < new_size)
+        err = expand_file(file, new_size);
+    return err;
+}
+
+/* Grow the file to NEW_SIZE with zeros, after its delayed writes were
+   placed.  The new blocks are left as a hole, so this costs the same for
+   any size; descriptors without flags can't tell a hole, they get zeroed
+   blocks instead. */
+int expand_file(descr_struct *file, int64_t new_size)
+{
+    // the bytes past the size are zeros already
+    if (is_inline(file) && new_size <= INLINE_DATA_SIZE)
+    {
+        set_file_size(file, new_size);
+        return STATUS_OK;
+    }
+    if (pack_fits(file, new_size))
+    {
+        int err = pack_grow(file, new_size);
+        if (err == STATUS_OK)
+            set_file_size(file, new_size);
         return err;
     }
+    if (!has_map(file))
+    {
+        int err = unpack_file(file);
+        if (err)
+            return err;
+    }
+    int64_t old_size = disk_size(file);
+    if (!HAS_FLAGS)
+    {
+        int err = grow_file(file, new_size);
+        if (err)
+            return err;
+        copy_blocks(file, old_size, new_size - old_size, NULL, true);
+        return STATUS_OK;
+    }
+    if (new_size > MAX_FILE_SIZE)
+        return STATUS_SIZE_ERR;
+    int block_size = BLOCK_SIZE;
+    int64_t slack = old_size % block_size ? block_size - old_size % block_size : 0;
+    if (slack > new_size - old_size)
+        slack = new_size - old_size;
+    int start;
+    // the last block may still hold bytes of a longer past
+    if (slack > 0 && map_run(file, old_size / block_size, 1, &start) == 1)
+    {
+        char *past = (char *) BLOCKS(start) + old_size % block_size;
+        memset(past, 0, slack);
+        mark_dirty(past, slack);
+    }
+    int blocks_num = BLOCKS_NUM(file);
+    set_file_size(file, new_size);
+    if (BLOCKS_NUM(file) > blocks_num)
+        file->flags |= DESCR_HOLES;
     return STATUS_OK;
 }
 
+/* Cut the file down to NEW_SIZE, after its delayed writes were placed. */
+void shrink_file(descr_struct *file, int64_t new_size)
+{
+    if (is_inline(file))
+    {
+        int64_t old_size = disk_size(file);
+        set_file_size(file, new_size);
+        memset(file->inline_data + new_size, 0, old_size - new_size);
+        mark_dirty(file->inline_data, INLINE_DATA_SIZE);
+        return;
+    }
+    if (is_packed(file))
+    {
+        pack_shrink(file, new_size);
+        set_file_size(file, new_size);
+        if (new_size == 0)
+            map_inline(file);
+        return;
+    }
+    map_shrink(file, (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    set_file_size(file, new_size);
+    // an empty file takes no blocks again
+    if ((FEATURES & FEATURE_INLINE_DATA) && new_size == 0)
+        map_inline(file);
+    else if (HAS_FLAGS && new_size == 0)
+        file->flags &= ~DESCR_HOLES;
+}
+
 int make_dir(char *path_arg)
 {
-    return create(path_arg, DIR_TYPE);
+    lock_ns(true);
+    int err = create(path_arg, DIR_TYPE, NULL);
+    unlock_ns();
+    return err;
 }
 
 char *pwd()
@@ -823,21 +1724,116 @@ int cd(char *path_arg)
     int err = check_mount();
     if (err)
         return err;
-    char *path = abs_path(path_arg);
-    descr_struct *dir = lookup_full(path);
+    lock_ns(true);
+    err = change_dir(path_arg);
+    unlock_ns();
+    return err;
+}
+
+int change_dir(char *path_arg)
+{
+    path_struct walk;
+    int err = walk_path(path_arg, true, &walk);
+    if (err)
+        return err;
+    descr_struct *dir = walk.target;
     if (dir == NULL)
-    {
-        free(path);
         return STATUS_NOT_FOUND;
-    }
     if (dir->type != DIR_TYPE)
-    {
-        free(path);
         return STATUS_NOT_DIR;
-    }
 
+    char path[MAX_PATH_SIZE];
+    err = normalize_path(path_arg, path);
+    if (err)
+        return err;
     strcpy(WORK_DIR, path);
-    free(path);
+    WORK_DIR_ID = dir->id;
+    return STATUS_OK;
+}
+
+int set_dcache_size(int size)
+{
+    if (size < 0)
+        return STATUS_SIZE_ERR;
+    DCACHE_SIZE = size;
+    if (FS == NULL)
+        return STATUS_OK;
+    lock_ns(true);
+    int err = dcache_init(DCACHE_SIZE);
+    unlock_ns();
+    return err;
+}
+
+/* Commit the metadata journal after MS milliseconds or once BLOCKS
+   blocks changed, 0 blocks for a quarter of the journal. */
+int set_commit_window(int ms, int blocks)
+{
+    if (ms < 0 || blocks < 0)
+        return STATUS_SIZE_ERR;
+    journal_window(ms, blocks);
+    return STATUS_OK;
+}
+
+/* Make every change to the metadata made so far durable.  With a journal
+   that's one flush of the log shared by everybody committing at the
+   time, images without one sync what was written in place. */
+int commit_journal()
+{
+    int err = check_mount();
+    if (err)
+        return err;
+    if (SFS->journal)
+        journal_sync();
+    else
+        flush_dirty(false);
+    return STATUS_OK;
+}
+
+/* Write everything written so far back to the image, data included:
+   delayed writes are placed, then the dirty pages are synced. */
+int sync_image()
+{
+    int err = check_mount();
+    if (err)
+        return err;
+    err = delay_flush();
+    if (SFS->journal)
+        journal_sync();
+    flush_dirty(false);
+    return err;
+}
+
+/* Write back in the background once the oldest write is AGE_MS old or
+   once RATIO percent of the image is dirty; 0 leaves either out and
+   both 0 stop the flusher. */
+int set_flusher(int age_ms, int ratio)
+{
+    if (age_ms < 0 || ratio < 0 || ratio > 100)
+        return STATUS_SIZE_ERR;
+    SFS->flush_age_ms = age_ms;
+    SFS->flush_ratio = ratio;
+    if (FS != NULL)
+        flush_policy();
+    return STATUS_OK;
+}
+
+/* Let appends wait in memory for up to MAX_BLOCKS blocks per file, so
+   they are placed in one run, 0 to map blocks as they are written. */
+int set_delayed_alloc(int max_blocks)
+{
+    if (max_blocks < 0)
+        return STATUS_SIZE_ERR;
+    SFS->delay_blocks = max_blocks;
+    return STATUS_OK;
+}
+
+/* Let files of up to MAX_SIZE bytes share blocks from now on, 0 gives every
+   new one blocks of its own.  Packed files stay packed. */
+int set_tail_packing(int max_size)
+{
+    if (max_size < 0)
+        return STATUS_SIZE_ERR;
+    SFS->pack_size = max_size;
     return STATUS_OK;
 }
 
@@ -848,142 +1844,108 @@ int is_mount()
 
 int remove_dir(char *path_arg)
 {
-    char *path = abs_path(path_arg);
-    descr_struct *dir = lookup_full(path);
-    if (dir == NULL)
-    {
-        free(path);
+    lock_ns(true);
+    int err = remove_empty_dir(path_arg);
+    unlock_ns();
+    return err;
+}
+
+int remove_empty_dir(char *path_arg)
+{
+    path_struct walk;
+    int err = walk_path(path_arg, false, &walk);
+    if (err)
+        return err;
+    descr_struct *dir = walk.target;
+    if (dir == NULL || walk.parent == NULL)
         return STATUS_NOT_FOUND;
-    }
     if (dir->type != DIR_TYPE)
-    {
-        free(path);
         return STATUS_NOT_DIR;
-    }
-    char *name = get_filename(path);
-    char *dir_path = get_dir_path(path);
-    descr_struct *parent_dir = lookup_full(dir_path);
-    free(dir_path);
-    if (parent_dir == NULL)
-    {
-        free(path);
-        return STATUS_NOT_FOUND;
-    }
-    if (dir->size > 2 * sizeof(file_struct))
-    {
-        free(path);
+    if (dir_files_num(dir) > 2)
         return STATUS_NOT_EMPTY;
-    }
-    int err = rm_from_dir(parent_dir, name);
-    free(path);
+    err = rm_from_dir(walk.parent, walk.name);
     if (err)
         return err;
+    journal_dirty(dir, DESCR_SIZE);
     dir->links_num--;
     if (dir->links_num == 0)
         return rm_descr(dir);
     return STATUS_OK;
 }
 
-char *pack_path(char *path)
-{
-    if (strcmp(path, "/") == 0)
-    {
-        char *packed = malloc(2);
-        strcpy(packed, "/");
-        return packed;
-    }
-    char *name = get_filename(path);
-    char *dir_path = get_dir_path(path);
-    char *packed_dir = pack_path(dir_path);
-    free(dir_path);
-    if (strcmp(name, ".") == 0)
-    {
-        return packed_dir;
-    }
-    if (strcmp(name, "..") == 0)
-    {
-        char *dir_path = get_dir_path(packed_dir);
-        free(packed_dir);
-        return dir_path;
-    }
-    char *packed = malloc(strlen(path));
-    strcpy(packed, "");
-    strcat(packed, packed_dir);
-    if (strcmp(packed_dir, "/") != 0)
-        strcat(packed, "/");
-    strcat(packed, name);
-    free(packed_dir);
-    return packed;
-}
-
 char *abs_path(char *path_arg)
 {
     char *path = malloc(MAX_PATH_SIZE);
-    strcpy(path, path_arg);
-    // strip trailing slash
-    int path_len = strlen(path);
-    while(path_len > 1 && path[path_len - 1] == '/')
-    {
-        path[path_len - 1] = '\0';
-        path_len--;
-    }
-    char *a_path = malloc(MAX_PATH_SIZE);
-    if (path[0] == '/')
+    lock_ns(false);
+    int err = normalize_path(path_arg, path);
+    unlock_ns();
+    if (err)
     {
-        strcpy(a_path, path);
-    } else {
-        strcpy(a_path, WORK_DIR);
-        if (strcmp(WORK_DIR, "/") != 0)
-            strcat(a_path, "/");
-        strcat(a_path, path);
+        free(path);
+        return NULL;
     }
-    free(path);
-
-    char *packed = pack_path(a_path);
-    free(a_path);
-    return packed;
+    return path;
 }
 
 int mksymlink(char *from_arg, char *to_arg)
 {
-    char *from = abs_path(from_arg);
-    if (lookup_full(from) == NULL)
-    {
-        free(from);
+    lock_ns(true);
+    int err = make_symlink(from_arg, to_arg);
+    unlock_ns();
+    return err;
+}
+
+/* An absolute target is stored normalized, a relative one as written:
+   it is resolved from the directory of the link, wherever that is. */
+int make_symlink(char *from_arg, char *to_arg)
+{
+    char from[MAX_PATH_SIZE];
+    int err = STATUS_OK;
+    if (from_arg[0] == '/')
+        err = normalize_path(from_arg, from);
+    else if (strlen(from_arg) < MAX_PATH_SIZE)
+        strcpy(from, from_arg);
+    else
+        err = STATUS_NAME_TOO_LONG;
+    if (err)
+        return err;
+    path_struct walk;
+    err = walk_target(to_arg, from, &walk);
+    if (err)
+        return err;
+    if (walk.target == NULL)
         return STATUS_NOT_FOUND;
-    }
-    char *to = abs_path(to_arg);
-    int err = create(to, LINK_TYPE);
+    descr_struct *link;
+    err = create(to_arg, LINK_TYPE, &link);
     if (err)
-    {
-        free(to);
         return err;
-    }
-    descr_struct *link = lookup_link(to);
-    int fid = create_fid(link);
-    err = write_file(fid, 0, strlen(from), from);
-    rm_fid(fid);
-    free(to);
-    free(from);
-    return err;
+    return write_descr(link, 0, strlen(from), from);
 }
 
 int get_file_size(char *path_arg)
 {
-    char *path = abs_path(path_arg);
-    descr_struct *file = lookup_full(path);
-    free(path);
-    if (file == NULL)
+    int64_t size = get_file_size64(path_arg);
+    return size < INT32_MAX ? size : INT32_MAX;
+}
+
+int64_t get_file_size64(char *path_arg)
+{
+    descr_struct *file;
+    if (lock_path(path_arg, false, &file))
         return -1;
-    return file->size;
+    int64_t size = file_size(file);
+    unlock_file(file);
+    return size;
 }
 
-char *read_symlink(descr_struct *link)
+int get_file_fragments(char *path_arg)
 {
-    int fid = create_fid(link);
-    char *data = malloc(link->size + 1);
-    read_file(fid, 0, link->size, data);
-    data[link->size] = '\0';
-    rm_fid(fid);
-    return data;
+    descr_struct *file;
+    if (lock_path(path_arg, false, &file))
+        return -1;
+    int fragments = -1;
+    if (file->type == FILE_TYPE || file->type == LINK_TYPE)
+        fragments = map_fragments(file);
+    unlock_file(file);
+    return fragments;
 }
@@ -0,0 +1,800 @@
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/journal.h"
+
+/*
+ * Free-space allocator.
+ *
+ * The on-disk MASK keeps one bit per block (bit NUM % 8 of byte NUM / 8),
+ * which read as little-endian 64-bit words gives bit NUM % 64 of word
+ * NUM / 64.
+ *
+ * In memory the bitmap is split into allocation groups, like ext2 block
+ * groups but without anything on disk: a group is a slice of GROUP_WORDS
+ * bitmap words with its own lock, free counter and hierarchy of summary
+ * levels.  Bit W of level 0 is set while word W of the slice still has a
+ * free block, and bit I of level L + 1 is set while word I of level L is
+ * non-zero, so finding a free block takes one ctz per level regardless of
+ * how full the group is.
+ *
+ * find_run() and alloc_blocks() look for runs of adjacent blocks: they
+ * go over the free runs from a goal block on, group after group, the
+ * first one long enough wins, otherwise the longest of the first
+ * ALLOC_SCAN_RUNS does.  A run never crosses a group.  Without a goal a
+ * thread starts in a group of its own, so writers mostly take different
+ * locks.  New directories go to the emptiest group (alloc_dir_goal()),
+ * and files are wanted next to their directory.
+ *
+ * Single blocks without a goal come from small per-thread pools, which
+ * take POOL_BLOCKS free blocks of a group at once and hand them out
+ * without the group lock.  A pooled block is marked in the in-memory
+ * RESERVED bitmap only, never on disk, and leftovers go back to the group
+ * when the image is about to run out of space.  Bitmap words are changed
+ * with atomic operations since a pool and the group lock holder may share
+ * a word.
+ *
+ * Delayed writes (see delay.c) promise themselves blocks with
+ * alloc_reserve() before they get any, so they fail as soon as the image
+ * can't hold them rather than when they are placed.  Promised blocks stay
+ * free in the bitmap but are nobody else's: alloc_free_blocks() leaves
+ * them out, and an allocation that finds it took some of them gives them
+ * back, unless the thread is placing the write they were promised to
+ * (alloc_spend_promise()).  A promise counts before its check and a
+ * taken block before the allocator looks at the promises, so one of two
+ * racing threads always sees the other.
+ */
+
+#define WORD_BITS 64
+#define MAX_LEVELS 8
+#define FULL_WORD (~(uint64_t) 0)
+#define ALLOC_SCAN_RUNS 32
+#define SEARCH_TRIES 4
+#define MIN_GROUPS 16
+#define MIN_GROUP_WORDS 64
+#define POOLS_NUM 64
+#define POOL_BLOCKS 32
+
+#define MASK_WORDS ((uint64_t *) (MASK))
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t *levels[MAX_LEVELS];
+    int level_words[MAX_LEVELS];
+    int levels_num;
+    // bitmap words [first_word, first_word + words_num)
+    int first_word;
+    int words_num;
+    // word of the group where the next search without a goal starts
+    int hint;
+    int free_num;
+} alloc_group;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int blocks[POOL_BLOCKS];
+    int blocks_num;
+    // blocks before this one were handed out already
+    int taken;
+} alloc_pool;
+
+typedef struct alloc_state {
+    alloc_group *groups;
+    int groups_num;
+    int group_words;
+    // bitmap words covering FS_BLOCKS
+    int words_num;
+    // blocks sitting in pools, busy for everybody else
+    uint64_t *reserved;
+    alloc_pool pools[POOLS_NUM];
+    // blocks in pools not handed out yet, still free as far as callers go
+    int pooled;
+    // group the last directory went to
+    int dir_group;
+    // blocks promised to delayed writes, free on disk until they are placed
+    int promised;
+} alloc_state;
+
+// NULL until alloc_init(), mkfs marks blocks before that
+#define ALLOC (SFS->alloc)
+#define GROUPS (ALLOC->groups)
+#define GROUPS_NUM (ALLOC->groups_num)
+#define GROUP_WORDS (ALLOC->group_words)
+#define WORDS_NUM (ALLOC->words_num)
+#define RESERVED (ALLOC->reserved)
+#define POOLS (ALLOC->pools)
+
+#define GROUP_OF(num) (GROUPS + (num) / WORD_BITS / GROUP_WORDS)
+#define GROUP_START(group) ((group)->first_word * WORD_BITS)
+#define GROUP_END(group) ((group)->first_word * WORD_BITS + (group)->words_num * WORD_BITS)
+
+/* Forward declarations. */
+void summary_set(alloc_group *group, int word);
+void summary_clear(alloc_group *group, int word);
+int search(int goal, int want, int *start, bool take);
+int search_groups(int goal, int want, int *start, bool take);
+int take_range(alloc_group *group, int start, int want);
+void clear_range(alloc_group *group, int start, int count);
+bool drain_pools();
+
+// threads are numbered as they first allocate, to spread them over groups
+int THREADS_SEEN = 0;
+__thread int THREAD_SLOT = -1;
+// promised blocks the thread may take, while it places a delayed write
+__thread int PROMISE_SPENDING = 0;
+
+
+int thread_slot()
+{
+    if (THREAD_SLOT == -1)
+        THREAD_SLOT = __atomic_fetch_add(&THREADS_SEEN, 1, __ATOMIC_RELAXED);
+    return THREAD_SLOT;
+}
+
+uint64_t get_word(int w)
+{
+    uint64_t word = le64toh(__atomic_load_n(MASK_WORDS + w, __ATOMIC_RELAXED));
+    if (ALLOC)
+        word |= __atomic_load_n(RESERVED + w, __ATOMIC_RELAXED);
+    // blocks past the end of the image never count as free
+    if (w == (FS_BLOCKS - 1) / WORD_BITS && FS_BLOCKS % WORD_BITS)
+        word |= FULL_WORD << (FS_BLOCKS % WORD_BITS);
+    return word;
+}
+
+void set_bits(int w, uint64_t bits)
+{
+    journal_dirty(MASK_WORDS + w, sizeof(uint64_t));
+    __atomic_fetch_or(MASK_WORDS + w, htole64(bits), __ATOMIC_RELAXED);
+}
+
+void clear_bits(int w, uint64_t bits)
+{
+    journal_dirty(MASK_WORDS + w, sizeof(uint64_t));
+    __atomic_fetch_and(MASK_WORDS + w, htole64(~bits), __ATOMIC_RELAXED);
+}
+
+/* Bits of word W for blocks [START, END), both within the word or past it. */
+uint64_t word_bits(int w, int start, int end)
+{
+    int from = start - w * WORD_BITS;
+    int to = end - w * WORD_BITS;
+    uint64_t bits = FULL_WORD << from;
+    if (to < WORD_BITS)
+        bits &= ~(FULL_WORD << to);
+    return bits;
+}
+
+// others read free counters without the group lock
+void add_free(alloc_group *group, int num)
+{
+    __atomic_store_n(&group->free_num, group->free_num + num, __ATOMIC_RELAXED);
+}
+
+int group_free(alloc_group *group)
+{
+    return __atomic_load_n(&group->free_num, __ATOMIC_RELAXED);
+}
+
+int group_init(alloc_group *group, int first_word, int words_num)
+{
+    pthread_mutex_init(&group->lock, NULL);
+    group->first_word = first_word;
+    group->words_num = words_num;
+    int bits = words_num;
+    do {
+        int words = (bits + WORD_BITS - 1) / WORD_BITS;
+        group->levels[group->levels_num] = calloc(words, sizeof(uint64_t));
+        if (group->levels[group->levels_num] == NULL)
+            return STATUS_ERR;
+        group->level_words[group->levels_num] = words;
+        group->levels_num++;
+        bits = words;
+    } while (bits > 1 && group->levels_num < MAX_LEVELS);
+
+    for (int w = 0; w < words_num; ++w)
+    {
+        uint64_t word = get_word(first_word + w);
+        group->free_num += __builtin_popcountll(~word);
+        if (word != FULL_WORD)
+            summary_set(group, w);
+    }
+    return STATUS_OK;
+}
+
+int alloc_init()
+{
+    alloc_release();
+    ALLOC = calloc(1, sizeof(alloc_state));
+    if (ALLOC == NULL)
+        return STATUS_ERR;
+    WORDS_NUM = (FS_BLOCKS + WORD_BITS - 1) / WORD_BITS;
+    RESERVED = calloc(WORDS_NUM, sizeof(uint64_t));
+    for (int i = 0; i < POOLS_NUM; ++i)
+        pthread_mutex_init(&POOLS[i].lock, NULL);
+
+    // one bitmap block per group like ext2, but small images still get
+    // enough groups for writers to spread over
+    GROUP_WORDS = BLOCK_SIZE / sizeof(uint64_t);
+    while (GROUP_WORDS > MIN_GROUP_WORDS && WORDS_NUM / GROUP_WORDS < MIN_GROUPS)
+        GROUP_WORDS /= 2;
+    GROUPS_NUM = (WORDS_NUM + GROUP_WORDS - 1) / GROUP_WORDS;
+    GROUPS = calloc(GROUPS_NUM, sizeof(alloc_group));
+    if (RESERVED == NULL || GROUPS == NULL)
+    {
+        alloc_release();
+        return STATUS_ERR;
+    }
+    for (int g = 0; g < GROUPS_NUM; ++g)
+    {
+        int first_word = g * GROUP_WORDS;
+        int words_num = WORDS_NUM - first_word < GROUP_WORDS ? WORDS_NUM - first_word : GROUP_WORDS;
+        if (group_init(GROUPS + g, first_word, words_num))
+        {
+            alloc_release();
+            return STATUS_ERR;
+        }
+    }
+    return STATUS_OK;
+}
+
+/* Pooled blocks were never marked on disk, dropping the pools frees them. */
+void alloc_release()
+{
+    if (ALLOC == NULL)
+        return;
+    for (int g = 0; GROUPS && g < GROUPS_NUM; ++g)
+    {
+        for (int i = 0; i < GROUPS[g].levels_num; ++i)
+            free(GROUPS[g].levels[i]);
+        pthread_mutex_destroy(&GROUPS[g].lock);
+    }
+    for (int i = 0; i < POOLS_NUM; ++i)
+        pthread_mutex_destroy(&POOLS[i].lock);
+    free(GROUPS);
+    free(RESERVED);
+    free(ALLOC);
+    ALLOC = NULL;
+}
+
+/* Free blocks in the bitmap, promised ones included. */
+int free_total()
+{
+    int free_num = __atomic_load_n(&ALLOC->pooled, __ATOMIC_RELAXED);
+    for (int g = 0; g < GROUPS_NUM; ++g)
+        free_num += group_free(GROUPS + g);
+    return free_num;
+}
+
+/* Blocks that can still be allocated or promised. */
+int alloc_free_blocks()
+{
+    if (ALLOC == NULL)
+        return 0;
+    int free_num = free_total() - __atomic_load_n(&ALLOC->promised, __ATOMIC_RELAXED);
+    return free_num > 0 ? free_num : 0;
+}
+
+/* Promise NUM blocks to a delayed write, false if fewer are left. */
+bool alloc_reserve(int num)
+{
+    if (ALLOC == NULL)
+        return false;
+    int promised = __atomic_add_fetch(&ALLOC->promised, num, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (free_total() >= promised)
+        return true;
+    alloc_unreserve(num);
+    return false;
+}
+
+void alloc_unreserve(int num)
+{
+    __atomic_fetch_sub(&ALLOC->promised, num, __ATOMIC_RELAXED);
+}
+
+/* Let the thread take up to NUM promised blocks while it places the
+   delayed write they were promised to, 0 when it is done. */
+void alloc_spend_promise(int num)
+{
+    PROMISE_SPENDING = num;
+}
+
+/* RUN blocks from START were just taken, give back the end of them if
+   they were promised to somebody else.  Return how many are kept. */
+int keep_promises(int start, int run)
+{
+    if (run == 0)
+        return 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int promised = __atomic_load_n(&ALLOC->promised, __ATOMIC_RELAXED) - PROMISE_SPENDING;
+    if (promised <= 0)
+        return run;
+    int over = promised - free_total();
+    if (over <= 0)
+        return run;
+    if (over > run)
+        over = run;
+    free_range(start + run - over, over);
+    return run - over;
+}
+
+void summary_set(alloc_group *group, int word)
+{
+    for (int l = 0; l < group->levels_num; ++l)
+    {
+        uint64_t *w = group->levels[l] + word / WORD_BITS;
+        uint64_t old = *w;
+        *w |= (uint64_t) 1 << (word % WORD_BITS);
+        // upper levels already know this word is not empty
+        if (old != 0)
+            break;
+        word /= WORD_BITS;
+    }
+}
+
+void summary_clear(alloc_group *group, int word)
+{
+    for (int l = 0; l < group->levels_num; ++l)
+    {
+        uint64_t *w = group->levels[l] + word / WORD_BITS;
+        *w &= ~((uint64_t) 1 << (word % WORD_BITS));
+        if (*w != 0)
+            break;
+        word /= WORD_BITS;
+    }
+}
+
+/* Return the first set bit at or after POS on summary level LEVEL of
+   GROUP, or -1 if there is none. */
+int level_next(alloc_group *group, int level, int pos)
+{
+    uint64_t *words = group->levels[level];
+    int w = pos / WORD_BITS;
+    if (w >= group->level_words[level])
+        return -1;
+    uint64_t bits = words[w] & (FULL_WORD << (pos % WORD_BITS));
+    if (bits)
+        return w * WORD_BITS + __builtin_ctzll(bits);
+
+    if (level + 1 == group->levels_num)
+    {
+        for (++w; w < group->level_words[level]; ++w)
+        {
+            if (words[w])
+                return w * WORD_BITS + __builtin_ctzll(words[w]);
+        }
+        return -1;
+    }
+    w = level_next(group, level + 1, w + 1);
+    if (w == -1)
+        return -1;
+    return w * WORD_BITS + __builtin_ctzll(words[w]);
+}
+
+/* First free block of GROUP at or after NUM, -1 if there is none. */
+int next_free(alloc_group *group, int num)
+{
+    if (num >= GROUP_END(group) || num >= FS_BLOCKS)
+        return -1;
+    int w = num / WORD_BITS;
+    uint64_t free_bits = ~get_word(w) & (FULL_WORD << (num % WORD_BITS));
+    if (free_bits)
+        return w * WORD_BITS + __builtin_ctzll(free_bits);
+    w = level_next(group, 0, w + 1 - group->first_word);
+    if (w == -1)
+        return -1;
+    w += group->first_word;
+    return w * WORD_BITS + __builtin_ctzll(~get_word(w));
+}
+
+/* Number of free blocks from NUM on, at most MAX. */
+int free_run(int num, int max)
+{
+    int run = 0;
+    while (run < max && num + run < FS_BLOCKS)
+    {
+        int bit = (num + run) % WORD_BITS;
+        uint64_t busy = get_word((num + run) / WORD_BITS) >> bit;
+        int len = busy ? __builtin_ctzll(busy) : WORD_BITS - bit;
+        run += len;
+        if (busy)
+            break;
+    }
+    return run < max ? run : max;
+}
+
+/* Mark [START, START + COUNT) of GROUP busy on disk. */
+void mask_range(alloc_group *group, int start, int count)
+{
+    int end = start + count;
+    while (start < end)
+    {
+        int w = start / WORD_BITS;
+        uint64_t bits = word_bits(w, start, end);
+        add_free(group, -__builtin_popcountll(~get_word(w) & bits));
+        set_bits(w, bits);
+        if (get_word(w) == FULL_WORD)
+            summary_clear(group, w - group->first_word);
+        group->hint = w - group->first_word;
+        start = (w + 1) * WORD_BITS;
+    }
+}
+
+void clear_range(alloc_group *group, int start, int count)
+{
+    int end = start + count;
+    while (start < end)
+    {
+        int w = start / WORD_BITS;
+        uint64_t bits = word_bits(w, start, end);
+        if (group)
+        {
+            uint64_t word = le64toh(__atomic_load_n(MASK_WORDS + w, __ATOMIC_RELAXED));
+            add_free(group, __builtin_popcountll(word & bits));
+        }
+        clear_bits(w, bits);
+        if (group && get_word(w) != FULL_WORD)
+            summary_set(group, w - group->first_word);
+        start = (w + 1) * WORD_BITS;
+    }
+}
+
+void mask_block(int num)
+{
+    if (ALLOC == NULL || num >= FS_BLOCKS)
+    {
+        set_bits(num / WORD_BITS, (uint64_t) 1 << (num % WORD_BITS));
+        return;
+    }
+    alloc_group *group = GROUP_OF(num);
+    pthread_mutex_lock(&group->lock);
+    mask_range(group, num, 1);
+    pthread_mutex_unlock(&group->lock);
+}
+
+void umask_block(int num)
+{
+    free_range(num, 1);
+}
+
+/* Mark COUNT blocks from START busy, whole bytes of the mask at once.
+   Only for mkfs, before alloc_init() and without the journal. */
+void mask_blocks(int64_t start, int64_t count)
+{
+    int64_t end = start + count;
+    for (; start < end && start % 8; ++start)
+        MASK[start / 8] |= 1 << (start % 8);
+    if (end - start >= 8)
+    {
+        memset(MASK + start / 8, 0xff, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    for (; start < end; ++start)
+        MASK[start / 8] |= 1 << (start % 8);
+}
+
+bool check_block(int num)
+{
+    int i = num / 8;
+    return __atomic_load_n(MASK + i, __ATOMIC_RELAXED) & (1 << (num % 8));
+}
+
+/* Look at the free runs of GROUP from FROM up to TO for one of WANT
+   blocks, keep the longest in *BEST and *BEST_LEN.  At most *BUDGET runs
+   are looked at, and the budget goes down by that many.  Return true
+   once WANT was found. */
+bool scan_runs(alloc_group *group, int from, int to, int want, int *budget, int *best, int *best_len)
+{
+    int num = next_free(group, from);
+    while (*budget > 0 && num != -1 && num < to)
+    {
+        int len = free_run(num, want < GROUP_END(group) - num ? want : GROUP_END(group) - num);
+        if (len > *best_len)
+        {
+            *best = num;
+            *best_len = len;
+        }
+        (*budget)--;
+        if (len == want)
+            return true;
+        num = next_free(group, num + len);
+    }
+    return false;
+}
+
+/* Linear search for the first free block, for mkfs before alloc_init(). */
+int first_free()
+{
+    for (int i = 0; i < FS_BLOCKS; ++i)
+    {
+        if (!check_block(i))
+            return i;
+    }
+    return -1;
+}
+
+int find_block()
+{
+    int block_id;
+    if (ALLOC == NULL)
+        return first_free();
+    return search(-1, 1, &block_id, false) ? block_id : -1;
+}
+
+/* Find up to WANT adjacent free blocks as close after GOAL as possible,
+   -1 meaning no preference.  Return how many start at *START, 0 if the
+   image is full. */
+int find_run(int goal, int want, int *start)
+{
+    if (ALLOC == NULL)
+    {
+        *start = first_free();
+        return *start == -1 ? 0 : 1;
+    }
+    int run = search(goal, want, start, false);
+    if (run == 0 && drain_pools())
+        run = search(goal, want, start, false);
+    return run;
+}
+
+/* Look for a run of WANT blocks and with TAKE allocate it. */
+int search(int goal, int want, int *start, bool take)
+{
+    for (int i = 0; i < SEARCH_TRIES; ++i)
+    {
+        int run = search_groups(goal, want, start, take);
+        if (run != -1)
+            return run;
+    }
+    return 0;
+}
+
+/* Go over the groups from the one of GOAL on, or from the group of the
+   thread without a goal, and back to the start of the first one.  Return
+   -1 if the run found was gone by the time it was to be taken. */
+int search_groups(int goal, int want, int *start, bool take)
+{
+    alloc_group *first;
+    if (goal < 0 || goal >= FS_BLOCKS)
+    {
+        first = GROUPS + thread_slot() % GROUPS_NUM;
+        goal = -1;
+    } else {
+        first = GROUP_OF(goal);
+    }
+
+    int first_from = -1;
+    int budget = ALLOC_SCAN_RUNS;
+    int best = -1;
+    int best_len = 0;
+    for (int i = 0; i <= GROUPS_NUM && budget > 0; ++i)
+    {
+        alloc_group *group = GROUPS + (first - GROUPS + i) % GROUPS_NUM;
+        if (group_free(group) == 0)
+            continue;
+        pthread_mutex_lock(&group->lock);
+        int from = GROUP_START(group);
+        int to = GROUP_END(group);
+        if (i == 0)
+            from = first_from = goal != -1 ? goal : from + group->hint * WORD_BITS;
+        else if (i == GROUPS_NUM && first_from != -1)
+            to = first_from;
+        int run = 0;
+        if (scan_runs(group, from, to, want, &budget, &best, &best_len))
+        {
+            *start = best;
+            run = take ? take_range(group, best, best_len) : best_len;
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (run > 0)
+            return run;
+    }
+    if (best == -1)
+        return 0;
+    *start = best;
+    if (!take)
+        return best_len;
+
+    // the best run was in a group unlocked since, it may have shrunk
+    alloc_group *group = GROUP_OF(best);
+    pthread_mutex_lock(&group->lock);
+    int run = take_range(group, best, best_len);
+    pthread_mutex_unlock(&group->lock);
+    return run > 0 ? run : -1;
+}
+
+/* Allocate the free blocks from START on, at most WANT of them and not
+   past its group, and return how many there were. */
+int alloc_range(int start, int want)
+{
+    if (start < 0 || start >= FS_BLOCKS)
+        return 0;
+    if (ALLOC == NULL)
+    {
+        if (check_block(start))
+            return 0;
+        mask_block(start);
+        return 1;
+    }
+    alloc_group *group = GROUP_OF(start);
+    pthread_mutex_lock(&group->lock);
+    int run = take_range(group, start, want);
+    pthread_mutex_unlock(&group->lock);
+    return keep_promises(start, run);
+}
+
+int take_range(alloc_group *group, int start, int want)
+{
+    if (GROUP_END(group) - start < want)
+        want = GROUP_END(group) - start;
+    int run = free_run(start, want);
+    mask_range(group, start, run);
+    return run;
+}
+
+/* Take up to POOL_BLOCKS free blocks for POOL, from the group of the
+   thread or the next one with any. */
+void fill_pool(alloc_pool *pool)
+{
+    pool->blocks_num = pool->taken = 0;
+    for (int i = 0; i < GROUPS_NUM && pool->blocks_num == 0; ++i)
+    {
+        alloc_group *group = GROUPS + (thread_slot() + i) % GROUPS_NUM;
+        if (group_free(group) == 0)
+            continue;
+        pthread_mutex_lock(&group->lock);
+        int num = next_free(group, GROUP_START(group) + group->hint * WORD_BITS);
+        if (num == -1)
+            num = next_free(group, GROUP_START(group));
+        while (num != -1 && pool->blocks_num < POOL_BLOCKS)
+        {
+            int w = num / WORD_BITS;
+            __atomic_fetch_or(RESERVED + w, (uint64_t) 1 << (num % WORD_BITS), __ATOMIC_RELAXED);
+            if (get_word(w) == FULL_WORD)
+                summary_clear(group, w - group->first_word);
+            pool->blocks[pool->blocks_num++] = num;
+            num = next_free(group, num + 1);
+        }
+        add_free(group, -pool->blocks_num);
+        pthread_mutex_unlock(&group->lock);
+        __atomic_fetch_add(&ALLOC->pooled, pool->blocks_num, __ATOMIC_RELAXED);
+    }
+}
+
+/* Allocate a block from the pool of the thread, -1 if there is none. */
+int pool_block()
+{
+    alloc_pool *pool = POOLS + thread_slot() % POOLS_NUM;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->taken == pool->blocks_num)
+        fill_pool(pool);
+    int block_id = -1;
+    if (pool->taken < pool->blocks_num)
+    {
+        block_id = pool->blocks[pool->taken++];
+        // busy on disk before it stops being reserved, never free between
+        uint64_t bit = (uint64_t) 1 << (block_id % WORD_BITS);
+        set_bits(block_id / WORD_BITS, bit);
+        __atomic_fetch_and(RESERVED + block_id / WORD_BITS, ~bit, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&ALLOC->pooled, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return block_id;
+}
+
+/* Give the blocks left in every pool back to their groups, return
+   whether there were any. */
+bool drain_pools()
+{
+    bool drained = false;
+    for (int i = 0; i < POOLS_NUM; ++i)
+    {
+        alloc_pool *pool = POOLS + i;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->taken < pool->blocks_num)
+        {
+            // a pool takes all its blocks from one group
+            alloc_group *group = GROUP_OF(pool->blocks[pool->taken]);
+            pthread_mutex_lock(&group->lock);
+            for (int j = pool->taken; j < pool->blocks_num; ++j)
+            {
+                int w = pool->blocks[j] / WORD_BITS;
+                __atomic_fetch_and(RESERVED + w, ~((uint64_t) 1 << (pool->blocks[j] % WORD_BITS)), __ATOMIC_RELAXED);
+                summary_set(group, w - group->first_word);
+            }
+            add_free(group, pool->blocks_num - pool->taken);
+            pthread_mutex_unlock(&group->lock);
+            __atomic_fetch_sub(&ALLOC->pooled, pool->blocks_num - pool->taken, __ATOMIC_RELAXED);
+            drained = true;
+        }
+        pool->blocks_num = pool->taken = 0;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return drained;
+}
+
+/* Allocate up to WANT adjacent blocks as close after GOAL as possible. */
+int alloc_blocks(int goal, int want, int *start)
+{
+    if (ALLOC == NULL)
+    {
+        *start = first_free();
+        if (*start == -1)
+            return 0;
+        mask_block(*start);
+        return 1;
+    }
+    if (goal < 0 && want == 1)
+    {
+        *start = pool_block();
+        if (*start != -1)
+            return keep_promises(*start, 1);
+    }
+    int run = search(goal, want, start, true);
+    if (run == 0 && drain_pools())
+        run = search(goal, want, start, true);
+    return keep_promises(*start, run);
+}
+
+/* First block of the group a new directory should go to: the one with
+   the most free blocks, so directories spread out and keep room for their
+   files.  Ties go to the group after the last directory. */
+int alloc_dir_goal()
+{
+    if (ALLOC == NULL)
+        return -1;
+    int from = __atomic_load_n(&ALLOC->dir_group, __ATOMIC_RELAXED) + 1;
+    alloc_group *best = NULL;
+    for (int i = 0; i < GROUPS_NUM; ++i)
+    {
+        alloc_group *group = GROUPS + (from + i) % GROUPS_NUM;
+        if (best == NULL || group_free(group) > group_free(best))
+            best = group;
+    }
+    __atomic_store_n(&ALLOC->dir_group, (int) (best - GROUPS), __ATOMIC_RELAXED);
+    return GROUP_START(best);
+}
+
+void free_range(int start, int count)
+{
+    if (ALLOC == NULL)
+    {
+        clear_range(NULL, start, count);
+        return;
+    }
+    int end = start + count;
+    while (start < end)
+    {
+        alloc_group *group = GROUP_OF(start);
+        int to = GROUP_END(group) < end ? GROUP_END(group) : end;
+        pthread_mutex_lock(&group->lock);
+        clear_range(group, start, to - start);
+        pthread_mutex_unlock(&group->lock);
+        start = to;
+    }
+}
+
+void free_blocks(int *blocks, int count)
+{
+    int i = 0;
+    while (i < count)
+    {
+        // 0 is a hole
+        if (blocks[i] == 0)
+        {
+            i++;
+            continue;
+        }
+        // release runs of adjacent blocks with one call
+        int run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run)
+            run++;
+        free_range(blocks[i], run);
+        i += run;
+    }
+}
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/dir.h"
+#include "sfs/dcache.h"
+
+/*
+ * Dentry cache.
+ *
+ * Maps (directory descriptor id, filename) to the descriptor id found in
+ * that directory, or to NO_DESCR when the name is known to be missing.
+ * All entries are preallocated from the memory budget given to
+ * dcache_init(); when they run out one is reused in CLOCK order: entries
+ * are queued by insertion and a hit only sets the referenced flag, which
+ * buys the entry one more trip around the queue.  Hits thus never write
+ * shared state beyond that flag and lookups from many threads run in
+ * parallel under the read side of the cache lock.
+ * Directory code keeps the cache exact: add_to_dir() and rm_from_dir()
+ * update the entry for the name they touch and freeing a directory drops
+ * everything cached under its id.
+ *
+ * Resolved symlinks are cached next to the names: (link descriptor id,
+ * directory it was met in) maps to the descriptor its target led to and
+ * the links that took, in a table indexed by the link id.  A resolution
+ * only depends on names that existed, so adding names leaves it right;
+ * removing one, or a directory, forgets every link at once by moving to
+ * a new generation.
+ */
+
+typedef struct dentry {
+    int dir_id;
+    int descr_id;
+    char filename[FILENAME_SIZE];
+    struct dentry *hash_next;
+    struct dentry *lru_prev;
+    struct dentry *lru_next;
+    // hit since the clock hand last passed
+    bool referenced;
+} dentry;
+
+#define LINK_SLOTS 1024
+
+typedef struct {
+    int link_id;
+    int dir_id;
+    int target_id;
+    // links followed on the way, the link itself included
+    int hops;
+    // valid while it matches links_gen
+    uint32_t gen;
+} link_entry;
+
+typedef struct dcache_state {
+    dentry *dentries;
+    dentry **buckets;
+    int dentries_num;
+    int buckets_num;
+    int dentries_used;
+    // entries dropped by dcache_forget_dir(), chained through hash_next
+    dentry *free_dentries;
+    // newest entry, lru.lru_prev is the next one the clock hand looks at
+    dentry lru;
+    long hits;
+    long misses;
+    long evictions;
+    link_entry links[LINK_SLOTS];
+    uint32_t links_gen;
+    long link_hits;
+    long link_misses;
+    pthread_rwlock_t lock;
+} dcache_state;
+
+// NULL while the cache is off
+#define DCACHE (SFS->dcache)
+#define DENTRIES (DCACHE->dentries)
+#define BUCKETS (DCACHE->buckets)
+#define DENTRIES_NUM (DCACHE->dentries_num)
+#define BUCKETS_NUM (DCACHE->buckets_num)
+#define DENTRIES_USED (DCACHE->dentries_used)
+#define FREE_DENTRIES (DCACHE->free_dentries)
+#define LRU (DCACHE->lru)
+#define DCACHE_HITS (DCACHE->hits)
+#define DCACHE_MISSES (DCACHE->misses)
+#define DCACHE_EVICTIONS (DCACHE->evictions)
+
+
+int dcache_init(int size)
+{
+    dcache_release();
+
+    int entries_num = size / (sizeof(dentry) + sizeof(dentry *));
+    if (entries_num <= 0)
+        return STATUS_OK;
+    int buckets_num = 1;
+    while (buckets_num < entries_num)
+        buckets_num <<= 1;
+
+    DCACHE = calloc(1, sizeof(dcache_state));
+    if (DCACHE == NULL)
+        return STATUS_ERR;
+    pthread_rwlock_init(&DCACHE->lock, NULL);
+    DENTRIES = calloc(entries_num, sizeof(dentry));
+    BUCKETS = calloc(buckets_num, sizeof(dentry *));
+    if (DENTRIES == NULL || BUCKETS == NULL)
+    {
+        dcache_release();
+        return STATUS_ERR;
+    }
+    DENTRIES_NUM = entries_num;
+    BUCKETS_NUM = buckets_num;
+    LRU.lru_prev = LRU.lru_next = &LRU;
+    // the zeroed entries are of no generation
+    DCACHE->links_gen = 1;
+    return STATUS_OK;
+}
+
+void dcache_release()
+{
+    if (DCACHE == NULL)
+        return;
+    free(DENTRIES);
+    free(BUCKETS);
+    pthread_rwlock_destroy(&DCACHE->lock);
+    free(DCACHE);
+    DCACHE = NULL;
+}
+
+dentry **bucket_of(int dir_id, char *filename)
+{
+    uint32_t hash = name_hash(filename) ^ ((uint32_t) dir_id * 2654435761u);
+    return BUCKETS + (hash & (BUCKETS_NUM - 1));
+}
+
+void lru_unlink(dentry *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+void lru_push(dentry *entry)
+{
+    entry->lru_prev = &LRU;
+    entry->lru_next = LRU.lru_next;
+    LRU.lru_next->lru_prev = entry;
+    LRU.lru_next = entry;
+}
+
+void hash_unlink(dentry *entry)
+{
+    dentry **link = bucket_of(entry->dir_id, entry->filename);
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+}
+
+dentry *dcache_find(int dir_id, char *filename)
+{
+    dentry *entry = *bucket_of(dir_id, filename);
+    for (; entry; entry = entry->hash_next)
+    {
+        if (entry->dir_id == dir_id && strcmp(entry->filename, filename) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Statistics only: concurrent hits may get lost, but nobody waits for a
+   locked add. */
+void count(long *counter)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+bool dcache_get(int dir_id, char *filename, int *descr_id)
+{
+    if (DCACHE == NULL)
+        return false;
+    pthread_rwlock_rdlock(&DCACHE->lock);
+    dentry *entry = dcache_find(dir_id, filename);
+    if (entry == NULL)
+    {
+        count(&DCACHE_MISSES);
+    } else {
+        count(&DCACHE_HITS);
+        // hot entries are referenced already, keep their line clean
+        if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&entry->referenced, true, __ATOMIC_RELAXED);
+        *descr_id = entry->descr_id;
+    }
+    pthread_rwlock_unlock(&DCACHE->lock);
+    return entry != NULL;
+}
+
+/* Take the entry under the clock hand, giving referenced ones another
+   round. */
+dentry *evict()
+{
+    dentry *entry = LRU.lru_prev;
+    while (entry->referenced)
+    {
+        entry->referenced = false;
+        lru_unlink(entry);
+        lru_push(entry);
+        entry = LRU.lru_prev;
+    }
+    lru_unlink(entry);
+    hash_unlink(entry);
+    DCACHE_EVICTIONS++;
+    return entry;
+}
+
+void dcache_put(int dir_id, char *filename, int descr_id)
+{
+    if (DCACHE == NULL || strlen(filename) >= FILENAME_SIZE)
+        return;
+    pthread_rwlock_wrlock(&DCACHE->lock);
+    dentry *entry = dcache_find(dir_id, filename);
+    if (entry)
+    {
+        entry->descr_id = descr_id;
+        entry->referenced = true;
+        pthread_rwlock_unlock(&DCACHE->lock);
+        return;
+    }
+
+    if (FREE_DENTRIES)
+    {
+        entry = FREE_DENTRIES;
+        FREE_DENTRIES = entry->hash_next;
+    } else if (DENTRIES_USED < DENTRIES_NUM) {
+        entry = DENTRIES + DENTRIES_USED++;
+    } else {
+        entry = evict();
+    }
+    entry->dir_id = dir_id;
+    entry->descr_id = descr_id;
+    entry->referenced = false;
+    strcpy(entry->filename, filename);
+    dentry **bucket = bucket_of(dir_id, filename);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push(entry);
+    pthread_rwlock_unlock(&DCACHE->lock);
+}
+
+void dcache_forget_dir(int dir_id)
+{
+    if (DCACHE == NULL)
+        return;
+    pthread_rwlock_wrlock(&DCACHE->lock);
+    DCACHE->links_gen++;
+    dentry *entry = LRU.lru_next;
+    while (entry != &LRU)
+    {
+        dentry *next = entry->lru_next;
+        if (entry->dir_id == dir_id)
+        {
+            lru_unlink(entry);
+            hash_unlink(entry);
+            entry->hash_next = FREE_DENTRIES;
+            FREE_DENTRIES = entry;
+        }
+        entry = next;
+    }
+    pthread_rwlock_unlock(&DCACHE->lock);
+}
+
+/* Did the symlink LINK_ID met in directory DIR_ID lead to *TARGET_ID
+   through *HOPS links last time? */
+bool dcache_get_link(int link_id, int dir_id, int *target_id, int *hops)
+{
+    if (DCACHE == NULL)
+        return false;
+    pthread_rwlock_rdlock(&DCACHE->lock);
+    link_entry *entry = DCACHE->links + link_id % LINK_SLOTS;
+    bool hit = entry->link_id == link_id && entry->dir_id == dir_id && entry->gen == DCACHE->links_gen;
+    if (hit)
+    {
+        *target_id = entry->target_id;
+        *hops = entry->hops;
+    }
+    count(hit ? &DCACHE->link_hits : &DCACHE->link_misses);
+    pthread_rwlock_unlock(&DCACHE->lock);
+    return hit;
+}
+
+void dcache_put_link(int link_id, int dir_id, int target_id, int hops)
+{
+    if (DCACHE == NULL)
+        return;
+    pthread_rwlock_wrlock(&DCACHE->lock);
+    link_entry *entry = DCACHE->links + link_id % LINK_SLOTS;
+    entry->link_id = link_id;
+    entry->dir_id = dir_id;
+    entry->target_id = target_id;
+    entry->hops = hops;
+    entry->gen = DCACHE->links_gen;
+    pthread_rwlock_unlock(&DCACHE->lock);
+}
+
+/* Forget every resolved symlink, something they went through may be
+   gone. */
+void dcache_forget_links()
+{
+    if (DCACHE == NULL)
+        return;
+    pthread_rwlock_wrlock(&DCACHE->lock);
+    DCACHE->links_gen++;
+    pthread_rwlock_unlock(&DCACHE->lock);
+}
+
+void dcache_dump_stats()
+{
+    if (DCACHE == NULL)
+    {
+        printf("dcache: off\n");
+        return;
+    }
+    pthread_rwlock_rdlock(&DCACHE->lock);
+    int free_num = 0;
+    for (dentry *entry = FREE_DENTRIES; entry; entry = entry->hash_next)
+        free_num++;
+    printf("dcache entries: %d/%d\n", DENTRIES_USED - free_num, DENTRIES_NUM);
+    printf("dcache hits: %ld\n", DCACHE_HITS);
+    printf("dcache misses: %ld\n", DCACHE_MISSES);
+    printf("dcache evictions: %ld\n", DCACHE_EVICTIONS);
+    printf("symlink cache: %ld hits, %ld misses\n", DCACHE->link_hits, DCACHE->link_misses);
+    pthread_rwlock_unlock(&DCACHE->lock);
+}
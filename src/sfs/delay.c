@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/map.h"
+#include "sfs/flush.h"
+#include "sfs/delay.h"
+
+/*
+ * Delayed allocation.
+ *
+ * An append that needs new blocks doesn't map them.  The file gets a
+ * tail in memory instead: the bytes from its first unmapped block on,
+ * with blocks promised by the allocator, for the data and for the map
+ * that will point to it, so the write fails right away when the image
+ * can't hold it and placing it later can't.  Reads and writes find the
+ * tail through file_span(), and file_size() is the size with the tail
+ * while the descriptor keeps the size of what is mapped, so a crash
+ * loses the tail and nothing else.
+ *
+ * The tail is placed, mapped in one go and copied into the image, when
+ * the file is closed, on sync_image() and by the flusher, at umount, and
+ * when it grows past DELAY_BLOCKS blocks or all tails together past
+ * DELAY_MAX_MEMORY.  By then the allocator sees the whole tail at once,
+ * so a file appended a little at a time by several writers still ends up
+ * in one run.  Truncating a file or pinning its tail with read_iov()
+ * places it first.
+ *
+ * A tail is guarded by the lock of its file.  The table of tails has a
+ * lock of its own, a leaf, so tails of different files come and go in
+ * parallel.
+ */
+
+#define DELAY_SLOTS 256
+
+typedef struct delay_tail {
+    int descr_id;
+    // the buffered bytes start at this logical block, the first unmapped one
+    int first_block;
+    // of the whole file, tail included
+    int64_t size;
+    // blocks promised by the allocator, map blocks included, and room in data
+    int reserved;
+    int capacity;
+    char *data;
+    struct delay_tail *next;
+} delay_tail;
+
+typedef struct delay_state {
+    delay_tail *slots[DELAY_SLOTS];
+    pthread_mutex_t lock;
+    int tails_num;
+    // bytes of all tails
+    int64_t memory;
+    int placed;
+    int64_t placed_blocks;
+} delay_state;
+
+#define DELAY (SFS->delay)
+
+/* Forward declarations. */
+delay_tail *find_tail(int descr_id);
+void remove_tail(delay_tail *tail);
+int place_tail(descr_struct *file, delay_tail *tail);
+int place_all();
+
+
+int delay_init()
+{
+    delay_state *delay = calloc(1, sizeof(delay_state));
+    if (delay == NULL)
+        return STATUS_NO_SPACE_LEFT;
+    pthread_mutex_init(&delay->lock, NULL);
+    DELAY = delay;
+    return STATUS_OK;
+}
+
+/* Place every tail, with nothing else running on the instance.  The
+   tails stay if any can't be placed, written data is never dropped. */
+int delay_release()
+{
+    delay_state *delay = DELAY;
+    if (delay == NULL)
+        return STATUS_OK;
+    int err = place_all();
+    if (err)
+        return err;
+    for (int i = 0; i < DELAY_SLOTS; ++i)
+    {
+        while (delay->slots[i])
+        {
+            delay_tail *tail = delay->slots[i];
+            remove_tail(tail);
+            alloc_unreserve(tail->reserved);
+            free(tail->data);
+            free(tail);
+        }
+    }
+    pthread_mutex_destroy(&delay->lock);
+    free(delay);
+    DELAY = NULL;
+    return STATUS_OK;
+}
+
+delay_tail *find_tail(int descr_id)
+{
+    delay_state *delay = DELAY;
+    // the tail of a file is made under its lock, which the caller holds
+    if (delay == NULL || __atomic_load_n(&delay->tails_num, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    pthread_mutex_lock(&delay->lock);
+    delay_tail *tail = delay->slots[descr_id % DELAY_SLOTS];
+    while (tail && tail->descr_id != descr_id)
+        tail = tail->next;
+    pthread_mutex_unlock(&delay->lock);
+    return tail;
+}
+
+void add_tail(delay_tail *tail)
+{
+    delay_state *delay = DELAY;
+    pthread_mutex_lock(&delay->lock);
+    delay_tail **slot = delay->slots + tail->descr_id % DELAY_SLOTS;
+    tail->next = *slot;
+    *slot = tail;
+    __atomic_add_fetch(&delay->tails_num, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&delay->lock);
+}
+
+void remove_tail(delay_tail *tail)
+{
+    delay_state *delay = DELAY;
+    pthread_mutex_lock(&delay->lock);
+    delay_tail **slot = delay->slots + tail->descr_id % DELAY_SLOTS;
+    while (*slot != tail)
+        slot = &(*slot)->next;
+    *slot = tail->next;
+    __atomic_sub_fetch(&delay->tails_num, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&delay->memory, (int64_t) tail->capacity * BLOCK_SIZE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&delay->lock);
+}
+
+/* Can the growth of FILE to NEW_SIZE wait for its blocks? */
+bool delay_fits(descr_struct *file, int64_t new_size)
+{
+    delay_state *delay = DELAY;
+    if (delay == NULL || SFS->delay_blocks == 0)
+        return false;
+    delay_tail *tail = find_tail(file->id);
+    int first = tail ? tail->first_block : BLOCKS_NUM(file);
+    int64_t blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+    // growing within the last block maps nothing anyway
+    if ((tail == NULL && blocks <= 0) || blocks > SFS->delay_blocks)
+        return false;
+    int64_t more = blocks - (tail ? tail->capacity : 0);
+    return more <= 0
+        || __atomic_load_n(&delay->memory, __ATOMIC_RELAXED) + more * BLOCK_SIZE <= DELAY_MAX_MEMORY;
+}
+
+/* Grow FILE to NEW_SIZE in memory, promising the blocks it needs, after
+   delay_fits() said it may. */
+int delay_grow(descr_struct *file, int64_t new_size)
+{
+    delay_tail *tail = find_tail(file->id);
+    bool added = tail == NULL;
+    if (added)
+    {
+        tail = calloc(1, sizeof(delay_tail));
+        if (tail == NULL)
+            return STATUS_NO_SPACE_LEFT;
+        tail->descr_id = file->id;
+        tail->first_block = BLOCKS_NUM(file);
+        tail->size = file_size(file);
+    }
+    int blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE - tail->first_block;
+    int reserved = blocks + map_spare(blocks);
+    int err = STATUS_OK;
+    if (reserved > tail->reserved && !alloc_reserve(reserved - tail->reserved))
+        err = STATUS_NO_SPACE_LEFT;
+    if (err == STATUS_OK && blocks > tail->capacity)
+    {
+        // appends come a little at a time, don't copy the tail for each
+        int capacity = tail->capacity * 2 > blocks ? tail->capacity * 2 : blocks;
+        if (capacity > SFS->delay_blocks)
+            capacity = SFS->delay_blocks;
+        char *data = realloc(tail->data, (int64_t) capacity * BLOCK_SIZE);
+        if (data == NULL)
+        {
+            if (reserved > tail->reserved)
+                alloc_unreserve(reserved - tail->reserved);
+            err = STATUS_NO_SPACE_LEFT;
+        } else {
+            __atomic_add_fetch(&DELAY->memory, (int64_t) (capacity - tail->capacity) * BLOCK_SIZE,
+                               __ATOMIC_RELAXED);
+            tail->data = data;
+            tail->capacity = capacity;
+        }
+    }
+    if (err)
+    {
+        if (added)
+            free(tail);
+        return err;
+    }
+    if (reserved > tail->reserved)
+        tail->reserved = reserved;
+    tail->size = new_size;
+    if (added)
+        add_tail(tail);
+    return STATUS_OK;
+}
+
+/* Size of FILE with its tail, -1 if it has none. */
+int64_t delay_size(descr_struct *file)
+{
+    delay_tail *tail = find_tail(file->id);
+    return tail ? tail->size : -1;
+}
+
+/* Where the byte at OFFSET of FILE waits in memory, NULL if it is in the
+   image.  *SIZE is cut to what follows it in the same buffer. */
+char *delay_span(descr_struct *file, int64_t offset, int64_t *size)
+{
+    delay_tail *tail = find_tail(file->id);
+    int64_t tail_start = tail ? (int64_t) tail->first_block * BLOCK_SIZE : 0;
+    if (tail == NULL || offset < tail_start)
+        return NULL;
+    if (*size > tail->size - offset)
+        *size = tail->size - offset;
+    return tail->data + offset - tail_start;
+}
+
+/* Do SIZE bytes at OFFSET of FILE reach into its tail? */
+bool delay_pending(descr_struct *file, int64_t offset, int64_t size)
+{
+    delay_tail *tail = find_tail(file->id);
+    return tail && offset + size > (int64_t) tail->first_block * BLOCK_SIZE;
+}
+
+/* Give the tail of FILE its blocks.  The caller holds the file lock for
+   writing.  On failure the tail stays in memory. */
+int delay_place(descr_struct *file)
+{
+    delay_tail *tail = find_tail(file->id);
+    return tail ? place_tail(file, tail) : STATUS_OK;
+}
+
+int place_tail(descr_struct *file, delay_tail *tail)
+{
+    int block_size = BLOCK_SIZE;
+    int blocks_num = (tail->size + block_size - 1) / block_size;
+    // the map sees the whole tail at once and takes it in as few runs as it can
+    alloc_spend_promise(tail->reserved);
+    int err = map_grow(file, blocks_num);
+    alloc_spend_promise(0);
+    if (err)
+        return err;
+    int64_t tail_start = (int64_t) tail->first_block * block_size;
+    int64_t offset = tail_start;
+    while (offset < tail->size)
+    {
+        int start;
+        int block_id = offset / block_size;
+        int64_t len = (int64_t) map_run(file, block_id, blocks_num - block_id, &start) * block_size;
+        if (len > tail->size - offset)
+            len = tail->size - offset;
+        memcpy(BLOCKS(start), tail->data + offset - tail_start, len);
+        mark_dirty(BLOCKS(start), len);
+        offset += len;
+    }
+    remove_tail(tail);
+    set_file_size(file, tail->size);
+    alloc_unreserve(tail->reserved);
+    __atomic_add_fetch(&DELAY->placed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&DELAY->placed_blocks, blocks_num - tail->first_block, __ATOMIC_RELAXED);
+    free(tail->data);
+    free(tail);
+    return STATUS_OK;
+}
+
+/* Forget the tail of FILE, which is being removed. */
+void delay_drop(descr_struct *file)
+{
+    delay_tail *tail = find_tail(file->id);
+    if (tail == NULL)
+        return;
+    remove_tail(tail);
+    alloc_unreserve(tail->reserved);
+    free(tail->data);
+    free(tail);
+}
+
+/* Place every tail, with every lock held. */
+int place_all()
+{
+    delay_state *delay = DELAY;
+    pthread_mutex_lock(&delay->lock);
+    int tails_num = delay->tails_num;
+    delay_tail **tails = malloc(tails_num * sizeof(delay_tail *));
+    int num = 0;
+    for (int i = 0; tails && i < DELAY_SLOTS; ++i)
+    {
+        for (delay_tail *tail = delay->slots[i]; tail; tail = tail->next)
+            tails[num++] = tail;
+    }
+    pthread_mutex_unlock(&delay->lock);
+    if (tails_num > 0 && tails == NULL)
+        return STATUS_NO_SPACE_LEFT;
+    int err = STATUS_OK;
+    for (int i = 0; i < num; ++i)
+    {
+        int placed = place_tail(DESCR(tails[i]->descr_id), tails[i]);
+        if (err == STATUS_OK)
+            err = placed;
+    }
+    free(tails);
+    return err;
+}
+
+/* Place the tails of all files. */
+int delay_flush()
+{
+    delay_state *delay = DELAY;
+    if (delay == NULL || __atomic_load_n(&delay->tails_num, __ATOMIC_RELAXED) == 0)
+        return STATUS_OK;
+    lock_all();
+    int err = place_all();
+    unlock_all();
+    return err;
+}
+
+void delay_dump_stats()
+{
+    delay_state *delay = DELAY;
+    if (delay == NULL)
+        return;
+    pthread_mutex_lock(&delay->lock);
+    int blocks = 0;
+    for (int i = 0; i < DELAY_SLOTS; ++i)
+    {
+        for (delay_tail *tail = delay->slots[i]; tail; tail = tail->next)
+            blocks += tail->reserved;
+    }
+    printf("delayed: %d files, %d blocks promised\n", delay->tails_num, blocks);
+    printf("placed: %d tails, %lld blocks\n", delay->placed, (long long) delay->placed_blocks);
+    pthread_mutex_unlock(&delay->lock);
+}
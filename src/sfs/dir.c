@@ -0,0 +1,658 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/dir.h"
+#include "sfs/dcache.h"
+#include "sfs/journal.h"
+
+/*
+ * Directories.
+ *
+ * A small directory keeps the original layout: blocks_id is an index
+ * block listing data blocks packed with FILES_IN_BLOCK file_structs each.
+ * Once a directory outgrows DIR_LINEAR_BLOCKS blocks it is converted into
+ * a hash tree keyed by the filename hash, much like ext3 htree:
+ *
+ *   - blocks_id points to the root node instead of the index block, tagged
+ *     with HTREE_MAGIC in place of the first block id (real block ids are
+ *     never negative);
+ *   - a node holds (hash, block) pairs sorted by hash, where hash is the
+ *     lowest hash stored under that child, and its level says how many
+ *     node levels are still below it (0 means the children are leaves);
+ *   - a leaf holds up to LEAF_CAPACITY unsorted file_structs.
+ *
+ * Leaves are split between two different hashes where they can be, so a
+ * name is usually found with one leaf scan plus a binary search per
+ * level.  A leaf full of names with one hash is split all the same, and
+ * the child of an entry then holds hashes from its own up to the next
+ * entry's, that one included: a lookup goes back over the children
+ * starting at exactly its hash (htree_find()).  The size of a hashed
+ * directory is kept as the number of entries times sizeof(file_struct).
+ *
+ * The conversion builds the whole tree in new blocks and only then points
+ * the directory at it, and a split takes its blocks from a promise made
+ * before it starts, so a full image leaves the directory as it was.
+ */
+
+#define DIR_LINEAR_BLOCKS 1
+#define HTREE_MAGIC ((int) 0xd1d1d1d1)
+#define HTREE_MAX_DEPTH 8
+// a leaf split and a split of every node above it, the root pushed down
+#define HTREE_SPLIT_BLOCKS (HTREE_MAX_DEPTH + 2)
+
+typedef struct {
+    int magic;
+    int level;
+    int count;
+    int reserved;
+} htree_node;
+
+typedef struct {
+    uint32_t hash;
+    int block;
+} htree_entry;
+
+typedef struct {
+    int count;
+    int reserved;
+} htree_leaf;
+
+#define NODE(ID) ((htree_node *) BLOCKS(ID))
+#define NODE_ENTRIES(node) ((htree_entry *) ((node) + 1))
+#define NODE_CAPACITY ((int) ((BLOCK_SIZE - sizeof(htree_node)) / sizeof(htree_entry)))
+#define LEAF(ID) ((htree_leaf *) BLOCKS(ID))
+#define LEAF_FILES(leaf) ((file_struct *) ((leaf) + 1))
+#define LEAF_CAPACITY ((int) ((BLOCK_SIZE - sizeof(htree_leaf)) / sizeof(file_struct)))
+
+// size of a linear directory holding N entries, padding of full blocks included
+#define LINEAR_SIZE(n) ((n) / FILES_IN_BLOCK * BLOCK_SIZE + (n) % FILES_IN_BLOCK * sizeof(file_struct))
+
+typedef struct {
+    int depth;
+    int blocks[HTREE_MAX_DEPTH];
+    int index[HTREE_MAX_DEPTH];
+} htree_path;
+
+
+uint32_t name_hash(char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name)
+    {
+        hash ^= (uint8_t) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool is_hashed(descr_struct *dir)
+{
+    return dir->blocks_id != 0 && *(int *) BLOCKS(dir->blocks_id) == HTREE_MAGIC;
+}
+
+int new_dir_block()
+{
+    int block_id;
+    if (alloc_blocks(-1, 1, &block_id) == 0)
+        return -1;
+    journal_dirty(BLOCKS(block_id), BLOCK_SIZE);
+    memset(BLOCKS(block_id), 0, BLOCK_SIZE);
+    return block_id;
+}
+
+/* Linear directories. */
+
+int linear_files_num(descr_struct *dir)
+{
+    return dir->size / BLOCK_SIZE * FILES_IN_BLOCK
+        + dir->size % BLOCK_SIZE / sizeof(file_struct);
+}
+
+file_struct *linear_file(descr_struct *dir, int f_id)
+{
+    int *blocks = BLOCKS(dir->blocks_id);
+    file_struct *files = BLOCKS(blocks[f_id / FILES_IN_BLOCK]);
+    return files + f_id % FILES_IN_BLOCK;
+}
+
+int linear_find(descr_struct *dir, char *filename)
+{
+    int files_num = linear_files_num(dir);
+    for (int f_id = 0; f_id < files_num; ++f_id)
+    {
+        if (strcmp(linear_file(dir, f_id)->filename, filename) == 0)
+            return f_id;
+    }
+    return -1;
+}
+
+int linear_remove(descr_struct *dir, char *filename)
+{
+    int f_id = linear_find(dir, filename);
+    if (f_id == -1)
+        return STATUS_NOT_FOUND;
+    int last_id = linear_files_num(dir) - 1;
+    file_struct *del_file = linear_file(dir, f_id);
+    file_struct *last_file = linear_file(dir, last_id);
+    journal_dirty(del_file, sizeof(file_struct));
+    journal_dirty(last_file, sizeof(file_struct));
+
+    // copy last file on the place of deleted file
+    if (del_file != last_file)
+        *del_file = *last_file;
+
+    strncpy(last_file->filename, "", FILENAME_SIZE);
+    last_file->descr_id = 0;
+
+    // release the last block once it is empty
+    if (last_id % FILES_IN_BLOCK == 0)
+    {
+        int *blocks = BLOCKS(dir->blocks_id);
+        journal_dirty(blocks + last_id / FILES_IN_BLOCK, sizeof(int));
+        umask_block(blocks[last_id / FILES_IN_BLOCK]);
+        blocks[last_id / FILES_IN_BLOCK] = 0;
+    }
+    dir->size = LINEAR_SIZE(last_id);
+    return STATUS_OK;
+}
+
+/* Hash tree. */
+
+/* Return the last entry of NODE whose hash is not above HASH. */
+int node_search(htree_node *node, uint32_t hash)
+{
+    htree_entry *entries = NODE_ENTRIES(node);
+    int lo = 1;
+    int hi = node->count - 1;
+    int found = 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].hash <= hash)
+        {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/* Walk from the root down to the leaf where a name with HASH goes. */
+int htree_leaf_of(descr_struct *dir, uint32_t hash, htree_path *path)
+{
+    int block_id = dir->blocks_id;
+    path->depth = 0;
+    while (1)
+    {
+        htree_node *node = NODE(block_id);
+        int i = node_search(node, hash);
+        path->blocks[path->depth] = block_id;
+        path->index[path->depth] = i;
+        path->depth++;
+        block_id = NODE_ENTRIES(node)[i].block;
+        if (node->level == 0 || path->depth == HTREE_MAX_DEPTH)
+            return block_id;
+    }
+}
+
+int leaf_find(htree_leaf *leaf, char *filename)
+{
+    file_struct *files = LEAF_FILES(leaf);
+    for (int i = 0; i < leaf->count; ++i)
+    {
+        if (strcmp(files[i].filename, filename) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Look for FILENAME with HASH under the node NODE_ID, at depth
+   PATH->depth of PATH.  Return the leaf and set *POS, or -1. */
+int find_under(int node_id, uint32_t hash, char *filename, htree_path *path, int *pos)
+{
+    htree_node *node = NODE(node_id);
+    htree_entry *entries = NODE_ENTRIES(node);
+    int d = path->depth++;
+    path->blocks[d] = node_id;
+    // the last child starting at or below HASH, and before it those whose
+    // successor starts at exactly HASH
+    for (int i = node_search(node, hash); i >= 0; --i)
+    {
+        path->index[d] = i;
+        int child_id = entries[i].block;
+        if (node->level == 0 || path->depth == HTREE_MAX_DEPTH)
+        {
+            *pos = leaf_find(LEAF(child_id), filename);
+            if (*pos != -1)
+                return child_id;
+        } else {
+            int leaf_id = find_under(child_id, hash, filename, path, pos);
+            if (leaf_id != -1)
+                return leaf_id;
+        }
+        if (i == 0 || entries[i].hash != hash)
+            break;
+    }
+    path->depth--;
+    return -1;
+}
+
+/* The leaf holding FILENAME with PATH down to it and its position in
+   *POS, -1 if there is none. */
+int htree_find(descr_struct *dir, char *filename, htree_path *path, int *pos)
+{
+    path->depth = 0;
+    return find_under(dir->blocks_id, name_hash(filename), filename, path, pos);
+}
+
+void node_insert_at(htree_node *node, int pos, uint32_t hash, int block_id)
+{
+    htree_entry *entries = NODE_ENTRIES(node);
+    journal_dirty(node, BLOCK_SIZE);
+    memmove(entries + pos + 1, entries + pos, (node->count - pos) * sizeof(htree_entry));
+    entries[pos].hash = hash;
+    entries[pos].block = block_id;
+    node->count++;
+}
+
+/* Insert (HASH, BLOCK_ID) right after the path entry at depth D,
+   splitting full nodes on the way up. */
+int node_insert(htree_path *path, int d, uint32_t hash, int block_id)
+{
+    htree_node *node = NODE(path->blocks[d]);
+    if (node->count < NODE_CAPACITY)
+    {
+        node_insert_at(node, path->index[d] + 1, hash, block_id);
+        return STATUS_OK;
+    }
+
+    if (d == 0)
+    {
+        // the root never moves: push its entries down into a new node
+        int child_id = new_dir_block();
+        if (child_id == -1)
+            return STATUS_NO_SPACE_LEFT;
+        memcpy(BLOCKS(child_id), node, BLOCK_SIZE);
+        journal_dirty(node, BLOCK_SIZE);
+        node->level++;
+        node->count = 1;
+        NODE_ENTRIES(node)[0].hash = 0;
+        NODE_ENTRIES(node)[0].block = child_id;
+
+        if (path->depth == HTREE_MAX_DEPTH)
+            return STATUS_NO_SPACE_LEFT;
+        memmove(path->blocks + 1, path->blocks, path->depth * sizeof(int));
+        memmove(path->index + 1, path->index, path->depth * sizeof(int));
+        path->blocks[1] = child_id;
+        path->index[0] = 0;
+        path->depth++;
+        d = 1;
+        node = NODE(child_id);
+    }
+
+    int sibling_id = new_dir_block();
+    if (sibling_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    htree_node *sibling = NODE(sibling_id);
+    int half = node->count / 2;
+    sibling->magic = HTREE_MAGIC;
+    sibling->level = node->level;
+    sibling->count = node->count - half;
+    memcpy(NODE_ENTRIES(sibling), NODE_ENTRIES(node) + half, sibling->count * sizeof(htree_entry));
+    node->count = half;
+    journal_dirty(node, BLOCK_SIZE);
+    uint32_t sibling_hash = NODE_ENTRIES(sibling)[0].hash;
+
+    int pos = path->index[d] + 1;
+    if (pos <= half)
+        node_insert_at(node, pos, hash, block_id);
+    else
+        node_insert_at(sibling, pos - half, hash, block_id);
+    return node_insert(path, d - 1, sibling_hash, sibling_id);
+}
+
+int compare_hashed(const void *a, const void *b)
+{
+    uint32_t ha = name_hash(((file_struct *) a)->filename);
+    uint32_t hb = name_hash(((file_struct *) b)->filename);
+    return (ha > hb) - (ha < hb);
+}
+
+/* Move the upper half of the leaf at the bottom of PATH to a new leaf. */
+int split_leaf(htree_path *path, int leaf_id)
+{
+    htree_leaf *leaf = LEAF(leaf_id);
+    file_struct *files = LEAF_FILES(leaf);
+    journal_dirty(leaf, BLOCK_SIZE);
+    qsort(files, leaf->count, sizeof(file_struct), compare_hashed);
+
+    // split between two different hashes as close to the middle as we can
+    int split = -1;
+    for (int delta = 0; delta < leaf->count && split == -1; ++delta)
+    {
+        int candidates[2] = {leaf->count / 2 + delta, leaf->count / 2 - delta};
+        for (int c = 0; c < 2; ++c)
+        {
+            int i = candidates[c];
+            if (i > 0 && i < leaf->count
+                && name_hash(files[i].filename) != name_hash(files[i - 1].filename))
+            {
+                split = i;
+                break;
+            }
+        }
+    }
+    // every name in the leaf has the same hash, find_under() looks in
+    // both halves
+    if (split == -1)
+        split = leaf->count / 2;
+
+    int sibling_id = new_dir_block();
+    if (sibling_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    htree_leaf *sibling = LEAF(sibling_id);
+    sibling->count = leaf->count - split;
+    memcpy(LEAF_FILES(sibling), files + split, sibling->count * sizeof(file_struct));
+    memset(files + split, 0, sibling->count * sizeof(file_struct));
+    leaf->count = split;
+
+    int err = node_insert(path, path->depth - 1, name_hash(LEAF_FILES(sibling)[0].filename), sibling_id);
+    if (err)
+    {
+        // keep the directory consistent: merge the halves back
+        memcpy(files + split, LEAF_FILES(sibling), sibling->count * sizeof(file_struct));
+        leaf->count += sibling->count;
+        umask_block(sibling_id);
+    }
+    return err;
+}
+
+int htree_add(descr_struct *dir, char *filename, int descr_id)
+{
+    uint32_t hash = name_hash(filename);
+    htree_path path;
+    while (1)
+    {
+        int leaf_id = htree_leaf_of(dir, hash, &path);
+        htree_leaf *leaf = LEAF(leaf_id);
+        if (leaf->count < LEAF_CAPACITY)
+        {
+            file_struct *new_file = LEAF_FILES(leaf) + leaf->count;
+            journal_dirty(leaf, BLOCK_SIZE);
+            strcpy(new_file->filename, filename);
+            new_file->descr_id = descr_id;
+            leaf->count++;
+            dir->size += sizeof(file_struct);
+            return STATUS_OK;
+        }
+        // a leaf split may have to split every node up to the root as
+        // well, the blocks for that are promised before it starts
+        if (!alloc_reserve(HTREE_SPLIT_BLOCKS))
+            return STATUS_NO_SPACE_LEFT;
+        alloc_spend_promise(HTREE_SPLIT_BLOCKS);
+        int err = split_leaf(&path, leaf_id);
+        alloc_spend_promise(0);
+        alloc_unreserve(HTREE_SPLIT_BLOCKS);
+        if (err)
+            return err;
+    }
+}
+
+int htree_remove(descr_struct *dir, char *filename)
+{
+    htree_path path;
+    int i;
+    int leaf_id = htree_find(dir, filename, &path, &i);
+    if (leaf_id == -1)
+        return STATUS_NOT_FOUND;
+    htree_leaf *leaf = LEAF(leaf_id);
+    file_struct *files = LEAF_FILES(leaf);
+    journal_dirty(leaf, BLOCK_SIZE);
+    leaf->count--;
+    files[i] = files[leaf->count];
+    memset(files + leaf->count, 0, sizeof(file_struct));
+    dir->size -= sizeof(file_struct);
+
+    // drop an empty leaf unless it is the only child of its node
+    htree_node *parent = NODE(path.blocks[path.depth - 1]);
+    if (leaf->count == 0 && parent->count > 1)
+    {
+        int pos = path.index[path.depth - 1];
+        htree_entry *entries = NODE_ENTRIES(parent);
+        journal_dirty(parent, BLOCK_SIZE);
+        memmove(entries + pos, entries + pos + 1, (parent->count - pos - 1) * sizeof(htree_entry));
+        parent->count--;
+        umask_block(leaf_id);
+    }
+    return STATUS_OK;
+}
+
+int htree_foreach(htree_node *node, dir_callback *callback, void *arg)
+{
+    htree_entry *entries = NODE_ENTRIES(node);
+    for (int i = 0; i < node->count; ++i)
+    {
+        if (node->level > 0)
+        {
+            int err = htree_foreach(NODE(entries[i].block), callback, arg);
+            if (err)
+                return err;
+            continue;
+        }
+        htree_leaf *leaf = LEAF(entries[i].block);
+        for (int f = 0; f < leaf->count; ++f)
+        {
+            int err = callback(LEAF_FILES(leaf) + f, arg);
+            if (err)
+                return err;
+        }
+    }
+    return STATUS_OK;
+}
+
+int htree_blocks_num(htree_node *node)
+{
+    int blocks_num = 1;
+    for (int i = 0; i < node->count; ++i)
+    {
+        if (node->level > 0)
+            blocks_num += htree_blocks_num(NODE(NODE_ENTRIES(node)[i].block));
+        else
+            blocks_num++;
+    }
+    return blocks_num;
+}
+
+void htree_release(htree_node *node)
+{
+    for (int i = 0; i < node->count; ++i)
+    {
+        int block_id = NODE_ENTRIES(node)[i].block;
+        if (node->level > 0)
+            htree_release(NODE(block_id));
+        umask_block(block_id);
+    }
+}
+
+/* Turn a linear directory into a hash tree: the entries go sorted into
+   new leaves under a new root, the directory is pointed at it, and only
+   then are the old blocks freed.  On failure the directory stays linear. */
+int convert_to_htree(descr_struct *dir)
+{
+    int files_num = linear_files_num(dir);
+    int leaves_num = files_num > 0 ? (files_num + LEAF_CAPACITY - 1) / LEAF_CAPACITY : 1;
+    if (leaves_num > NODE_CAPACITY)
+        return STATUS_ERR;
+    file_struct *files = malloc(files_num * sizeof(file_struct));
+    if (files == NULL)
+        return STATUS_ERR;
+    for (int f_id = 0; f_id < files_num; ++f_id)
+        files[f_id] = *linear_file(dir, f_id);
+    qsort(files, files_num, sizeof(file_struct), compare_hashed);
+
+    int root_id = new_dir_block();
+    if (root_id == -1)
+    {
+        free(files);
+        return STATUS_NO_SPACE_LEFT;
+    }
+    htree_node *root = NODE(root_id);
+    root->magic = HTREE_MAGIC;
+    root->level = 0;
+    for (int first = 0; root->count < leaves_num; first += LEAF_CAPACITY)
+    {
+        int leaf_id = new_dir_block();
+        if (leaf_id == -1)
+        {
+            htree_release(root);
+            umask_block(root_id);
+            free(files);
+            return STATUS_NO_SPACE_LEFT;
+        }
+        htree_leaf *leaf = LEAF(leaf_id);
+        leaf->count = files_num - first < LEAF_CAPACITY ? files_num - first : LEAF_CAPACITY;
+        memcpy(LEAF_FILES(leaf), files + first, leaf->count * sizeof(file_struct));
+        htree_entry *entry = NODE_ENTRIES(root) + root->count++;
+        entry->hash = first == 0 ? 0 : name_hash(files[first].filename);
+        entry->block = leaf_id;
+    }
+    free(files);
+
+    int index_id = dir->blocks_id;
+    int blocks_num = BLOCKS_NUM(dir);
+    journal_dirty(dir, DESCR_SIZE);
+    dir->blocks_id = root_id;
+    dir->size = files_num * sizeof(file_struct);
+    free_blocks(BLOCKS(index_id), blocks_num);
+    umask_block(index_id);
+    return STATUS_OK;
+}
+
+/* Public directory interface. */
+
+int dir_lookup(descr_struct *dir, char *filename)
+{
+    int descr_id;
+    if (dcache_get(dir->id, filename, &descr_id))
+        return descr_id;
+
+    descr_id = NO_DESCR;
+    if (!is_hashed(dir))
+    {
+        int f_id = linear_find(dir, filename);
+        if (f_id != -1)
+            descr_id = linear_file(dir, f_id)->descr_id;
+    } else {
+        htree_path path;
+        int i;
+        int leaf_id = htree_find(dir, filename, &path, &i);
+        if (leaf_id != -1)
+            descr_id = LEAF_FILES(LEAF(leaf_id))[i].descr_id;
+    }
+    dcache_put(dir->id, filename, descr_id);
+    return descr_id;
+}
+
+int linear_add(descr_struct *dir, char *filename, int descr_id)
+{
+    int files_num = linear_files_num(dir);
+    if (files_num % FILES_IN_BLOCK == 0)
+    {
+        if (files_num / FILES_IN_BLOCK >= DIR_LINEAR_BLOCKS)
+        {
+            int err = convert_to_htree(dir);
+            if (err)
+                return err;
+            return htree_add(dir, filename, descr_id);
+        }
+        int new_block_id = new_dir_block();
+        if (new_block_id == -1)
+            return STATUS_NO_SPACE_LEFT;
+        int *blocks = BLOCKS(dir->blocks_id);
+        journal_dirty(blocks + files_num / FILES_IN_BLOCK, sizeof(int));
+        blocks[files_num / FILES_IN_BLOCK] = new_block_id;
+    }
+    file_struct *new_file = linear_file(dir, files_num);
+    journal_dirty(new_file, sizeof(file_struct));
+    dir->size = LINEAR_SIZE(files_num + 1);
+    strcpy(new_file->filename, filename);
+    new_file->descr_id = descr_id;
+    return STATUS_OK;
+}
+
+int add_to_dir(descr_struct *dir, descr_struct *file, char *filename)
+{
+    int err;
+    journal_dirty(dir, DESCR_SIZE);
+    if (is_hashed(dir))
+        err = htree_add(dir, filename, file->id);
+    else
+        err = linear_add(dir, filename, file->id);
+    if (err)
+        return err;
+    dcache_put(dir->id, filename, file->id);
+    return STATUS_OK;
+}
+
+int rm_from_dir(descr_struct *dir, char *filename)
+{
+    int err;
+    journal_dirty(dir, DESCR_SIZE);
+    if (is_hashed(dir))
+        err = htree_remove(dir, filename);
+    else
+        err = linear_remove(dir, filename);
+    if (err)
+        return err;
+    dcache_put(dir->id, filename, NO_DESCR);
+    dcache_forget_links();
+    return STATUS_OK;
+}
+
+int dir_foreach(descr_struct *dir, dir_callback *callback, void *arg)
+{
+    if (is_hashed(dir))
+        return htree_foreach(NODE(dir->blocks_id), callback, arg);
+
+    int files_num = linear_files_num(dir);
+    for (int f_id = 0; f_id < files_num; ++f_id)
+    {
+        int err = callback(linear_file(dir, f_id), arg);
+        if (err)
+            return err;
+    }
+    return STATUS_OK;
+}
+
+int dir_files_num(descr_struct *dir)
+{
+    if (is_hashed(dir))
+        return dir->size / sizeof(file_struct);
+    return linear_files_num(dir);
+}
+
+int dir_blocks_num(descr_struct *dir)
+{
+    if (is_hashed(dir))
+        return htree_blocks_num(NODE(dir->blocks_id)) - 1;
+    return BLOCKS_NUM(dir);
+}
+
+/* Free every block of DIR except its index (or root) block. */
+void dir_release(descr_struct *dir)
+{
+    dcache_forget_dir(dir->id);
+    if (is_hashed(dir))
+    {
+        htree_release(NODE(dir->blocks_id));
+        return;
+    }
+    int *blocks = BLOCKS(dir->blocks_id);
+    free_blocks(blocks, BLOCKS_NUM(dir));
+}
@@ -0,0 +1,397 @@
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/extent.h"
+#include "sfs/journal.h"
+
+/*
+ * Extent trees.
+ *
+ * A file maps its blocks with extents sorted by logical block.  Up to
+ * INLINE_EXTENTS of them live in the descriptor itself; past that the
+ * descriptor holds the root of a B+tree, much like ext4:
+ *
+ *   - a node block starts with an ext_header and is followed by
+ *     NODE_CAPACITY extent_structs;
+ *   - on depth 0 the entries are extents, above it they are index
+ *     entries whose block is the lowest logical block of the child and
+ *     whose start is the child node;
+ *   - the root is the descriptor, with depth and extents_num in place of
+ *     the header.
+ *
+ * Nodes are split on the way down before inserting, so an insert never
+ * has to go back up the tree.  New blocks are usually physically next to
+ * the previous ones and just make the last extent longer.
+ */
+
+#define EXT_MAGIC 0xf30a
+#define EXT_MAX_LEN 32768
+#define EXT_MAX_DEPTH 5
+
+typedef struct {
+    uint16_t magic;
+    uint16_t extents_num;
+    uint16_t depth;
+    uint16_t reserved;
+} ext_header;
+
+#define NODE_CAPACITY ((int) ((BLOCK_SIZE - sizeof(ext_header)) / sizeof(extent_struct)))
+
+typedef struct {
+    extent_struct *extents;
+    uint16_t *extents_num;
+    int capacity;
+    // node block, -1 for the root inside the descriptor
+    int block_id;
+} ext_node;
+
+
+// start_hi is kept zero until block numbers outgrow 32 bits
+int ext_start(extent_struct *ext)
+{
+    return ext->start_lo;
+}
+
+void ext_set_start(extent_struct *ext, int start)
+{
+    ext->start_hi = 0;
+    ext->start_lo = start;
+}
+
+void root_node(descr_struct *file, ext_node *node)
+{
+    node->extents = file->extents;
+    node->extents_num = &file->extents_num;
+    node->capacity = INLINE_EXTENTS;
+    node->block_id = -1;
+}
+
+void block_node(int block_id, ext_node *node)
+{
+    ext_header *header = BLOCKS(block_id);
+    node->extents = (extent_struct *) (header + 1);
+    node->extents_num = &header->extents_num;
+    node->capacity = NODE_CAPACITY;
+    node->block_id = block_id;
+}
+
+/* Add the entries of NODE to the running journal transaction before
+   changing them. */
+void node_dirty(ext_node *node)
+{
+    journal_dirty(node->extents_num, sizeof(uint16_t));
+    journal_dirty(node->extents, node->capacity * sizeof(extent_struct));
+}
+
+int new_node(int depth)
+{
+    int block_id;
+    if (alloc_blocks(-1, 1, &block_id) == 0)
+        return -1;
+    ext_header *header = BLOCKS(block_id);
+    journal_dirty(header, BLOCK_SIZE);
+    header->magic = EXT_MAGIC;
+    header->extents_num = 0;
+    header->depth = depth;
+    header->reserved = 0;
+    return block_id;
+}
+
+/* Index of the last entry of NODE starting at or before BLOCK_ID, -1 if
+   there is none. */
+int node_find(ext_node *node, uint32_t block_id)
+{
+    int lo = 0;
+    int hi = *node->extents_num;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (node->extents[mid].block <= block_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/* The leaf that would hold BLOCK_ID. */
+void leaf_of(descr_struct *file, uint32_t block_id, ext_node *node)
+{
+    root_node(file, node);
+    for (int depth = file->depth; depth > 0; --depth)
+    {
+        int i = node_find(node, block_id);
+        if (i < 0)
+            i = 0;
+        block_node(ext_start(node->extents + i), node);
+    }
+}
+
+int ext_run(descr_struct *file, int block_id, int max_num, int *start)
+{
+    ext_node leaf;
+    leaf_of(file, block_id, &leaf);
+    int i = node_find(&leaf, block_id);
+    if (i < 0)
+        return 0;
+    extent_struct *ext = leaf.extents + i;
+    int run = ext->block + ext->len - block_id;
+    if (run <= 0)
+        return 0;
+    *start = ext_start(ext) + block_id - ext->block;
+    return run < max_num ? run : max_num;
+}
+
+/* Number of unmapped blocks from BLOCK_ID on, at most MAX_NUM.  The
+   next extent starts at the key following the path down, so a hole is
+   measured in one walk however long it is. */
+int ext_hole(descr_struct *file, int block_id, int max_num)
+{
+    ext_node node;
+    root_node(file, &node);
+    int64_t next = (int64_t) block_id + max_num;
+    for (int depth = file->depth; depth > 0; --depth)
+    {
+        int i = node_find(&node, block_id);
+        if (i + 1 < *node.extents_num && node.extents[i + 1].block < next)
+            next = node.extents[i + 1].block;
+        block_node(ext_start(node.extents + (i < 0 ? 0 : i)), &node);
+    }
+    int i = node_find(&node, block_id);
+    if (i >= 0 && node.extents[i].block + node.extents[i].len > (uint32_t) block_id)
+        return 0;
+    if (i + 1 < *node.extents_num && node.extents[i + 1].block < next)
+        next = node.extents[i + 1].block;
+    return next - block_id;
+}
+
+/* Grow an extent next to the new blocks instead of adding one. */
+bool ext_merge(descr_struct *file, int block_id, int start, int len)
+{
+    ext_node leaf;
+    leaf_of(file, block_id, &leaf);
+    int i = node_find(&leaf, block_id);
+    if (i < 0)
+        return false;
+    extent_struct *left = leaf.extents + i;
+    if (left->block + left->len == block_id && ext_start(left) + left->len == start
+        && left->len + len <= EXT_MAX_LEN)
+    {
+        node_dirty(&leaf);
+        left->len += len;
+        return true;
+    }
+    // only past the first entry, so the keys above stay valid
+    if (i + 1 < *leaf.extents_num)
+    {
+        extent_struct *right = leaf.extents + i + 1;
+        if (block_id + len == right->block && start + len == ext_start(right)
+            && right->len + len <= EXT_MAX_LEN)
+        {
+            node_dirty(&leaf);
+            right->block = block_id;
+            ext_set_start(right, start);
+            right->len += len;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Move the root entries into a new node one level down. */
+int push_down(descr_struct *file)
+{
+    if (file->depth == EXT_MAX_DEPTH)
+        return STATUS_SIZE_ERR;
+    int block_id = new_node(file->depth);
+    if (block_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    ext_node child;
+    block_node(block_id, &child);
+    memcpy(child.extents, file->extents, file->extents_num * sizeof(extent_struct));
+    *child.extents_num = file->extents_num;
+
+    journal_dirty(file, DESCR_SIZE);
+    extent_struct *index = file->extents;
+    index->len = 0;
+    ext_set_start(index, block_id);
+    file->extents_num = 1;
+    file->depth++;
+    return STATUS_OK;
+}
+
+/* Move the entries of CHILD, the I-th child of PARENT, from KEEP on into
+   a new node.  PARENT must have room for one more entry. */
+int split_node(ext_node *parent, int i, ext_node *child, int keep, int depth)
+{
+    int block_id = new_node(depth);
+    if (block_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    ext_node sibling;
+    block_node(block_id, &sibling);
+    node_dirty(child);
+    node_dirty(parent);
+    int moved = *child->extents_num - keep;
+    memcpy(sibling.extents, child->extents + keep, moved * sizeof(extent_struct));
+    *sibling.extents_num = moved;
+    *child->extents_num = keep;
+
+    extent_struct *index = parent->extents + i + 1;
+    memmove(index + 1, index, (*parent->extents_num - i - 1) * sizeof(extent_struct));
+    index->block = sibling.extents[0].block;
+    index->len = 0;
+    ext_set_start(index, block_id);
+    (*parent->extents_num)++;
+    return STATUS_OK;
+}
+
+int insert_extent(descr_struct *file, int block_id, int start, int len)
+{
+    if (ext_merge(file, block_id, start, len))
+        return STATUS_OK;
+    if (file->extents_num == INLINE_EXTENTS)
+    {
+        int err = push_down(file);
+        if (err)
+            return err;
+    }
+
+    ext_node node;
+    root_node(file, &node);
+    for (int depth = file->depth; depth > 0; --depth)
+    {
+        int i = node_find(&node, block_id);
+        if (i < 0)
+        {
+            // the new block becomes the lowest one under the first child
+            i = 0;
+            node_dirty(&node);
+            node.extents[0].block = block_id;
+        }
+        ext_node child;
+        block_node(ext_start(node.extents + i), &child);
+        if (*child.extents_num == child.capacity)
+        {
+            // files mostly grow at the end, leave full nodes behind then
+            int keep = child.capacity / 2;
+            if (child.extents[child.capacity - 1].block < block_id)
+                keep = child.capacity - 1;
+            int err = split_node(&node, i, &child, keep, depth - 1);
+            if (err)
+                return err;
+            if (node.extents[i + 1].block <= block_id)
+                block_node(ext_start(node.extents + i + 1), &child);
+        }
+        node = child;
+    }
+
+    int i = node_find(&node, block_id) + 1;
+    extent_struct *ext = node.extents + i;
+    node_dirty(&node);
+    memmove(ext + 1, ext, (*node.extents_num - i) * sizeof(extent_struct));
+    ext->block = block_id;
+    ext->len = len;
+    ext_set_start(ext, start);
+    (*node.extents_num)++;
+    return STATUS_OK;
+}
+
+/* Map LEN blocks from logical BLOCK_ID on to physical blocks from START
+   on.  The logical range must not be mapped yet.  *INSERTED is set to the
+   number of blocks mapped, which on failure are the first ones of a range
+   longer than an extent. */
+int ext_insert(descr_struct *file, int block_id, int start, int len, int *inserted)
+{
+    *inserted = 0;
+    while (*inserted < len)
+    {
+        int left = len - *inserted;
+        int ext_len = left < EXT_MAX_LEN ? left : EXT_MAX_LEN;
+        int err = insert_extent(file, block_id + *inserted, start + *inserted, ext_len);
+        if (err)
+            return err;
+        *inserted += ext_len;
+    }
+    return STATUS_OK;
+}
+
+void ext_truncate_node(ext_node *node, int depth, uint32_t block_id)
+{
+    node_dirty(node);
+    int num = *node->extents_num;
+    while (num > 0)
+    {
+        extent_struct *ext = node->extents + num - 1;
+        if (depth == 0)
+        {
+            if (ext->block + ext->len <= block_id)
+                break;
+            int keep = ext->block < block_id ? block_id - ext->block : 0;
+            free_range(ext_start(ext) + keep, ext->len - keep);
+            ext->len = keep;
+            if (keep > 0)
+                break;
+            num--;
+            continue;
+        }
+        ext_node child;
+        block_node(ext_start(ext), &child);
+        ext_truncate_node(&child, depth - 1, block_id);
+        if (*child.extents_num > 0)
+            break;
+        umask_block(child.block_id);
+        num--;
+    }
+    *node->extents_num = num;
+}
+
+/* Unmap and free every block from logical BLOCK_ID on. */
+void ext_truncate(descr_struct *file, int block_id)
+{
+    journal_dirty(file, DESCR_SIZE);
+    ext_node root;
+    root_node(file, &root);
+    ext_truncate_node(&root, file->depth, block_id);
+    if (file->extents_num == 0)
+        file->depth = 0;
+
+    // pull a lone child back into the descriptor once it fits there
+    while (file->depth > 0 && file->extents_num == 1)
+    {
+        ext_node child;
+        block_node(ext_start(file->extents), &child);
+        if (*child.extents_num > INLINE_EXTENTS)
+            break;
+        file->extents_num = *child.extents_num;
+        memcpy(file->extents, child.extents, file->extents_num * sizeof(extent_struct));
+        umask_block(child.block_id);
+        file->depth--;
+    }
+}
+
+int node_blocks_num(ext_node *node, int depth)
+{
+    int blocks_num = 0;
+    for (int i = 0; i < *node->extents_num; ++i)
+    {
+        if (depth == 0)
+        {
+            blocks_num += node->extents[i].len;
+        } else {
+            ext_node child;
+            block_node(ext_start(node->extents + i), &child);
+            blocks_num += 1 + node_blocks_num(&child, depth - 1);
+        }
+    }
+    return blocks_num;
+}
+
+/* Data blocks plus tree nodes. */
+int ext_blocks_num(descr_struct *file)
+{
+    ext_node root;
+    root_node(file, &root);
+    return node_blocks_num(&root, file->depth);
+}
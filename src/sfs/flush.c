@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/journal.h"
+#include "sfs/flush.h"
+#include "sfs/delay.h"
+
+/*
+ * Writeback.
+ *
+ * Writes land in the shared mapping and the kernel writes them back
+ * whenever it likes; only msync() makes them durable.  Instead of
+ * syncing the whole mapping, every write of file data and every
+ * journal_dirty() of metadata sets the bits of its blocks in the DIRTY
+ * bitmap, with one SUMMARY bit per bitmap word so a sync skips clean
+ * parts of the image quickly.  flush_dirty() takes the bits under every
+ * lock, so it sees whole operations, and then msyncs the span from the
+ * first dirty block to the last outside the locks, or nothing at all
+ * when nothing was written.  Pages the journal keeps mapped privately are
+ * written back first and synced through its shared view of the image.
+ * umount() costs what is dirty rather than the size of the image.
+ *
+ * The flusher thread is optional.  It syncs once the oldest unsynced
+ * write is FLUSH_AGE milliseconds old or once a part of the image is
+ * dirty, placing delayed writes and committing the journal first so the
+ * log stays ahead of the metadata written in place.
+ */
+
+#define WORD_BITS 64
+
+typedef struct flush_state {
+    uint64_t *dirty;
+    uint64_t *summary;
+    int words_num;
+    // blocks with their dirty bit set
+    int dirty_num;
+    // CLOCK_MONOTONIC milliseconds of the first write since the last sync, 0 if clean
+    int64_t since;
+    // the flusher waits on wake, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    int syncs;
+    int64_t synced;
+} flush_state;
+
+#define FLUSH (SFS->flush)
+
+/* Forward declarations. */
+void *flusher(void *arg);
+void start_flusher(flush_state *flush);
+void stop_flusher(flush_state *flush);
+
+
+int64_t now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Dirty blocks past which the flusher doesn't wait for the age. */
+int dirty_limit()
+{
+    if (SFS->flush_ratio == 0)
+        return INT32_MAX;
+    return (int64_t) FS_BLOCKS * SFS->flush_ratio / 100;
+}
+
+int flush_init()
+{
+    flush_state *flush = calloc(1, sizeof(flush_state));
+    if (flush == NULL)
+        return STATUS_NO_SPACE_LEFT;
+    flush->words_num = (FS_BLOCKS + WORD_BITS - 1) / WORD_BITS;
+    flush->dirty = calloc(flush->words_num, sizeof(uint64_t));
+    flush->summary = calloc((flush->words_num + WORD_BITS - 1) / WORD_BITS, sizeof(uint64_t));
+    if (flush->dirty == NULL || flush->summary == NULL)
+    {
+        free(flush->dirty);
+        free(flush->summary);
+        free(flush);
+        return STATUS_NO_SPACE_LEFT;
+    }
+    pthread_mutex_init(&flush->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flush->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    FLUSH = flush;
+    return STATUS_OK;
+}
+
+/* Stop the flusher, which places delayed writes and syncs the journal,
+   before those go. */
+void flush_stop()
+{
+    flush_state *flush = FLUSH;
+    if (flush == NULL)
+        return;
+    pthread_mutex_lock(&flush->lock);
+    stop_flusher(flush);
+    pthread_mutex_unlock(&flush->lock);
+}
+
+/* Stop the flusher and sync whatever is still dirty, the whole image if
+   nothing was tracked. */
+void flush_release()
+{
+    flush_state *flush = FLUSH;
+    if (flush == NULL)
+    {
+        msync(FS, MAPPED_SIZE, MS_SYNC);
+        return;
+    }
+    flush_stop();
+    flush_dirty(true);
+    FLUSH = NULL;
+    pthread_mutex_destroy(&flush->lock);
+    pthread_cond_destroy(&flush->wake);
+    free(flush->dirty);
+    free(flush->summary);
+    free(flush);
+}
+
+/* Note that SIZE bytes at ADDR of the image were written.  The caller
+   holds a lock of what it wrote. */
+void mark_dirty(void *addr, int64_t size)
+{
+    flush_state *flush = FLUSH;
+    // delayed writes land in memory until they are placed
+    if (flush == NULL || size <= 0 || (char *) addr < (char *) FS
+        || (char *) addr >= (char *) FS + MAPPED_SIZE)
+        return;
+    int64_t first = ((char *) addr - (char *) FS) / BLOCK_SIZE;
+    int64_t last = ((char *) addr - (char *) FS + size - 1) / BLOCK_SIZE;
+    if (last >= FS_BLOCKS)
+        last = FS_BLOCKS - 1;
+    int added = 0;
+    for (int64_t w = first / WORD_BITS; w <= last / WORD_BITS; ++w)
+    {
+        uint64_t bits = ~(uint64_t) 0;
+        if (w == first / WORD_BITS)
+            bits &= ~(uint64_t) 0 << (first % WORD_BITS);
+        if (w == last / WORD_BITS && last % WORD_BITS != WORD_BITS - 1)
+            bits &= ((uint64_t) 1 << (last % WORD_BITS + 1)) - 1;
+        // most writes go to blocks that are dirty already
+        if ((__atomic_load_n(flush->dirty + w, __ATOMIC_RELAXED) & bits) == bits)
+            continue;
+        uint64_t old = __atomic_fetch_or(flush->dirty + w, bits, __ATOMIC_RELAXED);
+        if (old == 0)
+            __atomic_fetch_or(flush->summary + w / WORD_BITS, (uint64_t) 1 << (w % WORD_BITS), __ATOMIC_RELAXED);
+        added += __builtin_popcountll(bits & ~old);
+    }
+    if (added == 0)
+        return;
+    int dirty_num = __atomic_add_fetch(&flush->dirty_num, added, __ATOMIC_RELAXED);
+    // the first write since a sync starts the age clock, a big one wakes the flusher
+    if (dirty_num == added || (dirty_num >= dirty_limit() && dirty_num - added < dirty_limit()))
+    {
+        pthread_mutex_lock(&flush->lock);
+        if (flush->since == 0)
+            flush->since = now_ms();
+        pthread_cond_signal(&flush->wake);
+        pthread_mutex_unlock(&flush->lock);
+    }
+}
+
+/* Sync the blocks written so far in place.  STOPPED says the caller
+   keeps everybody else out of the image already. */
+void flush_dirty(bool stopped)
+{
+    flush_state *flush = FLUSH;
+    if (flush == NULL)
+    {
+        if (!stopped)
+        {
+            lock_all();
+            journal_write_back();
+            unlock_all();
+        }
+        journal_msync(FS, MAPPED_SIZE);
+        return;
+    }
+    // take the bits of whole operations, and what the journal holds back
+    // of them, a stopped caller saw to that
+    if (!stopped)
+    {
+        lock_all();
+        journal_write_back();
+    }
+    int64_t first = -1;
+    int64_t last = -1;
+    int64_t blocks = 0;
+    int summary_words = (flush->words_num + WORD_BITS - 1) / WORD_BITS;
+    for (int s = 0; s < summary_words; ++s)
+    {
+        uint64_t summary = __atomic_exchange_n(flush->summary + s, 0, __ATOMIC_RELAXED);
+        while (summary)
+        {
+            int64_t w = (int64_t) s * WORD_BITS + __builtin_ctzll(summary);
+            summary &= summary - 1;
+            uint64_t bits = __atomic_exchange_n(flush->dirty + w, 0, __ATOMIC_RELAXED);
+            if (bits == 0)
+                continue;
+            blocks += __builtin_popcountll(bits);
+            if (first == -1)
+                first = w * WORD_BITS + __builtin_ctzll(bits);
+            last = w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(bits);
+        }
+    }
+    __atomic_store_n(&flush->dirty_num, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&flush->lock);
+    flush->since = 0;
+    flush->syncs++;
+    flush->synced += blocks;
+    pthread_mutex_unlock(&flush->lock);
+    if (!stopped)
+        unlock_all();
+
+    if (first == -1)
+        return;
+    // every msync() is an fsync() of its range, so one call goes over all
+    // the dirty runs, the clean pages between them cost nothing
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t from = (uintptr_t) BLOCKS(first) & ~page_mask;
+    uintptr_t to = (uintptr_t) BLOCKS(last + 1);
+    journal_msync((void *) from, to - from);
+}
+
+/* Start or stop the flusher as the policy says, once mounted or after it
+   changed. */
+void flush_policy()
+{
+    flush_state *flush = FLUSH;
+    if (flush == NULL)
+        return;
+    pthread_mutex_lock(&flush->lock);
+    if (SFS->flush_age_ms || SFS->flush_ratio)
+        start_flusher(flush);
+    else
+        stop_flusher(flush);
+    pthread_cond_signal(&flush->wake);
+    pthread_mutex_unlock(&flush->lock);
+}
+
+int flush_dirty_num()
+{
+    flush_state *flush = FLUSH;
+    return flush ? __atomic_load_n(&flush->dirty_num, __ATOMIC_RELAXED) : 0;
+}
+
+void flush_dump_stats()
+{
+    flush_state *flush = FLUSH;
+    if (flush == NULL)
+        return;
+    pthread_mutex_lock(&flush->lock);
+    printf("dirty blocks: %d\n", __atomic_load_n(&flush->dirty_num, __ATOMIC_RELAXED));
+    printf("syncs: %d, %lld blocks\n", flush->syncs, (long long) flush->synced);
+    printf("flusher: %s\n", flush->running ? "on" : "off");
+    pthread_mutex_unlock(&flush->lock);
+}
+
+/* With the flush lock held. */
+void start_flusher(flush_state *flush)
+{
+    if (flush->running)
+        return;
+    flush->stop = false;
+    if (pthread_create(&flush->thread, NULL, flusher, SFS) == 0)
+        flush->running = true;
+}
+
+/* With the flush lock held, which is dropped while waiting. */
+void stop_flusher(flush_state *flush)
+{
+    if (!flush->running)
+        return;
+    flush->stop = true;
+    pthread_cond_signal(&flush->wake);
+    pthread_mutex_unlock(&flush->lock);
+    pthread_join(flush->thread, NULL);
+    pthread_mutex_lock(&flush->lock);
+    flush->running = false;
+}
+
+/* Is it time to sync?  If not, wait for something to change. */
+bool flush_due(flush_state *flush)
+{
+    if (__atomic_load_n(&flush->dirty_num, __ATOMIC_RELAXED) >= dirty_limit())
+        return true;
+    if (flush->since == 0 || SFS->flush_age_ms == 0)
+    {
+        pthread_cond_wait(&flush->wake, &flush->lock);
+        return false;
+    }
+    int64_t deadline = flush->since + SFS->flush_age_ms;
+    if (now_ms() >= deadline)
+        return true;
+    struct timespec ts = {deadline / 1000, deadline % 1000 * 1000000};
+    pthread_cond_timedwait(&flush->wake, &flush->lock, &ts);
+    return false;
+}
+
+void *flusher(void *arg)
+{
+    SFS = arg;
+    flush_state *flush = FLUSH;
+    pthread_mutex_lock(&flush->lock);
+    while (!flush->stop)
+    {
+        if (!flush_due(flush))
+            continue;
+        pthread_mutex_unlock(&flush->lock);
+        delay_flush();
+        if (SFS->journal)
+            journal_sync();
+        flush_dirty(false);
+        pthread_mutex_lock(&flush->lock);
+    }
+    pthread_mutex_unlock(&flush->lock);
+    return NULL;
+}
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+
+/*
+ * Instances.
+ *
+ * All state of a mounted image lives in an sfs_t, and the code below
+ * sfs.h works on the current one, SFS.  The calls without a handle use a
+ * per-process default instance; the sfs_* calls here make their instance
+ * current for the duration of the call.  SFS is thread-local, so threads
+ * can work on different images at the same time without any locking.
+ */
+
+// run CALL with SFS set to INSTANCE and give back its result
+#define ON_INSTANCE(instance, call) ({ \
+    sfs_t *prev_ = SFS; \
+    SFS = (instance); \
+    typeof(call) res_ = (call); \
+    SFS = prev_; \
+    res_; \
+})
+
+
+sfs_t *sfs_mount(char *path)
+{
+    sfs_t *sfs = malloc(sizeof(sfs_t));
+    if (sfs == NULL)
+        return NULL;
+    init_instance(sfs);
+    if (ON_INSTANCE(sfs, mount(path)))
+    {
+        release_instance(sfs);
+        free(sfs);
+        return NULL;
+    }
+    return sfs;
+}
+
+int sfs_umount(sfs_t *sfs)
+{
+    int err = ON_INSTANCE(sfs, umount());
+    if (err == STATUS_OK)
+    {
+        release_instance(sfs);
+        free(sfs);
+    }
+    return err;
+}
+
+int sfs_dump_stats(sfs_t *sfs)
+{
+    return ON_INSTANCE(sfs, dump_stats());
+}
+
+int sfs_create_file(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, create_file(path));
+}
+
+int sfs_list(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, list(path));
+}
+
+int sfs_filestat(sfs_t *sfs, int descr_id)
+{
+    return ON_INSTANCE(sfs, filestat(descr_id));
+}
+
+int sfs_mklink(sfs_t *sfs, char *from, char *to)
+{
+    return ON_INSTANCE(sfs, mklink(from, to));
+}
+
+int sfs_rmlink(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, rmlink(path));
+}
+
+int sfs_open(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, open_file(path));
+}
+
+int sfs_close(sfs_t *sfs, int fid)
+{
+    return ON_INSTANCE(sfs, close_file(fid));
+}
+
+int sfs_read(sfs_t *sfs, int fid, int64_t offset, int64_t size, char *data)
+{
+    return ON_INSTANCE(sfs, read_file64(fid, offset, size, data));
+}
+
+int sfs_write(sfs_t *sfs, int fid, int64_t offset, int64_t size, char *data)
+{
+    return ON_INSTANCE(sfs, write_file64(fid, offset, size, data));
+}
+
+int sfs_truncate(sfs_t *sfs, char *path, int64_t new_size)
+{
+    return ON_INSTANCE(sfs, trancate64(path, new_size));
+}
+
+int sfs_read_iov(sfs_t *sfs, int fid, int64_t offset, int64_t size, struct iovec *iov, int *iov_num)
+{
+    return ON_INSTANCE(sfs, read_iov(fid, offset, size, iov, iov_num));
+}
+
+int sfs_unpin(sfs_t *sfs, int fid)
+{
+    return ON_INSTANCE(sfs, unpin_file(fid));
+}
+
+int sfs_readv(sfs_t *sfs, int fid, int64_t offset, const struct iovec *iov, int iov_num)
+{
+    return ON_INSTANCE(sfs, readv_file(fid, offset, iov, iov_num));
+}
+
+int sfs_writev(sfs_t *sfs, int fid, int64_t offset, const struct iovec *iov, int iov_num)
+{
+    return ON_INSTANCE(sfs, writev_file(fid, offset, iov, iov_num));
+}
+
+int sfs_submit(sfs_t *sfs, sfs_op *ops, int ops_num)
+{
+    return ON_INSTANCE(sfs, submit_ops(ops, ops_num));
+}
+
+int sfs_advise(sfs_t *sfs, int fid, int advice)
+{
+    return ON_INSTANCE(sfs, advise_file(fid, advice));
+}
+
+int64_t sfs_seek(sfs_t *sfs, int fid, int64_t offset, int whence)
+{
+    return ON_INSTANCE(sfs, seek_file(fid, offset, whence));
+}
+
+int sfs_mkdir(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, make_dir(path));
+}
+
+int sfs_rmdir(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, remove_dir(path));
+}
+
+int sfs_symlink(sfs_t *sfs, char *from, char *to)
+{
+    return ON_INSTANCE(sfs, mksymlink(from, to));
+}
+
+int sfs_cd(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, cd(path));
+}
+
+char *sfs_pwd(sfs_t *sfs)
+{
+    return ON_INSTANCE(sfs, pwd());
+}
+
+int sfs_set_dcache_size(sfs_t *sfs, int size)
+{
+    return ON_INSTANCE(sfs, set_dcache_size(size));
+}
+
+int sfs_set_commit_window(sfs_t *sfs, int ms, int blocks)
+{
+    return ON_INSTANCE(sfs, set_commit_window(ms, blocks));
+}
+
+int sfs_commit(sfs_t *sfs)
+{
+    return ON_INSTANCE(sfs, commit_journal());
+}
+
+int sfs_sync(sfs_t *sfs)
+{
+    return ON_INSTANCE(sfs, sync_image());
+}
+
+int sfs_set_flusher(sfs_t *sfs, int age_ms, int ratio)
+{
+    return ON_INSTANCE(sfs, set_flusher(age_ms, ratio));
+}
+
+int sfs_set_delayed_alloc(sfs_t *sfs, int max_blocks)
+{
+    return ON_INSTANCE(sfs, set_delayed_alloc(max_blocks));
+}
+
+int sfs_set_tail_packing(sfs_t *sfs, int max_size)
+{
+    return ON_INSTANCE(sfs, set_tail_packing(max_size));
+}
+
+int64_t sfs_file_size(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, get_file_size64(path));
+}
+
+int sfs_file_fragments(sfs_t *sfs, char *path)
+{
+    return ON_INSTANCE(sfs, get_file_fragments(path));
+}
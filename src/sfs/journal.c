@@ -0,0 +1,791 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/journal.h"
+#include "sfs/flush.h"
+
+/*
+ * Metadata journal.
+ *
+ * Images made with a journal keep a log of FS->journal_blocks blocks from
+ * FS->journal_start on.  Block 0 of the log is its super block and holds
+ * the id of the first transaction to replay, the log itself starts at
+ * block 1.  A transaction is written as
+ *
+ *   - one or more RECORD_BLOCKS blocks, each listing the image blocks
+ *     whose copies follow it;
+ *   - the copies;
+ *   - a RECORD_COMMIT block with the checksum of all the blocks before it.
+ *
+ * Whatever changes the bitmap, a descriptor, the info block or a
+ * directory, index or extent block calls journal_dirty() on it while
+ * holding the namespace or the file lock for writing.  The block joins
+ * the running transaction, which the committer thread of the instance
+ * writes to the log once COMMIT_MS passed, once it grew past the block
+ * window or once somebody waits for it in journal_sync().  It takes every
+ * lock to copy the blocks, so the log always gets whole operations, but
+ * flushes outside of them: all waiters share one sequential msync() of
+ * the log.  Data blocks are not logged, like in ext3 writeback mode.
+ *
+ * Nothing of a transaction may reach the image before it commits, but
+ * the image is mapped shared and the kernel writes pages back whenever it
+ * likes.  So journal_dirty() shadows the pages of a block before the
+ * block joins the transaction: they get mapped privately over the image,
+ * and what is written to them stays in memory.  Once the log is durable
+ * the committer writes them back with pwrite(), under every lock so it
+ * sees whole operations, and maps them shared again.  Blocks of the next
+ * transaction are written back from their logged copies instead, and the
+ * pages changed by the last commit stay shadowed, as they are likely to
+ * change again.  Those go back once nothing changed for COMMIT_MS or when
+ * the image is synced.  msync() doesn't look behind a private mapping,
+ * so syncs go through a second shared mapping (journal_msync()).
+ *
+ * Remapping a page doesn't change what it holds: a private page reads
+ * from the page cache until it is written, and a store racing with the
+ * remap either lands in the page cache first or faults and goes to the
+ * private page.  So other threads keep using the blocks they locked on a
+ * page while shadow_block() remaps it for the caller's, and pages only go
+ * back to the shared mapping under every lock.  ThreadSanitizer takes a
+ * remap for a write of the whole page; tsan.supp keeps it from reporting
+ * the accesses of other threads it crosses (make tsan-check).  The
+ * geometry in the info block, read without any lock, is copied to the
+ * instance at mount.
+ *
+ * When the log fills up, the logged blocks, in place already, are synced
+ * and the log starts over with the transaction that didn't fit.  A
+ * transaction too big for the log, or one that would shadow more than
+ * MAX_SHADOWED pages, is written in place by a checkpoint instead and
+ * isn't atomic.  umount() logs what is left and checkpoints, so a clean
+ * image has an empty log.  mount() copies the committed transactions back
+ * in place.
+ */
+
+#define JOURNAL_MAGIC 0x4c4e524a
+#define RECORD_SUPER 1
+#define RECORD_BLOCKS 2
+#define RECORD_COMMIT 3
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+// every shadowed page may cost the process a mapping or two, and there
+// are some 64K of them
+#define MAX_SHADOWED 8192
+// pages written back and mapped shared again at once
+#define RELEASE_PAGES 16
+// which shadowed pages release_shadows() leaves alone
+#define KEEP_NONE 0
+#define KEEP_DIRTY 1
+#define KEEP_TOUCHED 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    // transaction, for the super block the first one to replay
+    uint32_t tid;
+    // blocks listed after the header, for a commit all blocks logged
+    uint32_t count;
+    // commit only, of the records and copies of the transaction
+    uint64_t checksum;
+} record_header;
+
+typedef struct journal_state {
+    pthread_mutex_t lock;
+    // the committer waits on wake, journal_sync() callers on done
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t thread;
+    bool stop;
+    // one bit per image block, set while it is in the running transaction
+    uint64_t *dirty;
+    int *blocks;
+    int blocks_num;
+    int capacity;
+    // more blocks were dirtied than fit in the log, checkpoint the image
+    bool overflow;
+    // when the running transaction got its first block
+    struct timespec started;
+    // blocks logged since the log was last emptied
+    int *logged;
+    int logged_num;
+    // one bit per page of the image set while it is mapped privately, and
+    // one set once a block on it joins a transaction, until the next
+    // release
+    uint64_t *shadowed;
+    uint64_t *touched;
+    int shadowed_num;
+    int page_size;
+    // the image mapped shared once more, to msync() behind the shadows
+    char *view;
+    // RELEASE_PAGES pages to write back from
+    char *bounce;
+    // when the shadowed pages were last written back
+    struct timespec released;
+    // the running transaction, the last durable one and the last waited for
+    uint32_t tid;
+    uint32_t durable;
+    uint32_t wanted;
+    // next free block of the log
+    int head;
+    int commits;
+    int checkpoints;
+} journal_state;
+
+#define JOURNAL (SFS->journal)
+#define LOG_BLOCK(i) ((record_header *) BLOCKS(FS->journal_start + (i)))
+#define IDS(record) ((int *) ((record) + 1))
+#define IDS_PER_RECORD ((BLOCK_SIZE - (int) sizeof(record_header)) / (int) sizeof(int))
+
+/* Forward declarations. */
+void *committer(void *arg);
+void commit_transaction();
+void checkpoint();
+uint32_t replay(uint32_t tid);
+void restart_log(journal_state *journal, uint32_t tid);
+void release_shadows(journal_state *journal, int keep);
+
+
+uint64_t block_checksum(uint64_t sum, void *block)
+{
+    uint64_t *words = block;
+    for (int i = 0; i < BLOCK_SIZE / (int) sizeof(uint64_t); ++i)
+        sum = (sum ^ words[i]) * FNV_PRIME;
+    return sum;
+}
+
+void sync_range(void *from, int64_t size)
+{
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t start = (uintptr_t) from & ~page_mask;
+    msync((void *) start, (uintptr_t) from + size - start, MS_SYNC);
+}
+
+int compare_ids(const void *a, const void *b)
+{
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Sync IDS_NUM blocks in place, one msync() per run of pages. */
+void sync_blocks(int *ids, int ids_num)
+{
+    qsort(ids, ids_num, sizeof(int), compare_ids);
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t from = 0;
+    uintptr_t to = 0;
+    for (int i = 0; i < ids_num; ++i)
+    {
+        uintptr_t start = (uintptr_t) BLOCKS(ids[i]) & ~page_mask;
+        uintptr_t end = ((uintptr_t) BLOCKS(ids[i]) + BLOCK_SIZE + page_mask) & ~page_mask;
+        if (start > to)
+        {
+            if (from != to)
+                journal_msync((void *) from, to - from);
+            from = start;
+        }
+        if (end > to)
+            to = end;
+    }
+    if (from != to)
+        journal_msync((void *) from, to - from);
+}
+
+/* Start the super block of an empty log on TID. */
+void reset_log(uint32_t tid)
+{
+    record_header *super = LOG_BLOCK(0);
+    super->magic = JOURNAL_MAGIC;
+    super->type = RECORD_SUPER;
+    super->tid = tid;
+    sync_range(super, BLOCK_SIZE);
+}
+
+void free_journal(journal_state *journal)
+{
+    free(journal->dirty);
+    free(journal->blocks);
+    free(journal->logged);
+    free(journal->shadowed);
+    free(journal->touched);
+    free(journal->bounce);
+    if (journal->view != NULL)
+        munmap(journal->view, MAPPED_SIZE);
+    free(journal);
+}
+
+/* Set up an empty log of BLOCKS_NUM blocks from block START on, for
+   mkfs. */
+int journal_format(int start, int blocks_num)
+{
+    FS->journal_start = start;
+    FS->journal_blocks = blocks_num;
+    memset(LOG_BLOCK(0), 0, 2 * BLOCK_SIZE);
+    record_header *super = LOG_BLOCK(0);
+    super->magic = JOURNAL_MAGIC;
+    super->type = RECORD_SUPER;
+    super->tid = 1;
+    FS->features |= FEATURE_JOURNAL;
+    return STATUS_OK;
+}
+
+/* Replay the log, if the image has one, and start the committer. */
+int journal_init()
+{
+    if (!(FS->features & FEATURE_JOURNAL))
+        return STATUS_OK;
+    record_header *super = LOG_BLOCK(0);
+    if (FS->journal_start <= 0 || FS->journal_blocks < MIN_JOURNAL_BLOCKS
+        || (int64_t) FS->journal_start + FS->journal_blocks > FS_BLOCKS
+        || super->magic != JOURNAL_MAGIC || super->type != RECORD_SUPER)
+        return STATUS_ERR;
+
+    journal_state *journal = calloc(1, sizeof(journal_state));
+    if (journal == NULL)
+        return STATUS_NO_SPACE_LEFT;
+    journal->capacity = FS->journal_blocks;
+    journal->dirty = calloc((FS_BLOCKS + 63) / 64, sizeof(uint64_t));
+    journal->blocks = malloc(journal->capacity * sizeof(int));
+    journal->logged = malloc(journal->capacity * sizeof(int));
+    journal->page_size = sysconf(_SC_PAGESIZE);
+    int64_t pages_num = (MAPPED_SIZE + journal->page_size - 1) / journal->page_size;
+    journal->shadowed = calloc((pages_num + 63) / 64, sizeof(uint64_t));
+    journal->touched = calloc((pages_num + 63) / 64, sizeof(uint64_t));
+    journal->bounce = malloc(RELEASE_PAGES * journal->page_size);
+    journal->view = mmap(NULL, MAPPED_SIZE, PROT_READ, MAP_SHARED, IMAGE_FD, 0);
+    if (journal->view == MAP_FAILED)
+        journal->view = NULL;
+    if (journal->dirty == NULL || journal->blocks == NULL || journal->logged == NULL
+        || journal->shadowed == NULL || journal->touched == NULL || journal->bounce == NULL
+        || journal->view == NULL)
+    {
+        free_journal(journal);
+        return STATUS_NO_SPACE_LEFT;
+    }
+    journal->tid = replay(super->tid);
+    journal->durable = journal->tid - 1;
+    journal->wanted = journal->durable;
+    journal->head = 1;
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&journal->done, NULL);
+    JOURNAL = journal;
+    if (pthread_create(&journal->thread, NULL, committer, SFS))
+    {
+        JOURNAL = NULL;
+        pthread_mutex_destroy(&journal->lock);
+        pthread_cond_destroy(&journal->wake);
+        pthread_cond_destroy(&journal->done);
+        free_journal(journal);
+        return STATUS_ERR;
+    }
+    return STATUS_OK;
+}
+
+/* Stop the committer and checkpoint everything, for umount(). */
+void journal_release()
+{
+    journal_state *journal = JOURNAL;
+    if (journal == NULL)
+        return;
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = true;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+
+    // the whole image is synced anyway, the log can go once what is left
+    // is in it
+    commit_transaction();
+    checkpoint();
+    JOURNAL = NULL;
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wake);
+    pthread_cond_destroy(&journal->done);
+    free_journal(journal);
+}
+
+/* Map the pages of block BLOCK_ID privately over the image, unless they
+   are already, so the kernel can't write them back, and mark them
+   touched.  With the journal lock held. */
+void shadow_block(journal_state *journal, int block_id)
+{
+    int64_t first = (int64_t) block_id * BLOCK_SIZE / journal->page_size;
+    int64_t last = ((int64_t) block_id * BLOCK_SIZE + BLOCK_SIZE - 1) / journal->page_size;
+    for (int64_t page = first; page <= last; ++page)
+    {
+        uint64_t bit = (uint64_t) 1 << (page % 64);
+        journal->touched[page / 64] |= bit;
+        if (journal->shadowed[page / 64] & bit)
+            continue;
+        int64_t offset = page * journal->page_size;
+        // the transaction goes in place at a checkpoint instead
+        if (journal->shadowed_num >= MAX_SHADOWED
+            || mmap((char *) FS + offset, journal->page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, IMAGE_FD, offset) == MAP_FAILED)
+        {
+            journal->overflow = true;
+            continue;
+        }
+        journal->shadowed[page / 64] |= bit;
+        journal->shadowed_num++;
+    }
+}
+
+/* Add the blocks holding SIZE bytes at ADDR of the image to the running
+   transaction and mark them dirty.  The caller holds the namespace or the
+   file lock of what it changes for writing. */
+void journal_dirty(void *addr, int64_t size)
+{
+    mark_dirty(addr, size);
+    journal_state *journal = JOURNAL;
+    if (journal == NULL || size <= 0)
+        return;
+    int first = ((char *) addr - (char *) FS) / BLOCK_SIZE;
+    int last = ((char *) addr - (char *) FS + size - 1) / BLOCK_SIZE;
+    for (int block_id = first; block_id <= last; ++block_id)
+    {
+        uint64_t bit = (uint64_t) 1 << (block_id % 64);
+        // set once the pages of the block are shadowed
+        if (__atomic_load_n(journal->dirty + block_id / 64, __ATOMIC_ACQUIRE) & bit)
+            continue;
+        pthread_mutex_lock(&journal->lock);
+        if (__atomic_load_n(journal->dirty + block_id / 64, __ATOMIC_RELAXED) & bit)
+        {
+            pthread_mutex_unlock(&journal->lock);
+            continue;
+        }
+        shadow_block(journal, block_id);
+        __atomic_fetch_or(journal->dirty + block_id / 64, bit, __ATOMIC_RELEASE);
+        if (journal->blocks_num == 0 && !journal->overflow)
+            clock_gettime(CLOCK_MONOTONIC, &journal->started);
+        if (journal->blocks_num < journal->capacity)
+            journal->blocks[journal->blocks_num++] = block_id;
+        else
+            journal->overflow = true;
+        int window = SFS->commit_blocks ? SFS->commit_blocks : journal->capacity / 4;
+        // the committer sleeps until a transaction starts or gets big
+        if (journal->blocks_num == 1 || journal->blocks_num >= window || journal->overflow)
+            pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+/* Wait until every change made so far is durable. */
+void journal_sync()
+{
+    journal_state *journal = JOURNAL;
+    pthread_mutex_lock(&journal->lock);
+    uint32_t tid = journal->blocks_num > 0 || journal->overflow ? journal->tid : journal->tid - 1;
+    if (journal->durable != tid)
+    {
+        journal->wanted = tid;
+        pthread_cond_signal(&journal->wake);
+        while ((int32_t) (journal->durable - tid) < 0)
+            pthread_cond_wait(&journal->done, &journal->lock);
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/* msync() SIZE bytes of the image from page aligned ADDR on, shadowed
+   pages included. */
+void journal_msync(void *addr, int64_t size)
+{
+    journal_state *journal = JOURNAL;
+    char *base = journal != NULL ? journal->view : (char *) FS;
+    msync(base + ((char *) addr - (char *) FS), size, MS_SYNC);
+}
+
+/* Write back what the shadowed pages hold besides the running
+   transaction, before the image is synced.  Nothing may change it
+   meanwhile. */
+void journal_write_back()
+{
+    journal_state *journal = JOURNAL;
+    if (journal == NULL)
+        return;
+    pthread_mutex_lock(&journal->lock);
+    release_shadows(journal, KEEP_DIRTY);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/* Commit after MS milliseconds or BLOCKS blocks, 0 for the default. */
+void journal_window(int ms, int blocks)
+{
+    journal_state *journal = JOURNAL;
+    if (journal)
+        pthread_mutex_lock(&journal->lock);
+    SFS->commit_ms = ms;
+    SFS->commit_blocks = blocks;
+    if (journal)
+    {
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+void journal_dump_stats()
+{
+    if (!(FS->features & FEATURE_JOURNAL))
+    {
+        printf("journal: no\n");
+        return;
+    }
+    printf("journal: %d blocks\n", FS->journal_blocks);
+    journal_state *journal = JOURNAL;
+    if (journal == NULL)
+        return;
+    pthread_mutex_lock(&journal->lock);
+    printf("journal commits: %d\n", journal->commits);
+    printf("journal checkpoints: %d\n", journal->checkpoints);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/* Is the running transaction to be committed now?  If not, wait for
+   something to change. */
+bool commit_due(journal_state *journal)
+{
+    // an empty transaction only lets the shadowed pages go back
+    bool empty = journal->blocks_num == 0 && !journal->overflow;
+    if (empty && journal->shadowed_num == 0)
+    {
+        pthread_cond_wait(&journal->wake, &journal->lock);
+        return false;
+    }
+    int window = SFS->commit_blocks ? SFS->commit_blocks : journal->capacity / 4;
+    if (!empty && (journal->overflow || journal->wanted == journal->tid || journal->blocks_num >= window))
+        return true;
+
+    struct timespec deadline = empty ? journal->released : journal->started;
+    int64_t ms = SFS->commit_ms;
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += ms % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline.tv_sec
+        || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+        return true;
+    pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline);
+    return false;
+}
+
+void *committer(void *arg)
+{
+    SFS = arg;
+    journal_state *journal = JOURNAL;
+    pthread_mutex_lock(&journal->lock);
+    while (!journal->stop)
+    {
+        if (!commit_due(journal))
+            continue;
+        pthread_mutex_unlock(&journal->lock);
+        commit_transaction();
+        pthread_mutex_lock(&journal->lock);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+/* Forget the blocks of the running transaction and start the next one. */
+void end_transaction(journal_state *journal)
+{
+    if (journal->overflow)
+    {
+        memset(journal->dirty, 0, (FS_BLOCKS + 63) / 64 * sizeof(uint64_t));
+    } else {
+        for (int i = 0; i < journal->blocks_num; ++i)
+        {
+            int block_id = journal->blocks[i];
+            __atomic_and_fetch(journal->dirty + block_id / 64, ~((uint64_t) 1 << (block_id % 64)), __ATOMIC_RELAXED);
+        }
+    }
+    journal->blocks_num = 0;
+    journal->overflow = false;
+    journal->tid++;
+}
+
+/* Copy the running transaction to the log from the head on. */
+void write_transaction(journal_state *journal)
+{
+    int pos = journal->head;
+    uint64_t sum = FNV_OFFSET;
+    for (int i = 0; i < journal->blocks_num; i += IDS_PER_RECORD)
+    {
+        int count = journal->blocks_num - i < IDS_PER_RECORD ? journal->blocks_num - i : IDS_PER_RECORD;
+        record_header *record = LOG_BLOCK(pos++);
+        memset(record, 0, BLOCK_SIZE);
+        record->magic = JOURNAL_MAGIC;
+        record->type = RECORD_BLOCKS;
+        record->tid = journal->tid;
+        record->count = count;
+        memcpy(IDS(record), journal->blocks + i, count * sizeof(int));
+        sum = block_checksum(sum, record);
+        for (int k = 0; k < count; ++k)
+        {
+            void *copy = LOG_BLOCK(pos++);
+            memcpy(copy, BLOCKS(journal->blocks[i + k]), BLOCK_SIZE);
+            sum = block_checksum(sum, copy);
+            journal->logged[journal->logged_num++] = journal->blocks[i + k];
+        }
+    }
+    record_header *commit = LOG_BLOCK(pos++);
+    memset(commit, 0, BLOCK_SIZE);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = RECORD_COMMIT;
+    commit->tid = journal->tid;
+    commit->count = journal->blocks_num;
+    commit->checksum = sum;
+    journal->head = pos;
+}
+
+/* Write SIZE bytes of the image from OFFSET on back to the file. */
+bool write_back(journal_state *journal, int64_t offset, int64_t size)
+{
+    if (offset + size > MAPPED_SIZE)
+        size = MAPPED_SIZE - offset;
+    // through a copy, the bytes may be mapped from the very pages written
+    memcpy(journal->bounce, (char *) FS + offset, size);
+    return pwrite(IMAGE_FD, journal->bounce, size, offset) == size;
+}
+
+bool block_dirty(journal_state *journal, int64_t block_id)
+{
+    return block_id < FS_BLOCKS
+        && (__atomic_load_n(journal->dirty + block_id / 64, __ATOMIC_RELAXED) >> (block_id % 64) & 1);
+}
+
+/* Write back the COUNT shadowed pages from PAGE on and map them shared
+   again. */
+void release_pages(journal_state *journal, int64_t page, int count)
+{
+    int64_t offset = page * journal->page_size;
+    int64_t size = (int64_t) count * journal->page_size;
+    // pages that can't be written back stay what the image is
+    if (!write_back(journal, offset, size)
+        || mmap((char *) FS + offset, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                IMAGE_FD, offset) == MAP_FAILED)
+        return;
+    for (int64_t p = page; p < page + count; ++p)
+        journal->shadowed[p / 64] &= ~((uint64_t) 1 << (p % 64));
+    journal->shadowed_num -= count;
+}
+
+/* Write the shadowed pages back and map them shared again, but for those
+   KEEP says: with KEEP_DIRTY the pages with blocks of the running
+   transaction, and with KEEP_TOUCHED those touched since the last release
+   as well.  Of the pages kept only the blocks not in the transaction are
+   written back.  Nothing may change the image meanwhile. */
+void release_shadows(journal_state *journal, int keep)
+{
+    int64_t pages_num = (MAPPED_SIZE + journal->page_size - 1) / journal->page_size;
+    int page_blocks = journal->page_size > BLOCK_SIZE ? journal->page_size / BLOCK_SIZE : 1;
+    // a run of pages goes back at once
+    int64_t run = 0;
+    int run_num = 0;
+    for (int64_t w = 0; w < (pages_num + 63) / 64; ++w)
+    {
+        uint64_t bits = journal->shadowed[w];
+        uint64_t touched = journal->touched[w];
+        journal->touched[w] = 0;
+        while (bits)
+        {
+            int64_t page = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            int64_t first = page * journal->page_size / BLOCK_SIZE;
+            bool kept = keep == KEEP_TOUCHED && (touched >> (page % 64) & 1);
+            for (int i = 0; i < page_blocks && !kept && keep != KEEP_NONE; ++i)
+                kept = block_dirty(journal, first + i);
+            if (kept)
+            {
+                for (int i = 0; i < page_blocks; ++i)
+                {
+                    if (!block_dirty(journal, first + i))
+                        write_back(journal, (first + i) * BLOCK_SIZE, BLOCK_SIZE);
+                }
+                continue;
+            }
+            if (run_num > 0 && (page != run + run_num || run_num == RELEASE_PAGES))
+            {
+                release_pages(journal, run, run_num);
+                run_num = 0;
+            }
+            if (run_num == 0)
+                run = page;
+            run_num++;
+        }
+    }
+    if (run_num > 0)
+        release_pages(journal, run, run_num);
+    clock_gettime(CLOCK_MONOTONIC, &journal->released);
+}
+
+/* Of the blocks logged from block FROM of the log to block TO, write the
+   copies of those in the running transaction again in place, their pages
+   hold newer bytes.  A failure checkpoints the next transaction. */
+void write_logged(journal_state *journal, int from, int to)
+{
+    for (int pos = from; pos < to; ++pos)
+    {
+        record_header *record = LOG_BLOCK(pos);
+        if (record->type != RECORD_BLOCKS)
+            continue;
+        for (uint32_t k = 0; k < record->count; ++k)
+        {
+            int block_id = IDS(record)[k];
+            if (block_dirty(journal, block_id)
+                && pwrite(IMAGE_FD, LOG_BLOCK(pos + 1 + k), BLOCK_SIZE,
+                          (int64_t) block_id * BLOCK_SIZE) != BLOCK_SIZE)
+                journal->overflow = true;
+        }
+        pos += record->count;
+    }
+}
+
+/* Sync the logged blocks, which are in place, and start the log over on
+   TID.  Nothing may change the image meanwhile. */
+void restart_log(journal_state *journal, uint32_t tid)
+{
+    sync_blocks(journal->logged, journal->logged_num);
+    reset_log(tid);
+    journal->head = 1;
+    journal->logged_num = 0;
+    journal->checkpoints++;
+}
+
+/* Write the running transaction in place without the log and sync the
+   image.  Nothing may change it meanwhile. */
+void checkpoint()
+{
+    journal_state *journal = JOURNAL;
+    release_shadows(journal, KEEP_NONE);
+    flush_dirty(true);
+    restart_log(journal, journal->tid + 1);
+    end_transaction(journal);
+}
+
+void commit_transaction()
+{
+    journal_state *journal = JOURNAL;
+    lock_all();
+    pthread_mutex_lock(&journal->lock);
+    // nothing changed for a while, the shadowed pages may go back
+    if (journal->blocks_num == 0 && !journal->overflow)
+    {
+        release_shadows(journal, KEEP_DIRTY);
+        pthread_mutex_unlock(&journal->lock);
+        unlock_all();
+        return;
+    }
+    uint32_t tid = journal->tid;
+    int records = (journal->blocks_num + IDS_PER_RECORD - 1) / IDS_PER_RECORD;
+    int from = journal->head;
+    bool logged = false;
+    // the super block, the records, the copies and the commit
+    if (journal->overflow || 1 + records + journal->blocks_num + 1 > FS->journal_blocks)
+    {
+        checkpoint();
+    } else if (journal->blocks_num > 0) {
+        if (journal->head + records + journal->blocks_num + 1 > FS->journal_blocks)
+            restart_log(journal, tid);
+        from = journal->head;
+        write_transaction(journal);
+        end_transaction(journal);
+        logged = true;
+    }
+    int to = journal->head;
+    pthread_mutex_unlock(&journal->lock);
+    unlock_all();
+
+    if (logged)
+    {
+        sync_range(LOG_BLOCK(from), (int64_t) (to - from) * BLOCK_SIZE);
+        // durable, so it may go in place now
+        lock_all();
+        pthread_mutex_lock(&journal->lock);
+        release_shadows(journal, KEEP_TOUCHED);
+        write_logged(journal, from, to);
+        pthread_mutex_unlock(&journal->lock);
+        unlock_all();
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal->durable = tid;
+    journal->commits++;
+    pthread_cond_broadcast(&journal->done);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/* Check the transaction TID starting at block POS of the log and give
+   back the block after its commit, 0 if it didn't commit. */
+int check_transaction(int pos, uint32_t tid)
+{
+    uint64_t sum = FNV_OFFSET;
+    int64_t count = 0;
+    while (pos < FS->journal_blocks)
+    {
+        record_header *record = LOG_BLOCK(pos);
+        if (record->magic != JOURNAL_MAGIC || record->tid != tid)
+            return 0;
+        if (record->type == RECORD_COMMIT)
+            return record->checksum == sum && record->count == count ? pos + 1 : 0;
+        if (record->type != RECORD_BLOCKS || record->count > (uint32_t) IDS_PER_RECORD
+            || pos + 1 + (int64_t) record->count > FS->journal_blocks)
+            return 0;
+        sum = block_checksum(sum, record);
+        for (uint32_t k = 0; k < record->count; ++k)
+        {
+            int block_id = IDS(record)[k];
+            if (block_id < 0 || block_id >= FS_BLOCKS
+                || (block_id >= FS->journal_start && block_id < FS->journal_start + FS->journal_blocks))
+                return 0;
+            sum = block_checksum(sum, LOG_BLOCK(pos + 1 + k));
+        }
+        count += record->count;
+        pos += 1 + record->count;
+    }
+    return 0;
+}
+
+/* Copy the committed transactions from TID on back in place and give
+   back the id for the next one. */
+uint32_t replay(uint32_t tid)
+{
+    int pos = 1;
+    bool replayed = false;
+    int end;
+    while ((end = check_transaction(pos, tid)) != 0)
+    {
+        while (pos < end - 1)
+        {
+            record_header *record = LOG_BLOCK(pos);
+            for (uint32_t k = 0; k < record->count; ++k)
+            {
+                memcpy(BLOCKS(IDS(record)[k]), LOG_BLOCK(pos + 1 + k), BLOCK_SIZE);
+                mark_dirty(BLOCKS(IDS(record)[k]), BLOCK_SIZE);
+            }
+            pos += 1 + record->count;
+        }
+        pos = end;
+        tid++;
+        replayed = true;
+    }
+    if (replayed)
+    {
+        flush_dirty(true);
+        reset_log(tid);
+    }
+    return tid;
+}
@@ -0,0 +1,773 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/extent.h"
+#include "sfs/map.h"
+#include "sfs/journal.h"
+#include "sfs/flush.h"
+#include "sfs/pack.h"
+
+/*
+ * Block maps.
+ *
+ * Translates logical file blocks into physical ones.  Files on images
+ * with FEATURE_EXTENTS are mapped by extents (see extent.c); directories
+ * and every file on older images use an index block at blocks_id holding
+ * one block id per logical block.  Nothing is mapped past the size of
+ * the file, so callers change it only after growing and before shrinking
+ * the map.  Below it a file may have holes, logical blocks mapped to
+ * nothing that read as zeros; map_fill() gives them blocks when they are
+ * written.
+ *
+ * On images with FEATURE_INLINE_DATA a new file or symlink has no map at
+ * all: its bytes live in the descriptor until they outgrow it, so small
+ * files take no blocks.  map_uninline() gives it a map then, and
+ * map_inline() takes an empty one back.  A file packed into a shared
+ * block (see pack.c) has no map either.
+ *
+ * An index block maps INDEX_ENTRIES blocks.  A bigger file gets double
+ * and then triple indirection without moving its root: the root is
+ * tagged with INDIRECT_MAGIC in place of the first block id, followed by
+ * the number of levels and ROOT_ENTRIES ids of index blocks one level
+ * down, which are plain index blocks again.  Block 0 is never part of a
+ * file, so 0 marks a missing entry.
+ *
+ * Growing a file allocates runs of adjacent blocks aimed at a goal: right
+ * after the last block of the file, or next to its parent directory for
+ * a new one.  Like ext3, a growing file also reserves a window of free
+ * blocks after its end that other growing files stay out of, so files
+ * written side by side still come out contiguous.  The window doubles
+ * every time the file runs out of it.  Windows live in memory only and
+ * nothing else has to respect them.
+ *
+ * A hint slot is shared by the files hashing to it, so everything that
+ * touches the hint of a file holds the lock of its slot; files in other
+ * slots grow in parallel.  Windows of other slots are only peeked at, with
+ * atomic loads, as they are advisory anyway.  Extent lookups don't use
+ * hints and run without any lock.
+ */
+
+#define INDIRECT_MAGIC ((int) 0xb10cb10c)
+#define MAX_INDEX_LEVELS 3
+// deeper than an index or an extent tree ever gets
+#define MAX_MAP_LEVELS 6
+#define INDEX_ENTRIES ((int) (BLOCK_SIZE / sizeof(int)))
+#define ROOT_ENTRIES (INDEX_ENTRIES - 2)
+#define FILE_HINTS_NUM 64
+#define RSV_MIN_BLOCKS 16
+#define RSV_MAX_BLOCKS 8192
+#define RSV_TRIES 8
+
+/* What was learned about a descriptor last time it was mapped. */
+typedef struct {
+    int descr_id;
+    // last leaf index block found, 0 if none, so sequential access doesn't
+    // walk down from the root for every block
+    int leaf_id;
+    int first_block;
+    // where the next block of the file should go, -1 if unknown
+    int goal;
+    // reservation window, empty when rsv_start == rsv_end
+    int rsv_start;
+    int rsv_end;
+    int rsv_size;
+} file_hint;
+
+typedef struct map_state {
+    file_hint hints[FILE_HINTS_NUM];
+    pthread_mutex_t locks[FILE_HINTS_NUM];
+} map_state;
+
+#define FILE_HINTS (SFS->map->hints)
+#define HINT_LOCK(file) (SFS->map->locks + (file)->id % FILE_HINTS_NUM)
+
+/* Forward declarations. */
+int index_run(descr_struct *file, int block_id, int max_num, int *start);
+int grow_map(descr_struct *file, int blocks_num);
+void shrink_map(descr_struct *file, int blocks_num);
+int new_map(descr_struct *file, file_hint *hint);
+
+
+bool has_extents(descr_struct *file)
+{
+    return (FEATURES & FEATURE_EXTENTS) && (file->flags & DESCR_EXTENTS);
+}
+
+bool is_inline(descr_struct *file)
+{
+    return (FEATURES & FEATURE_INLINE_DATA) && (file->flags & DESCR_INLINE);
+}
+
+/* Are the bytes of FILE in blocks found through its map? */
+bool has_map(descr_struct *file)
+{
+    return !is_inline(file) && !is_packed(file);
+}
+
+int map_hints_init()
+{
+    if (SFS->map == NULL)
+    {
+        SFS->map = malloc(sizeof(map_state));
+        if (SFS->map == NULL)
+            return STATUS_ERR;
+        for (int i = 0; i < FILE_HINTS_NUM; ++i)
+            pthread_mutex_init(SFS->map->locks + i, NULL);
+    }
+    for (int i = 0; i < FILE_HINTS_NUM; ++i)
+        FILE_HINTS[i].descr_id = NO_DESCR;
+    return STATUS_OK;
+}
+
+void map_hints_release()
+{
+    for (int i = 0; SFS->map && i < FILE_HINTS_NUM; ++i)
+        pthread_mutex_destroy(SFS->map->locks + i);
+    free(SFS->map);
+    SFS->map = NULL;
+}
+
+// window_at() reads the windows of other slots without their locks
+void set_window(file_hint *hint, int start, int end)
+{
+    __atomic_store_n(&hint->rsv_start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&hint->rsv_end, end, __ATOMIC_RELAXED);
+}
+
+file_hint *hint_of(descr_struct *file)
+{
+    file_hint *hint = FILE_HINTS + file->id % FILE_HINTS_NUM;
+    if (hint->descr_id != file->id)
+    {
+        __atomic_store_n(&hint->descr_id, file->id, __ATOMIC_RELAXED);
+        hint->leaf_id = 0;
+        hint->goal = -1;
+        set_window(hint, 0, 0);
+        hint->rsv_size = 0;
+    }
+    return hint;
+}
+
+/* Find the window of another file overlapping [START, END) and put its
+   bounds in *RSV_START and *RSV_END, return false if there is none. */
+bool window_at(file_hint *own, int start, int end, int *rsv_start, int *rsv_end)
+{
+    for (int i = 0; i < FILE_HINTS_NUM; ++i)
+    {
+        file_hint *hint = FILE_HINTS + i;
+        if (hint == own || __atomic_load_n(&hint->descr_id, __ATOMIC_RELAXED) == NO_DESCR)
+            continue;
+        *rsv_start = __atomic_load_n(&hint->rsv_start, __ATOMIC_RELAXED);
+        *rsv_end = __atomic_load_n(&hint->rsv_end, __ATOMIC_RELAXED);
+        if (*rsv_start < end && start < *rsv_end)
+            return true;
+    }
+    return false;
+}
+
+/* Allocate up to WANT blocks for FILE at GOAL, out of its reservation
+   window if GOAL is in it, otherwise opening a new window. */
+int alloc_for(descr_struct *file, int goal, int want, int *start)
+{
+    file_hint *hint = hint_of(file);
+    if (goal >= hint->rsv_start && goal < hint->rsv_end)
+    {
+        int max = hint->rsv_end - goal < want ? hint->rsv_end - goal : want;
+        int run = alloc_range(goal, max);
+        if (run > 0)
+        {
+            *start = goal;
+            return run;
+        }
+    }
+
+    int size = hint->rsv_size * 2;
+    if (size < RSV_MIN_BLOCKS)
+        size = RSV_MIN_BLOCKS;
+    if (size > RSV_MAX_BLOCKS)
+        size = RSV_MAX_BLOCKS;
+    if (size < want)
+        size = want;
+    for (int i = 0; i < RSV_TRIES; ++i)
+    {
+        int found = find_run(goal, size, start);
+        if (found == 0)
+            break;
+        int rsv_start, rsv_end;
+        bool taken = window_at(hint, *start, *start + found, &rsv_start, &rsv_end);
+        if (taken && rsv_start > *start)
+        {
+            // keep the part before the other window
+            found = rsv_start - *start;
+        } else if (taken) {
+            goal = rsv_end;
+            continue;
+        }
+        set_window(hint, *start, *start + found);
+        hint->rsv_size = size;
+        int run = alloc_range(*start, found < want ? found : want);
+        // another file may have been faster, look again
+        if (run > 0)
+            return run;
+    }
+    // every free run nearby is reserved, take one anyway
+    return alloc_blocks(goal, want, start);
+}
+
+void forget_leaf(descr_struct *file)
+{
+    hint_of(file)->leaf_id = 0;
+}
+
+int new_index_block(int goal)
+{
+    int block_id;
+    if (alloc_blocks(goal, 1, &block_id) == 0)
+        return -1;
+    journal_dirty(BLOCKS(block_id), BLOCK_SIZE);
+    memset(BLOCKS(block_id), 0, BLOCK_SIZE);
+    return block_id;
+}
+
+int index_levels(descr_struct *file)
+{
+    int *root = BLOCKS(file->blocks_id);
+    return root[0] == INDIRECT_MAGIC ? root[1] : 1;
+}
+
+/* Blocks mapped by one entry of the root. */
+int root_span(int levels)
+{
+    int span = 1;
+    for (int level = 1; level < levels; ++level)
+        span *= INDEX_ENTRIES;
+    return span;
+}
+
+int index_capacity(int levels)
+{
+    if (levels == 1)
+        return INDEX_ENTRIES;
+    // big blocks map more than an int can count, file sizes are ints anyway
+    long long capacity = (long long) ROOT_ENTRIES * root_span(levels);
+    return capacity < INT_MAX ? capacity : INT_MAX;
+}
+
+/* Entry holding the id of logical block BLOCK_ID.  With CREATE missing
+   index blocks on the way are allocated, otherwise (or when that fails)
+   NULL is returned for them. */
+int *index_slot(descr_struct *file, int block_id, bool create)
+{
+    // a hole past what the index reaches yet
+    if (block_id >= index_capacity(index_levels(file)))
+        return NULL;
+    int *root = BLOCKS(file->blocks_id);
+    if (root[0] != INDIRECT_MAGIC)
+        return root + block_id;
+
+    file_hint *hint = hint_of(file);
+    if (hint->leaf_id != 0 && block_id >= hint->first_block
+        && block_id < hint->first_block + INDEX_ENTRIES)
+        return (int *) BLOCKS(hint->leaf_id) + block_id - hint->first_block;
+
+    int span = root_span(root[1]);
+    int *slot = root + 2 + block_id / span;
+    int rest = block_id % span;
+    while (span > 1)
+    {
+        if (*slot == 0)
+        {
+            if (!create)
+                return NULL;
+            journal_dirty(slot, sizeof(int));
+            *slot = new_index_block(hint->goal);
+            if (*slot == -1)
+            {
+                *slot = 0;
+                return NULL;
+            }
+        }
+        int *index = BLOCKS(*slot);
+        if (span == INDEX_ENTRIES)
+        {
+            hint->first_block = block_id - rest;
+            hint->leaf_id = *slot;
+        }
+        span /= INDEX_ENTRIES;
+        slot = index + rest / span;
+        rest %= span;
+    }
+    return slot;
+}
+
+/* Add a level above the root, keeping the root in place. */
+int index_deepen(descr_struct *file)
+{
+    int block_id = new_index_block(file->blocks_id);
+    if (block_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    int *root = BLOCKS(file->blocks_id);
+    int *child = BLOCKS(block_id);
+    int levels = index_levels(file);
+    if (levels == 1)
+        memcpy(child, root, INDEX_ENTRIES * sizeof(int));
+    else
+        memcpy(child, root + 2, ROOT_ENTRIES * sizeof(int));
+    journal_dirty(root, BLOCK_SIZE);
+    memset(root, 0, BLOCK_SIZE);
+    root[0] = INDIRECT_MAGIC;
+    root[1] = levels + 1;
+    root[2] = block_id;
+    forget_leaf(file);
+    return STATUS_OK;
+}
+
+/* Drop the top level while the rest fits under the root. */
+void index_shallow(descr_struct *file, int blocks_num)
+{
+    int levels = index_levels(file);
+    while (levels > 1 && blocks_num <= index_capacity(levels - 1))
+    {
+        int *root = BLOCKS(file->blocks_id);
+        int child_id = root[2];
+        int *child = BLOCKS(child_id);
+        journal_dirty(root, BLOCK_SIZE);
+        memset(root, 0, BLOCK_SIZE);
+        levels--;
+        if (child_id != 0)
+        {
+            if (levels == 1)
+                memcpy(root, child, INDEX_ENTRIES * sizeof(int));
+            else
+                memcpy(root + 2, child, ROOT_ENTRIES * sizeof(int));
+            umask_block(child_id);
+        }
+        if (levels > 1)
+        {
+            root[0] = INDIRECT_MAGIC;
+            root[1] = levels;
+        }
+    }
+}
+
+/* Free the blocks INDEX maps in [KEEP, END), the index blocks left empty
+   included.  INDEX maps SPAN blocks per entry from logical block FIRST. */
+void index_free(int *index, int entries_num, int first, int span, int keep, int end)
+{
+    if (span == 1)
+    {
+        int from = keep > first ? keep - first : 0;
+        int to = end - first < entries_num ? end - first : entries_num;
+        if (from >= to)
+            return;
+        free_blocks(index + from, to - from);
+        journal_dirty(index + from, (to - from) * sizeof(int));
+        memset(index + from, 0, (to - from) * sizeof(int));
+        return;
+    }
+    for (int i = 0; i < entries_num; ++i)
+    {
+        int start = first + i * span;
+        if (index[i] == 0 || start + span <= keep || start >= end)
+            continue;
+        index_free(BLOCKS(index[i]), INDEX_ENTRIES, start, span / INDEX_ENTRIES, keep, end);
+        if (start >= keep)
+        {
+            umask_block(index[i]);
+            journal_dirty(index + i, sizeof(int));
+            index[i] = 0;
+        }
+    }
+}
+
+void index_shrink(descr_struct *file, int keep, int end)
+{
+    int *root = BLOCKS(file->blocks_id);
+    if (root[0] == INDIRECT_MAGIC)
+        index_free(root + 2, ROOT_ENTRIES, 0, root_span(root[1]), keep, end);
+    else
+        index_free(root, INDEX_ENTRIES, 0, 1, keep, end);
+    forget_leaf(file);
+    index_shallow(file, keep);
+}
+
+/* Set up an empty map for a new descriptor of known type, with its
+   blocks wanted near GOAL. */
+int map_init(descr_struct *file, int goal)
+{
+    journal_dirty(file, DESCR_SIZE);
+    if (HAS_FLAGS)
+    {
+        file->flags = 0;
+        file->depth = 0;
+        file->extents_num = 0;
+        file->pack_unit = 0;
+        file->pack_units = 0;
+    }
+    pthread_mutex_lock(HINT_LOCK(file));
+    file_hint *hint = hint_of(file);
+    hint->leaf_id = 0;
+    hint->goal = goal;
+    set_window(hint, 0, 0);
+    hint->rsv_size = 0;
+    int err = STATUS_OK;
+    if ((FEATURES & FEATURE_INLINE_DATA) && file->type != DIR_TYPE)
+    {
+        file->flags |= DESCR_INLINE;
+        file->blocks_id = 0;
+        memset(file->inline_data, 0, INLINE_DATA_SIZE);
+    } else {
+        err = new_map(file, hint);
+    }
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return err;
+}
+
+int new_map(descr_struct *file, file_hint *hint)
+{
+    if ((FEATURES & FEATURE_EXTENTS) && file->type != DIR_TYPE)
+    {
+        file->flags |= DESCR_EXTENTS;
+        file->blocks_id = 0;
+        return STATUS_OK;
+    }
+    int block_id = new_index_block(hint->goal);
+    if (block_id == -1)
+        return STATUS_NO_SPACE_LEFT;
+    file->blocks_id = block_id;
+    hint->goal = block_id + 1;
+    return STATUS_OK;
+}
+
+/* Give an inline or packed file an empty map, leaving its bytes where
+   they are for the caller to move. */
+int map_uninline(descr_struct *file)
+{
+    journal_dirty(file, DESCR_SIZE);
+    pthread_mutex_lock(HINT_LOCK(file));
+    int err = new_map(file, hint_of(file));
+    if (err == STATUS_OK)
+    {
+        file->flags &= ~(DESCR_INLINE | DESCR_PACKED);
+        file->pack_unit = 0;
+        file->pack_units = 0;
+    }
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return err;
+}
+
+/* Drop the empty map or the packed units of a file on an image with
+   FEATURE_INLINE_DATA and keep its bytes inline again; inline_data must
+   be zeros past the size. */
+void map_inline(descr_struct *file)
+{
+    journal_dirty(file, DESCR_SIZE);
+    if (is_packed(file))
+        pack_free(file);
+    else if (!has_extents(file))
+        umask_block(file->blocks_id);
+    file->flags = (file->flags & ~(DESCR_EXTENTS | DESCR_HOLES)) | DESCR_INLINE;
+    file->blocks_id = 0;
+    file->depth = 0;
+    file->extents_num = 0;
+}
+
+/* Number of blocks from logical block BLOCK_ID on, at most MAX_NUM, that
+   sit next to each other on disk; *START is the first of them. */
+int map_run(descr_struct *file, int block_id, int max_num, int *start)
+{
+    if (!has_map(file))
+        return 0;
+    if (has_extents(file))
+        return ext_run(file, block_id, max_num, start);
+    pthread_mutex_lock(HINT_LOCK(file));
+    int run = index_run(file, block_id, max_num, start);
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return run;
+}
+
+int index_run(descr_struct *file, int block_id, int max_num, int *start)
+{
+    int *slot = index_slot(file, block_id, false);
+    if (slot == NULL || *slot == 0)
+        return 0;
+    // stay within the index block the slot is in
+    int left = INDEX_ENTRIES - block_id % INDEX_ENTRIES;
+    if (max_num > left)
+        max_num = left;
+    int run = 1;
+    while (run < max_num && slot[run] == slot[0] + run)
+        run++;
+    *start = slot[0];
+    return run;
+}
+
+/* Where the block after the first BLOCKS_NUM of FILE should go. */
+int file_goal(descr_struct *file, int blocks_num)
+{
+    file_hint *hint = hint_of(file);
+    if (hint->goal != -1)
+        return hint->goal;
+    int start;
+    if (blocks_num > 0)
+    {
+        // the hint lock is held already, don't go through map_run()
+        int last = blocks_num - 1;
+        int run = has_extents(file) ? ext_run(file, last, 1, &start) : index_run(file, last, 1, &start);
+        if (run)
+            return start + 1;
+    }
+    return has_extents(file) ? -1 : file->blocks_id + 1;
+}
+
+/* Map new blocks for logical blocks up to BLOCKS_NUM, taking them in runs
+   as long as possible.  On failure the map is left as it was. */
+int map_grow(descr_struct *file, int blocks_num)
+{
+    pthread_mutex_lock(HINT_LOCK(file));
+    int err = grow_map(file, blocks_num);
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return err;
+}
+
+int grow_map(descr_struct *file, int blocks_num)
+{
+    int old_blocks_num = BLOCKS_NUM(file);
+    bool extents = has_extents(file);
+    if (!extents)
+    {
+        if (blocks_num > index_capacity(MAX_INDEX_LEVELS))
+            return STATUS_SIZE_ERR;
+        while (blocks_num > index_capacity(index_levels(file)))
+        {
+            int err = index_deepen(file);
+            if (err)
+            {
+                index_shallow(file, old_blocks_num);
+                return err;
+            }
+        }
+    }
+
+    int goal = file_goal(file, old_blocks_num);
+    int err = STATUS_OK;
+    int i = old_blocks_num;
+    while (i < blocks_num)
+    {
+        int start;
+        int run = alloc_for(file, goal, blocks_num - i, &start);
+        if (run == 0)
+        {
+            err = STATUS_NO_SPACE_LEFT;
+            break;
+        }
+        if (extents)
+        {
+            int inserted;
+            err = ext_insert(file, i, start, run, &inserted);
+            if (err)
+            {
+                // what was mapped goes with the truncate below
+                free_range(start + inserted, run - inserted);
+                run = inserted;
+            }
+        } else {
+            for (int j = 0; j < run; ++j)
+            {
+                int *slot = index_slot(file, i + j, true);
+                if (slot == NULL)
+                {
+                    free_range(start + j, run - j);
+                    run = j;
+                    err = STATUS_NO_SPACE_LEFT;
+                    break;
+                }
+                journal_dirty(slot, sizeof(int));
+                *slot = start + j;
+            }
+        }
+        i += run;
+        goal = start + run;
+        if (err)
+            break;
+    }
+    if (err)
+    {
+        if (extents)
+            ext_truncate(file, old_blocks_num);
+        else
+            index_shrink(file, old_blocks_num, i);
+        return err;
+    }
+    hint_of(file)->goal = goal;
+    return STATUS_OK;
+}
+
+/* Most blocks the map of a file may take to grow by BLOCKS: extent
+   leaves hold the fewest entries, at worst one for each block and half
+   full after a split, and each level above may gain a node on the way. */
+int map_spare(int blocks)
+{
+    int entries = BLOCK_SIZE / sizeof(extent_struct) / 2;
+    return blocks / entries + 1 + MAX_MAP_LEVELS;
+}
+
+/* Map zeroed blocks to the holes among logical blocks [FIRST, END), which
+   lie below the end of the file.  On failure the holes filled so far
+   stay filled, they read as zeros all the same. */
+int map_fill(descr_struct *file, int first, int end)
+{
+    pthread_mutex_lock(HINT_LOCK(file));
+    bool extents = has_extents(file);
+    int err = STATUS_OK;
+    while (!extents && end > index_capacity(index_levels(file)) && err == STATUS_OK)
+        err = index_deepen(file);
+    int goal = -1;
+    int i = first;
+    while (i < end && err == STATUS_OK)
+    {
+        int start;
+        int run = extents ? ext_run(file, i, end - i, &start) : index_run(file, i, end - i, &start);
+        if (run > 0)
+        {
+            goal = start + run;
+            i += run;
+            continue;
+        }
+        // the hint lock is held already, don't go through map_hole()
+        int hole = 1;
+        if (extents)
+            hole = ext_hole(file, i, end - i);
+        while (!extents && i + hole < end && index_run(file, i + hole, 1, &start) == 0)
+            hole++;
+        run = alloc_for(file, goal, hole, &start);
+        if (run == 0)
+        {
+            err = STATUS_NO_SPACE_LEFT;
+            break;
+        }
+        // what isn't written of them has to read as zeros
+        memset(BLOCKS(start), 0, (int64_t) run * BLOCK_SIZE);
+        mark_dirty(BLOCKS(start), (int64_t) run * BLOCK_SIZE);
+        int mapped = run;
+        if (extents)
+        {
+            err = ext_insert(file, i, start, run, &mapped);
+        } else {
+            for (int j = 0; j < run; ++j)
+            {
+                int *slot = index_slot(file, i + j, true);
+                if (slot == NULL)
+                {
+                    err = STATUS_NO_SPACE_LEFT;
+                    mapped = j;
+                    break;
+                }
+                journal_dirty(slot, sizeof(int));
+                *slot = start + j;
+            }
+        }
+        // the blocks mapped already stay with the file
+        if (err)
+            free_range(start + mapped, run - mapped);
+        goal = start + run;
+        i += run;
+    }
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return err;
+}
+
+/* Number of logical blocks from BLOCK_ID on, at most MAX_NUM, that are
+   holes. */
+int map_hole(descr_struct *file, int block_id, int max_num)
+{
+    if (has_extents(file))
+        return ext_hole(file, block_id, max_num);
+    pthread_mutex_lock(HINT_LOCK(file));
+    int hole = 0;
+    int start;
+    while (hole < max_num && index_run(file, block_id + hole, 1, &start) == 0)
+        hole++;
+    pthread_mutex_unlock(HINT_LOCK(file));
+    return hole;
+}
+
+/* Free the blocks past the first BLOCKS_NUM. */
+void map_shrink(descr_struct *file, int blocks_num)
+{
+    pthread_mutex_lock(HINT_LOCK(file));
+    shrink_map(file, blocks_num);
+    pthread_mutex_unlock(HINT_LOCK(file));
+}
+
+void shrink_map(descr_struct *file, int blocks_num)
+{
+    if (!has_map(file))
+        return;
+    // the map knows better where the file ends now
+    hint_of(file)->goal = -1;
+    if (has_extents(file))
+        ext_truncate(file, blocks_num);
+    else
+        index_shrink(file, blocks_num, BLOCKS_NUM(file));
+}
+
+/* Free the data blocks and the map itself. */
+void map_release(descr_struct *file)
+{
+    if (is_packed(file))
+    {
+        pack_free(file);
+        return;
+    }
+    pthread_mutex_lock(HINT_LOCK(file));
+    set_window(hint_of(file), 0, 0);
+    shrink_map(file, 0);
+    pthread_mutex_unlock(HINT_LOCK(file));
+    if (!has_extents(file) && has_map(file))
+        umask_block(file->blocks_id);
+}
+
+/* Number of physically contiguous runs the file data is split into. */
+int map_fragments(descr_struct *file)
+{
+    int blocks_num = BLOCKS_NUM(file);
+    int fragments = 0;
+    int next = -1;
+    for (int i = 0; i < blocks_num;)
+    {
+        int start;
+        int run = map_run(file, i, blocks_num - i, &start);
+        if (run == 0)
+        {
+            i++;
+            continue;
+        }
+        if (start != next)
+            fragments++;
+        next = start + run;
+        i += run;
+    }
+    return fragments;
+}
+
+/* Blocks holding the file data, extent tree nodes included. */
+int map_blocks_num(descr_struct *file)
+{
+    if (has_extents(file))
+        return ext_blocks_num(file);
+    int blocks_num = BLOCKS_NUM(file);
+    int mapped = 0;
+    for (int i = 0; i < blocks_num;)
+    {
+        int start;
+        int run = map_run(file, i, blocks_num - i, &start);
+        mapped += run;
+        i += run ? run : 1;
+    }
+    return mapped;
+}
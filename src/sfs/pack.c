@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/alloc.h"
+#include "sfs/map.h"
+#include "sfs/journal.h"
+#include "sfs/pack.h"
+
+/*
+ * Tail packing.
+ *
+ * On images with FEATURE_TAIL_PACKING a file that outgrew its descriptor
+ * but is still small, up to pack_size bytes and half a block, gets no
+ * block of its own.  Its bytes go into a run of units of a packed block
+ * shared with other small files: the block is cut into PACK_UNITS units
+ * and the first one holds the bitmap of those in use.  The descriptor has
+ * DESCR_PACKED, the block in blocks_id and the run in pack_unit and
+ * pack_units, and the bytes of the run past the size are zeros.  A
+ * thousand 200-byte files then take a few dozen blocks rather than a
+ * thousand.
+ *
+ * A packed file grows in place while the units after it are free and
+ * moves to a longer run otherwise.  Past the limit it gets a map and
+ * blocks like any other file and stays that way.  Shrinking gives back
+ * the units it no longer needs, and a packed block is freed with its
+ * last unit.
+ *
+ * A packed block holds bytes of several files, and the journal logs whole
+ * blocks, so everything written to one is journaled like metadata;
+ * otherwise replaying the bitmap would bring back stale bytes of its
+ * neighbours.
+ *
+ * The blocks with free units are remembered in memory, up to PACK_SLOTS
+ * of them, the emptiest ones when there are more.  Mount finds them by
+ * going over the packed descriptors, and after that they are remembered
+ * as they are made and as units are given back.
+ * The bitmaps and the table are guarded by the pack lock, taken after
+ * the hint slot lock and before the allocator.
+ */
+
+#define PACK_UNITS 64
+#define PACK_SLOTS 64
+#define UNIT_SIZE (BLOCK_SIZE / PACK_UNITS)
+
+typedef struct pack_state {
+    // packed blocks known to have free units
+    int partial[PACK_SLOTS];
+    int partial_num;
+    pthread_mutex_t lock;
+    // packed blocks allocated and freed since mount
+    int made;
+    int freed;
+} pack_state;
+
+#define PACK (SFS->pack)
+
+/* Forward declarations. */
+int take_units(int units, int *block_id, int *unit);
+bool grow_units(descr_struct *file, int units);
+uint64_t *unit_bitmap(int block_id);
+void remember(pack_state *pack, int block_id);
+
+
+int pack_init()
+{
+    pack_state *pack = calloc(1, sizeof(pack_state));
+    if (pack == NULL)
+        return STATUS_NO_SPACE_LEFT;
+    pthread_mutex_init(&pack->lock, NULL);
+    // the packed blocks with room from before mount
+    if (FEATURES & FEATURE_TAIL_PACKING)
+    {
+        for (int i = 0; i < DESCRS_READY; ++i)
+        {
+            descr_struct *descr = DESCR(i);
+            if (descr->type != 0 && (descr->flags & DESCR_PACKED)
+                && *unit_bitmap(descr->blocks_id) != ~(uint64_t) 0)
+                remember(pack, descr->blocks_id);
+        }
+    }
+    PACK = pack;
+    return STATUS_OK;
+}
+
+void pack_release()
+{
+    pack_state *pack = PACK;
+    if (pack == NULL)
+        return;
+    pthread_mutex_destroy(&pack->lock);
+    free(pack);
+    PACK = NULL;
+}
+
+bool is_packed(descr_struct *file)
+{
+    return (FEATURES & FEATURE_TAIL_PACKING) && (file->flags & DESCR_PACKED);
+}
+
+/* Can FILE, inline or packed now, keep NEW_SIZE bytes in a packed block? */
+bool pack_fits(descr_struct *file, int64_t new_size)
+{
+    if (PACK == NULL || SFS->pack_size == 0 || !(FEATURES & FEATURE_TAIL_PACKING))
+        return false;
+    if (file->type != FILE_TYPE && file->type != LINK_TYPE)
+        return false;
+    if (!is_inline(file) && !is_packed(file))
+        return false;
+    return new_size <= SFS->pack_size && new_size <= BLOCK_SIZE / 2;
+}
+
+int units_for(int64_t size)
+{
+    int units = (size + UNIT_SIZE - 1) / UNIT_SIZE;
+    return units > 0 ? units : 1;
+}
+
+uint64_t unit_mask(int unit, int units)
+{
+    return (((uint64_t) 1 << units) - 1) << unit;
+}
+
+uint64_t *unit_bitmap(int block_id)
+{
+    return (uint64_t *) BLOCKS(block_id);
+}
+
+/* First of UNITS set bits in a row in FREE, -1 if there are none. */
+int unit_run(uint64_t free, int units)
+{
+    uint64_t starts = free;
+    for (int i = 1; i < units && starts; ++i)
+        starts &= free >> i;
+    return starts ? __builtin_ctzll(starts) : -1;
+}
+
+/* With the pack lock held. */
+void remember(pack_state *pack, int block_id)
+{
+    for (int i = 0; i < pack->partial_num; ++i)
+    {
+        if (pack->partial[i] == block_id)
+            return;
+    }
+    if (pack->partial_num < PACK_SLOTS)
+    {
+        pack->partial[pack->partial_num++] = block_id;
+        return;
+    }
+    // the fullest has the least room to offer
+    int fullest = 0;
+    for (int i = 1; i < PACK_SLOTS; ++i)
+    {
+        if (__builtin_popcountll(*unit_bitmap(pack->partial[i]))
+            > __builtin_popcountll(*unit_bitmap(pack->partial[fullest])))
+            fullest = i;
+    }
+    if (__builtin_popcountll(*unit_bitmap(block_id)) < __builtin_popcountll(*unit_bitmap(pack->partial[fullest])))
+        pack->partial[fullest] = block_id;
+}
+
+/* With the pack lock held. */
+void forget(pack_state *pack, int block_id)
+{
+    for (int i = 0; i < pack->partial_num; ++i)
+    {
+        if (pack->partial[i] != block_id)
+            continue;
+        memmove(pack->partial + i, pack->partial + i + 1, (pack->partial_num - i - 1) * sizeof(int));
+        pack->partial_num--;
+        return;
+    }
+}
+
+/* Take UNITS units in a row from a packed block with room, or from a new
+   one next to the last remembered. */
+int take_units(int units, int *block_id, int *unit)
+{
+    pack_state *pack = PACK;
+    pthread_mutex_lock(&pack->lock);
+    *unit = -1;
+    for (int i = pack->partial_num - 1; i >= 0 && *unit == -1; --i)
+    {
+        *block_id = pack->partial[i];
+        *unit = unit_run(~*unit_bitmap(*block_id), units);
+    }
+    if (*unit == -1)
+    {
+        int goal = pack->partial_num ? pack->partial[pack->partial_num - 1] + 1 : -1;
+        if (alloc_blocks(goal, 1, block_id) == 0)
+        {
+            pthread_mutex_unlock(&pack->lock);
+            return STATUS_NO_SPACE_LEFT;
+        }
+        uint64_t *bitmap = unit_bitmap(*block_id);
+        journal_dirty(bitmap, sizeof(uint64_t));
+        // unit 0 is the bitmap itself
+        *bitmap = 1;
+        *unit = 1;
+        pack->made++;
+        remember(pack, *block_id);
+    }
+    uint64_t *bitmap = unit_bitmap(*block_id);
+    journal_dirty(bitmap, sizeof(uint64_t));
+    *bitmap |= unit_mask(*unit, units);
+    if (*bitmap == ~(uint64_t) 0)
+        forget(pack, *block_id);
+    pthread_mutex_unlock(&pack->lock);
+    return STATUS_OK;
+}
+
+/* Give back UNITS units from UNIT on of packed block BLOCK_ID, and the
+   block with its last one. */
+void pack_put(int block_id, int unit, int units)
+{
+    pack_state *pack = PACK;
+    pthread_mutex_lock(&pack->lock);
+    uint64_t *bitmap = unit_bitmap(block_id);
+    journal_dirty(bitmap, sizeof(uint64_t));
+    *bitmap &= ~unit_mask(unit, units);
+    if (*bitmap == 1)
+    {
+        forget(pack, block_id);
+        umask_block(block_id);
+        pack->freed++;
+    } else {
+        remember(pack, block_id);
+    }
+    pthread_mutex_unlock(&pack->lock);
+}
+
+/* Take the units right after the run of a packed FILE, if they are free,
+   so it has UNITS of them. */
+bool grow_units(descr_struct *file, int units)
+{
+    int end = file->pack_unit + file->pack_units;
+    int more = units - file->pack_units;
+    if (end + more > PACK_UNITS)
+        return false;
+    pack_state *pack = PACK;
+    pthread_mutex_lock(&pack->lock);
+    uint64_t *bitmap = unit_bitmap(file->blocks_id);
+    bool taken = *bitmap & unit_mask(end, more);
+    if (!taken)
+    {
+        journal_dirty(bitmap, sizeof(uint64_t));
+        *bitmap |= unit_mask(end, more);
+        if (*bitmap == ~(uint64_t) 0)
+            forget(pack, file->blocks_id);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    if (taken)
+        return false;
+    // a file that was there before may have left its bytes
+    char *data = pack_span(file) + pack_room(file);
+    journal_dirty(data, (int64_t) more * UNIT_SIZE);
+    memset(data, 0, (int64_t) more * UNIT_SIZE);
+    journal_dirty(file, DESCR_SIZE);
+    file->pack_units = units;
+    return true;
+}
+
+/* Make room in a packed block for NEW_SIZE bytes of an inline or packed
+   FILE, after pack_fits() said it may.  The caller sets the size.  On
+   failure the bytes stay where they were. */
+int pack_grow(descr_struct *file, int64_t new_size)
+{
+    int units = units_for(new_size);
+    bool packed = is_packed(file);
+    if (packed && (units <= file->pack_units || grow_units(file, units)))
+        return STATUS_OK;
+    int block_id, unit;
+    int err = take_units(units, &block_id, &unit);
+    if (err)
+        return err;
+    char *data = (char *) BLOCKS(block_id) + unit * UNIT_SIZE;
+    int64_t size = disk_size(file);
+    journal_dirty(data, (int64_t) units * UNIT_SIZE);
+    memcpy(data, packed ? pack_span(file) : file->inline_data, size);
+    memset(data + size, 0, (int64_t) units * UNIT_SIZE - size);
+    if (packed)
+    {
+        pack_free(file);
+    } else {
+        journal_dirty(file, DESCR_SIZE);
+        memset(file->inline_data, 0, INLINE_DATA_SIZE);
+    }
+    pack_set(file, block_id, unit, units);
+    return STATUS_OK;
+}
+
+/* Zero the bytes of a packed FILE past NEW_SIZE and give back the units
+   it doesn't need any more, keeping one.  The caller sets the size. */
+void pack_shrink(descr_struct *file, int64_t new_size)
+{
+    int64_t old_size = disk_size(file);
+    char *data = pack_span(file);
+    journal_dirty(data + new_size, old_size - new_size);
+    memset(data + new_size, 0, old_size - new_size);
+    int units = units_for(new_size);
+    if (units >= file->pack_units)
+        return;
+    pack_put(file->blocks_id, file->pack_unit + units, file->pack_units - units);
+    journal_dirty(file, DESCR_SIZE);
+    file->pack_units = units;
+}
+
+/* Keep the bytes of FILE in UNITS units from UNIT on of packed block
+   BLOCK_ID. */
+void pack_set(descr_struct *file, int block_id, int unit, int units)
+{
+    journal_dirty(file, DESCR_SIZE);
+    file->flags = (file->flags & ~DESCR_INLINE) | DESCR_PACKED;
+    file->blocks_id = block_id;
+    file->pack_unit = unit;
+    file->pack_units = units;
+}
+
+/* Give back the units of a packed FILE, which is left without data. */
+void pack_free(descr_struct *file)
+{
+    pack_put(file->blocks_id, file->pack_unit, file->pack_units);
+    journal_dirty(file, DESCR_SIZE);
+    file->flags &= ~DESCR_PACKED;
+    file->blocks_id = 0;
+    file->pack_unit = 0;
+    file->pack_units = 0;
+}
+
+/* Where the bytes of a packed FILE start. */
+char *pack_span(descr_struct *file)
+{
+    return (char *) BLOCKS(file->blocks_id) + file->pack_unit * UNIT_SIZE;
+}
+
+/* Bytes the units of a packed FILE hold. */
+int pack_room(descr_struct *file)
+{
+    return file->pack_units * UNIT_SIZE;
+}
+
+int compare_blocks(const void *a, const void *b)
+{
+    return *(int *) a - *(int *) b;
+}
+
+/* Print how well the packed files of the image fill their blocks, given
+   the blocks of all FILES_NUM of them, BYTES long together. */
+void pack_dump_stats(int *blocks, int files_num, int64_t bytes)
+{
+    if (files_num > 0)
+        qsort(blocks, files_num, sizeof(int), compare_blocks);
+    int blocks_num = 0;
+    for (int i = 0; i < files_num; ++i)
+    {
+        if (i == 0 || blocks[i] != blocks[i - 1])
+            blocks_num++;
+    }
+    printf("packed files: %d in %d blocks\n", files_num, blocks_num);
+    // 100% would be packed blocks full of file bytes
+    printf("packing efficiency: %.1f%%\n",
+           blocks_num ? 100.0 * bytes / ((double) blocks_num * BLOCK_SIZE) : 0.0);
+    pack_state *pack = PACK;
+    if (pack == NULL)
+        return;
+    pthread_mutex_lock(&pack->lock);
+    printf("packed blocks: %d made, %d freed, %d with room\n", pack->made, pack->freed, pack->partial_num);
+    pthread_mutex_unlock(&pack->lock);
+}
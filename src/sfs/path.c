@@ -0,0 +1,410 @@
+#include <string.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/dir.h"
+#include "sfs/dcache.h"
+#include "sfs/path.h"
+#include "sfs/map.h"
+
+/*
+ * Path resolution.
+ *
+ * A path is split into components in one pass without copying it: "." is
+ * dropped and ".." removes the previous component, so ".." is resolved
+ * lexically against the path as written, the way the shell shows it in
+ * pwd().  A relative path is walked from the working directory descriptor
+ * unless it climbs above it, in which case the components of WORK_DIR are
+ * put in front and the walk starts from the root.
+ *
+ * Symlinks are resolved by the same loop that walks the components: the
+ * target is spliced into the path in place of the link and the walk goes
+ * on from the directory holding the link for a relative target, or from
+ * the root.  Within a target ".." is the parent on disk, as in POSIX.  A
+ * walk goes through at most MAX_SYMLINK_HOPS links, so a loop ends in
+ * STATUS_LOOP rather than running forever, and every link resolved on
+ * the way is cached with the descriptor it led to (see dcache.c), so a
+ * path through links costs about what the plain path does.  Nothing here
+ * touches the heap.
+ */
+
+#define MAX_COMPONENTS MAX_PATH_SIZE
+// symlinks one walk may go through, as many as Linux allows
+#define MAX_SYMLINK_HOPS 40
+// the walk has to start over from the root, never returned outside
+#define WALK_AGAIN -1
+
+typedef struct {
+    char *name;
+    int len;
+} component;
+
+typedef struct {
+    component items[MAX_COMPONENTS];
+    int num;
+    bool from_cwd;
+} components;
+
+
+/* Put the components of WORK_DIR in front of COMPS. */
+int rebase_on_cwd(components *comps)
+{
+    int cwd_num = 0;
+    for (char *p = WORK_DIR; *p; ++p)
+    {
+        if (*p != '/' && (p == WORK_DIR || p[-1] == '/'))
+            cwd_num++;
+    }
+    if (cwd_num + comps->num > MAX_COMPONENTS)
+        return STATUS_NAME_TOO_LONG;
+    memmove(comps->items + cwd_num, comps->items, comps->num * sizeof(component));
+    comps->num += cwd_num;
+    comps->from_cwd = false;
+
+    component *item = comps->items;
+    for (char *p = WORK_DIR; *p; ++p)
+    {
+        if (*p == '/' || (p != WORK_DIR && p[-1] != '/'))
+            continue;
+        item->name = p;
+        item->len = strcspn(p, "/");
+        item++;
+    }
+    return STATUS_OK;
+}
+
+int split_path(char *path, components *comps)
+{
+    comps->num = 0;
+    comps->from_cwd = path[0] != '/';
+    char *p = path;
+    while (*p)
+    {
+        if (*p == '/')
+        {
+            p++;
+            continue;
+        }
+        char *name = p;
+        while (*p && *p != '/')
+            p++;
+        int len = p - name;
+
+        if (len == 1 && name[0] == '.')
+            continue;
+        if (len == 2 && name[0] == '.' && name[1] == '.')
+        {
+            if (comps->num == 0 && comps->from_cwd)
+            {
+                int err = rebase_on_cwd(comps);
+                if (err)
+                    return err;
+            }
+            // ".." of the root is the root
+            if (comps->num > 0)
+                comps->num--;
+            continue;
+        }
+        if (comps->num == MAX_COMPONENTS)
+            return STATUS_NAME_TOO_LONG;
+        comps->items[comps->num].name = name;
+        comps->items[comps->num].len = len;
+        comps->num++;
+    }
+    // the working directory itself has to be named from its parent
+    if (comps->from_cwd && (comps->num == 0 || WORK_DIR_ID == NO_DESCR))
+        return rebase_on_cwd(comps);
+    return STATUS_OK;
+}
+
+int normalize_path(char *path, char *normalized)
+{
+    components comps;
+    int err = split_path(path, &comps);
+    if (err)
+        return err;
+    if (comps.from_cwd)
+    {
+        err = rebase_on_cwd(&comps);
+        if (err)
+            return err;
+    }
+
+    int len = 0;
+    for (int i = 0; i < comps.num; ++i)
+    {
+        if (len + 1 + comps.items[i].len >= MAX_PATH_SIZE)
+            return STATUS_NAME_TOO_LONG;
+        normalized[len++] = '/';
+        memcpy(normalized + len, comps.items[i].name, comps.items[i].len);
+        len += comps.items[i].len;
+    }
+    if (len == 0)
+        normalized[len++] = '/';
+    normalized[len] = '\0';
+    return STATUS_OK;
+}
+
+/* Append the components of symlink TARGET to COMPS.  Unlike in a path
+   given to walk_path(), ".." stays a component: it goes back to the
+   directory the walk came from, the parent on disk, as in POSIX. */
+int append_target(char *target, components *comps)
+{
+    char *p = target;
+    while (*p)
+    {
+        if (*p == '/')
+        {
+            p++;
+            continue;
+        }
+        char *name = p;
+        while (*p && *p != '/')
+            p++;
+        int len = p - name;
+        if (len == 1 && name[0] == '.')
+            continue;
+        if (comps->num == MAX_COMPONENTS)
+            return STATUS_NAME_TOO_LONG;
+        comps->items[comps->num].name = name;
+        comps->items[comps->num].len = len;
+        comps->num++;
+    }
+    return STATUS_OK;
+}
+
+bool is_dotdot(component *comp)
+{
+    return comp->len == 2 && comp->name[0] == '.' && comp->name[1] == '.';
+}
+
+/* Put the target of LINK, met at component I of COMPS, in its place:
+   spell the target and the components after I into SPLICED and split
+   that into COMPS.  *TARGET_NUM is set to the number of components of the
+   target. */
+int splice_link(descr_struct *link, components *comps, int i, char *spliced, int *target_num)
+{
+    int64_t len = file_size(link);
+    if (len >= MAX_PATH_SIZE)
+        return STATUS_NAME_TOO_LONG;
+    int err = read_descr(link, 0, len, spliced);
+    if (err)
+        return err;
+    int target_len = len;
+    for (int k = i + 1; k < comps->num; ++k)
+    {
+        if (len + 1 + comps->items[k].len >= MAX_PATH_SIZE)
+            return STATUS_NAME_TOO_LONG;
+        spliced[len++] = '/';
+        memcpy(spliced + len, comps->items[k].name, comps->items[k].len);
+        len += comps->items[k].len;
+    }
+    spliced[len] = '\0';
+    comps->num = 0;
+    err = append_target(spliced, comps);
+    if (err)
+        return err;
+    *target_num = 0;
+    while (*target_num < comps->num && comps->items[*target_num].name < spliced + target_len)
+        (*target_num)++;
+    return STATUS_OK;
+}
+
+/* Walk COMPS into WALK, see walk_path().  A symlink is resolved in the
+   same loop: its target is spliced in place of it and the walk goes on
+   from the directory of the link, or from the root for an absolute
+   target.  Every resolved link is cached, so the next walk through it
+   costs one lookup; with CACHED unset the cache is only filled.  A jump
+   through the cache doesn't tell the directories above the target, so
+   if a ".." climbs above what the walk knows, WALK_AGAIN asks to walk
+   once more from the root without the cache. */
+int walk_components(components *comps, bool follow, bool cached, path_struct *walk)
+{
+    // a target and the components after its link are spelled here in turn
+    char spliced[2][MAX_PATH_SIZE];
+    // links whose targets are being walked, the innermost last
+    struct {
+        int link_id;
+        int dir_id;
+        // the target ends right before this component
+        int end;
+        // HOPS before the link
+        int hops;
+    } links[MAX_SYMLINK_HOPS];
+    int links_num = 0;
+    int hops = 0;
+    int splices = 0;
+    // the directories walked through, for ".." in targets; the bottom one
+    // is the root if ROOTED is set, otherwise its parent is unknown
+    int dirs[MAX_COMPONENTS];
+    int depth = 1;
+    bool rooted = !comps->from_cwd;
+    dirs[0] = rooted ? 0 : WORK_DIR_ID;
+    descr_struct *cur = DESCR(dirs[0]);
+    // where the last component is when it is a followed link
+    descr_struct *link_dir = NULL;
+    char link_name[FILENAME_SIZE];
+    int err = STATUS_OK;
+    walk->parent = NULL;
+    walk->name[0] = '\0';
+    for (int i = 0; ; ++i)
+    {
+        // the links whose targets end here lead to CUR
+        for (; links_num > 0 && links[links_num - 1].end == i; --links_num)
+        {
+            int link_hops = hops - links[links_num - 1].hops;
+            dcache_put_link(links[links_num - 1].link_id, links[links_num - 1].dir_id, cur->id, link_hops);
+        }
+        if (i == comps->num)
+            break;
+        component *comp = comps->items + i;
+        bool last = i == comps->num - 1;
+        if (cur->type != DIR_TYPE)
+        {
+            err = STATUS_NOT_FOUND;
+            break;
+        }
+        if (comp->len >= FILENAME_SIZE)
+        {
+            err = last ? STATUS_NAME_TOO_LONG : STATUS_NOT_FOUND;
+            break;
+        }
+        memcpy(walk->name, comp->name, comp->len);
+        walk->name[comp->len] = '\0';
+        walk->parent = cur;
+
+        if (is_dotdot(comp))
+        {
+            if (depth > 1)
+                depth--;
+            else if (!rooted)
+                return WALK_AGAIN;
+            cur = DESCR(dirs[depth - 1]);
+            continue;
+        }
+        int descr_id = dir_lookup(cur, walk->name);
+        if (descr_id == NO_DESCR)
+        {
+            err = last ? STATUS_OK : STATUS_NOT_FOUND;
+            cur = NULL;
+            break;
+        }
+        cur = DESCR(descr_id);
+        if (cur->type != LINK_TYPE || (last && !follow))
+        {
+            if (depth == MAX_COMPONENTS)
+            {
+                err = STATUS_NAME_TOO_LONG;
+                break;
+            }
+            dirs[depth++] = descr_id;
+            continue;
+        }
+        if (last && link_dir == NULL)
+        {
+            link_dir = walk->parent;
+            strcpy(link_name, walk->name);
+        }
+        // a cached link costs the hops it took, so a walk loops or not
+        // whatever is cached
+        int target_id;
+        int link_hops;
+        if (cached && dcache_get_link(cur->id, walk->parent->id, &target_id, &link_hops))
+        {
+            hops += link_hops;
+            if (hops > MAX_SYMLINK_HOPS)
+                return STATUS_LOOP;
+            cur = DESCR(target_id);
+            dirs[0] = target_id;
+            depth = 1;
+            rooted = target_id == 0;
+            continue;
+        }
+        if (++hops > MAX_SYMLINK_HOPS)
+            return STATUS_LOOP;
+        // COMPS point into the other buffer
+        char *target = spliced[splices++ % 2];
+        int target_num;
+        err = splice_link(cur, comps, i, target, &target_num);
+        if (err)
+            return err;
+        // what is left of the outer targets moved along
+        for (int k = 0; k < links_num; ++k)
+            links[k].end += target_num - (i + 1);
+        links[links_num].link_id = cur->id;
+        links[links_num].dir_id = walk->parent->id;
+        links[links_num].end = target_num;
+        links[links_num].hops = hops - 1;
+        links_num++;
+        if (target[0] == '/')
+        {
+            dirs[0] = 0;
+            depth = 1;
+            rooted = true;
+        }
+        cur = DESCR(dirs[depth - 1]);
+        i = -1;
+    }
+    if (link_dir)
+    {
+        // a dangling link names nothing, like a missing file
+        if (err == STATUS_NOT_FOUND)
+            cur = NULL;
+        err = err == STATUS_NOT_FOUND ? STATUS_OK : err;
+        walk->parent = link_dir;
+        strcpy(walk->name, link_name);
+    }
+    walk->target = cur;
+    return err;
+}
+
+/* Resolve PATH into WALK.  Symlinks met on the way are always followed,
+   the last component only if FOLLOW is set, at most MAX_SYMLINK_HOPS of
+   them, STATUS_LOOP past that.  A missing last component is not an error:
+   WALK->target is NULL and WALK->parent and WALK->name say where it would
+   be created.  For a followed link they say where the link is. */
+int walk_path(char *path, bool follow, path_struct *walk)
+{
+    components comps;
+    for (bool cached = true; ; cached = false)
+    {
+        int err = split_path(path, &comps);
+        if (err == STATUS_OK && !cached && comps.from_cwd)
+            err = rebase_on_cwd(&comps);
+        if (err)
+            return err;
+        err = walk_components(&comps, follow, cached, walk);
+        if (err != WALK_AGAIN)
+            return err;
+    }
+}
+
+/* Resolve TARGET of a symlink at LINK_PATH into WALK, the way walking
+   through the link would. */
+int walk_target(char *link_path, char *target, path_struct *walk)
+{
+    components comps;
+    for (bool cached = true; ; cached = false)
+    {
+        int err = split_path(link_path, &comps);
+        if (err == STATUS_OK && !cached && comps.from_cwd)
+            err = rebase_on_cwd(&comps);
+        if (err)
+            return err;
+        if (comps.num == 0)
+            return STATUS_NOT_FOUND;
+        // the target is walked from the directory of the link
+        comps.num--;
+        if (target[0] == '/')
+        {
+            comps.num = 0;
+            comps.from_cwd = false;
+        }
+        err = append_target(target, &comps);
+        if (err)
+            return err;
+        err = walk_components(&comps, true, cached, walk);
+        if (err != WALK_AGAIN)
+            return err;
+    }
+}
@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfs/core.h"
+#include "sfs/map.h"
+#include "sfs/readahead.h"
+
+/*
+ * Readahead.
+ *
+ * The image is mapped, so a cold read takes a page fault for every page
+ * it touches.  While the reads through a fid follow each other, the pages
+ * ahead of the reader are asked for with MADV_WILLNEED, and the kernel
+ * reads them in big requests while the reader is still copying.  Like
+ * Linux, the window starts at a few times the read size and doubles every
+ * time the reader gets halfway into it, up to RA_MAX_SIZE; a read
+ * anywhere else starts over.  SFS_ADVICE_SEQUENTIAL starts with the
+ * biggest window and SFS_ADVICE_RANDOM turns readahead off.
+ */
+
+#define RA_MIN_SIZE (128 * 1024)
+#define RA_MAX_SIZE (4 * 1024 * 1024)
+
+
+void will_need(uintptr_t from, uintptr_t to)
+{
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    from &= ~page_mask;
+    madvise((void *) from, to - from, MADV_WILLNEED);
+}
+
+/* Ask for the pages holding SIZE bytes of FILE at OFFSET, one call per
+   run of blocks next to each other in the image. */
+void prefetch(descr_struct *file, int64_t offset, int64_t size)
+{
+    int block_size = BLOCK_SIZE;
+    int block_id = offset / block_size;
+    int end = (offset + size + block_size - 1) / block_size;
+    uintptr_t from = 0;
+    uintptr_t to = 0;
+    while (block_id < end)
+    {
+        int start;
+        int run = map_run(file, block_id, end - block_id, &start);
+        if (run == 0)
+        {
+            block_id++;
+            continue;
+        }
+        uintptr_t span = (uintptr_t) BLOCKS(start);
+        if (span != to)
+        {
+            if (from != to)
+                will_need(from, to);
+            from = span;
+        }
+        to = span + (uintptr_t) run * block_size;
+        block_id += run;
+    }
+    if (from != to)
+        will_need(from, to);
+}
+
+/* Note a read of SIZE bytes at OFFSET of FILE through FID, and prefetch
+   what comes next if the reads look sequential. */
+void read_ahead(fid_struct *fid, descr_struct *file, int64_t offset, int64_t size)
+{
+    int64_t end = offset + size;
+    int64_t pos = __atomic_exchange_n(&fid->pos, end, __ATOMIC_RELAXED);
+    int advice = __atomic_load_n(&fid->advice, __ATOMIC_RELAXED);
+    if (advice == SFS_ADVICE_RANDOM || size == 0)
+        return;
+    int64_t ra_end = __atomic_load_n(&fid->ra_end, __ATOMIC_RELAXED);
+    int64_t ra_size = __atomic_load_n(&fid->ra_size, __ATOMIC_RELAXED);
+    if (offset != pos && advice != SFS_ADVICE_SEQUENTIAL)
+    {
+        if (ra_size != 0)
+        {
+            __atomic_store_n(&fid->ra_end, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&fid->ra_size, 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    // the pages up to ra_end are on their way, top up only halfway in
+    if (ra_size != 0 && end + ra_size / 2 < ra_end)
+        return;
+
+    if (ra_size == 0 && advice == SFS_ADVICE_SEQUENTIAL)
+        ra_size = RA_MAX_SIZE;
+    else if (ra_size == 0)
+        ra_size = 4 * size < RA_MIN_SIZE ? RA_MIN_SIZE : 4 * size;
+    else
+        ra_size *= 2;
+    if (ra_size > RA_MAX_SIZE)
+        ra_size = RA_MAX_SIZE;
+
+    int64_t from = ra_end > offset ? ra_end : offset;
+    int64_t to = end + ra_size;
+    // delayed writes are in memory already
+    if (to > disk_size(file))
+        to = disk_size(file);
+    if (from < to)
+        prefetch(file, from, to - from);
+    __atomic_store_n(&fid->ra_end, to > ra_end ? to : ra_end, __ATOMIC_RELAXED);
+    __atomic_store_n(&fid->ra_size, ra_size, __ATOMIC_RELAXED);
+}
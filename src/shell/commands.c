@@ -10,6 +10,8 @@
 #include "shell/commands.h"
 #include "sfs.h"
 
+#define CAT_IOV_NUM 16
+
 
 int com_mount(char *arg);
 int com_umount(char *arg);
@@ -33,9 +35,10 @@ int com_write(char *arg);
 int com_symlink(char *arg);
 int com_cat(char *arg);
 int com_dump_stats(char *arg);
+int com_sync(char *arg);
 
 COMMAND commands[] = {
-    { "mkfs", com_mkfs, "Create file system in file" },
+    { "mkfs", com_mkfs, "Create file system in file: FILE [BLOCK_SIZE [DESCR_PART [FILES [SIZE]]]]" },
     { "mount", com_mount, "Mount file system" },
     { "umount", com_umount, "Umount file system" },
     { "stat", com_stat, "Get info about descriptor spec. by ID" },
@@ -58,6 +61,7 @@ COMMAND commands[] = {
     { "symlink", com_symlink, "Create symlink from FILE1 to FILE2" },
     { "cat", com_cat, "Display whole file contents" },
     { "dump", com_dump_stats, "Print file system stats" },
+    { "sync", com_sync, "Write all changes back to the image" },
     { "quit", com_quit, "Quit shell" },
     { (char *)NULL, (Function *)NULL, (char *)NULL }
 };
@@ -147,11 +151,32 @@ int com_umount(char *ignore)
     }
 }
 
-int com_mkfs(char *path)
+int com_mkfs(char *arg)
 {
-    int err = mkfs(path);
-    if (err)
+    if (!valid_argument("mkfs", arg))
+        return STATUS_ERR;
+    char *path = strtok(arg, " ");
+    char *block_size_arg = strtok(NULL, " ");
+    char *part_arg = strtok(NULL, " ");
+    char *files_arg = strtok(NULL, " ");
+    char *size_arg = strtok(NULL, " ");
+    // with a size the file is made anew, sparse
+    if (size_arg && create_image(path, atoll(size_arg)))
     {
+        fprintf(stderr, "Can't make a %s bytes image\n", size_arg);
+        return STATUS_ERR;
+    }
+    int err = mkfs_geometry(path, block_size_arg ? atoi(block_size_arg) : 0,
+                            part_arg ? atof(part_arg) : 0, files_arg ? atoi(files_arg) : 0);
+    if (err == STATUS_SIZE_ERR)
+    {
+        fprintf(stderr, "Block size must be a power of two from 512 to 65536, "
+                "descriptors part below 1\n");
+        return STATUS_ERR;
+    } else if (err == STATUS_NO_SPACE_LEFT) {
+        fprintf(stderr, "File too small for this geometry\n");
+        return STATUS_ERR;
+    } else if (err) {
         fprintf(stderr, "Failed\n");
         return STATUS_ERR;
     }
@@ -200,6 +225,12 @@ int com_create(char *path)
     } else if (err == STATUS_EXISTS_ERR) {
         fprintf(stderr, "File or directory already exists\n");
         return STATUS_ERR;
+    } else if (err == STATUS_NAME_TOO_LONG) {
+        fprintf(stderr, "File name too long\n");
+        return STATUS_ERR;
+    } else if (err == STATUS_NOT_FOUND) {
+        fprintf(stderr, "No such file or directory\n");
+        return STATUS_ERR;
     } else {
         return STATUS_OK;
     }
@@ -217,6 +248,12 @@ int com_mkdir(char *path)
     } else if (err == STATUS_EXISTS_ERR) {
         fprintf(stderr, "File or directory already exists\n");
         return STATUS_ERR;
+    } else if (err == STATUS_NAME_TOO_LONG) {
+        fprintf(stderr, "File name too long\n");
+        return STATUS_ERR;
+    } else if (err == STATUS_NOT_FOUND) {
+        fprintf(stderr, "No such file or directory\n");
+        return STATUS_ERR;
     } else {
         return STATUS_OK;
     }
@@ -307,11 +344,11 @@ int com_read(char *arg)
         return STATUS_ERR;
     }
     int fid = atoi(fid_arg);
-    int offset = atoi(offset_arg);
+    int64_t offset = atoll(offset_arg);
     int size = atoi(size_arg);
     char *data = malloc(size + 1);
     data[size] = '\0';
-    int err = read_file(fid, offset, size, data);
+    int err = read_file64(fid, offset, size, data);
     if (err == STATUS_NOT_FOUND)
     {
         fprintf(stderr, "No such fid: %d\n", fid);
@@ -360,7 +397,7 @@ int com_write(char *arg)
         return STATUS_ERR;
     }
     int fid = atoi(fid_arg);
-    int offset = atoi(offset_arg);
+    int64_t offset = atoll(offset_arg);
     int size = atoi(size_arg);
     char *data = malloc(size + 1);
     fgets(data, size + 1, stdin);
@@ -371,7 +408,7 @@ int com_write(char *arg)
         c = getchar();
     } while (c != EOF && c != '\n');
 
-    int err = write_file(fid, offset, size, data);
+    int err = write_file64(fid, offset, size, data);
     if (err == STATUS_NOT_FOUND)
     {
         fprintf(stderr, "No such fid: %d\n", fid);
@@ -447,6 +484,9 @@ int com_symlink(char *arg)
     {
         fprintf(stderr, "No such file or directory\n");
         return STATUS_ERR;
+    } else if (err == STATUS_LOOP) {
+        fprintf(stderr, "Too many levels of symbolic links\n");
+        return STATUS_ERR;
     } else if(err) {
         return STATUS_ERR;
     }
@@ -467,8 +507,8 @@ int com_tranc(char *arg)
             size_arg = arg + i + 1;
         }
     }
-    int size = atoi(size_arg);
-    int err = trancate(path, size);
+    int64_t size = atoll(size_arg);
+    int err = trancate64(path, size);
     if (err == STATUS_NOT_FOUND)
     {
         fprintf(stderr, "No such file: %s\n", path);
@@ -490,10 +530,24 @@ int com_cat(char *path)
         fprintf(stderr, "Can't open '%s'\n", path);
         return STATUS_ERR;
     }
-    int size = get_file_size(path);
-    char *data = malloc(size + 1);
-    data[size] = '\0';
-    int err = read_file(fid, 0, size, data);
+    // print straight from the image, a few segments at a time
+    int64_t size = get_file_size64(path);
+    int64_t offset = 0;
+    int err = STATUS_OK;
+    while (offset < size && !err)
+    {
+        struct iovec iov[CAT_IOV_NUM];
+        int iov_num = CAT_IOV_NUM;
+        err = read_iov(fid, offset, size - offset, iov, &iov_num);
+        if (err)
+            break;
+        for (int i = 0; i < iov_num; ++i)
+        {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+            offset += iov[i].iov_len;
+        }
+        unpin_file(fid);
+    }
     close_file(fid);
     if (err == STATUS_NOT_FOUND)
     {
@@ -503,7 +557,7 @@ int com_cat(char *path)
         fprintf(stderr, "Not file: %s\n", path);
         return STATUS_ERR;
     } else {
-        printf("%s\n", data);
+        printf("\n");
     }
     return STATUS_OK;
 }
@@ -582,6 +636,11 @@ int com_dump_stats(char *ignore)
     return dump_stats();
 }
 
+int com_sync(char *ignore)
+{
+    return sync_image();
+}
+
 /* Return non-zero if ARG is a valid argument for CALLER, else print
    an error message and return zero. */
 int valid_argument(char *caller, char *arg)